@@ -0,0 +1,160 @@
+#ifndef NOAH_FS_H
+#define NOAH_FS_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+
+#include "types.h"
+#include "linux/common.h"
+
+struct l_newstat;
+struct l_statfs;
+
+struct file {
+  struct file_operations *ops;
+  int fd;
+  void *private_data;   /* state of a virtual file, shared among dup'ed fds */
+};
+
+struct file_operations {
+  int (*readv)(struct file *f, struct iovec *iov, size_t iovcnt);
+  int (*writev)(struct file *f, const struct iovec *iov, size_t iovcnt);
+  int (*close)(struct file *f);
+  int (*ioctl)(struct file *f, int cmd, uint64_t val0);
+  int (*lseek)(struct file *f, l_off_t offset, int whence);
+  int (*getdents)(struct file *f, char *buf, uint count, bool is64);
+  int (*fcntl)(struct file *f, unsigned int cmd, unsigned long arg);
+  int (*fsync)(struct file *f);
+  /* inode operations */
+  int (*fstat)(struct file *f, struct l_newstat *stat);
+  int (*fstatfs)(struct file *f, struct l_statfs *buf);
+  int (*fchown)(struct file *f, l_uid_t uid, l_gid_t gid);
+  int (*fchmod)(struct file *f, l_mode_t mode);
+  /* called on the original file when it is duplicated by dup(2) family */
+  void (*dup)(struct file *f);
+};
+
+struct file *get_file(int fd);
+int register_file(int fd, bool is_cloexec, struct file_operations *ops, void *private_data);
+void for_each_host_file(void (*fn)(struct file *file, bool cloexec, void *arg), void *arg);
+int do_close(struct fdtable *table, int fd);
+void for_each_file(struct file_operations *ops, void (*fn)(struct file *file, bool cloexec, void *arg), void *arg);
+
+/* host file operations; virtual files backed by a host fd may borrow them */
+int darwinfs_writev(struct file *file, const struct iovec *iov, size_t iovcnt);
+int darwinfs_readv(struct file *file, struct iovec *iov, size_t iovcnt);
+int darwinfs_close(struct file *file);
+int darwinfs_ioctl(struct file *file, int cmd, uint64_t val0);
+int darwinfs_lseek(struct file *file, l_off_t offset, int whence);
+int darwinfs_getdents(struct file *file, char *direntp, unsigned count, bool is64);
+int darwinfs_fcntl(struct file *file, unsigned int cmd, unsigned long arg);
+int darwinfs_fsync(struct file *file);
+int darwinfs_fstat(struct file *file, struct l_newstat *l_st);
+int darwinfs_fstatfs(struct file *file, struct l_statfs *buf);
+int darwinfs_fchown(struct file *file, l_uid_t uid, l_gid_t gid);
+int darwinfs_fchmod(struct file *file, l_mode_t mode);
+
+/* open a guest path; the returned host fd is not registered in any fdtable */
+int do_openat(int dirfd, const char *name, int flags, int mode);
+
+struct dirent;
+ssize_t darwin_to_linux_dent(struct dirent *d_dent, void *l_dent, size_t buflen, int is64);
+
+/*
+ * Filesystems
+ */
+
+struct dir {
+  int fd;
+};
+
+struct path {
+  struct fs *fs;
+  struct dir *dir;
+  char subpath[LINUX_PATH_MAX];
+};
+
+struct fs {
+  struct fs_operations *ops;
+};
+
+struct fs_operations {
+  int (*openat)(struct fs *fs, struct dir *dir, const char *path, int flags, int mode); /* TODO: return struct file * instaed of file descripter */
+  int (*symlinkat)(struct fs *fs, const char *target, struct dir *dir, const char *name);
+  int (*faccessat)(struct fs *fs, struct dir *dir, const char *path, int mode);
+  int (*renameat)(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to);
+  int (*linkat)(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to, int flags);
+  int (*unlinkat)(struct fs *fs, struct dir *dir, const char *path, int flags);
+  int (*readlinkat)(struct fs *fs, struct dir *dir, const char *path, char *buf, int bufsize);
+  int (*mkdirat)(struct fs *fs, struct dir *dir, const char *path, int mode);
+  /* inode operations */
+  int (*fstatat)(struct fs *fs, struct dir *dir, const char *path, struct l_newstat *stat, int flags);
+  int (*statfs)(struct fs *fs, struct dir *dir, const char *path, struct l_statfs *buf);
+  int (*fchownat)(struct fs *fs, struct dir *dir, const char *path, l_uid_t uid, l_gid_t gid, int flags);
+  int (*fchmodat)(struct fs *fs, struct dir *dir, const char *path, l_mode_t mode);
+  /* optional; called when a file opened by openat is installed in the user fdtable,
+     with the path openat was given */
+  void (*init_file)(struct fs *fs, struct file *file, const char *path);
+};
+
+/* the host filesystem, accessed as is */
+extern struct fs darwinfs;
+
+int darwinfs_openat(struct fs *fs, struct dir *dir, const char *path, int l_flags, int mode);
+int darwinfs_symlinkat(struct fs *fs, const char *target, struct dir *dir, const char *name);
+int darwinfs_faccessat(struct fs *fs, struct dir *dir, const char *path, int mode);
+int darwinfs_renameat(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to);
+int darwinfs_linkat(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to, int l_flags);
+int darwinfs_unlinkat(struct fs *fs, struct dir *dir, const char *path, int l_flags);
+int darwinfs_readlinkat(struct fs *fs, struct dir *dir, const char *path, char *buf, int bufsize);
+int darwinfs_mkdirat(struct fs *fs, struct dir *dir, const char *path, int mode);
+int darwinfs_fstatat(struct fs *fs, struct dir *dir, const char *path, struct l_newstat *l_st, int l_flags);
+int darwinfs_statfs(struct fs *fs, struct dir *dir, const char *path, struct l_statfs *buf);
+int darwinfs_fchownat(struct fs *fs, struct dir *dir, const char *path, l_uid_t uid, l_gid_t gid, int l_flags);
+int darwinfs_fchmodat(struct fs *fs, struct dir *dir, const char *path, l_mode_t mode);
+
+/* synthesized procfs and sysfs files (pseudo.c) */
+extern struct fs pseudofs;
+bool is_pseudo_file(const char *path);
+
+/* memory and random devices served by noah (dev.c) */
+extern struct fs devfs;
+extern struct file_operations dev_file_ops;
+bool is_dev_file(const char *path);
+bool is_dev_zero(int fd);
+const char *dev_file_path(struct file *file);
+const char *dev_host_path(const char *path);
+int register_dev_file(int fd, bool is_cloexec, const char *path);
+
+/* overlay root filesystem (overlay.c) */
+int init_overlay(const char *upper);
+
+/*
+ * Virtual files whose fd is a host kqueue (eventfd.c).
+ * struct evfile must be the first member of the private data.
+ */
+struct evfile {
+  atomic_int refcount;
+  pthread_mutex_t lock;
+  bool nonblock;
+  pid_t owner;         /* the process the kqueue was made in */
+  int kq;              /* and the fd it was made under */
+};
+
+int evfile_create(struct evfile *ef, struct file_operations *ops, bool cloexec, bool nonblock);
+int evfile_close(struct file *file);
+void evfile_dup(struct file *file);
+int evfile_fcntl(struct file *file, unsigned int cmd, unsigned long arg);
+void evfile_set_ready(int kq, bool ready);
+bool evfile_renew(struct file *file, bool cloexec);
+
+int pselect_sigmask(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, const struct timespec *timeout);
+
+size_t iov_size(const struct iovec *iov, size_t iovcnt);
+void copy_to_iov(struct iovec *iov, size_t iovcnt, const void *buf, size_t len);
+
+#endif
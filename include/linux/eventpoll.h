@@ -0,0 +1,35 @@
+#ifndef LINUX_EVENTPOLL_H
+#define LINUX_EVENTPOLL_H
+
+#include <stdint.h>
+
+#define LINUX_EPOLL_CLOEXEC   02000000
+
+#define LINUX_EPOLL_CTL_ADD   1
+#define LINUX_EPOLL_CTL_DEL   2
+#define LINUX_EPOLL_CTL_MOD   3
+
+#define LINUX_EPOLLIN         0x00000001
+#define LINUX_EPOLLPRI        0x00000002
+#define LINUX_EPOLLOUT        0x00000004
+#define LINUX_EPOLLERR        0x00000008
+#define LINUX_EPOLLHUP        0x00000010
+#define LINUX_EPOLLRDNORM     0x00000040
+#define LINUX_EPOLLRDBAND     0x00000080
+#define LINUX_EPOLLWRNORM     0x00000100
+#define LINUX_EPOLLWRBAND     0x00000200
+#define LINUX_EPOLLMSG        0x00000400
+#define LINUX_EPOLLRDHUP      0x00002000
+#define LINUX_EPOLLEXCLUSIVE  (1U << 28)
+#define LINUX_EPOLLWAKEUP     (1U << 29)
+#define LINUX_EPOLLONESHOT    (1U << 30)
+#define LINUX_EPOLLET         (1U << 31)
+
+#define LINUX_EP_MAX_EVENTS   (INT32_MAX / sizeof(struct l_epoll_event))
+
+struct l_epoll_event {
+  uint32_t events;
+  uint64_t data;
+} __attribute__((packed));
+
+#endif
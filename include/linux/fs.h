@@ -218,6 +218,24 @@ struct l_statfs {
 #define LINUX_ST_NODIRATIME   0x0800
 #define LINUX_ST_RELATIME     0x1000
 
+/*
+ * splice
+ */
+#define LINUX_SPLICE_F_MOVE     1
+#define LINUX_SPLICE_F_NONBLOCK 2
+#define LINUX_SPLICE_F_MORE     4
+#define LINUX_SPLICE_F_GIFT     8
+
+#define LINUX_MAX_RW_COUNT 0x7ffff000
+#define LINUX_UIO_MAXIOV   1024
+
+/*
+ * eventfd
+ */
+#define LINUX_EFD_SEMAPHORE     1
+#define LINUX_EFD_CLOEXEC       LINUX_O_CLOEXEC
+#define LINUX_EFD_NONBLOCK      LINUX_O_NONBLOCK
+
 #define LINUX_FD_SETSIZE 1024
 
 typedef unsigned long l_fd_set[LINUX_FD_SETSIZE / (8 * sizeof(long))];
@@ -62,6 +62,15 @@
 #define	LINUX_SHM_RDONLY	0x1000
 #define	LINUX_SHM_RND		0x2000
 #define	LINUX_SHM_REMAP		0x4000
+#define	LINUX_SHM_EXEC		0x8000
+
+/* shmget flags and segment mode bits */
+#define	LINUX_SHM_DEST		01000
+#define	LINUX_SHM_LOCKED	02000
+#define	LINUX_SHM_HUGETLB	04000
+#define	LINUX_SHM_NORESERVE	010000
+
+#define	LINUX_SHM_STAT_ANY	15
 
 /* semctl commands */
 #define	LINUX_GETPID		11
@@ -73,6 +82,7 @@
 #define	LINUX_SETALL		17
 #define	LINUX_SEM_STAT		18
 #define	LINUX_SEM_INFO		19
+#define	LINUX_SEM_STAT_ANY	20
 
 /*
  * Version flags for semctl, msgctl, and shmctl commands
@@ -108,6 +118,77 @@ struct l_ipc_perm {
   l_ushort	seq;
 };
 
+struct l_ipc64_perm {
+  l_key_t	key;
+  l_uid_t	uid;
+  l_gid_t	gid;
+  l_uid_t	cuid;
+  l_gid_t	cgid;
+  l_mode_t	mode;
+  l_ushort	seq;
+  l_ushort	__pad2;
+  l_ulong	__unused1;
+  l_ulong	__unused2;
+};
+
+struct l_semid64_ds {
+  struct l_ipc64_perm sem_perm;
+  l_long	sem_otime;
+  l_ulong	__unused1;
+  l_long	sem_ctime;
+  l_ulong	__unused2;
+  l_ulong	sem_nsems;
+  l_ulong	__unused3;
+  l_ulong	__unused4;
+};
+
+struct l_shmid64_ds {
+  struct l_ipc64_perm shm_perm;
+  l_size_t	shm_segsz;
+  l_long	shm_atime;
+  l_long	shm_dtime;
+  l_long	shm_ctime;
+  l_pid_t	shm_cpid;
+  l_pid_t	shm_lpid;
+  l_ulong	shm_nattch;
+  l_ulong	__unused4;
+  l_ulong	__unused5;
+};
+
+struct l_shminfo64 {
+  l_ulong	shmmax;
+  l_ulong	shmmin;
+  l_ulong	shmmni;
+  l_ulong	shmseg;
+  l_ulong	shmall;
+  l_ulong	__unused1;
+  l_ulong	__unused2;
+  l_ulong	__unused3;
+  l_ulong	__unused4;
+};
+
+struct l_shm_info {
+  l_int		used_ids;
+  l_ulong	shm_tot;
+  l_ulong	shm_rss;
+  l_ulong	shm_swp;
+  l_ulong	swap_attempts;
+  l_ulong	swap_successes;
+};
+
+struct l_seminfo {
+  l_int	semmap;
+  l_int	semmni;
+  l_int	semmns;
+  l_int	semmnu;
+  l_int	semmsl;
+  l_int	semopm;
+  l_int	semume;
+  l_int	semusz;
+  l_int	semvmx;
+  l_int	semaem;
+};
+
 #define LINUX_IPC_PRIVATE 0
 
 #define LINUX_IPC_CREAT  00001000
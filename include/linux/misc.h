@@ -157,6 +157,10 @@ struct l_pollfd {
 #define LINUX_ARCH_GET_FS		0x1003
 #define LINUX_ARCH_GET_GS		0x1004
 
+/* AT_HWCAP2 bits */
+#define LINUX_HWCAP2_RING3MWAIT	(1 << 0)
+#define LINUX_HWCAP2_FSGSBASE	(1 << 1)
+
 /* linux sysinfo */
 struct l_sysinfo {
   l_long		uptime;		/* Seconds since boot */
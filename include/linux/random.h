@@ -3,5 +3,8 @@
 
 #define GRND_NONBLOCK 0x0001
 #define GRND_RANDOM   0x0002
+#define GRND_INSECURE 0x0004
+
+#define GRND_MAX_COUNT 33554431     /* in a single call */
 
 #endif
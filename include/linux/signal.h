@@ -148,6 +148,18 @@ typedef struct {
 #define LINUX_SS_DISABLE      2
 #define LINUX_SS_AUTODISARM   (1U << 31)
 
+/* in the fxsave image of a signal frame whose xsave state follows */
+#define LINUX_FP_XSTATE_MAGIC1	0x46505853U
+#define LINUX_FP_XSTATE_MAGIC2	0x46505845U	/* right after the xsave area */
+
+struct l_fpx_sw_bytes {
+  u_int32_t magic1;
+  u_int32_t extended_size;      /* xstate_size + sizeof MAGIC2 */
+  u_int64_t xfeatures;
+  u_int32_t xstate_size;
+  u_int32_t padding[7];
+};
+
 struct l_fpstate {
   u_int16_t cwd;
   u_int16_t swd;
@@ -159,7 +171,8 @@ struct l_fpstate {
   u_int32_t mxcsr_mask;
   u_int32_t st_space[32];
   u_int32_t xmm_space[64];
-  u_int32_t reserved2[24];
+  u_int32_t reserved2[12];
+  struct l_fpx_sw_bytes sw_reserved;    /* tells the extended state that follows */
 };
 
 struct l_sigcontext {
@@ -277,6 +290,55 @@ typedef struct l_siginfo {
 #define	lsi_band	_sifields._sigpoll._band
 #define	lsi_fd		_sifields._sigpoll._fd
 
+/* si_code */
+#define	LINUX_SI_USER		0
+#define	LINUX_SI_KERNEL		0x80
+#define	LINUX_SI_QUEUE		-1
+#define	LINUX_SI_TIMER		-2
+#define	LINUX_SI_TKILL		-6
+
+/* sigev_notify */
+#define	LINUX_SIGEV_SIGNAL	0
+#define	LINUX_SIGEV_NONE	1
+#define	LINUX_SIGEV_THREAD	2
+#define	LINUX_SIGEV_THREAD_ID	4
+
+#define	LINUX_SIGEV_MAX_SIZE	64
+#define	LINUX_SIGEV_PAD_SIZE	((LINUX_SIGEV_MAX_SIZE - \
+				    2 * sizeof(l_int) - sizeof(l_sigval_t)) / sizeof(l_int))
+
+struct l_sigevent {
+  l_sigval_t	sigev_value;
+  l_int		sigev_signo;
+  l_int		sigev_notify;
+  union {
+    l_int	_pad[LINUX_SIGEV_PAD_SIZE];
+    l_int	_tid;
+    struct {
+      l_uintptr_t	_function;
+      l_uintptr_t	_attribute;
+    } _sigev_thread;
+  } _sigev_un;
+};
+
+#define	lsigev_notify_thread_id	_sigev_un._tid
+
+/* si_code of faults */
+#define	LINUX_ILL_ILLOPN	2
+#define	LINUX_FPE_INTDIV	1
+#define	LINUX_FPE_FLTDIV	3
+#define	LINUX_FPE_FLTOVF	4
+#define	LINUX_FPE_FLTUND	5
+#define	LINUX_FPE_FLTRES	6
+#define	LINUX_FPE_FLTINV	7
+#define	LINUX_SEGV_MAPERR	1
+#define	LINUX_SEGV_ACCERR	2
+#define	LINUX_BUS_ADRALN	1
+#define	LINUX_BUS_MCEERR_AR	4
+#define	LINUX_TRAP_BRKPT	1
+#define	LINUX_TRAP_TRACE	2
+#define	LINUX_TRAP_HWBKPT	4
+
 /*
  * We make l_rt_sigframe exactly the same as that of Linux.
  * This is a different choice of FreeBSD's Linuxulator.
@@ -289,4 +351,33 @@ struct l_rt_sigframe {
   /* fp state should follow */
 };
 
+/* signalfd */
+#define LINUX_SFD_CLOEXEC  02000000
+#define LINUX_SFD_NONBLOCK 00004000
+
+struct l_signalfd_siginfo {
+  uint32_t ssi_signo;
+  int32_t  ssi_errno;
+  int32_t  ssi_code;
+  uint32_t ssi_pid;
+  uint32_t ssi_uid;
+  int32_t  ssi_fd;
+  uint32_t ssi_tid;
+  uint32_t ssi_band;
+  uint32_t ssi_overrun;
+  uint32_t ssi_trapno;
+  int32_t  ssi_status;
+  int32_t  ssi_int;
+  uint64_t ssi_ptr;
+  uint64_t ssi_utime;
+  uint64_t ssi_stime;
+  uint64_t ssi_addr;
+  uint16_t ssi_addr_lsb;
+  uint16_t __pad2;
+  int32_t  ssi_syscall;
+  uint64_t ssi_call_addr;
+  uint32_t ssi_arch;
+  uint8_t  __pad[28];
+};
+
 #endif
@@ -30,6 +30,8 @@
 #ifndef _NOAH_TIME_H
 #define _NOAH_TIME_H
 
+#define LINUX_HZ			100	/* USER_HZ, the unit of clock_t */
+
 #define LINUX_UTIME_NOW			0x3FFFFFFF
 #define LINUX_UTIME_OMIT		0x3FFFFFFE
 
@@ -48,19 +50,30 @@ struct l_timezone {
   int tz_dsttime;
 };
 
-typedef uint32_t l_clockid_t;
+typedef int32_t l_clockid_t;
 
 struct l_itimerval {
   struct l_timeval it_interval;
   struct l_timeval it_value;
 };
 
+struct l_itimerspec {
+  struct l_timespec it_interval;
+  struct l_timespec it_value;
+};
+
+/* timerfd */
+#define LINUX_TFD_TIMER_ABSTIME        1
+#define LINUX_TFD_TIMER_CANCEL_ON_SET  2
+#define LINUX_TFD_CLOEXEC              02000000
+#define LINUX_TFD_NONBLOCK             00004000
+
 #define LINUX_CLOCK_REALTIME             0
 #define LINUX_CLOCK_MONOTONIC            1
 #define LINUX_CLOCK_PROCESS_CPUTIME_ID   2
 #define LINUX_CLOCK_THREAD_CPUTIME_ID    3
-#define LINUX_CLOCK_REALTIME_HR          4
-#define LINUX_CLOCK_MONOTONIC_HR         5
+#define LINUX_CLOCK_MONOTONIC_RAW        4
+#define LINUX_CLOCK_REALTIME_COARSE      5
 #define LINUX_CLOCK_MONOTONIC_COARSE     6
 #define LINUX_CLOCK_BOOTTIME             7
 #define LINUX_CLOCK_REALTIME_ALARM       8
@@ -68,4 +81,22 @@ struct l_itimerval {
 #define LINUX_CLOCK_SGI_CYCLE            10
 #define LINUX_CLOCK_TAI                  11
 
+/* the cpu-time clocks of a given process or thread have negative ids */
+#define LINUX_CPUCLOCK_PROF              0
+#define LINUX_CPUCLOCK_VIRT              1
+#define LINUX_CPUCLOCK_SCHED             2
+#define LINUX_CPUCLOCK_MAX               3
+#define LINUX_CPUCLOCK_CLOCK_MASK        3
+#define LINUX_CPUCLOCK_PERTHREAD_MASK    4
+#define LINUX_CPUCLOCK_PID(clock)        ((l_pid_t) ~((clock) >> 3))
+#define LINUX_CPUCLOCK_WHICH(clock)      ((clock) & LINUX_CPUCLOCK_CLOCK_MASK)
+#define LINUX_CPUCLOCK_PERTHREAD(clock)  (((clock) & LINUX_CPUCLOCK_PERTHREAD_MASK) != 0)
+#define LINUX_MAKE_PROCESS_CPUCLOCK(pid, clock) \
+  ((l_clockid_t) ((uint32_t) ~(pid) << 3) | (clock))
+#define LINUX_MAKE_THREAD_CPUCLOCK(tid, clock) \
+  (LINUX_MAKE_PROCESS_CPUCLOCK(tid, clock) | LINUX_CPUCLOCK_PERTHREAD_MASK)
+
+/* timer_settime and clock_nanosleep */
+#define LINUX_TIMER_ABSTIME              1
+
 #endif
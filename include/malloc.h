@@ -6,5 +6,6 @@
 void init_shm_malloc(void);
 void *shm_malloc(size_t nbytes);
 void shm_free(void *);
+void shm_commit(void);
 
 #endif
@@ -12,6 +12,7 @@
 #include "malloc.h"
 #include "version.h"
 #include <stdnoreturn.h>
+#include <mach/semaphore.h>
 
 #define __page_aligned __attribute__((aligned(0x1000)))
 
@@ -41,6 +42,7 @@ int do_exec(const char *elf_path, int argc, char *argv[], char **envp);
 int do_faccessat(int l_dirfd, const char *l_path, int l_mode);
 int do_access(const char *path, int l_mode);
 int do_futex_wake(gaddr_t uaddr, int count);
+void futex_interrupt_waiters(void);
 int user_open(const char *path, int flags, int mode);
 int vkern_open(const char *path, int flags, int mode);
 int user_openat(int fd, const char *path, int flags, int mode);
@@ -54,6 +56,12 @@ gaddr_t alloc_region(size_t len);
 
 noreturn void die_with_forcedsig(int sig);
 void main_loop(int return_on_sigret);
+void settle_deferred_fork(int nr);
+noreturn void exit_thread(void);
+void release_vfork_parent(void);
+void fork_evfiles(void);
+void fork_inotify(void);
+void fork_epoll(void);
 
 /* signal */
 
@@ -65,17 +73,40 @@ typedef atomic_uint_least64_t atomic_sigbits_t;
 void handle_signal(void);
 bool has_sigpending(void);
 int send_signal(pid_t pid, int sig);
+int send_kernel_signal(l_pid_t tid, const l_siginfo_t *info);
+void force_fault(int sig, int code, gaddr_t addr, int trapno, uint64_t err);
+int dequeue_signal(uint64_t mask, l_siginfo_t *info);
+void init_sigqueue(void);
+void flush_sigqueue(void);
+void set_temporary_sigmask(const l_sigset_t *mask);
+void restore_saved_sigmask(void);
 
 /* task related data */
 
+#define LINUX_NR_CPUS 1024
+#define CPUMASK_WORDS (LINUX_NR_CPUS / 64)
+
 struct task {
   struct list_head head;
   gaddr_t set_child_tid, clear_child_tid;
   uint64_t tid;
   gaddr_t robust_list;
   l_sigset_t sigmask;
+  l_sigset_t saved_sigmask;     /* to go back to after a wait with a temporary mask */
+  bool restore_sigmask;
   atomic_sigbits_t sigpending;
+  semaphore_t sigwake;          /* signaled when a signal becomes pending */
+  pid_t sigwake_owner;
+  pthread_t thread;             /* the host thread running this task */
+  pthread_mutex_t sigqueue_lock;
+  struct list_head sigqueue;    /* siginfo of signals sent from within noah, oldest first */
+  int nr_sigqueue;
+  struct {
+    l_pid_t pid;
+    l_uid_t uid;
+  } sigsender[LINUX_NSIG];      /* of signals caught by the host handler */
   l_stack_t sas;
+  uint64_t cpumask[CPUMASK_WORDS]; /* by sched_setaffinity; all zero means every online cpu */
 };
 
 struct fdtable {
@@ -88,6 +119,7 @@ struct fdtable {
 
 struct fileinfo {
   int rootfd;                      // FS root
+  struct fs *rootfs;               // Filesystem mounted on the root
   struct fdtable fdtable;          // File descriptors for the user space
   struct fdtable vkern_fdtable;    // File descriptors for the kernel space
   pthread_rwlock_t fdtable_lock;
@@ -135,9 +167,83 @@ _Thread_local extern struct task task;
 
 void init_signal(void);
 void reset_signal_state(void);
+void reload_signal_state(void);
 void init_fileinfo(int rootfd);
 
+/* sysv ipc (ipc.c, sem.c and shm.c) */
+
+struct l_ipc64_perm;
+
+void init_ipc(void);
+void exit_ipc(void);
+void init_shared_mutex(pthread_mutex_t *mutex);
+bool ipc_permitted(const struct l_ipc64_perm *perm, int flag);
+bool ipc_owner(const struct l_ipc64_perm *perm);
+void init_ipc_perm(struct l_ipc64_perm *perm, l_key_t key, int mode, unsigned short seq);
+void init_sem(void);
+void exit_sem(void);
+void init_shm(void);
+void exit_shm(void);
+void fork_shm(bool vm_shared);
+
+/* clocks and timers (time.c and timer.c) */
+
+#include "linux/time.h"
+
+int clock_read(l_clockid_t id, uint64_t *ns);
+void get_real_itimer(struct l_itimerval *value);
+int set_real_itimer(const struct l_itimerval *value, struct l_itimerval *ovalue);
+void take_timer_signal(l_siginfo_t *info);
+void drop_timer_signal(const l_siginfo_t *info);
+void flush_timers(void);
+void prepare_fork_timers(void);
+void fork_timers(bool child);
+void forget_nanosleep_restart(void);
+
 void init_fpu(void);
+void init_special_regs(void);
+
+/* checkpoint and restore (checkpoint.c) */
+
+void arm_checkpoint(const char *path);
+bool checkpoint_pending(void);
+void do_checkpoint(void);
+int checkpoint_root(const char *path, char *root, size_t size);
+int restore_checkpoint(const char *path);
+
+/* template mode (zygote.c) */
+
+#define ZYGOTE_MAX_PRELOAD 16
+
+void zygote_serve(const char *sockpath, const char *root, const char *const *preloads, int nr_preloads, int *argcp, char ***argvp, char ***envpp);
+noreturn void zygote_connect(const char *sockpath, int argc, char *argv[], char **envp);
+
+/* host cpus, as reported to the guest (sys.c) */
+
+struct cpu_topology {
+  int nr_online;               /* logical cpus */
+  int nr_possible;
+  int nr_cores;                /* physical cpus */
+  int nr_packages;
+  char vendor[16];
+  char brand[64];
+  int family, model, stepping;
+  uint64_t freq;               /* in Hz */
+  uint64_t cache_size;         /* last level, in bytes */
+  char features[512];          /* lower case, separated by spaces */
+};
+
+const struct cpu_topology *host_cpu_topology(void);
+void host_online_cpumask(uint64_t mask[CPUMASK_WORDS]);
+
+/* cpuid as seen by the guest (cpuid.c) */
+
+void init_cpuid(void);
+void guest_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]);
+uint64_t guest_xcr0(void);
+uint64_t guest_hwcap(void);
+uint64_t guest_hwcap2(void);
+bool guest_has_fsgsbase(void);
 
 /* Linux kernel constants */
 
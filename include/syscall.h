@@ -41,7 +41,7 @@
   SYSCALL(37, alarm)                            \
   SYSCALL(38, setitimer)                        \
   SYSCALL(39, getpid)                           \
-  SYSCALL(40, unimplemented)                    \
+  SYSCALL(40, sendfile)                         \
   SYSCALL(41, socket)                           \
   SYSCALL(42, connect)                          \
   SYSCALL(43, accept)                           \
@@ -68,7 +68,7 @@
   SYSCALL(64, semget)                           \
   SYSCALL(65, semop)                            \
   SYSCALL(66, semctl)                           \
-  SYSCALL(67, unimplemented)                    \
+  SYSCALL(67, shmdt)                            \
   SYSCALL(68, unimplemented)                    \
   SYSCALL(69, unimplemented)                    \
   SYSCALL(70, unimplemented)                    \
@@ -129,8 +129,8 @@
   SYSCALL(125, capget)                          \
   SYSCALL(126, unimplemented)                   \
   SYSCALL(127, rt_sigpending)                   \
-  SYSCALL(128, unimplemented)                   \
-  SYSCALL(129, unimplemented)                   \
+  SYSCALL(128, rt_sigtimedwait)                 \
+  SYSCALL(129, rt_sigqueueinfo)                 \
   SYSCALL(130, rt_sigsuspend)                   \
   SYSCALL(131, sigaltstack)                     \
   SYSCALL(132, utime)                           \
@@ -201,10 +201,10 @@
   SYSCALL(197, unimplemented)                   \
   SYSCALL(198, unimplemented)                   \
   SYSCALL(199, unimplemented)                   \
-  SYSCALL(200, unimplemented)                   \
+  SYSCALL(200, tkill)                           \
   SYSCALL(201, time)                            \
   SYSCALL(202, futex)                           \
-  SYSCALL(203, unimplemented)                   \
+  SYSCALL(203, sched_setaffinity)               \
   SYSCALL(204, sched_getaffinity)               \
   SYSCALL(205, set_thread_area)                 \
   SYSCALL(206, unimplemented)                   \
@@ -214,27 +214,27 @@
   SYSCALL(210, unimplemented)                   \
   SYSCALL(211, get_thread_area)                 \
   SYSCALL(212, unimplemented)                   \
-  SYSCALL(213, unimplemented)                   \
+  SYSCALL(213, epoll_create)                    \
   SYSCALL(214, epoll_ctl_old)                   \
   SYSCALL(215, epoll_wait_old)                  \
   SYSCALL(216, unimplemented)                   \
   SYSCALL(217, getdents64)                      \
   SYSCALL(218, set_tid_address)                 \
   SYSCALL(219, unimplemented)                   \
-  SYSCALL(220, unimplemented)                   \
+  SYSCALL(220, semtimedop)                      \
   SYSCALL(221, fadvise64)                       \
-  SYSCALL(222, unimplemented)                   \
-  SYSCALL(223, unimplemented)                   \
-  SYSCALL(224, unimplemented)                   \
-  SYSCALL(225, unimplemented)                   \
-  SYSCALL(226, unimplemented)                   \
+  SYSCALL(222, timer_create)                    \
+  SYSCALL(223, timer_settime)                   \
+  SYSCALL(224, timer_gettime)                   \
+  SYSCALL(225, timer_getoverrun)                \
+  SYSCALL(226, timer_delete)                    \
   SYSCALL(227, unimplemented)                   \
   SYSCALL(228, clock_gettime)                   \
   SYSCALL(229, clock_getres)                    \
-  SYSCALL(230, unimplemented)                   \
+  SYSCALL(230, clock_nanosleep)                 \
   SYSCALL(231, exit_group)                      \
-  SYSCALL(232, unimplemented)                   \
-  SYSCALL(233, unimplemented)                   \
+  SYSCALL(232, epoll_wait)                      \
+  SYSCALL(233, epoll_ctl)                       \
   SYSCALL(234, tgkill)                          \
   SYSCALL(235, utimes)                          \
   SYSCALL(236, vserver)                         \
@@ -254,9 +254,9 @@
   SYSCALL(250, unimplemented)                   \
   SYSCALL(251, unimplemented)                   \
   SYSCALL(252, unimplemented)                   \
-  SYSCALL(253, unimplemented)                   \
-  SYSCALL(254, unimplemented)                   \
-  SYSCALL(255, unimplemented)                   \
+  SYSCALL(253, inotify_init)                    \
+  SYSCALL(254, inotify_add_watch)               \
+  SYSCALL(255, inotify_rm_watch)                \
   SYSCALL(256, unimplemented)                   \
   SYSCALL(257, openat)                          \
   SYSCALL(258, mkdirat)                         \
@@ -272,33 +272,33 @@
   SYSCALL(268, fchmodat)                        \
   SYSCALL(269, faccessat)                       \
   SYSCALL(270, pselect6)                        \
-  SYSCALL(271, unimplemented)                   \
+  SYSCALL(271, ppoll)                           \
   SYSCALL(272, unimplemented)                   \
   SYSCALL(273, set_robust_list)                 \
   SYSCALL(274, unimplemented)                   \
-  SYSCALL(275, unimplemented)                   \
+  SYSCALL(275, splice)                          \
   SYSCALL(276, unimplemented)                   \
   SYSCALL(277, unimplemented)                   \
-  SYSCALL(278, unimplemented)                   \
+  SYSCALL(278, vmsplice)                        \
   SYSCALL(279, unimplemented)                   \
   SYSCALL(280, utimensat)                       \
-  SYSCALL(281, unimplemented)                   \
-  SYSCALL(282, unimplemented)                   \
-  SYSCALL(283, unimplemented)                   \
-  SYSCALL(284, unimplemented)                   \
+  SYSCALL(281, epoll_pwait)                     \
+  SYSCALL(282, signalfd)                        \
+  SYSCALL(283, timerfd_create)                  \
+  SYSCALL(284, eventfd)                         \
   SYSCALL(285, fallocate)                       \
-  SYSCALL(286, unimplemented)                   \
-  SYSCALL(287, unimplemented)                   \
+  SYSCALL(286, timerfd_settime)                 \
+  SYSCALL(287, timerfd_gettime)                 \
   SYSCALL(288, unimplemented)                   \
-  SYSCALL(289, unimplemented)                   \
-  SYSCALL(290, unimplemented)                   \
-  SYSCALL(291, unimplemented)                   \
+  SYSCALL(289, signalfd4)                       \
+  SYSCALL(290, eventfd2)                        \
+  SYSCALL(291, epoll_create1)                   \
   SYSCALL(292, dup3)                            \
   SYSCALL(293, pipe2)                           \
-  SYSCALL(294, unimplemented)                   \
+  SYSCALL(294, inotify_init1)                   \
   SYSCALL(295, unimplemented)                   \
   SYSCALL(296, unimplemented)                   \
-  SYSCALL(297, unimplemented)                   \
+  SYSCALL(297, rt_tgsigqueueinfo)               \
   SYSCALL(298, unimplemented)                   \
   SYSCALL(299, unimplemented)                   \
   SYSCALL(300, unimplemented)                   \
@@ -327,7 +327,7 @@
   SYSCALL(323, unimplemented)                   \
   SYSCALL(324, unimplemented)                   \
   SYSCALL(325, unimplemented)                   \
-  SYSCALL(326, unimplemented)                   \
+  SYSCALL(326, copy_file_range)                 \
   SYSCALL(327, unimplemented)                   \
   SYSCALL(328, unimplemented)
 
@@ -5,29 +5,83 @@
 #include <Hypervisor/hv_vmx.h>
 #include <Hypervisor/hv_arch_vmx.h>
 
+#include <time.h>
+
 #include "types.h"
 #include "noah.h"
 #include "x86/vmx.h"
 
+/* an xsave image of x87 through AVX-512 takes 2688 bytes; init_xcr0 leaves
+   out whatever would not fit */
+#define VMM_FPSTATE_SIZE 4096
+
 struct vcpu_snapshot {
   uint64_t vcpu_reg[NR_X86_REG_LIST];
   uint64_t vmcs[NR_VMCS_FIELD_MASKED];
-  char fpu_states[2496] __attribute__((aligned(16)));
+  char fpu_states[VMM_FPSTATE_SIZE] __attribute__((aligned(16)));
+};
+
+/* rip, rflags and the general purpose registers, which lead x86_reg_list */
+#define NR_THREAD_REGS 18
+
+/* the part of the vcpu state that is not shared among the threads of a process */
+struct vcpu_thread_snapshot {
+  uint64_t reg[NR_THREAD_REGS];
+  uint64_t xcr0;
+  uint64_t fs_base, gs_base;
+  char fpu_states[VMM_FPSTATE_SIZE] __attribute__((aligned(16)));
 };
 
+/* the other vcpus keep their state in their own threads while parked */
 struct vmm_snapshot {
+  pid_t pid;
   struct vcpu_snapshot first_vcpu_snapshot;
 };
 
+/* time spent in each phase of fork in nanoseconds, summed over the forks of
+   this process and its ancestors */
+struct vmm_fork_stats {
+  uint64_t nr_forks;
+  uint64_t snapshot;
+  uint64_t destroy;
+  uint64_t fork;
+  uint64_t reentry;    /* recreating the vm and the vcpu */
+  uint64_t restore;    /* entering the memory into the ept, including deferred entries */
+};
+
+extern struct vmm_fork_stats vmm_fork_stats;
+
+static inline uint64_t
+vmm_clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 void vmm_create(void);
 void vmm_destroy(void);
-void vmm_snapshot(struct vmm_snapshot*);
-void vmm_reentry(struct vmm_snapshot*);
+int vmm_snapshot(struct vmm_snapshot*);
+void vmm_reentry(struct vmm_snapshot*, bool defer_ept);
 void vmm_snapshot_vcpu(struct vcpu_snapshot*);
 void vmm_restore_vcpu(struct vcpu_snapshot*);
+void vmm_snapshot_vcpu_thread(struct vcpu_thread_snapshot*);
+void vmm_restore_vcpu_thread(struct vcpu_thread_snapshot*);
+
+bool vmm_ept_deferred(void);
+bool vmm_fault_in_ept(gaddr_t, int verify);
+void vmm_populate_ept(void);
+void vmm_drop_deferred_ept(void);
 
 void vmm_create_vcpu(struct vcpu_snapshot *);
 void vmm_destroy_vcpu(void);
+void vmm_park(void);
+bool vmm_kicked(void);
+bool vmm_kick_pending(void);
+void vmm_idle(atomic_bool *flag);
+void vmm_wake(pthread_t thread);
+void vmm_kick(pthread_t thread);
+void vmm_request_exit(void);
 
 int vmm_run(void);
 
@@ -38,6 +92,7 @@ void vmm_write_msr(uint32_t, uint64_t);
 void vmm_read_vmcs(uint32_t, uint64_t *);
 void vmm_write_vmcs(uint32_t, uint64_t);
 
+void vmm_read_fpstate(void *, size_t);
 void vmm_write_fpstate(void *, size_t);
 
 void vmm_enable_native_msr(uint32_t, bool);
@@ -7,6 +7,7 @@
 #define CR4_PAE         0x00000020      
 #define CR4_OSFXSR      0x00000200
 #define CR4_OSXMMEXCPT  0x00000400
+#define CR4_FSGSBASE    (1 << 16)
 #define CR4_OSXSAVE     (1 << 18)
 #define CR4_VMXE        0x00002000      
 
@@ -18,5 +19,7 @@
 #define MSR_KERNEL_GS_BASE     0xc0000102
 #define MSR_TSC_AUX            0xc0000103
 
+#define XCR0_X87_STATE  0x00000001
 #define XCR0_SSE_STATE  0x00000002
 #define XCR0_AVX_STATE  0x00000004
+#define XCR0_AVX512_STATE 0x000000e0    /* opmask, zmm_hi256, hi16_zmm */
@@ -6,6 +6,10 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <libgen.h>
 #include <sys/syslimits.h>
 
@@ -23,6 +27,8 @@
 struct vcpu {
   struct list_head list;
   hv_vcpuid_t vcpuid;
+  pthread_t thread;
+  bool parked;                  /* protected by park_lock */
 };
 
 struct list_head vcpus;
@@ -31,6 +37,49 @@ pthread_rwlock_t alloc_lock;
 
 _Thread_local static struct vcpu *vcpu;
 
+/*
+ * A vcpu can only be destroyed by its own thread, so fork asks every other
+ * thread to park: save its vcpu state, destroy the vcpu and sleep until the
+ * vm is back. Threads park at their next return to the guest. Those blocked
+ * in the host are interrupted by VMM_KICK_SIGNAL and restart their syscall.
+ */
+#define VMM_KICK_SIGNAL SIGEMT  /* Linux has no counterpart of it */
+
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool park_requested;
+static int nr_parked;
+static uint64_t park_epoch;
+_Thread_local static volatile sig_atomic_t kicked;
+
+/*
+ * A thread about to enter the guest cannot tell that it has just been kicked,
+ * and hv_vcpu_interrupt only affects a vcpu already running. A handler may
+ * also have interrupted this thread in the middle of its own VMCS updates, so
+ * it only notes the request; vmm_run turns it into a VMX-preemption timer of
+ * zero, and the next entry exits at once, before any guest instruction runs.
+ * A request that lands between that check and the entry is seen when the
+ * timer, armed with EXIT_CHECK_TICKS otherwise, runs out.
+ */
+#define EXIT_CHECK_TICKS (1 << 22)  /* tens of milliseconds on current cpus */
+
+static bool has_preemption_timer;
+_Thread_local static volatile sig_atomic_t exit_requested;
+
+void
+vmm_request_exit(void)
+{
+  /* async-signal-safe */
+  exit_requested = 1;
+}
+
+static void
+kick_handler(int signum)
+{
+  kicked = 1;
+  vmm_request_exit();
+}
+
 void
 vmm_mmap(gaddr_t gaddr, size_t size, int prot, void *haddr)
 {
@@ -51,6 +100,14 @@ vmm_munmap(gaddr_t gaddr, size_t size)
   hv_vm_unmap(gaddr, size);
 }
 
+void
+vmm_read_fpstate(void *buffer, size_t size)
+{
+  if (hv_vcpu_read_fpstate(vcpu->vcpuid, buffer, size) != HV_SUCCESS) {
+    abort();
+  }
+}
+
 void
 vmm_write_fpstate(void *buffer, size_t size)
 {
@@ -77,6 +134,15 @@ vmm_create()
   INIT_LIST_HEAD(&vcpus);
   nr_vcpus = 0;
 
+  /* no SA_RESTART, so that blocking host syscalls return */
+  struct sigaction sa = { .sa_handler = kick_handler };
+  sigaction(VMM_KICK_SIGNAL, &sa, NULL);
+
+  uint64_t cap;
+  if (hv_vmx_read_capability(HV_VMX_CAP_PINBASED, &cap) == HV_SUCCESS) {
+    has_preemption_timer = (cap >> 32) & PIN_BASED_PREEMPTION_TIMER;
+  }
+
   /* create the VM */
   ret = hv_vm_create(HV_VM_DEFAULT);
   if (ret != HV_SUCCESS) {
@@ -96,13 +162,11 @@ vmm_destroy()
 {
   hv_return_t ret;
 
-  struct vcpu *vcpu;
-  list_for_each_entry (vcpu, &vcpus, list) {
-    ret = hv_vcpu_destroy(vcpu->vcpuid);
-    if (ret != HV_SUCCESS) {
-      panic("could not destroy the vcpu: error code %x", ret);
-      exit(1);
-    }
+  /* the vcpus of the other threads have been parked by vmm_snapshot */
+  ret = hv_vcpu_destroy(vcpu->vcpuid);
+  if (ret != HV_SUCCESS) {
+    panic("could not destroy the vcpu: error code %x", ret);
+    exit(1);
   }
 
   printk("successfully destroyed the vcpu\n");
@@ -132,6 +196,7 @@ vmm_create_vcpu(struct vcpu_snapshot *snapshot)
 
   vcpu = calloc(sizeof(struct vcpu), 1);
   vcpu->vcpuid = vcpuid;
+  vcpu->thread = pthread_self();
 
   if (snapshot) {
     vmm_restore_vcpu(snapshot);
@@ -213,21 +278,198 @@ vmm_snapshot_vcpu(struct vcpu_snapshot *snapshot)
   hv_vcpu_read_fpstate(vcpu->vcpuid, snapshot->fpu_states, sizeof snapshot->fpu_states);
 }
 
+/* called by each thread before it enters the guest */
 void
+vmm_park(void)
+{
+  if (!atomic_load(&park_requested)) {
+    return;
+  }
+
+  struct vcpu_snapshot snapshot;
+  vmm_snapshot_vcpu(&snapshot);
+  hv_vcpu_destroy(vcpu->vcpuid);
+
+  pthread_mutex_lock(&park_lock);
+  uint64_t epoch = park_epoch;
+  vcpu->parked = true;
+  nr_parked++;
+  pthread_cond_broadcast(&park_cond);
+  while (park_epoch == epoch) {
+    pthread_cond_wait(&park_cond, &park_lock);
+  }
+  vcpu->parked = false;
+  pthread_mutex_unlock(&park_lock);
+
+  if (hv_vcpu_create(&vcpu->vcpuid, HV_VCPU_DEFAULT) != HV_SUCCESS) {
+    panic("could not recreate a parked vcpu");
+  }
+  vmm_restore_vcpu(&snapshot);
+  kicked = 0;
+}
+
+/* true if the last host syscall of this thread may have been interrupted only to park it */
+bool
+vmm_kicked(void)
+{
+  bool k = kicked;
+  kicked = 0;
+  return k;
+}
+
+/* the same, for a wait that has to tell the kick apart from a spurious wakeup;
+   unlike vmm_kicked it leaves the kick for the syscall restart to see */
+bool
+vmm_kick_pending(void)
+{
+  return kicked;
+}
+
+static void
+unpark_vcpus(void)
+{
+  pthread_mutex_lock(&park_lock);
+  atomic_store(&park_requested, false);
+  park_epoch++;
+  pthread_cond_broadcast(&park_cond);
+  pthread_mutex_unlock(&park_lock);
+}
+
+/* Kick the unparked vcpus until all of them are parked. Returns false if some
+   thread does not reach a safe point in time, e.g. waits on a host condvar. */
+static bool
+park_other_vcpus(void)
+{
+  pthread_mutex_lock(&park_lock);
+  while (atomic_load(&park_requested)) {
+    /* another thread is forking; let it go first */
+    pthread_mutex_unlock(&park_lock);
+    vmm_park();
+    pthread_mutex_lock(&park_lock);
+  }
+  atomic_store(&park_requested, true);
+  nr_parked = 0;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 2;
+
+  for (;;) {
+    pthread_rwlock_rdlock(&alloc_lock);
+    int nr_others = nr_vcpus - 1;
+    struct vcpu *p;
+    list_for_each_entry (p, &vcpus, list) {
+      if (p != vcpu && !p->parked) {
+        hv_vcpu_interrupt(&p->vcpuid, 1);
+        pthread_kill(p->thread, VMM_KICK_SIGNAL);
+      }
+    }
+    pthread_rwlock_unlock(&alloc_lock);
+    if (nr_parked >= nr_others) {
+      break;
+    }
+    /* futex waiters sleep on host condvars, which signals do not interrupt */
+    futex_interrupt_waiters();
+
+    struct timespec now, wait;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+      pthread_mutex_unlock(&park_lock);
+      unpark_vcpus();
+      return false;
+    }
+    wait = now;
+    wait.tv_nsec += 1000000;
+    if (wait.tv_nsec >= 1000000000) {
+      wait.tv_sec++;
+      wait.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&park_cond, &park_lock, &wait);
+  }
+  pthread_mutex_unlock(&park_lock);
+  return true;
+}
+
+int
 vmm_snapshot(struct vmm_snapshot *snapshot)
 {
   printk("vmm_snapshot\n");
 
-  pthread_rwlock_rdlock(&alloc_lock);
-
-  if (nr_vcpus > 1) {
-    fprintf(stderr, "multi-threaded fork is not implemented yet.\n");
-    exit(1);
+  if (nr_vcpus > 1 && !park_other_vcpus()) {
+    warnk("vmm_snapshot: some threads could not be parked\n");
+    return -1;
   }
 
+  snapshot->pid = getpid();
   vmm_snapshot_vcpu(&snapshot->first_vcpu_snapshot);
+  return 0;
+}
+
+/* Sleep with the vcpu kept until another thread sets *flag and calls
+   vmm_wake. The thread still parks for forks meanwhile. */
+void
+vmm_idle(atomic_bool *flag)
+{
+  sigset_t kick, omask, waitmask;
+  sigemptyset(&kick);
+  sigaddset(&kick, VMM_KICK_SIGNAL);
+  pthread_sigmask(SIG_BLOCK, &kick, &omask);
+  waitmask = omask;
+  sigdelset(&waitmask, VMM_KICK_SIGNAL);
+  while (!atomic_load(flag)) {
+    vmm_park();
+    sigsuspend(&waitmask);
+  }
+  pthread_sigmask(SIG_SETMASK, &omask, NULL);
+  kicked = 0;
+}
+
+void
+vmm_wake(pthread_t thread)
+{
+  pthread_kill(thread, VMM_KICK_SIGNAL);
+}
 
+/* Make the thread leave the guest, or the host syscall it is blocked in, and
+   look at its pending signals. */
+void
+vmm_kick(pthread_t thread)
+{
+  pthread_rwlock_rdlock(&alloc_lock);
+  struct vcpu *p;
+  list_for_each_entry (p, &vcpus, list) {
+    if (p->thread == thread && !p->parked) {
+      hv_vcpu_interrupt(&p->vcpuid, 1);
+      break;
+    }
+  }
   pthread_rwlock_unlock(&alloc_lock);
+  pthread_kill(thread, VMM_KICK_SIGNAL);
+}
+
+void
+vmm_snapshot_vcpu_thread(struct vcpu_thread_snapshot *snapshot)
+{
+  for (uint64_t i = 0; i < NR_THREAD_REGS; i++) {
+    vmm_read_register(x86_reg_list[i], &snapshot->reg[i]);
+  }
+  vmm_read_register(HV_X86_XCR0, &snapshot->xcr0);
+  vmm_read_vmcs(VMCS_GUEST_FS_BASE, &snapshot->fs_base);
+  vmm_read_vmcs(VMCS_GUEST_GS_BASE, &snapshot->gs_base);
+  hv_vcpu_read_fpstate(vcpu->vcpuid, snapshot->fpu_states, sizeof snapshot->fpu_states);
+}
+
+/* the rest of the state is left as the vcpu was last initialized within this process */
+void
+vmm_restore_vcpu_thread(struct vcpu_thread_snapshot *snapshot)
+{
+  for (uint64_t i = 0; i < NR_THREAD_REGS; i++) {
+    vmm_write_register(x86_reg_list[i], snapshot->reg[i]);
+  }
+  vmm_write_register(HV_X86_XCR0, snapshot->xcr0);
+  vmm_write_vmcs(VMCS_GUEST_FS_BASE, snapshot->fs_base);
+  vmm_write_vmcs(VMCS_GUEST_GS_BASE, snapshot->gs_base);
+  hv_vcpu_write_fpstate(vcpu->vcpuid, snapshot->fpu_states, sizeof snapshot->fpu_states);
 }
 
 void init_msr(); // TODO: save and resotre MSR. just call init_msr in main.c now
@@ -252,28 +494,99 @@ vmm_restore_vcpu(struct vcpu_snapshot *snapshot)
   init_msr();
 }
 
+/* set in a forked child whose user mappings are entered into the EPT on demand */
+static bool ept_deferred;
+
+struct vmm_fork_stats vmm_fork_stats;
+
+/* Enter the regions of mm into the ept. Regions adjacent in both the guest
+   and the host address space with the same protection are entered by one
+   call, which makes the cost follow the number of distinct mappings rather
+   than the number of regions, which mprotect and partial munmap multiply. */
+static bool
+map_regions(struct mm *mm, bool remap)
+{
+  struct mm_region *p;
+  void *haddr = NULL;
+  gaddr_t gaddr = 0;
+  size_t size = 0;
+  hv_memory_flags_t flags = 0;
+
+  list_for_each_entry (p, &mm->mm_regions, list) {
+    if (remap) {
+      /* some of them may have been faulted in already */
+      hv_vm_unmap(p->gaddr, p->size);
+    }
+    hv_memory_flags_t f = linux_mprot_to_hv_mflag(p->prot);
+    if (size > 0 && gaddr + size == p->gaddr && (char *) haddr + size == p->haddr && flags == f) {
+      size += p->size;
+      continue;
+    }
+    if (size > 0 && hv_vm_map(haddr, gaddr, size, flags) != HV_SUCCESS)
+      return false;
+    haddr = p->haddr;
+    gaddr = p->gaddr;
+    size = p->size;
+    flags = f;
+  }
+  return size == 0 || hv_vm_map(haddr, gaddr, size, flags) == HV_SUCCESS;
+}
+
 bool
 restore_ept()
 {
-  struct list_head *list;
+  return map_regions(&vkern_mm, false) && map_regions(proc.mm, false);
+}
 
-  list_for_each (list, &vkern_mm.mm_regions) {
-    struct mm_region *p = list_entry(list, struct mm_region, list);
-    if (hv_vm_map(p->haddr, p->gaddr, p->size, linux_mprot_to_hv_mflag(p->prot)) != HV_SUCCESS)
-      return false;
+bool
+vmm_ept_deferred(void)
+{
+  return ept_deferred;
+}
+
+/* Called on an EPT violation. Maps the user region containing gaddr if its
+   entry is still deferred and the region permits the access. */
+bool
+vmm_fault_in_ept(gaddr_t gaddr, int verify)
+{
+  if (!ept_deferred) {
+    return false;
   }
-  list_for_each (list, &proc.mm->mm_regions) {
-    struct mm_region *p = list_entry(list, struct mm_region, list);
-    if (hv_vm_map(p->haddr, p->gaddr, p->size, linux_mprot_to_hv_mflag(p->prot)) != HV_SUCCESS)
-      return false;
+  struct mm_region *p = find_region(gaddr, proc.mm);
+  if (!p || (p->prot & verify) != verify) {
+    return false;
   }
-  return true;
+  hv_vm_unmap(p->gaddr, p->size);
+  return hv_vm_map(p->haddr, p->gaddr, p->size, linux_mprot_to_hv_mflag(p->prot)) == HV_SUCCESS;
+}
+
+/* the child keeps its image after all; enter the remaining user regions at once */
+void
+vmm_populate_ept(void)
+{
+  if (!ept_deferred) {
+    return;
+  }
+  ept_deferred = false;
+  uint64_t start = vmm_clock_ns();
+  if (!map_regions(proc.mm, true)) {
+    panic("could not restore the ept");
+  }
+  vmm_fork_stats.restore += vmm_clock_ns() - start;
+}
+
+/* the child replaced its image by execve, whose regions are mapped eagerly */
+void
+vmm_drop_deferred_ept(void)
+{
+  ept_deferred = false;
 }
 
 void
-vmm_reentry(struct vmm_snapshot *snapshot)
+vmm_reentry(struct vmm_snapshot *snapshot, bool defer_ept)
 {
   hv_return_t ret;
+  uint64_t start = vmm_clock_ns();
 
   printk("vmm_restore\n");
   bool retried = false;
@@ -291,26 +604,49 @@ retry:
   }
   printk("successfully created vm\n");
 
-  pthread_rwlock_rdlock(&alloc_lock);
-
-  if (nr_vcpus > 1) {
-    fprintf(stderr, "multi-threaded fork is not implemented yet.\n");
-    exit(1);
-  }
-
   ret = hv_vcpu_create(&vcpu->vcpuid, HV_VCPU_DEFAULT);
   if (ret != HV_SUCCESS) {
     panic("could not create a vcpu: error code %x", ret);
     return;
   }
   vmm_restore_vcpu(&snapshot->first_vcpu_snapshot);
-
-  pthread_rwlock_unlock(&alloc_lock);
   printk("vcpu_restore done\n");
 
-  restore_ept();
+  if (getpid() != snapshot->pid) {
+    /* only the forking thread lives on in the child */
+    struct vcpu *p, *n;
+    list_for_each_entry_safe (p, n, &vcpus, list) {
+      if (p != vcpu) {
+        list_del(&p->list);
+        free(p);
+      }
+    }
+    nr_vcpus = 1;
+    /* other threads may have held them at the time of fork */
+    pthread_rwlock_init(&alloc_lock, NULL);
+    pthread_mutex_init(&park_lock, NULL);
+    pthread_cond_init(&park_cond, NULL);
+    atomic_store(&park_requested, false);
+    nr_parked = 0;
+  }
+
+  uint64_t restore_start = vmm_clock_ns();
+  vmm_fork_stats.reentry += restore_start - start;
+  if (defer_ept) {
+    /* only the kernel part is entered now; see vmm_fault_in_ept */
+    ept_deferred = true;
+    if (!map_regions(&vkern_mm, false)) {
+      panic("could not restore the ept");
+    }
+  } else {
+    restore_ept();
+  }
+  vmm_fork_stats.restore += vmm_clock_ns() - restore_start;
   printk("ept_restore done\n");
 
+  if (getpid() == snapshot->pid) {
+    unpark_vcpus();
+  }
 }
 
 void
@@ -368,6 +704,11 @@ vmm_write_vmcs(hv_x86_reg_t field, uint64_t val) {
 int
 vmm_run()
 {
+  if (has_preemption_timer) {
+    bool now = exit_requested;
+    exit_requested = 0;
+    vmm_write_vmcs(VMCS_GUEST_VMX_TIMER_VALUE, now ? 0 : EXIT_CHECK_TICKS);
+  }
   if (hv_vcpu_run(vcpu->vcpuid) == HV_SUCCESS) {
     return 0;
   }
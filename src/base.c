@@ -48,19 +48,26 @@ copy_from_user(void *to, gaddr_t src_ptr, size_t n)
 ssize_t
 strncpy_from_user(void *to, gaddr_t src_ptr, size_t n)
 {
-  size_t len = strnlen_user(src_ptr, n);
-  if (len == 0) {
-    return -LINUX_EFAULT;
-  } else if (n < len) {
-    if (copy_from_user(to, src_ptr, n)) {
+  /* copy while scanning so that the string is read only once */
+  size_t len = 0;
+  while (n > 0) {
+    const void *src = guest_to_host(src_ptr);
+    if (src == NULL) {
       return -LINUX_EFAULT;
     }
-    return n;
-  }
-  if (copy_from_user(to, src_ptr, len)) {
-    return -LINUX_EFAULT;
+    size_t size = MIN(rounddown(src_ptr + 4096, 4096) - src_ptr, n);
+    size_t i = strnlen(src, size);
+    if (i < size) {
+      memcpy(to, src, i + 1);
+      return len + i;
+    }
+    memcpy(to, src, size);
+    to = (char *) to + size;
+    len += size;
+    src_ptr += size;
+    n -= size;
   }
-  return len - 1;
+  return len;
 }
 
 // Get the size of a user string INCLUDING trailing NULL
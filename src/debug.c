@@ -22,8 +22,10 @@ pthread_mutex_t warnk_sync = PTHREAD_MUTEX_INITIALIZER;
 void
 init_sink(const char *fn, FILE **sinkp, const char *name)
 {
+  /* no sink at all is cheaper than one writing to /dev/null */
   if (! fn) {
-    fn = "/dev/null";
+    *sinkp = NULL;
+    return;
   }
   int fd = open(fn, O_RDWR | O_CREAT, 0644);
   *sinkp = fdopen(vkern_dup_fd(fd, false), "w");
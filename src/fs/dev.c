@@ -0,0 +1,294 @@
+#include "common.h"
+#include "noah.h"
+#include "fs.h"
+
+#include "linux/common.h"
+#include "linux/fs.h"
+#include "linux/errno.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * /dev/null, /dev/zero, /dev/full, /dev/random and /dev/urandom, served by
+ * noah itself so that reading and writing them never leaves noah. The fd
+ * number of an open device is reserved by an fd of the host device of the
+ * same name -- /dev/zero for /dev/full, which the host lacks -- and noah's own
+ * opens, which install no file, simply get that host fd.
+ */
+
+enum dev_kind { DEV_NULL, DEV_ZERO, DEV_FULL, DEV_RANDOM };
+
+struct device {
+  const char *path;
+  const char *host;
+  int minor;                    /* all are of major 1, mem, on Linux */
+  enum dev_kind kind;
+};
+
+static const struct device devices[] = {
+  {"/dev/null", "/dev/null", 3, DEV_NULL},
+  {"/dev/zero", "/dev/zero", 5, DEV_ZERO},
+  {"/dev/full", "/dev/zero", 7, DEV_FULL},
+  {"/dev/random", "/dev/random", 8, DEV_RANDOM},
+  {"/dev/urandom", "/dev/urandom", 9, DEV_RANDOM},
+};
+
+static const struct device *
+find_device(const char *path)
+{
+  for (size_t i = 0; i < sizeof devices / sizeof devices[0]; i++) {
+    if (strcmp(path, devices[i].path) == 0) {
+      return &devices[i];
+    }
+  }
+  return NULL;
+}
+
+bool
+is_dev_file(const char *path)
+{
+  return find_device(path) != NULL;
+}
+
+static void
+set_dev_stat(const struct device *dev, struct l_newstat *l_st)
+{
+  l_st->st_mode = S_IFCHR | 0666;
+  l_st->st_rdev = (1 << 8) | dev->minor;
+  l_st->st_size = 0;
+}
+
+static int
+dev_readv(struct file *file, struct iovec *iov, size_t iovcnt)
+{
+  const struct device *dev = file->private_data;
+  if (dev->kind == DEV_NULL) {
+    return 0;
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < iovcnt; i++) {
+    size_t len = MIN(iov[i].iov_len, (size_t) INT32_MAX - total);
+    if (dev->kind == DEV_RANDOM) {
+      arc4random_buf(iov[i].iov_base, len);
+    } else {
+      memset(iov[i].iov_base, 0, len);
+    }
+    total += len;
+  }
+  return total;
+}
+
+static int
+dev_writev(struct file *file, const struct iovec *iov, size_t iovcnt)
+{
+  const struct device *dev = file->private_data;
+  if (dev->kind == DEV_FULL) {
+    return -LINUX_ENOSPC;
+  }
+  /* what is written to the random devices is not mixed into anything */
+  return MIN(iov_size(iov, iovcnt), (size_t) INT32_MAX);
+}
+
+static int
+dev_ioctl(struct file *file, int cmd, uint64_t val0)
+{
+  return -LINUX_ENOTTY;
+}
+
+static int
+dev_lseek(struct file *file, l_off_t offset, int whence)
+{
+  /* the position of a memory device is always 0 */
+  return 0;
+}
+
+static int
+dev_getdents(struct file *file, char *buf, uint count, bool is64)
+{
+  return -LINUX_ENOTDIR;
+}
+
+static int
+dev_fsync(struct file *file)
+{
+  return -LINUX_EINVAL;
+}
+
+static int
+dev_fstat(struct file *file, struct l_newstat *l_st)
+{
+  int r = darwinfs_fstat(file, l_st);
+  if (r < 0) {
+    return r;
+  }
+  set_dev_stat(file->private_data, l_st);
+  return 0;
+}
+
+struct file_operations dev_file_ops = {
+  .readv = dev_readv,
+  .writev = dev_writev,
+  .close = darwinfs_close,
+  .ioctl = dev_ioctl,
+  .lseek = dev_lseek,
+  .getdents = dev_getdents,
+  .fcntl = darwinfs_fcntl,
+  .fsync = dev_fsync,
+  .fstat = dev_fstat,
+  .fstatfs = darwinfs_fstatfs,
+  .fchown = darwinfs_fchown,
+  .fchmod = darwinfs_fchmod,
+};
+
+/* a mapping of /dev/zero is anonymous memory, as on Linux */
+bool
+is_dev_zero(int fd)
+{
+  struct file *file = get_file(fd);
+  return file && file->ops == &dev_file_ops && ((const struct device *) file->private_data)->kind == DEV_ZERO;
+}
+
+/* checkpoints save a device by its guest path and restore it from the host
+   device behind that path */
+const char *
+dev_file_path(struct file *file)
+{
+  return ((const struct device *) file->private_data)->path;
+}
+
+const char *
+dev_host_path(const char *path)
+{
+  const struct device *dev = find_device(path);
+  return dev ? dev->host : NULL;
+}
+
+/* fdtable_lock must be held */
+int
+register_dev_file(int fd, bool is_cloexec, const char *path)
+{
+  const struct device *dev = find_device(path);
+  if (dev == NULL)
+    return -LINUX_ENOENT;
+  return register_file(fd, is_cloexec, &dev_file_ops, (void *) dev);
+}
+
+static int
+dev_openat(struct fs *fs, struct dir *dir, const char *path, int l_flags, int mode)
+{
+  const struct device *dev = find_device(path);
+  if (dev == NULL)
+    return -LINUX_ENOENT;
+  if (l_flags & LINUX_O_DIRECTORY)
+    return -LINUX_ENOTDIR;
+  struct dir hostdir = { AT_FDCWD };
+  return darwinfs_openat(&darwinfs, &hostdir, dev->host, l_flags & ~(LINUX_O_CREAT | LINUX_O_EXCL | LINUX_O_TRUNC), mode);
+}
+
+static void
+dev_init_file(struct fs *fs, struct file *file, const char *path)
+{
+  file->ops = &dev_file_ops;
+  file->private_data = (void *) find_device(path);
+}
+
+static int
+dev_symlinkat(struct fs *fs, const char *target, struct dir *dir, const char *name)
+{
+  return -LINUX_EEXIST;
+}
+
+static int
+dev_faccessat(struct fs *fs, struct dir *dir, const char *path, int mode)
+{
+  if (mode & X_OK)
+    return -LINUX_EACCES;
+  return 0;
+}
+
+static int
+dev_renameat(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to)
+{
+  return -LINUX_EACCES;
+}
+
+static int
+dev_linkat(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to, int l_flags)
+{
+  return -LINUX_EACCES;
+}
+
+static int
+dev_unlinkat(struct fs *fs, struct dir *dir, const char *path, int l_flags)
+{
+  return -LINUX_EACCES;
+}
+
+static int
+dev_readlinkat(struct fs *fs, struct dir *dir, const char *path, char *buf, int bufsize)
+{
+  return -LINUX_EINVAL;
+}
+
+static int
+dev_mkdirat(struct fs *fs, struct dir *dir, const char *path, int mode)
+{
+  return -LINUX_EEXIST;
+}
+
+static int
+dev_fstatat(struct fs *fs, struct dir *dir, const char *path, struct l_newstat *l_st, int l_flags)
+{
+  const struct device *dev = find_device(path);
+  struct dir hostdir = { AT_FDCWD };
+  int r = darwinfs_fstatat(&darwinfs, &hostdir, dev->host, l_st, l_flags);
+  if (r < 0) {
+    return r;
+  }
+  set_dev_stat(dev, l_st);
+  return 0;
+}
+
+static int
+dev_statfs(struct fs *fs, struct dir *dir, const char *path, struct l_statfs *buf)
+{
+  struct dir hostdir = { AT_FDCWD };
+  return darwinfs_statfs(&darwinfs, &hostdir, find_device(path)->host, buf);
+}
+
+static int
+dev_fchownat(struct fs *fs, struct dir *dir, const char *path, l_uid_t uid, l_gid_t gid, int l_flags)
+{
+  return -LINUX_EPERM;
+}
+
+static int
+dev_fchmodat(struct fs *fs, struct dir *dir, const char *path, l_mode_t mode)
+{
+  return -LINUX_EPERM;
+}
+
+static struct fs_operations devfs_ops = {
+  dev_openat,
+  dev_symlinkat,
+  dev_faccessat,
+  dev_renameat,
+  dev_linkat,
+  dev_unlinkat,
+  dev_readlinkat,
+  dev_mkdirat,
+  dev_fstatat,
+  dev_statfs,
+  dev_fchownat,
+  dev_fchmodat,
+  dev_init_file,
+};
+
+struct fs devfs = {
+  .ops = &devfs_ops,
+};
@@ -0,0 +1,536 @@
+#include "common.h"
+#include "noah.h"
+#include "fs.h"
+
+#include "linux/common.h"
+#include "linux/errno.h"
+#include "linux/eventpoll.h"
+#include "linux/signal.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+/*
+ * epoll on top of kqueue.
+ *
+ * An epoll instance is a host kqueue, so its fd number is owned by the host and
+ * the instance itself can be polled, selected, or nested into another epoll.
+ * An interest entry is kept as persistent EVFILT_READ/EVFILT_WRITE knotes whose
+ * ident is the target fd. EPOLLET maps to EV_CLEAR and EPOLLONESHOT to EV_DISPATCH.
+ */
+
+struct epitem {
+  int fd;
+  uint32_t events;
+  uint64_t data;
+  bool is_sock;
+  bool disabled;           /* oneshot item which has already fired */
+  uint64_t gen;            /* epoll_wait round in which `slot' is valid */
+  int slot;
+};
+
+KHASH_MAP_INIT_INT(epitem, struct epitem *)
+
+struct epoll {
+  atomic_int refcount;
+  pthread_mutex_t lock;
+  khash_t(epitem) *items;
+  uint64_t gen;
+  int kq;                  /* the fd the kqueue was made under in the last fork_epoll */
+  uint64_t renew_gen;
+};
+
+#define EPOLL_READ_EVENTS  (LINUX_EPOLLIN | LINUX_EPOLLRDNORM | LINUX_EPOLLPRI | LINUX_EPOLLRDHUP)
+#define EPOLL_WRITE_EVENTS (LINUX_EPOLLOUT | LINUX_EPOLLWRNORM)
+#define EPOLLEXCLUSIVE_OK_BITS (LINUX_EPOLLIN | LINUX_EPOLLOUT | LINUX_EPOLLERR | LINUX_EPOLLHUP | LINUX_EPOLLWAKEUP | LINUX_EPOLLET | LINUX_EPOLLEXCLUSIVE)
+
+static const int epoll_max_kevents = 1024;
+
+static int epoll_close(struct file *file);
+static void epoll_dup(struct file *file);
+
+static struct file_operations epoll_ops = {
+  .close = epoll_close,
+  .lseek = darwinfs_lseek,
+  .getdents = darwinfs_getdents,
+  .fcntl = darwinfs_fcntl,
+  .fsync = darwinfs_fsync,
+  .fstat = darwinfs_fstat,
+  .fstatfs = darwinfs_fstatfs,
+  .fchown = darwinfs_fchown,
+  .fchmod = darwinfs_fchmod,
+  .dup = epoll_dup,
+};
+
+static int
+epoll_close(struct file *file)
+{
+  struct epoll *ep = file->private_data;
+  int r = syswrap(close(file->fd));
+  if (atomic_fetch_sub(&ep->refcount, 1) == 1) {
+    struct epitem *item;
+    kh_foreach_value(ep->items, item, free(item));
+    kh_destroy(epitem, ep->items);
+    pthread_mutex_destroy(&ep->lock);
+    free(ep);
+  }
+  return r;
+}
+
+static void
+epoll_dup(struct file *file)
+{
+  struct epoll *ep = file->private_data;
+  atomic_fetch_add(&ep->refcount, 1);
+}
+
+static int
+do_epoll_create(int flags)
+{
+  if (flags & ~LINUX_EPOLL_CLOEXEC) {
+    return -LINUX_EINVAL;
+  }
+
+  pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
+  int kq = syswrap(kqueue());
+  if (kq < 0) {
+    goto out;
+  }
+  if (flags & LINUX_EPOLL_CLOEXEC) {
+    fcntl(kq, F_SETFD, FD_CLOEXEC);
+  }
+  struct epoll *ep = malloc(sizeof *ep);
+  ep->refcount = ATOMIC_VAR_INIT(1);
+  pthread_mutex_init(&ep->lock, NULL);
+  ep->items = kh_init(epitem);
+  ep->gen = 0;
+  ep->kq = kq;
+  ep->renew_gen = 0;
+  int err = register_file(kq, flags & LINUX_EPOLL_CLOEXEC, &epoll_ops, ep);
+  if (err < 0) {
+    close(kq);
+    kh_destroy(epitem, ep->items);
+    free(ep);
+    kq = err;
+  }
+
+out:
+  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+  return kq;
+}
+
+DEFINE_SYSCALL(epoll_create, int, size)
+{
+  if (size <= 0) {
+    return -LINUX_EINVAL;
+  }
+  return do_epoll_create(0);
+}
+
+DEFINE_SYSCALL(epoll_create1, int, flags)
+{
+  return do_epoll_create(flags);
+}
+
+/* apply changes with EV_RECEIPT and return the first error */
+static int
+apply_kevents(int kq, struct kevent *changes, int n)
+{
+  if (n == 0) {
+    return 0;
+  }
+  for (int i = 0; i < n; i++) {
+    changes[i].flags |= EV_RECEIPT;
+  }
+  struct kevent res[n];
+  int r = kevent(kq, changes, n, res, n, NULL);
+  if (r < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  for (int i = 0; i < r; i++) {
+    if ((res[i].flags & EV_ERROR) && res[i].data != 0) {
+      return -darwin_to_linux_errno(res[i].data);
+    }
+  }
+  return 0;
+}
+
+static int
+epitem_register(int kq, struct epitem *item)
+{
+  struct kevent changes[2];
+  int n = 0;
+  u_short flags = EV_ADD | EV_ENABLE;
+  if (item->events & LINUX_EPOLLET) {
+    flags |= EV_CLEAR;
+  }
+  if (item->events & LINUX_EPOLLONESHOT) {
+    flags |= EV_DISPATCH;
+  }
+  if (item->events & EPOLL_READ_EVENTS) {
+    EV_SET(&changes[n++], item->fd, EVFILT_READ, flags, 0, 0, NULL);
+  }
+  if (item->events & EPOLL_WRITE_EVENTS) {
+    EV_SET(&changes[n++], item->fd, EVFILT_WRITE, flags, 0, 0, NULL);
+  }
+  return apply_kevents(kq, changes, n);
+}
+
+static void
+epitem_unregister(int kq, struct epitem *item, u_short flags)
+{
+  struct kevent changes[2];
+  int n = 0;
+  EV_SET(&changes[n++], item->fd, EVFILT_READ, flags, 0, 0, NULL);
+  EV_SET(&changes[n++], item->fd, EVFILT_WRITE, flags, 0, 0, NULL);
+  apply_kevents(kq, changes, n); // ENOENT is expected for filters not registered
+}
+
+/*
+ * The host drops knotes silently when the target fd gets closed, so an entry in
+ * the interest list may be stale. Touch a knote without changing it to find out.
+ */
+static bool
+epitem_alive(int kq, struct epitem *item)
+{
+  struct kevent change;
+  if (item->events & EPOLL_READ_EVENTS) {
+    EV_SET(&change, item->fd, EVFILT_READ, 0, 0, 0, NULL);
+  } else if (item->events & EPOLL_WRITE_EVENTS) {
+    EV_SET(&change, item->fd, EVFILT_WRITE, 0, 0, 0, NULL);
+  } else {
+    return true;
+  }
+  return apply_kevents(kq, &change, 1) != -LINUX_ENOENT;
+}
+
+static struct epitem *
+epitem_lookup(struct epoll *ep, int fd)
+{
+  khiter_t k = kh_get(epitem, ep->items, fd);
+  if (k == kh_end(ep->items)) {
+    return NULL;
+  }
+  return kh_value(ep->items, k);
+}
+
+static void
+epitem_remove(struct epoll *ep, struct epitem *item)
+{
+  kh_del(epitem, ep->items, kh_get(epitem, ep->items, item->fd));
+  free(item);
+}
+
+DEFINE_SYSCALL(epoll_ctl, int, epfd, int, op, int, fd, gaddr_t, event_ptr)
+{
+  struct file *epfile = get_file(epfd);
+  struct file *file = get_file(fd);
+  if (epfile == NULL || file == NULL) {
+    return -LINUX_EBADF;
+  }
+  if (epfile->ops != &epoll_ops || epfd == fd) {
+    return -LINUX_EINVAL;
+  }
+
+  struct l_epoll_event ev = {0};
+  if (op != LINUX_EPOLL_CTL_DEL) {
+    if (copy_from_user(&ev, event_ptr, sizeof ev)) {
+      return -LINUX_EFAULT;
+    }
+  }
+  if (ev.events & LINUX_EPOLLEXCLUSIVE) {
+    if (op == LINUX_EPOLL_CTL_MOD || (ev.events & ~EPOLLEXCLUSIVE_OK_BITS) || file->ops == &epoll_ops) {
+      return -LINUX_EINVAL;
+    }
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    return -LINUX_EBADF;
+  }
+  if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
+    return -LINUX_EPERM;
+  }
+
+  struct epoll *ep = epfile->private_data;
+  int kq = epfile->fd;
+  int r = 0;
+  pthread_mutex_lock(&ep->lock);
+
+  struct epitem *item = epitem_lookup(ep, fd);
+  if (item && !epitem_alive(kq, item)) {
+    epitem_remove(ep, item);
+    item = NULL;
+  }
+
+  switch (op) {
+  case LINUX_EPOLL_CTL_ADD: {
+    if (item) {
+      r = -LINUX_EEXIST;
+      break;
+    }
+    item = malloc(sizeof *item);
+    *item = (struct epitem) {
+      .fd = fd,
+      .events = ev.events,
+      .data = ev.data,
+      .is_sock = S_ISSOCK(st.st_mode),
+      .disabled = false,
+      .gen = 0,
+      .slot = -1,
+    };
+    r = epitem_register(kq, item);
+    if (r < 0) {
+      epitem_unregister(kq, item, EV_DELETE);
+      free(item);
+      break;
+    }
+    int ret;
+    khiter_t k = kh_put(epitem, ep->items, fd, &ret);
+    kh_value(ep->items, k) = item;
+    break;
+  }
+  case LINUX_EPOLL_CTL_MOD:
+    if (!item) {
+      r = -LINUX_ENOENT;
+      break;
+    }
+    if (item->events & LINUX_EPOLLEXCLUSIVE) {
+      r = -LINUX_EINVAL;
+      break;
+    }
+    epitem_unregister(kq, item, EV_DELETE);
+    item->events = ev.events;
+    item->data = ev.data;
+    item->disabled = false;
+    r = epitem_register(kq, item);
+    break;
+  case LINUX_EPOLL_CTL_DEL:
+    if (!item) {
+      r = -LINUX_ENOENT;
+      break;
+    }
+    epitem_unregister(kq, item, EV_DELETE);
+    epitem_remove(ep, item);
+    break;
+  default:
+    r = -LINUX_EINVAL;
+  }
+
+  pthread_mutex_unlock(&ep->lock);
+  return r;
+}
+
+static uint32_t
+kevent_to_epoll_events(struct kevent *kev, struct epitem *item)
+{
+  uint32_t events = 0;
+  if (kev->filter == EVFILT_READ) {
+    events |= LINUX_EPOLLIN | LINUX_EPOLLRDNORM;
+    if (kev->flags & EV_EOF) {
+      // for sockets EOF on the read side just means the peer shut down writing
+      events |= item->is_sock ? LINUX_EPOLLRDHUP : LINUX_EPOLLHUP;
+    }
+  } else if (kev->filter == EVFILT_WRITE) {
+    events |= LINUX_EPOLLOUT | LINUX_EPOLLWRNORM;
+    if (kev->flags & EV_EOF) {
+      events |= LINUX_EPOLLHUP;
+    }
+  }
+  if ((kev->flags & EV_EOF) && kev->fflags != 0) {
+    events |= LINUX_EPOLLERR;
+  }
+  return events & (item->events | LINUX_EPOLLERR | LINUX_EPOLLHUP);
+}
+
+static uint64_t renew_gen;
+
+static void
+renew_kqueue(struct file *file, bool cloexec, void *arg)
+{
+  struct epoll *ep = file->private_data;
+  if (ep->renew_gen == renew_gen) {
+    /* a dup of an instance made already */
+    dup2(ep->kq, file->fd);
+  } else {
+    int kq = kqueue();
+    if (kq < 0) {
+      /* the fd stays closed, and using it fails with EBADF */
+      return;
+    }
+    if (kq != file->fd) {
+      dup2(kq, file->fd);
+      close(kq);
+    }
+    ep->kq = file->fd;
+    ep->renew_gen = renew_gen;
+  }
+  if (cloexec) {
+    fcntl(file->fd, F_SETFD, FD_CLOEXEC);
+  }
+}
+
+static void
+renew_epitem(int kq, struct epitem *item)
+{
+  /* an item whose target is not there any more is found stale later */
+  if (epitem_register(kq, item) == 0 && item->disabled) {
+    epitem_unregister(kq, item, EV_DISABLE);
+  }
+}
+
+static void
+renew_interest(struct file *file, bool cloexec, void *arg)
+{
+  struct epoll *ep = file->private_data;
+  if (ep->renew_gen != renew_gen || ep->kq != file->fd) {
+    return;
+  }
+  struct epitem *item;
+  kh_foreach_value(ep->items, item, renew_epitem(ep->kq, item));
+}
+
+/* called in a forked child */
+void
+fork_epoll(void)
+{
+  renew_gen++;
+  for_each_file(&epoll_ops, renew_kqueue, NULL);
+  /* nested instances can be watched only once all of them exist again */
+  for_each_file(&epoll_ops, renew_interest, NULL);
+}
+
+static int
+do_epoll_wait(int epfd, gaddr_t events_ptr, int maxevents, int timeout, l_sigset_t *sigmask)
+{
+  if (maxevents <= 0 || (size_t) maxevents > LINUX_EP_MAX_EVENTS) {
+    return -LINUX_EINVAL;
+  }
+  struct file *file = get_file(epfd);
+  if (file == NULL) {
+    return -LINUX_EBADF;
+  }
+  if (file->ops != &epoll_ops) {
+    return -LINUX_EINVAL;
+  }
+  struct epoll *ep = file->private_data;
+
+  struct timespec ts, *tsp = NULL;
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    tsp = &ts;
+  }
+
+  int nkev = MIN(maxevents, epoll_max_kevents);
+  struct kevent *kev = malloc(sizeof(struct kevent) * nkev);
+  struct l_epoll_event *out = malloc(sizeof(struct l_epoll_event) * nkev);
+  struct kevent *disables = malloc(sizeof(struct kevent) * nkev);
+
+  int n;
+  if (sigmask && file->fd < FD_SETSIZE) {
+    /* a kqueue is readable while it has events; wait for that under the
+       temporary mask, then collect them */
+    set_temporary_sigmask(sigmask);
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(file->fd, &readfds);
+    n = pselect_sigmask(file->fd + 1, &readfds, NULL, NULL, tsp);
+    if (n > 0) {
+      static const struct timespec zero = { 0, 0 };
+      n = syswrap(kevent(file->fd, NULL, 0, kev, nkev, &zero));
+    }
+  } else {
+    if (sigmask) {
+      set_temporary_sigmask(sigmask);
+    }
+    if (has_sigpending()) {
+      n = -LINUX_EINTR;
+    } else {
+      n = syswrap(kevent(file->fd, NULL, 0, kev, nkev, tsp));
+    }
+  }
+
+  if (n <= 0) {
+    goto out;
+  }
+
+  int ndisables = 0;
+  int nr = 0;
+
+  pthread_mutex_lock(&ep->lock);
+  ep->gen++;
+  for (int i = 0; i < n; i++) {
+    if (kev[i].flags & EV_ERROR) {
+      continue;
+    }
+    struct epitem *item = epitem_lookup(ep, kev[i].ident);
+    if (item == NULL) {
+      continue;
+    }
+    bool seen = item->gen == ep->gen;
+    if (item->disabled && !seen) {
+      continue;
+    }
+    uint32_t events = kevent_to_epoll_events(&kev[i], item);
+    if (events == 0) {
+      continue;
+    }
+    if (!seen) {
+      item->gen = ep->gen;
+      item->slot = nr++;
+      out[item->slot] = (struct l_epoll_event) { 0, item->data };
+    }
+    out[item->slot].events |= events;
+    if ((item->events & LINUX_EPOLLONESHOT) && !item->disabled) {
+      // the fired knote is disabled by EV_DISPATCH; its sibling must be too
+      item->disabled = true;
+      int other = (kev[i].filter == EVFILT_READ) ? EVFILT_WRITE : EVFILT_READ;
+      EV_SET(&disables[ndisables++], item->fd, other, EV_DISABLE, 0, 0, NULL);
+    }
+  }
+  pthread_mutex_unlock(&ep->lock);
+
+  apply_kevents(file->fd, disables, ndisables);
+
+  n = nr;
+  if (copy_to_user(events_ptr, out, sizeof(struct l_epoll_event) * nr)) {
+    n = -LINUX_EFAULT;
+  }
+
+out:
+  free(kev);
+  free(out);
+  free(disables);
+  return n;
+}
+
+DEFINE_SYSCALL(epoll_wait, int, epfd, gaddr_t, events, int, maxevents, int, timeout)
+{
+  return do_epoll_wait(epfd, events, maxevents, timeout, NULL);
+}
+
+DEFINE_SYSCALL(epoll_pwait, int, epfd, gaddr_t, events, int, maxevents, int, timeout, gaddr_t, sigmask_ptr, size_t, sigsetsize)
+{
+  if (sigmask_ptr == 0) {
+    return do_epoll_wait(epfd, events, maxevents, timeout, NULL);
+  }
+  if (sigsetsize != sizeof(l_sigset_t)) {
+    return -LINUX_EINVAL;
+  }
+  l_sigset_t sigmask;
+  if (copy_from_user(&sigmask, sigmask_ptr, sizeof sigmask)) {
+    return -LINUX_EFAULT;
+  }
+  return do_epoll_wait(epfd, events, maxevents, timeout, &sigmask);
+}
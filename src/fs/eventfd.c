@@ -0,0 +1,854 @@
+#include "common.h"
+#include "noah.h"
+#include "fs.h"
+
+#include "linux/common.h"
+#include "linux/time.h"
+#include "linux/fs.h"
+#include "linux/errno.h"
+#include "linux/signal.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+/*
+ * eventfd, timerfd and signalfd.
+ *
+ * Each of them is backed by its own host kqueue. The kqueue reserves the fd
+ * number and is what the host poll/select/kevent (and thus our epoll) look at,
+ * so no pipe is needed. Readiness is expressed by knotes on that kqueue:
+ *   - eventfd:  an EVFILT_USER knote, enabled and triggered while readable
+ *   - timerfd:  a one-shot EVFILT_TIMER knote armed for the next expiration
+ *   - signalfd: EVFILT_SIGNAL knotes, plus the user knote for signals that
+ *               were already pending when the mask was set
+ * Blocking reads wait on the same kqueue, so they are interruptible by signals.
+ *
+ * A forked child does not get the kqueues, only the fd numbers. fork_evfiles
+ * makes a new kqueue for each file and registers the knotes its state calls
+ * for again: the counter of an eventfd, the armed timer of a timerfd, and the
+ * mask of a signalfd. Like any other file, the child's copy is not shared
+ * with the parent's any more.
+ */
+
+static const uintptr_t evfile_user_ident = 0;
+static const uintptr_t evfile_timer_ident = 1;
+
+int
+evfile_close(struct file *file)
+{
+  struct evfile *ef = file->private_data;
+  int r = syswrap(close(file->fd));
+  if (atomic_fetch_sub(&ef->refcount, 1) == 1) {
+    pthread_mutex_destroy(&ef->lock);
+    free(ef);
+  }
+  return r;
+}
+
+void
+evfile_dup(struct file *file)
+{
+  struct evfile *ef = file->private_data;
+  atomic_fetch_add(&ef->refcount, 1);
+}
+
+/* darwin refuses F_SETFL on a kqueue, so O_NONBLOCK is kept on our side */
+int
+evfile_fcntl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  struct evfile *ef = file->private_data;
+  switch (cmd) {
+  case LINUX_F_GETFL:
+    return LINUX_O_RDWR | (ef->nonblock ? LINUX_O_NONBLOCK : 0);
+  case LINUX_F_SETFL:
+    ef->nonblock = arg & LINUX_O_NONBLOCK;
+    return 0;
+  default:
+    return darwinfs_fcntl(file, cmd, arg);
+  }
+}
+
+void
+evfile_set_ready(int kq, bool ready)
+{
+  struct kevent kev;
+  if (ready) {
+    EV_SET(&kev, evfile_user_ident, EVFILT_USER, EV_ENABLE, NOTE_TRIGGER, 0, NULL);
+  } else {
+    EV_SET(&kev, evfile_user_ident, EVFILT_USER, EV_DISABLE, 0, 0, NULL);
+  }
+  kevent(kq, &kev, 1, NULL, 0, NULL);
+}
+
+/* sleep until something happens on the kqueue */
+static int
+evfile_wait(int kq)
+{
+  struct kevent kev;
+  if (kevent(kq, NULL, 0, &kev, 1, NULL) < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  return 0;
+}
+
+/* consume delivered knotes so that the kqueue is no longer readable */
+static void
+evfile_drain(int kq)
+{
+  struct kevent kev[8];
+  struct timespec zero = { 0, 0 };
+  while (kevent(kq, NULL, 0, kev, 8, &zero) > 0)
+    ;
+}
+
+int
+evfile_create(struct evfile *ef, struct file_operations *ops, bool cloexec, bool nonblock)
+{
+  ef->refcount = ATOMIC_VAR_INIT(1);
+  pthread_mutex_init(&ef->lock, NULL);
+  ef->nonblock = nonblock;
+  ef->owner = getpid();
+
+  pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
+  int kq = syswrap(kqueue());
+  if (kq < 0) {
+    goto fail;
+  }
+  if (cloexec) {
+    fcntl(kq, F_SETFD, FD_CLOEXEC);
+  }
+  struct kevent kev;
+  EV_SET(&kev, evfile_user_ident, EVFILT_USER, EV_ADD | EV_DISABLE, 0, 0, NULL);
+  kevent(kq, &kev, 1, NULL, 0, NULL);
+  int err = register_file(kq, cloexec, ops, ef);
+  if (err < 0) {
+    close(kq);
+    kq = err;
+    goto fail;
+  }
+  ef->kq = kq;
+  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+  return kq;
+
+fail:
+  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+  pthread_mutex_destroy(&ef->lock);
+  free(ef);
+  return kq;
+}
+
+/*
+ * Gives file->fd a kqueue of this process, in a forked child. The dups of an
+ * evfile share the one made for the first of them. Returns true if the kqueue
+ * is new and still empty but for the user knote, and the caller has to add
+ * the rest of the knotes.
+ */
+bool
+evfile_renew(struct file *file, bool cloexec)
+{
+  struct evfile *ef = file->private_data;
+  bool fresh = ef->owner != getpid();
+  if (!fresh) {
+    dup2(ef->kq, file->fd);
+  } else {
+    int kq = kqueue();
+    if (kq < 0) {
+      /* the fd stays closed, and using it fails with EBADF */
+      return false;
+    }
+    if (kq != file->fd) {
+      dup2(kq, file->fd);
+      close(kq);
+    }
+    ef->owner = getpid();
+    ef->kq = file->fd;
+    /* a thread of the parent may have held it; that thread is not here */
+    pthread_mutex_init(&ef->lock, NULL);
+    struct kevent kev;
+    EV_SET(&kev, evfile_user_ident, EVFILT_USER, EV_ADD | EV_DISABLE, 0, 0, NULL);
+    kevent(file->fd, &kev, 1, NULL, 0, NULL);
+  }
+  if (cloexec) {
+    fcntl(file->fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fresh;
+}
+
+size_t
+iov_size(const struct iovec *iov, size_t iovcnt)
+{
+  size_t size = 0;
+  for (size_t i = 0; i < iovcnt; i++) {
+    size += iov[i].iov_len;
+  }
+  return size;
+}
+
+void
+copy_to_iov(struct iovec *iov, size_t iovcnt, const void *buf, size_t len)
+{
+  for (size_t i = 0; i < iovcnt && len > 0; i++) {
+    size_t n = MIN(len, iov[i].iov_len);
+    memcpy(iov[i].iov_base, buf, n);
+    buf = (const char *) buf + n;
+    len -= n;
+  }
+}
+
+static void
+copy_from_iov(void *buf, const struct iovec *iov, size_t iovcnt, size_t len)
+{
+  for (size_t i = 0; i < iovcnt && len > 0; i++) {
+    size_t n = MIN(len, iov[i].iov_len);
+    memcpy(buf, iov[i].iov_base, n);
+    buf = (char *) buf + n;
+    len -= n;
+  }
+}
+
+/*
+ * eventfd
+ *
+ * The counter is a single atomic word, so that reads and writes which leave it
+ * on the same side of zero are one compare-and-swap. Only a crossing of zero
+ * touches the readiness knote, under the lock, so that the last crossing
+ * always leaves the knote in agreement with the counter. A writer blocked by
+ * a full counter sleeps on a word readers bump, with the host's futex-like
+ * ulock, which signal delivery breaks.
+ */
+
+/* from xnu's sys/ulock.h, which is not installed */
+extern int __ulock_wait(uint32_t operation, void *addr, uint64_t value, uint32_t timeout_us);
+extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
+#define UL_COMPARE_AND_WAIT 1
+#define ULF_WAKE_ALL        0x00000100
+
+/* a signal that lands between the pending check and the sleep is noticed this late at worst */
+#define EVENTFD_SLEEP_SLICE_US 100000
+
+struct eventfd {
+  struct evfile base;
+  _Atomic uint64_t count;
+  bool semaphore;
+  atomic_uint drained;          /* bumped by reads while writers are blocked */
+  atomic_int nr_blocked_writers;
+};
+
+static const uint64_t eventfd_max = UINT64_MAX - 1;
+
+/* called after the counter crossed zero, in either direction */
+static void
+eventfd_sync_ready(int kq, struct eventfd *efd)
+{
+  pthread_mutex_lock(&efd->base.lock);
+  evfile_set_ready(kq, atomic_load(&efd->count) > 0);
+  pthread_mutex_unlock(&efd->base.lock);
+}
+
+/* sleep until a read lowers the counter from count */
+static int
+eventfd_wait_drained(struct eventfd *efd, uint64_t count)
+{
+  int r = 0;
+  atomic_fetch_add(&efd->nr_blocked_writers, 1);
+  uint32_t seq = atomic_load(&efd->drained);
+  if (atomic_load(&efd->count) != count) {
+    /* drained already */
+  } else if (has_sigpending()) {
+    r = -LINUX_EINTR;
+  } else if (__ulock_wait(UL_COMPARE_AND_WAIT, (void *) &efd->drained, seq, EVENTFD_SLEEP_SLICE_US) < 0 && errno == EINTR) {
+    r = -LINUX_EINTR;
+  }
+  atomic_fetch_sub(&efd->nr_blocked_writers, 1);
+  return r;
+}
+
+static int
+eventfd_readv(struct file *file, struct iovec *iov, size_t iovcnt)
+{
+  struct eventfd *efd = file->private_data;
+  if (iov_size(iov, iovcnt) < sizeof(uint64_t)) {
+    return -LINUX_EINVAL;
+  }
+  uint64_t count = atomic_load(&efd->count), val;
+  while (1) {
+    if (count == 0) {
+      if (efd->base.nonblock) {
+        return -LINUX_EAGAIN;
+      }
+      int r = evfile_wait(file->fd);
+      if (r < 0) {
+        return r;
+      }
+      count = atomic_load(&efd->count);
+      continue;
+    }
+    val = efd->semaphore ? 1 : count;
+    if (atomic_compare_exchange_weak(&efd->count, &count, count - val)) {
+      break;
+    }
+  }
+  if (count == val) {
+    eventfd_sync_ready(file->fd, efd);
+  }
+  if (atomic_load(&efd->nr_blocked_writers) > 0) {
+    atomic_fetch_add(&efd->drained, 1);
+    __ulock_wake(UL_COMPARE_AND_WAIT | ULF_WAKE_ALL, (void *) &efd->drained, 0);
+  }
+  copy_to_iov(iov, iovcnt, &val, sizeof val);
+  return sizeof val;
+}
+
+static int
+eventfd_writev(struct file *file, const struct iovec *iov, size_t iovcnt)
+{
+  struct eventfd *efd = file->private_data;
+  if (iov_size(iov, iovcnt) < sizeof(uint64_t)) {
+    return -LINUX_EINVAL;
+  }
+  uint64_t val;
+  copy_from_iov(&val, iov, iovcnt, sizeof val);
+  if (val == UINT64_MAX) {
+    return -LINUX_EINVAL;
+  }
+
+  uint64_t count = atomic_load(&efd->count);
+  while (1) {
+    if (eventfd_max - count < val) {
+      if (efd->base.nonblock) {
+        return -LINUX_EAGAIN;
+      }
+      int r = eventfd_wait_drained(efd, count);
+      if (r < 0) {
+        return r;
+      }
+      count = atomic_load(&efd->count);
+      continue;
+    }
+    if (atomic_compare_exchange_weak(&efd->count, &count, count + val)) {
+      break;
+    }
+  }
+  if (count == 0 && val > 0) {
+    eventfd_sync_ready(file->fd, efd);
+  }
+  return sizeof val;
+}
+
+static struct file_operations eventfd_ops = {
+  .readv = eventfd_readv,
+  .writev = eventfd_writev,
+  .close = evfile_close,
+  .lseek = darwinfs_lseek,
+  .getdents = darwinfs_getdents,
+  .fcntl = evfile_fcntl,
+  .fsync = darwinfs_fsync,
+  .fstat = darwinfs_fstat,
+  .fstatfs = darwinfs_fstatfs,
+  .fchown = darwinfs_fchown,
+  .fchmod = darwinfs_fchmod,
+  .dup = evfile_dup,
+};
+
+static void
+eventfd_renew(struct file *file, bool cloexec, void *arg)
+{
+  struct eventfd *efd = file->private_data;
+  if (evfile_renew(file, cloexec)) {
+    efd->nr_blocked_writers = ATOMIC_VAR_INIT(0);
+    evfile_set_ready(file->fd, atomic_load(&efd->count) > 0);
+  }
+}
+
+DEFINE_SYSCALL(eventfd2, unsigned int, initval, int, flags)
+{
+  if (flags & ~(LINUX_EFD_SEMAPHORE | LINUX_EFD_CLOEXEC | LINUX_EFD_NONBLOCK)) {
+    return -LINUX_EINVAL;
+  }
+  struct eventfd *efd = malloc(sizeof *efd);
+  if (efd == NULL) {
+    return -LINUX_ENOMEM;
+  }
+  efd->count = ATOMIC_VAR_INIT(initval);
+  efd->semaphore = flags & LINUX_EFD_SEMAPHORE;
+  efd->drained = ATOMIC_VAR_INIT(0);
+  efd->nr_blocked_writers = ATOMIC_VAR_INIT(0);
+  int fd = evfile_create(&efd->base, &eventfd_ops, flags & LINUX_EFD_CLOEXEC, flags & LINUX_EFD_NONBLOCK);
+  if (fd >= 0 && initval > 0) {
+    evfile_set_ready(fd, true);
+  }
+  return fd;
+}
+
+DEFINE_SYSCALL(eventfd, unsigned int, initval)
+{
+  return sys_eventfd2(initval, 0);
+}
+
+/*
+ * timerfd
+ */
+
+struct timerfd {
+  struct evfile base;
+  l_clockid_t clockid;
+  bool armed;
+  uint64_t next;       /* next expiration in the host monotonic clock (ns) */
+  uint64_t interval;   /* ns, 0 for one-shot timers */
+};
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t
+l_timespec_to_ns(const struct l_timespec *ts)
+{
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void
+ns_to_l_timespec(uint64_t ns, struct l_timespec *ts)
+{
+  ts->tv_sec = ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static bool
+l_timespec_valid(const struct l_timespec *ts)
+{
+  return ts->tv_sec >= 0 && ts->tv_nsec >= 0 && ts->tv_nsec < 1000000000L;
+}
+
+/* must be called with the lock held */
+static void
+timerfd_arm(int kq, struct timerfd *tfd, uint64_t now)
+{
+  struct kevent kev;
+  evfile_drain(kq);
+  if (!tfd->armed) {
+    EV_SET(&kev, evfile_timer_ident, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+  } else {
+    uint64_t delta = (tfd->next > now) ? tfd->next - now : 0;
+    EV_SET(&kev, evfile_timer_ident, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_NSECONDS, MAX(delta, 1), NULL);
+  }
+  kevent(kq, &kev, 1, NULL, 0, NULL);
+}
+
+/* returns the number of expirations since the last call; must be called with the lock held */
+static uint64_t
+timerfd_expire(int kq, struct timerfd *tfd)
+{
+  if (!tfd->armed) {
+    return 0;
+  }
+  uint64_t now = clock_ns(CLOCK_MONOTONIC);
+  if (now < tfd->next) {
+    /* the host's timer clock is not ours, so the knote may fire a little early */
+    timerfd_arm(kq, tfd, now);
+    return 0;
+  }
+  uint64_t ticks = 1;
+  if (tfd->interval) {
+    ticks += (now - tfd->next) / tfd->interval;
+    tfd->next += ticks * tfd->interval;
+  } else {
+    tfd->armed = false;
+  }
+  timerfd_arm(kq, tfd, now);
+  return ticks;
+}
+
+static void
+timerfd_gettime_locked(struct timerfd *tfd, struct l_itimerspec *cur)
+{
+  memset(cur, 0, sizeof *cur);
+  if (!tfd->armed) {
+    return;
+  }
+  uint64_t now = clock_ns(CLOCK_MONOTONIC);
+  ns_to_l_timespec((tfd->next > now) ? tfd->next - now : 1, &cur->it_value);
+  ns_to_l_timespec(tfd->interval, &cur->it_interval);
+}
+
+static int
+timerfd_readv(struct file *file, struct iovec *iov, size_t iovcnt)
+{
+  struct timerfd *tfd = file->private_data;
+  if (iov_size(iov, iovcnt) < sizeof(uint64_t)) {
+    return -LINUX_EINVAL;
+  }
+  uint64_t ticks;
+  while (1) {
+    pthread_mutex_lock(&tfd->base.lock);
+    ticks = timerfd_expire(file->fd, tfd);
+    pthread_mutex_unlock(&tfd->base.lock);
+    if (ticks > 0) {
+      break;
+    }
+    if (tfd->base.nonblock) {
+      return -LINUX_EAGAIN;
+    }
+    int r = evfile_wait(file->fd);
+    if (r < 0) {
+      return r;
+    }
+  }
+  copy_to_iov(iov, iovcnt, &ticks, sizeof ticks);
+  return sizeof ticks;
+}
+
+static struct file_operations timerfd_ops = {
+  .readv = timerfd_readv,
+  .close = evfile_close,
+  .lseek = darwinfs_lseek,
+  .getdents = darwinfs_getdents,
+  .fcntl = evfile_fcntl,
+  .fsync = darwinfs_fsync,
+  .fstat = darwinfs_fstat,
+  .fstatfs = darwinfs_fstatfs,
+  .fchown = darwinfs_fchown,
+  .fchmod = darwinfs_fchmod,
+  .dup = evfile_dup,
+};
+
+static void
+timerfd_renew(struct file *file, bool cloexec, void *arg)
+{
+  struct timerfd *tfd = file->private_data;
+  if (evfile_renew(file, cloexec) && tfd->armed) {
+    /* an expiration the parent did not read yet fires at once */
+    timerfd_arm(file->fd, tfd, clock_ns(CLOCK_MONOTONIC));
+  }
+}
+
+DEFINE_SYSCALL(timerfd_create, int, clockid, int, flags)
+{
+  switch (clockid) {
+  case LINUX_CLOCK_REALTIME:
+  case LINUX_CLOCK_MONOTONIC:
+  case LINUX_CLOCK_BOOTTIME:
+  case LINUX_CLOCK_REALTIME_ALARM:
+  case LINUX_CLOCK_BOOTTIME_ALARM:
+    break;
+  default:
+    return -LINUX_EINVAL;
+  }
+  if (flags & ~(LINUX_TFD_CLOEXEC | LINUX_TFD_NONBLOCK)) {
+    return -LINUX_EINVAL;
+  }
+  struct timerfd *tfd = malloc(sizeof *tfd);
+  tfd->clockid = clockid;
+  tfd->armed = false;
+  tfd->next = tfd->interval = 0;
+  return evfile_create(&tfd->base, &timerfd_ops, flags & LINUX_TFD_CLOEXEC, flags & LINUX_TFD_NONBLOCK);
+}
+
+static struct timerfd *
+get_timerfd(int fd, struct file **filep)
+{
+  struct file *file = get_file(fd);
+  if (file == NULL || file->ops != &timerfd_ops) {
+    return NULL;
+  }
+  *filep = file;
+  return file->private_data;
+}
+
+DEFINE_SYSCALL(timerfd_settime, int, fd, int, flags, gaddr_t, new_ptr, gaddr_t, old_ptr)
+{
+  if (flags & ~(LINUX_TFD_TIMER_ABSTIME | LINUX_TFD_TIMER_CANCEL_ON_SET)) {
+    return -LINUX_EINVAL;
+  }
+  struct file *file;
+  struct timerfd *tfd = get_timerfd(fd, &file);
+  if (tfd == NULL) {
+    return (get_file(fd) == NULL) ? -LINUX_EBADF : -LINUX_EINVAL;
+  }
+  struct l_itimerspec new, old;
+  if (copy_from_user(&new, new_ptr, sizeof new)) {
+    return -LINUX_EFAULT;
+  }
+  if (!l_timespec_valid(&new.it_value) || !l_timespec_valid(&new.it_interval)) {
+    return -LINUX_EINVAL;
+  }
+
+  pthread_mutex_lock(&tfd->base.lock);
+  timerfd_gettime_locked(tfd, &old);
+  uint64_t now = clock_ns(CLOCK_MONOTONIC);
+  uint64_t value = l_timespec_to_ns(&new.it_value);
+  tfd->armed = value != 0;
+  tfd->interval = l_timespec_to_ns(&new.it_interval);
+  if (tfd->armed) {
+    if (flags & LINUX_TFD_TIMER_ABSTIME) {
+      // everything is scheduled on the monotonic clock; absolute times are converted once here
+      clockid_t clock = (tfd->clockid == LINUX_CLOCK_REALTIME || tfd->clockid == LINUX_CLOCK_REALTIME_ALARM) ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+      uint64_t base = clock_ns(clock);
+      tfd->next = now + ((value > base) ? value - base : 0);
+    } else {
+      tfd->next = now + value;
+    }
+  }
+  timerfd_arm(file->fd, tfd, now);
+  pthread_mutex_unlock(&tfd->base.lock);
+
+  if (old_ptr != 0 && copy_to_user(old_ptr, &old, sizeof old)) {
+    return -LINUX_EFAULT;
+  }
+  return 0;
+}
+
+DEFINE_SYSCALL(timerfd_gettime, int, fd, gaddr_t, cur_ptr)
+{
+  struct file *file;
+  struct timerfd *tfd = get_timerfd(fd, &file);
+  if (tfd == NULL) {
+    return (get_file(fd) == NULL) ? -LINUX_EBADF : -LINUX_EINVAL;
+  }
+  struct l_itimerspec cur;
+  pthread_mutex_lock(&tfd->base.lock);
+  timerfd_gettime_locked(tfd, &cur);
+  pthread_mutex_unlock(&tfd->base.lock);
+  if (copy_to_user(cur_ptr, &cur, sizeof cur)) {
+    return -LINUX_EFAULT;
+  }
+  return 0;
+}
+
+/*
+ * signalfd
+ *
+ * Signals read from a signalfd are supposed to be blocked, so on the host they
+ * stay pending and are consumed with sigwait(2). Signals already pending in
+ * noah (task.sigpending), with their queued siginfo, are taken as well.
+ */
+
+struct signalfd {
+  struct evfile base;
+  l_sigset_t mask;
+};
+
+static int
+signalfd_dequeue(struct signalfd *sfd, l_siginfo_t *info)
+{
+  int sig = dequeue_signal(LINUX_SIGSET_TO_UI64(&sfd->mask), info);
+  if (sig) {
+    return sig;
+  }
+  bzero(info, sizeof *info);
+  sigset_t pending;
+  sigpending(&pending);
+  for (int sig = 1; sig < LINUX_SIGRTMIN; sig++) {
+    if (!LINUX_SIGISMEMBER(&sfd->mask, sig)) {
+      continue;
+    }
+    int dsig = linux_to_darwin_signal(sig);
+    if (dsig <= 0 || !sigismember(&pending, dsig)) {
+      continue;
+    }
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, dsig);
+    int got;
+    if (sigwait(&set, &got) == 0) {
+      info->lsi_signo = darwin_to_linux_signal(got);
+      info->lsi_code = LINUX_SI_USER;
+      return info->lsi_signo;
+    }
+  }
+  return 0;
+}
+
+static bool
+signalfd_has_pending(struct signalfd *sfd)
+{
+  if (task.sigpending & LINUX_SIGSET_TO_UI64(&sfd->mask)) {
+    return true;
+  }
+  sigset_t pending;
+  sigpending(&pending);
+  for (int sig = 1; sig < LINUX_SIGRTMIN; sig++) {
+    int dsig = linux_to_darwin_signal(sig);
+    if (LINUX_SIGISMEMBER(&sfd->mask, sig) && dsig > 0 && sigismember(&pending, dsig)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* must be called with the lock held */
+static void
+signalfd_update_ready(int kq, struct signalfd *sfd)
+{
+  if (signalfd_has_pending(sfd)) {
+    evfile_set_ready(kq, true);
+  } else {
+    evfile_set_ready(kq, false);
+    evfile_drain(kq);
+  }
+}
+
+/* must be called with the lock held */
+static void
+signalfd_set_mask(int kq, struct signalfd *sfd, l_sigset_t *mask)
+{
+  struct kevent kev;
+  for (int sig = 1; sig < LINUX_SIGRTMIN; sig++) {
+    int dsig = linux_to_darwin_signal(sig);
+    if (dsig <= 0 || LINUX_SIGISMEMBER(mask, sig) == LINUX_SIGISMEMBER(&sfd->mask, sig)) {
+      continue;
+    }
+    EV_SET(&kev, dsig, EVFILT_SIGNAL, LINUX_SIGISMEMBER(mask, sig) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+    kevent(kq, &kev, 1, NULL, 0, NULL);
+  }
+  sfd->mask = *mask;
+  signalfd_update_ready(kq, sfd);
+}
+
+static int
+signalfd_readv(struct file *file, struct iovec *iov, size_t iovcnt)
+{
+  struct signalfd *sfd = file->private_data;
+  size_t size = iov_size(iov, iovcnt);
+  if (size < sizeof(struct l_signalfd_siginfo)) {
+    return -LINUX_EINVAL;
+  }
+  size_t max = size / sizeof(struct l_signalfd_siginfo);
+  struct l_signalfd_siginfo *info = calloc(max, sizeof *info);
+  size_t n = 0;
+  int r;
+
+  while (1) {
+    pthread_mutex_lock(&sfd->base.lock);
+    l_siginfo_t si;
+    while (n < max && signalfd_dequeue(sfd, &si) != 0) {
+      info[n].ssi_signo = si.lsi_signo;
+      info[n].ssi_code = si.lsi_code;
+      info[n].ssi_pid = si.lsi_pid;
+      info[n].ssi_uid = si.lsi_uid;
+      if (si.lsi_code < 0) {
+        /* sigqueue and timers carry a value */
+        info[n].ssi_int = si.lsi_int;
+        info[n].ssi_ptr = si.lsi_ptr;
+      }
+      n++;
+    }
+    signalfd_update_ready(file->fd, sfd);
+    pthread_mutex_unlock(&sfd->base.lock);
+    if (n > 0) {
+      break;
+    }
+    if (sfd->base.nonblock) {
+      r = -LINUX_EAGAIN;
+      goto out;
+    }
+    if ((r = evfile_wait(file->fd)) < 0) {
+      goto out;
+    }
+  }
+  r = n * sizeof *info;
+  copy_to_iov(iov, iovcnt, info, r);
+
+out:
+  free(info);
+  return r;
+}
+
+static struct file_operations signalfd_ops = {
+  .readv = signalfd_readv,
+  .close = evfile_close,
+  .lseek = darwinfs_lseek,
+  .getdents = darwinfs_getdents,
+  .fcntl = evfile_fcntl,
+  .fsync = darwinfs_fsync,
+  .fstat = darwinfs_fstat,
+  .fstatfs = darwinfs_fstatfs,
+  .fchown = darwinfs_fchown,
+  .fchmod = darwinfs_fchmod,
+  .dup = evfile_dup,
+};
+
+static void
+signalfd_renew(struct file *file, bool cloexec, void *arg)
+{
+  struct signalfd *sfd = file->private_data;
+  if (!evfile_renew(file, cloexec)) {
+    return;
+  }
+  /* signalfd_set_mask only adds the knotes for signals new to the mask */
+  l_sigset_t mask = sfd->mask;
+  LINUX_SIGEMPTYSET(&sfd->mask);
+  signalfd_set_mask(file->fd, sfd, &mask);
+}
+
+DEFINE_SYSCALL(signalfd4, int, fd, gaddr_t, mask_ptr, size_t, sizemask, int, flags)
+{
+  if (flags & ~(LINUX_SFD_CLOEXEC | LINUX_SFD_NONBLOCK)) {
+    return -LINUX_EINVAL;
+  }
+  if (sizemask != sizeof(l_sigset_t)) {
+    return -LINUX_EINVAL;
+  }
+  l_sigset_t mask;
+  if (copy_from_user(&mask, mask_ptr, sizeof mask)) {
+    return -LINUX_EFAULT;
+  }
+  LINUX_SIGDELSET(&mask, LINUX_SIGKILL);
+  LINUX_SIGDELSET(&mask, LINUX_SIGSTOP);
+
+  if (fd != -1) {
+    struct file *file = get_file(fd);
+    if (file == NULL) {
+      return -LINUX_EBADF;
+    }
+    if (file->ops != &signalfd_ops) {
+      return -LINUX_EINVAL;
+    }
+    struct signalfd *sfd = file->private_data;
+    pthread_mutex_lock(&sfd->base.lock);
+    signalfd_set_mask(file->fd, sfd, &mask);
+    pthread_mutex_unlock(&sfd->base.lock);
+    return fd;
+  }
+
+  struct signalfd *sfd = malloc(sizeof *sfd);
+  LINUX_SIGEMPTYSET(&sfd->mask);
+  fd = evfile_create(&sfd->base, &signalfd_ops, flags & LINUX_SFD_CLOEXEC, flags & LINUX_SFD_NONBLOCK);
+  if (fd < 0) {
+    return fd;
+  }
+  pthread_mutex_lock(&sfd->base.lock);
+  signalfd_set_mask(fd, sfd, &mask);
+  pthread_mutex_unlock(&sfd->base.lock);
+  return fd;
+}
+
+DEFINE_SYSCALL(signalfd, int, fd, gaddr_t, mask_ptr, size_t, sizemask)
+{
+  return sys_signalfd4(fd, mask_ptr, sizemask, 0);
+}
+
+/* called in a forked child */
+void
+fork_evfiles(void)
+{
+  for_each_file(&eventfd_ops, eventfd_renew, NULL);
+  for_each_file(&timerfd_ops, timerfd_renew, NULL);
+  for_each_file(&signalfd_ops, signalfd_renew, NULL);
+}
@@ -29,6 +29,7 @@
 
 #include "common.h"
 #include "noah.h"
+#include "fs.h"
 
 #include "linux/common.h"
 #include "linux/time.h"
@@ -54,35 +55,19 @@
 #include <sys/syscall.h>
 #include <sys/select.h>
 #include <sys/poll.h>
+#include <signal.h>
 #include <sys/mount.h>
 #include <sys/syslimits.h>
+#include <limits.h>
 #include <dirent.h>
+#include <libproc.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <copyfile.h>
 
 #include <mach-o/dyld.h>
 
-struct file {
-  struct file_operations *ops;
-  int fd;
-};
-
-struct file_operations {
-  int (*readv)(struct file *f, struct iovec *iov, size_t iovcnt);
-  int (*writev)(struct file *f, const struct iovec *iov, size_t iovcnt);
-  int (*close)(struct file *f);
-  int (*ioctl)(struct file *f, int cmd, uint64_t val0);
-  int (*lseek)(struct file *f, l_off_t offset, int whence);
-  int (*getdents)(struct file *f, char *buf, uint count, bool is64);
-  int (*fcntl)(struct file *f, unsigned int cmd, unsigned long arg);
-  int (*fsync)(struct file *f);
-  /* inode operations */
-  int (*fstat)(struct file *f, struct l_newstat *stat);
-  int (*fstatfs)(struct file *f, struct l_statfs *buf);
-  int (*fchown)(struct file *f, l_uid_t uid, l_gid_t gid);
-  int (*fchmod)(struct file *f, l_mode_t mode);
-};
-
 static inline bool in_userfd(int fd);
 static const int user_fdtable_initsize = 64;
 static const int vkern_fdtable_maxsize = 64;
@@ -90,6 +75,7 @@ static const int fdtable_alloc_unit = 64; // must be a multiple of 64
 
 static inline void set_fdbit(struct fdtable *table, uint64_t *fdbits, int fd);
 static inline void clear_fdbit(struct fdtable *table, uint64_t *fdbits, int fd);
+static int dup_file(struct file *file, int newfd, bool is_cloexec);
 
 static inline int div_ceil(int x, int y) { return (x + y - 1) / y; }
 
@@ -130,6 +116,40 @@ alloc_fdtable(struct fdtable *fdtable, int newsize)
   return 0;
 }
 
+/*
+ * Returns the fds open in this process, asking the kernel for the list rather
+ * than probing every number below RLIMIT_NOFILE, which may be in the millions.
+ */
+static int *
+list_inherited_fds(int limit, int *nr_fds)
+{
+  int size = proc_pidinfo(getpid(), PROC_PIDLISTFDS, 0, NULL, 0);
+  if (size > 0) {
+    /* leave room for fds opened between the two calls */
+    size += 16 * sizeof(struct proc_fdinfo);
+    struct proc_fdinfo *info = malloc(size);
+    size = proc_pidinfo(getpid(), PROC_PIDLISTFDS, 0, info, size);
+    if (size > 0) {
+      int n = size / sizeof(struct proc_fdinfo);
+      int *fds = malloc(n * sizeof(int));
+      for (int i = 0; i < n; i++) {
+        fds[i] = info[i].proc_fd;
+      }
+      free(info);
+      *nr_fds = n;
+      return fds;
+    }
+    free(info);
+  }
+
+  int *fds = malloc(limit * sizeof(int));
+  for (int i = 0; i < limit; i++) {
+    fds[i] = i;
+  }
+  *nr_fds = limit;
+  return fds;
+}
+
 void
 init_fileinfo(int rootfd)
 {
@@ -143,7 +163,10 @@ init_fileinfo(int rootfd)
   fileinfo->fdtable = (struct fdtable) { 0, 0, NULL, NULL, NULL };
   alloc_fdtable(&fileinfo->fdtable, user_fdtable_initsize);
 
-  for (int i = 0; i < (int) limit.rlim_cur; i++) {
+  int nr_fds;
+  int *fds = list_inherited_fds((int) limit.rlim_cur, &nr_fds);
+  for (int j = 0; j < nr_fds; j++) {
+    int i = fds[j];
     if (i == rootfd) {
       continue;
     }
@@ -159,7 +182,9 @@ init_fileinfo(int rootfd)
       close(i);
     }
   }
+  free(fds);
   fileinfo->rootfd = vkern_dup_fd(rootfd, false);
+  fileinfo->rootfs = &darwinfs;
 }
 
 void
@@ -401,7 +426,7 @@ darwinfs_fcntl(struct file *file, unsigned int cmd, unsigned long arg)
     pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
     r = syswrap(fcntl(file->fd, F_DUPFD, arg)); /* FIXME */
     if (r >= 0) {
-      int err = register_fd(r, false);
+      int err = dup_file(file, r, false);
       if (err < 0) {
         close(r);
         r = err;
@@ -413,7 +438,7 @@ darwinfs_fcntl(struct file *file, unsigned int cmd, unsigned long arg)
     pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
     r = syswrap(fcntl(file->fd, F_DUPFD_CLOEXEC, arg));
     if (r >= 0) {
-      int err = register_fd(r, true);
+      int err = dup_file(file, r, true);
       if (err < 0) {
         close(r);
         r = err;
@@ -540,28 +565,30 @@ test_fdbit(struct fdtable *table, uint64_t *fdbits, int fd)
   return fdbits[idx_table] & (1ULL << (idx_bit));
 }
 
+static struct file_operations darwinfs_ops = {
+  darwinfs_readv,
+  darwinfs_writev,
+  darwinfs_close,
+  darwinfs_ioctl,
+  darwinfs_lseek,
+  darwinfs_getdents,
+  darwinfs_fcntl,
+  darwinfs_fsync,
+  darwinfs_fstat,
+  darwinfs_fstatfs,
+  darwinfs_fchown,
+  darwinfs_fchmod,
+  NULL,
+};
+
 static void
 alloc_file(struct fdtable *table, int fd)
 {
-  static struct file_operations ops = {
-    darwinfs_readv,
-    darwinfs_writev,
-    darwinfs_close,
-    darwinfs_ioctl,
-    darwinfs_lseek,
-    darwinfs_getdents,
-    darwinfs_fcntl,
-    darwinfs_fsync,
-    darwinfs_fstat,
-    darwinfs_fstatfs,
-    darwinfs_fchown,
-    darwinfs_fchmod,
-  };
-
   int offset = fd - table->start;
   struct file *file = &table->files[offset / fdtable_alloc_unit][offset % fdtable_alloc_unit];
-  file->ops = &ops;
+  file->ops = &darwinfs_ops;
   file->fd = fd;
+  file->private_data = NULL;
 }
 
 /*
@@ -647,6 +674,66 @@ out:
   return ret;
 }
 
+/* Call fn on each open user fd that is a plain host file or a device, with
+   fdtable_lock held. Other virtual files have no host state that could be
+   reopened from a path. */
+void
+for_each_host_file(void (*fn)(struct file *file, bool cloexec, void *arg), void *arg)
+{
+  struct fdtable *table = &proc.fileinfo.fdtable;
+  pthread_rwlock_rdlock(&proc.fileinfo.fdtable_lock);
+  for (int fd = table->start; fd < table->start + table->size; fd++) {
+    struct file *file = do_get_file(table, fd);
+    if (file && (file->ops == &darwinfs_ops || file->ops == &dev_file_ops)) {
+      fn(file, test_fdbit(table, table->cloexec_fds, fd), arg);
+    }
+  }
+  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+}
+
+/* call fn on each open fd of a virtual file of the given kind */
+void
+for_each_file(struct file_operations *ops, void (*fn)(struct file *file, bool cloexec, void *arg), void *arg)
+{
+  struct fdtable *table = &proc.fileinfo.fdtable;
+  pthread_rwlock_rdlock(&proc.fileinfo.fdtable_lock);
+  for (int fd = table->start; fd < table->start + table->size; fd++) {
+    struct file *file = do_get_file(table, fd);
+    if (file && file->ops == ops) {
+      fn(file, test_fdbit(table, table->cloexec_fds, fd), arg);
+    }
+  }
+  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+}
+
+/* register a virtual file whose fd number is reserved by a host fd */
+int
+register_file(int fd, bool is_cloexec, struct file_operations *ops, void *private_data)
+{
+  int err = register_fd(fd, is_cloexec);
+  if (err < 0) {
+    return err;
+  }
+  struct file *file = do_get_file(&proc.fileinfo.fdtable, fd);
+  file->ops = ops;
+  file->private_data = private_data;
+  return 0;
+}
+
+/* make newfd, a host dup of file->fd, refer to the same file. fdtable_lock must be held */
+static int
+dup_file(struct file *file, int newfd, bool is_cloexec)
+{
+  int err = register_file(newfd, is_cloexec, file->ops, file->private_data);
+  if (err < 0) {
+    return err;
+  }
+  if (file->ops->dup) {
+    file->ops->dup(file);
+  }
+  return 0;
+}
+
 DEFINE_SYSCALL(write, int, fd, gaddr_t, buf_ptr, size_t, size)
 {
   int r;
@@ -875,36 +962,6 @@ DEFINE_SYSCALL(fsync, int, fd)
   return file->ops->fsync(file);
 }
 
-struct dir {
-  int fd;
-};
-
-struct path {
-  struct fs *fs;
-  struct dir *dir;
-  char subpath[LINUX_PATH_MAX];
-};
-
-struct fs {
-  struct fs_operations *ops;
-};
-
-struct fs_operations {
-  int (*openat)(struct fs *fs, struct dir *dir, const char *path, int flags, int mode); /* TODO: return struct file * instaed of file descripter */
-  int (*symlinkat)(struct fs *fs, const char *target, struct dir *dir, const char *name);
-  int (*faccessat)(struct fs *fs, struct dir *dir, const char *path, int mode);
-  int (*renameat)(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to);
-  int (*linkat)(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to, int flags);
-  int (*unlinkat)(struct fs *fs, struct dir *dir, const char *path, int flags);
-  int (*readlinkat)(struct fs *fs, struct dir *dir, const char *path, char *buf, int bufsize);
-  int (*mkdirat)(struct fs *fs, struct dir *dir, const char *path, int mode);
-  /* inode operations */
-  int (*fstatat)(struct fs *fs, struct dir *dir, const char *path, struct l_newstat *stat, int flags);
-  int (*statfs)(struct fs *fs, struct dir *dir, const char *path, struct l_statfs *buf);
-  int (*fchownat)(struct fs *fs, struct dir *dir, const char *path, l_uid_t uid, l_gid_t gid, int flags);
-  int (*fchmodat)(struct fs *fs, struct dir *dir, const char *path, l_mode_t mode);
-};
-
 int
 darwinfs_openat(struct fs *fs, struct dir *dir, const char *path, int l_flags, int mode)
 {
@@ -1025,27 +1082,30 @@ darwinfs_fchmodat(struct fs *fs, struct dir *dir, const char *path, l_mode_t mod
 
 #define LOOP_MAX 20
 
+static struct fs_operations darwinfs_fs_ops = {
+  darwinfs_openat,
+  darwinfs_symlinkat,
+  darwinfs_faccessat,
+  darwinfs_renameat,
+  darwinfs_linkat,
+  darwinfs_unlinkat,
+  darwinfs_readlinkat,
+  darwinfs_mkdirat,
+  darwinfs_fstatat,
+  darwinfs_statfs,
+  darwinfs_fchownat,
+  darwinfs_fchmodat,
+  NULL,
+};
+
+struct fs darwinfs = {
+  .ops = &darwinfs_fs_ops,
+};
+
 int
 resolve_path(const struct dir *parent, const char *name, int flags, struct path *path, int loop)
 {
-  static struct fs_operations ops = {
-    darwinfs_openat,
-    darwinfs_symlinkat,
-    darwinfs_faccessat,
-    darwinfs_renameat,
-    darwinfs_linkat,
-    darwinfs_unlinkat,
-    darwinfs_readlinkat,
-    darwinfs_mkdirat,
-    darwinfs_fstatat,
-    darwinfs_statfs,
-    darwinfs_fchownat,
-    darwinfs_fchmodat,
-  };
-  static struct fs darwinfs = {
-    .ops = &ops,
-  };
-  struct fs *fs = &darwinfs;
+  struct fs *fs = proc.fileinfo.rootfs;
 
   if (loop > LOOP_MAX)
     return -LINUX_ELOOP;
@@ -1059,9 +1119,23 @@ resolve_path(const struct dir *parent, const char *name, int flags, struct path
       strcpy(path->subpath, ".");
       goto out;
     }
+    if (is_pseudo_file(name)) {
+      fs = &pseudofs;
+      dir.fd = AT_FDCWD;
+      strcpy(path->subpath, name);
+      goto out;
+    }
+    if (is_dev_file(name)) {
+      fs = &devfs;
+      dir.fd = AT_FDCWD;
+      strcpy(path->subpath, name);
+      goto out;
+    }
     if (strncmp(name, "/Users", sizeof "/Users" - 1) && strncmp(name, "/Volumes", sizeof "/Volumes" - 1) && strncmp(name, "/dev", sizeof "/dev" - 1) && strncmp(name, "/tmp", sizeof "/tmp" - 1) && strncmp(name, "/private", sizeof "/private" - 1)) {
       dir.fd = proc.fileinfo.rootfd;
       name++;
+    } else {
+      fs = &darwinfs;
     }
   }
 
@@ -1137,8 +1211,9 @@ vfs_ungrab_dir(struct path *path)
   free(path->dir);
 }
 
+/* fsp and subpath, if given, receive where the name was resolved to */
 static int
-do_openat(int dirfd, const char *name, int flags, int mode)
+do_openat_fs(int dirfd, const char *name, int flags, int mode, struct fs **fsp, char *subpath)
 {
   int lkflag = 0;
   if (flags & LINUX_O_NOFOLLOW) {
@@ -1154,10 +1229,22 @@ do_openat(int dirfd, const char *name, int flags, int mode)
     return r;
   }
   r = path.fs->ops->openat(path.fs, path.dir, path.subpath, flags, mode);
+  if (fsp) {
+    *fsp = path.fs;
+  }
+  if (subpath) {
+    strcpy(subpath, path.subpath);
+  }
   vfs_ungrab_dir(&path);
   return r;
 }
 
+int
+do_openat(int dirfd, const char *name, int flags, int mode)
+{
+  return do_openat_fs(dirfd, name, flags, mode, NULL, NULL);
+}
+
 static int
 do_open(const char *path, int l_flags, int mode)
 {
@@ -1193,15 +1280,21 @@ int
 user_openat(int atdirfd, const char *name, int flags, int mode)
 {
   int fd;
+  struct fs *fs;
+  char subpath[LINUX_PATH_MAX];
   pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
-  fd = do_openat(atdirfd, name, flags, mode);
+  fd = do_openat_fs(atdirfd, name, flags, mode, &fs, subpath);
   if (fd < 0) {
     goto out;
   }
   int err = register_fd(fd, flags & LINUX_O_CLOEXEC);
   if (err < 0) {
-    fd = err;
     close(fd);
+    fd = err;
+    goto out;
+  }
+  if (fs->ops->init_file) {
+    fs->ops->init_file(fs, do_get_file(&proc.fileinfo.fdtable, fd), subpath);
   }
 
 out:
@@ -1796,16 +1889,43 @@ out:
 
 DEFINE_SYSCALL(dup, unsigned int, fd)
 {
-  pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
-  int ret = sys_fcntl(fd, LINUX_F_DUPFD, 0);
-  if (ret >= 0) {
-    int err = register_fd(ret, false);
-    if (err < 0) {
+  return sys_fcntl(fd, LINUX_F_DUPFD, 0);
+}
+
+static int
+do_dup2(int oldfd, int newfd, bool is_cloexec)
+{
+  struct fdtable *table = &proc.fileinfo.fdtable;
+  if (oldfd >= table->size) {
+    return -LINUX_EBADF;
+  }
+  struct file *file = do_get_file(table, oldfd);
+  if (file == NULL) {
+    return -LINUX_EBADF;
+  }
+  if (oldfd == newfd) {
+    return newfd;
+  }
+  if (newfd < table->size && test_fdbit(table, table->open_fds, newfd)) {
+    // close it by ourselves so that virtual files release their resources
+    do_close(table, newfd);
+  }
+  int ret = syswrap(dup2(oldfd, newfd));
+  if (ret < 0) {
+    return ret;
+  }
+  if (is_cloexec) {
+    int fcntl_err = syswrap(fcntl(newfd, F_SETFD, FD_CLOEXEC));
+    if (fcntl_err < 0) {
       close(ret);
-      ret = err;
+      return fcntl_err;
     }
   }
-  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+  int err = dup_file(file, ret, is_cloexec);
+  if (err < 0) {
+    close(ret);
+    return err;
+  }
   return ret;
 }
 
@@ -1815,14 +1935,7 @@ DEFINE_SYSCALL(dup2, unsigned int, fd1, unsigned int, fd2)
     return -LINUX_EBADF;
   }
   pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
-  int ret = syswrap(dup2(fd1, fd2));
-  if (ret >= 0) {
-    int err = register_fd(ret, false);
-    if (err < 0) {
-      close(ret);
-      ret = err;
-    }
-  }
+  int ret = do_dup2(fd1, fd2, false);
   pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
   return ret;
 }
@@ -1835,27 +1948,12 @@ DEFINE_SYSCALL(dup3, unsigned int, oldfd, unsigned int, newfd, int, flags)
   if (oldfd == newfd) {
     return -LINUX_EINVAL;
   }
-
-  pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
-  int ret = syswrap(dup2(oldfd, newfd));
-  if (ret < 0) {
-    goto out;
-  }
-  if (flags & LINUX_O_CLOEXEC) {
-    int fcntl_err = syswrap(fcntl(newfd, F_SETFD, FD_CLOEXEC));
-    if (fcntl_err < 0) {
-      close(ret);
-      ret = fcntl_err;
-      goto out;
-    }
-  }
-  int err = register_fd(ret, flags & LINUX_O_CLOEXEC);
-  if (err < 0) {
-    close(ret);
-    ret = err;
+  if (!in_userfd(oldfd) || !in_userfd(newfd)) {
+    return -LINUX_EBADF;
   }
 
-out:
+  pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
+  int ret = do_dup2(oldfd, newfd, flags & LINUX_O_CLOEXEC);
   pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
   return ret;
 }
@@ -1866,7 +1964,15 @@ DEFINE_SYSCALL(pread64, unsigned int, fd, gstr_t, buf_ptr, size_t, count, off_t,
     return -LINUX_EBADF;
   }
   char *buf = malloc(count);
-  int r = syswrap(pread(fd, buf, count, pos));
+  int r;
+  struct file *file = get_file(fd);
+  if (file && file->ops == &dev_file_ops) {
+    // memory devices have no position to read at
+    struct iovec iov = { buf, count };
+    r = file->ops->readv(file, &iov, 1);
+  } else {
+    r = syswrap(pread(fd, buf, count, pos));
+  }
   if (r < 0) {
     goto out;
   }
@@ -1890,7 +1996,13 @@ DEFINE_SYSCALL(pwrite64, unsigned int, fd, gstr_t, buf_ptr, size_t, count, off_t
     r = -LINUX_EFAULT;
     goto out;
   }
-  r = syswrap(pwrite(fd, buf, count, pos));
+  struct file *file = get_file(fd);
+  if (file && file->ops == &dev_file_ops) {
+    struct iovec iov = { buf, count };
+    r = file->ops->writev(file, &iov, 1);
+  } else {
+    r = syswrap(pwrite(fd, buf, count, pos));
+  }
   if (r < 0) {
     goto out;
   }
@@ -1899,6 +2011,363 @@ out:
   return r;
 }
 
+/*
+ * sendfile, splice and friends. Data never goes through the guest memory;
+ * it is moved by the host kernel when possible, or through a host-side
+ * buffer otherwise.
+ */
+
+static const size_t splice_bufsize = 64 * 1024;
+
+/* devices go through their file ops, which have no position to honour */
+static ssize_t
+copy_read(struct file *file, int fd, char *buf, size_t n, const off_t *off)
+{
+  if (file && file->ops == &dev_file_ops) {
+    struct iovec iov = { buf, n };
+    return file->ops->readv(file, &iov, 1);
+  }
+  ssize_t r = off ? pread(fd, buf, n, *off) : read(fd, buf, n);
+  return (r < 0) ? -darwin_to_linux_errno(errno) : r;
+}
+
+static ssize_t
+copy_write(struct file *file, int fd, const char *buf, size_t n, const off_t *off)
+{
+  if (file && file->ops == &dev_file_ops) {
+    struct iovec iov = { (void *) buf, n };
+    return file->ops->writev(file, &iov, 1);
+  }
+  ssize_t r = off ? pwrite(fd, buf, n, *off) : write(fd, buf, n);
+  return (r < 0) ? -darwin_to_linux_errno(errno) : r;
+}
+
+/* off == NULL means using and updating the file position */
+static ssize_t
+do_copy_fds(int in_fd, off_t *in_off, int out_fd, off_t *out_off, size_t count)
+{
+  struct stat st;
+  if (fstat(in_fd, &st) < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  struct file *in_file = get_file(in_fd), *out_file = get_file(out_fd);
+  // reading from a pipe or socket must not block once something has been transferred
+  bool once = !S_ISREG(st.st_mode);
+  int out_fl = fcntl(out_fd, F_GETFL);
+  bool out_nonblock = out_fl >= 0 && (out_fl & O_NONBLOCK);
+
+  char *buf = malloc(MIN(count, splice_bufsize));
+  if (buf == NULL) {
+    return -LINUX_ENOMEM;
+  }
+  size_t total = 0;
+  int err = 0;
+  while (total < count) {
+    size_t n = MIN(count - total, splice_bufsize);
+    if (once && out_nonblock) {
+      // what is read from a pipe or socket cannot be given back, so only read what can go somewhere
+      struct pollfd pfd = { out_fd, POLLOUT, 0 };
+      if (poll(&pfd, 1, 0) == 0) {
+        err = -LINUX_EAGAIN;
+        break;
+      }
+    }
+    ssize_t r = copy_read(in_file, in_fd, buf, n, in_off);
+    if (r <= 0) {
+      err = r;
+      break;
+    }
+    ssize_t w = 0;
+    while (w < r) {
+      off_t pos = out_off ? *out_off + w : 0;
+      ssize_t k = copy_write(out_file, out_fd, buf + w, r - w, out_off ? &pos : NULL);
+      if (k < 0 && once && (k == -LINUX_EAGAIN || k == -LINUX_EINTR)) {
+        if (out_nonblock) {
+          err = -LINUX_EAGAIN;
+          break;
+        }
+        // what was read from a pipe or socket cannot be given back, so wait to write it
+        struct pollfd pfd = { out_fd, POLLOUT, 0 };
+        poll(&pfd, 1, -1);
+        continue;
+      }
+      if (k < 0) {
+        err = k;
+        break;
+      }
+      w += k;
+    }
+    if (in_off) {
+      *in_off += w;
+    } else if (w < r) {
+      // give back what could not be written (fails harmlessly on pipes)
+      lseek(in_fd, w - r, SEEK_CUR);
+    }
+    if (out_off) {
+      *out_off += w;
+    }
+    total += w;
+    if (err < 0 || once || (size_t) r < n) {
+      break;
+    }
+  }
+  free(buf);
+  // a partial transfer is reported as such, even if the write side failed after it
+  return (total > 0) ? (ssize_t) total : err;
+}
+
+static int
+get_user_off(gaddr_t off_ptr, int fd, off_t *off)
+{
+  if (off_ptr) {
+    l_off_t l_off;
+    if (copy_from_user(&l_off, off_ptr, sizeof l_off)) {
+      return -LINUX_EFAULT;
+    }
+    if (l_off < 0) {
+      return -LINUX_EINVAL;
+    }
+    *off = l_off;
+    return 0;
+  }
+  *off = lseek(fd, 0, SEEK_CUR);
+  if (*off < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  return 0;
+}
+
+/* linux leaves the file position untouched if an explicit offset is given */
+static int
+put_user_off(gaddr_t off_ptr, int fd, off_t off)
+{
+  if (off_ptr) {
+    l_off_t l_off = off;
+    if (copy_to_user(off_ptr, &l_off, sizeof l_off)) {
+      return -LINUX_EFAULT;
+    }
+    return 0;
+  }
+  if (lseek(fd, off, SEEK_SET) < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  return 0;
+}
+
+DEFINE_SYSCALL(sendfile, int, out_fd, int, in_fd, gaddr_t, offset_ptr, size_t, count)
+{
+  if (!in_userfd(out_fd) || !in_userfd(in_fd)) {
+    return -LINUX_EBADF;
+  }
+  struct stat in_st, out_st;
+  if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  if (!S_ISREG(in_st.st_mode)) {
+    return -LINUX_EINVAL;
+  }
+  off_t off;
+  int err = get_user_off(offset_ptr, in_fd, &off);
+  if (err < 0) {
+    return err;
+  }
+  count = MIN(count, LINUX_MAX_RW_COUNT);
+  if (count == 0) {
+    return 0;
+  }
+
+  ssize_t r;
+  if (S_ISSOCK(out_st.st_mode)) {
+    // darwin's sendfile never moves the file position and reports partial writes in len
+    off_t len = count;
+    if (sendfile(in_fd, out_fd, off, &len, NULL, 0) < 0 && len == 0) {
+      return -darwin_to_linux_errno(errno);
+    }
+    r = len;
+    off += len;
+  } else {
+    r = do_copy_fds(in_fd, &off, out_fd, NULL, count);
+    if (r < 0) {
+      return r;
+    }
+  }
+  err = put_user_off(offset_ptr, in_fd, off);
+  return (err < 0) ? err : r;
+}
+
+DEFINE_SYSCALL(copy_file_range, int, fd_in, gaddr_t, off_in_ptr, int, fd_out, gaddr_t, off_out_ptr, size_t, len, unsigned int, flags)
+{
+  if (flags != 0) {
+    return -LINUX_EINVAL;
+  }
+  if (!in_userfd(fd_in) || !in_userfd(fd_out)) {
+    return -LINUX_EBADF;
+  }
+  int in_fl = fcntl(fd_in, F_GETFL);
+  int out_fl = fcntl(fd_out, F_GETFL);
+  if (in_fl < 0 || out_fl < 0) {
+    return -LINUX_EBADF;
+  }
+  if ((in_fl & O_ACCMODE) == O_WRONLY || (out_fl & O_ACCMODE) == O_RDONLY || (out_fl & O_APPEND)) {
+    return -LINUX_EBADF;
+  }
+  struct stat in_st, out_st;
+  if (fstat(fd_in, &in_st) < 0 || fstat(fd_out, &out_st) < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  if (S_ISDIR(in_st.st_mode) || S_ISDIR(out_st.st_mode)) {
+    return -LINUX_EISDIR;
+  }
+  if (!S_ISREG(in_st.st_mode) || !S_ISREG(out_st.st_mode)) {
+    return -LINUX_EINVAL;
+  }
+  off_t off_in, off_out;
+  int err;
+  if ((err = get_user_off(off_in_ptr, fd_in, &off_in)) < 0) {
+    return err;
+  }
+  if ((err = get_user_off(off_out_ptr, fd_out, &off_out)) < 0) {
+    return err;
+  }
+  len = MIN(len, LINUX_MAX_RW_COUNT);
+  bool same_file = in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino;
+  if (same_file && off_in < off_out + (off_t) len && off_out < off_in + (off_t) len) {
+    return -LINUX_EINVAL;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  ssize_t r;
+  off_t in_pos = lseek(fd_in, 0, SEEK_CUR);
+  off_t out_pos = lseek(fd_out, 0, SEEK_CUR);
+  if (!same_file && off_in == 0 && off_out == 0 && in_pos == 0 && out_pos == 0
+      && out_st.st_size == 0 && in_st.st_size > 0 && (off_t) len >= in_st.st_size) {
+    // copying a whole file into an empty one; let the host do it in a single call
+    if (fcopyfile(fd_in, fd_out, NULL, COPYFILE_DATA) == 0) {
+      r = in_st.st_size;
+      off_in = off_out = r;
+      goto done;
+    }
+  }
+  r = do_copy_fds(fd_in, &off_in, fd_out, &off_out, len);
+  if (r < 0) {
+    return r;
+  }
+
+done:
+  // fcopyfile may have moved the file positions, so always put them back
+  if (off_in_ptr) {
+    lseek(fd_in, in_pos, SEEK_SET);
+  }
+  if (off_out_ptr) {
+    lseek(fd_out, out_pos, SEEK_SET);
+  }
+  if ((err = put_user_off(off_in_ptr, fd_in, off_in)) < 0) {
+    return err;
+  }
+  if ((err = put_user_off(off_out_ptr, fd_out, off_out)) < 0) {
+    return err;
+  }
+  return r;
+}
+
+static int
+set_nonblock(int fd, bool nonblock)
+{
+  int fl = fcntl(fd, F_GETFL);
+  if (fl < 0) {
+    return -1;
+  }
+  int newfl = nonblock ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK);
+  if (newfl != fl) {
+    fcntl(fd, F_SETFL, newfl);
+  }
+  return fl & O_NONBLOCK;
+}
+
+DEFINE_SYSCALL(splice, int, fd_in, gaddr_t, off_in_ptr, int, fd_out, gaddr_t, off_out_ptr, size_t, len, unsigned int, flags)
+{
+  if (flags & ~(LINUX_SPLICE_F_MOVE | LINUX_SPLICE_F_NONBLOCK | LINUX_SPLICE_F_MORE | LINUX_SPLICE_F_GIFT)) {
+    return -LINUX_EINVAL;
+  }
+  if (!in_userfd(fd_in) || !in_userfd(fd_out)) {
+    return -LINUX_EBADF;
+  }
+  struct stat in_st, out_st;
+  if (fstat(fd_in, &in_st) < 0 || fstat(fd_out, &out_st) < 0) {
+    return -LINUX_EBADF;
+  }
+  bool in_pipe = S_ISFIFO(in_st.st_mode), out_pipe = S_ISFIFO(out_st.st_mode);
+  if (!in_pipe && !out_pipe) {
+    return -LINUX_EINVAL;
+  }
+  if ((in_pipe && off_in_ptr) || (out_pipe && off_out_ptr)) {
+    return -LINUX_ESPIPE;
+  }
+  off_t off_in, off_out;
+  int err;
+  if (off_in_ptr && (err = get_user_off(off_in_ptr, fd_in, &off_in)) < 0) {
+    return err;
+  }
+  if (off_out_ptr && (err = get_user_off(off_out_ptr, fd_out, &off_out)) < 0) {
+    return err;
+  }
+  len = MIN(len, LINUX_MAX_RW_COUNT);
+  if (len == 0) {
+    return 0;
+  }
+
+  /* darwin has no pipe buffer sharing, so pages are copied once on the host side */
+  int in_fl = -1, out_fl = -1;
+  if (flags & LINUX_SPLICE_F_NONBLOCK) {
+    if (in_pipe)
+      in_fl = set_nonblock(fd_in, true);
+    if (out_pipe)
+      out_fl = set_nonblock(fd_out, true);
+  }
+  ssize_t r = do_copy_fds(fd_in, off_in_ptr ? &off_in : NULL, fd_out, off_out_ptr ? &off_out : NULL, len);
+  if (in_fl == 0)
+    set_nonblock(fd_in, false);
+  if (out_fl == 0)
+    set_nonblock(fd_out, false);
+  if (r < 0) {
+    return r;
+  }
+
+  if (off_in_ptr && (err = put_user_off(off_in_ptr, fd_in, off_in)) < 0) {
+    return err;
+  }
+  if (off_out_ptr && (err = put_user_off(off_out_ptr, fd_out, off_out)) < 0) {
+    return err;
+  }
+  return r;
+}
+
+DEFINE_SYSCALL(vmsplice, int, fd, gaddr_t, iov_ptr, unsigned long, nr_segs, unsigned int, flags)
+{
+  if (!in_userfd(fd)) {
+    return -LINUX_EBADF;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+    return -LINUX_EBADF;
+  }
+  if (nr_segs > LINUX_UIO_MAXIOV) {
+    return -LINUX_EINVAL;
+  }
+  /* user pages cannot be gifted to a darwin pipe; fall back to plain vectored I/O */
+  int fl = fcntl(fd, F_GETFL);
+  switch (fl & O_ACCMODE) {
+  case O_WRONLY:
+    return sys_writev(fd, iov_ptr, nr_segs);
+  case O_RDONLY:
+    return sys_readv(fd, iov_ptr, nr_segs);
+  default:
+    return -LINUX_EBADF;
+  }
+}
+
 DEFINE_SYSCALL(getxattr, gstr_t, path_ptr, gstr_t, name_ptr, gaddr_t, value, size_t, size)
 {
   warnk("getxattr is unimplemented\n");
@@ -1984,6 +2453,30 @@ DEFINE_SYSCALL(select, int, nfds, gaddr_t, readfds_ptr, gaddr_t, writefds_ptr, g
   return r;
 }
 
+/*
+ * Host pselect under the mask set by set_temporary_sigmask. The host signals
+ * are blocked while we look for pending ones and the host kernel unblocks them
+ * atomically as it starts to wait, so a signal that comes in between is not
+ * lost but ends the wait.
+ */
+int
+pselect_sigmask(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, const struct timespec *timeout)
+{
+  sigset_t all, dset;
+  sigfillset(&all);
+  linux_to_darwin_sigset(&task.sigmask, &dset);
+  pthread_sigmask(SIG_SETMASK, &all, NULL);
+
+  int r;
+  if (has_sigpending()) {
+    r = -LINUX_EINTR;
+  } else {
+    r = syswrap(pselect(nfds, readfds, writefds, errorfds, timeout, &dset));
+  }
+  pthread_sigmask(SIG_SETMASK, &dset, NULL);
+  return r;
+}
+
 DEFINE_SYSCALL(pselect6, int, nfds, gaddr_t, readfds_ptr, gaddr_t, writefds_ptr, gaddr_t, errorfds_ptr, gaddr_t, timeout_ptr, gaddr_t, sigmask_ptr)
 {
   // TODO: Check if fd is in userspace
@@ -2027,8 +2520,27 @@ DEFINE_SYSCALL(pselect6, int, nfds, gaddr_t, readfds_ptr, gaddr_t, writefds_ptr,
     efds = &errorfds;
   }
 
-  // FIXME: Ignore sigmask now. Support it after implementing signal handling
-  int r = syswrap(pselect(nfds, rfds, wfds, efds, to, NULL));
+  int r;
+  if (sigmask_ptr == 0) {
+    r = syswrap(pselect(nfds, rfds, wfds, efds, to, NULL));
+  } else {
+    /* a pointer to { const sigset_t *ss; size_t ss_len; } */
+    struct {
+      gaddr_t ss;
+      size_t ss_len;
+    } arg;
+    l_sigset_t sigmask;
+    if (copy_from_user(&arg, sigmask_ptr, sizeof arg))
+      return -LINUX_EFAULT;
+    if (arg.ss != 0) {
+      if (arg.ss_len != sizeof sigmask)
+        return -LINUX_EINVAL;
+      if (copy_from_user(&sigmask, arg.ss, sizeof sigmask))
+        return -LINUX_EFAULT;
+      set_temporary_sigmask(&sigmask);
+    }
+    r = pselect_sigmask(nfds, rfds, wfds, efds, to);
+  }
   if (r < 0)
     return r;
 
@@ -2041,7 +2553,85 @@ DEFINE_SYSCALL(pselect6, int, nfds, gaddr_t, readfds_ptr, gaddr_t, writefds_ptr,
   return r;
 }
 
-DEFINE_SYSCALL(poll, gaddr_t, fds_ptr, int, nfds, int, timeout)
+/* for poll, rounded up; NULL or too long to express means forever */
+static int
+timespec_to_ms(const struct timespec *ts)
+{
+  if (ts == NULL || ts->tv_sec >= INT_MAX / 1000 - 1) {
+    return -1;
+  }
+  return ts->tv_sec * 1000 + (ts->tv_nsec + 999999) / 1000000;
+}
+
+/* ppoll on the host, as pselect_sigmask followed by a poll that collects the exact revents */
+static int
+ppoll_sigmask(struct pollfd *fds, int nfds, const struct timespec *timeout)
+{
+  fd_set readfds, writefds, errorfds;
+  int maxfd = -1;
+  for (int i = 0; i < nfds; i++) {
+    if (fds[i].fd >= FD_SETSIZE) {
+      /* out of reach of select; fall back to checking just before we wait */
+      if (has_sigpending())
+        return -LINUX_EINTR;
+      return syswrap(poll(fds, nfds, timespec_to_ms(timeout)));
+    }
+    maxfd = MAX(maxfd, fds[i].fd);
+  }
+
+  struct timespec deadline, left;
+  if (timeout) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout->tv_sec + (deadline.tv_nsec + timeout->tv_nsec) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + timeout->tv_nsec) % 1000000000;
+    left = *timeout;
+  }
+
+  /* select may see an fd ready for an event that poll does not report,
+     e.g. a hangup, so wait again for what is left of the timeout */
+  for (;;) {
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    FD_ZERO(&errorfds);
+    for (int i = 0; i < nfds; i++) {
+      if (fds[i].fd < 0) {
+        continue;
+      }
+      /* hangups and errors show up as readable or writable */
+      if (fds[i].events & (POLLIN | POLLRDNORM))
+        FD_SET(fds[i].fd, &readfds);
+      if (fds[i].events & (POLLOUT | POLLWRNORM | POLLWRBAND))
+        FD_SET(fds[i].fd, &writefds);
+      if (fds[i].events & (POLLPRI | POLLRDBAND))
+        FD_SET(fds[i].fd, &errorfds);
+    }
+
+    int r = pselect_sigmask(maxfd + 1, &readfds, &writefds, &errorfds, timeout ? &left : NULL);
+    if (r == -LINUX_EBADF) {
+      /* let poll report POLLNVAL */
+      r = 1;
+    }
+    if (r <= 0) {
+      return r;
+    }
+    r = syswrap(poll(fds, nfds, 0));
+    if (r != 0) {
+      return r;
+    }
+    if (timeout) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      int64_t ns = (deadline.tv_sec - now.tv_sec) * 1000000000 + (deadline.tv_nsec - now.tv_nsec);
+      if (ns <= 0) {
+        return 0;
+      }
+      left = (struct timespec) { ns / 1000000000, ns % 1000000000 };
+    }
+  }
+}
+
+static int
+do_poll(gaddr_t fds_ptr, int nfds, const struct timespec *timeout, const l_sigset_t *sigmask)
 {
   /* FIXME! event numbers should be translated */
 
@@ -2075,7 +2665,12 @@ DEFINE_SYSCALL(poll, gaddr_t, fds_ptr, int, nfds, int, timeout)
     }
   }
 
-  r = syswrap(poll(d_fds, nfds, timeout));
+  if (sigmask) {
+    set_temporary_sigmask(sigmask);
+    r = ppoll_sigmask(d_fds, nfds, timeout);
+  } else {
+    r = syswrap(poll(d_fds, nfds, timespec_to_ms(timeout)));
+  }
   if (r < 0)
     goto out;
 
@@ -2098,6 +2693,34 @@ out:
   return r;
 }
 
+DEFINE_SYSCALL(poll, gaddr_t, fds_ptr, int, nfds, int, timeout)
+{
+  struct timespec ts = { timeout / 1000, timeout % 1000 * 1000000 };
+  return do_poll(fds_ptr, nfds, timeout < 0 ? NULL : &ts, NULL);
+}
+
+DEFINE_SYSCALL(ppoll, gaddr_t, fds_ptr, int, nfds, gaddr_t, tsp, gaddr_t, sigmask_ptr, size_t, sigsetsize)
+{
+  struct timespec ts;
+  if (tsp != 0) {
+    struct l_timespec lts;
+    if (copy_from_user(&lts, tsp, sizeof lts))
+      return -LINUX_EFAULT;
+    if (lts.tv_sec < 0 || lts.tv_nsec < 0 || lts.tv_nsec >= 1000000000)
+      return -LINUX_EINVAL;
+    ts = (struct timespec) { lts.tv_sec, lts.tv_nsec };
+  }
+
+  l_sigset_t sigmask;
+  if (sigmask_ptr != 0) {
+    if (sigsetsize != sizeof sigmask)
+      return -LINUX_EINVAL;
+    if (copy_from_user(&sigmask, sigmask_ptr, sizeof sigmask))
+      return -LINUX_EFAULT;
+  }
+  return do_poll(fds_ptr, nfds, tsp ? &ts : NULL, sigmask_ptr ? &sigmask : NULL);
+}
+
 DEFINE_SYSCALL(chroot, gstr_t, path_ptr)
 {
   char path[PATH_MAX];
@@ -0,0 +1,733 @@
+#include "common.h"
+#include "noah.h"
+#include "fs.h"
+
+#include "linux/common.h"
+#include "linux/time.h"
+#include "linux/fs.h"
+#include "linux/errno.h"
+#include "linux/ioctl.h"
+#include "linux/inotify.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/event.h>
+
+/*
+ * inotify on top of kqueue.
+ *
+ * The inotify fd is a host kqueue (see eventfd.c) and every watched vnode is
+ * registered on it as an EVFILT_VNODE knote. kqueue does not tell which entry
+ * of a directory has changed, so each watched directory keeps a snapshot of
+ * its entries and rescans itself on NOTE_WRITE. Removed and added entries of
+ * the same inode found in one batch of knotes are reported as a rename sharing
+ * a cookie, even across two watched directories. Regular files in a watched
+ * directory get their own knotes only when IN_MODIFY or IN_ATTRIB is requested.
+ *
+ * The host fds the knotes are made on are noah's own and live in the vkern fd
+ * range, out of the guest's reach. A forked child inherits them but not the
+ * kqueue, so fork_inotify registers them again on a new one.
+ */
+
+struct inotify_watch;
+
+/* a vnode monitored by a knote: the watch target itself or an entry of a watched directory */
+struct inotify_dent {
+  struct inotify_watch *watch;
+  char *name;                   /* NULL for the watch target */
+  ino_t ino;
+  bool is_dir;
+  bool seen;                    /* used while rescanning */
+  int fd;                       /* -1 if not monitored */
+};
+
+KHASH_MAP_INIT_STR(dent, struct inotify_dent *)
+
+struct inotify_watch {
+  int wd;
+  uint32_t mask;
+  dev_t dev;
+  struct inotify_dent self;
+  khash_t(dent) *dents;         /* NULL unless the target is a directory */
+  bool dead;
+  struct inotify_watch *next;
+};
+
+struct inotify_event_node {
+  struct inotify_event_node *next;
+  size_t size;
+  struct l_inotify_event ev;
+};
+
+struct inotify {
+  struct evfile base;
+  struct inotify_watch *watches;
+  int last_wd;
+  uint32_t last_cookie;
+  struct inotify_event_node *head, *tail;
+  int nevents;
+  int nchildfds;
+  bool closing;                 /* in inotify_close, where fdtable_lock is held */
+};
+
+static const int inotify_max_queued_events = 16384;
+static const int inotify_max_child_fds = 1024;
+
+#define INOTIFY_CHILD_EVENTS (LINUX_IN_MODIFY | LINUX_IN_ATTRIB)
+#define INOTIFY_VNODE_NOTES (NOTE_DELETE | NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_LINK | NOTE_RENAME | NOTE_REVOKE)
+
+/*
+ * event queue
+ */
+
+static void
+queue_event(struct inotify *in, int wd, uint32_t mask, uint32_t cookie, const char *name)
+{
+  struct inotify_event_node *last = in->tail;
+
+  /* coalesce identical consecutive events, as linux does */
+  if (last && last->ev.wd == wd && last->ev.mask == mask && last->ev.cookie == cookie) {
+    if (name == NULL ? last->ev.len == 0 : (last->ev.len != 0 && strcmp(last->ev.name, name) == 0)) {
+      return;
+    }
+  }
+  if (in->nevents >= inotify_max_queued_events) {
+    if (last && last->ev.mask == LINUX_IN_Q_OVERFLOW) {
+      return;
+    }
+    wd = -1;
+    mask = LINUX_IN_Q_OVERFLOW;
+    cookie = 0;
+    name = NULL;
+  }
+
+  /* the name is null-terminated and padded to the alignment of the header */
+  size_t len = name ? roundup(strlen(name) + 1, sizeof(struct l_inotify_event)) : 0;
+  struct inotify_event_node *node = calloc(1, sizeof *node + len);
+  node->size = sizeof(struct l_inotify_event) + len;
+  node->ev.wd = wd;
+  node->ev.mask = mask;
+  node->ev.cookie = cookie;
+  node->ev.len = len;
+  if (name) {
+    strcpy(node->ev.name, name);
+  }
+  if (last) {
+    last->next = node;
+  } else {
+    in->head = node;
+  }
+  in->tail = node;
+  in->nevents++;
+}
+
+static void
+notify(struct inotify *in, struct inotify_watch *w, uint32_t mask, uint32_t cookie, const char *name)
+{
+  if (w->dead && (w->mask & LINUX_IN_ONESHOT)) {
+    return;
+  }
+  if ((w->mask & mask & LINUX_IN_ALL_EVENTS) == 0) {
+    return;
+  }
+  queue_event(in, w->wd, mask, cookie, name);
+  if (w->mask & LINUX_IN_ONESHOT) {
+    w->dead = true;
+  }
+}
+
+/*
+ * watches
+ */
+
+/* moves a host fd of noah's own out of the range the guest can name */
+static int
+to_vkern_fd(int fd)
+{
+  pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
+  int vfd = vkern_dup_fd(fd, true);
+  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+  close(fd);
+  return vfd;
+}
+
+static void
+close_vkern_fd(struct inotify *in, int fd)
+{
+  if (in->closing) {
+    do_close(&proc.fileinfo.vkern_fdtable, fd);
+  } else {
+    vkern_close(fd);
+  }
+}
+
+static void
+watch_child(int kq, struct inotify *in, struct inotify_dent *d, int dirfd)
+{
+  if (d->fd >= 0 || d->is_dir || (d->watch->mask & INOTIFY_CHILD_EVENTS) == 0) {
+    return;
+  }
+  if (in->nchildfds >= inotify_max_child_fds) {
+    return;
+  }
+  int fd = openat(dirfd, d->name, O_EVTONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  fd = to_vkern_fd(fd);
+  struct kevent kev;
+  EV_SET(&kev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB, 0, d);
+  if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0) {
+    close_vkern_fd(in, fd);
+    return;
+  }
+  d->fd = fd;
+  in->nchildfds++;
+}
+
+static void
+free_dent(struct inotify *in, struct inotify_dent *d)
+{
+  if (d->fd >= 0) {
+    close_vkern_fd(in, d->fd);  /* this also removes the knote */
+    in->nchildfds--;
+  }
+  free(d->name);
+  free(d);
+}
+
+struct dent_changes {
+  struct inotify_dent **v;
+  size_t n, cap;
+};
+
+static void
+push_change(struct dent_changes *c, struct inotify_dent *d)
+{
+  if (c->n == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 16;
+    c->v = realloc(c->v, c->cap * sizeof *c->v);
+  }
+  c->v[c->n++] = d;
+}
+
+/*
+ * Bring the snapshot of a watched directory up to date. Entries that have gone
+ * or appeared are appended to removed and added; removed entries are detached
+ * from the snapshot and must be freed by the caller. Both may be NULL.
+ */
+static void
+scan_dir(int kq, struct inotify *in, struct inotify_watch *w, struct dent_changes *removed, struct dent_changes *added)
+{
+  int fd = openat(w->self.fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL) {
+    close(fd);
+    return;
+  }
+
+  khiter_t k;
+  for (k = kh_begin(w->dents); k != kh_end(w->dents); ++k) {
+    if (kh_exist(w->dents, k)) {
+      kh_value(w->dents, k)->seen = false;
+    }
+  }
+
+  struct dent_changes fresh = { NULL, 0, 0 };
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    k = kh_get(dent, w->dents, ent->d_name);
+    if (k != kh_end(w->dents) && kh_value(w->dents, k)->ino == ent->d_ino) {
+      kh_value(w->dents, k)->seen = true;
+      continue;
+    }
+    struct inotify_dent *d = malloc(sizeof *d);
+    *d = (struct inotify_dent) { w, strdup(ent->d_name), ent->d_ino, ent->d_type == DT_DIR, false, -1 };
+    push_change(&fresh, d);
+  }
+
+  /* drop vanished entries first, since a new entry may reuse the name */
+  for (k = kh_begin(w->dents); k != kh_end(w->dents); ++k) {
+    if (!kh_exist(w->dents, k)) {
+      continue;
+    }
+    struct inotify_dent *d = kh_value(w->dents, k);
+    if (d->seen) {
+      continue;
+    }
+    kh_del(dent, w->dents, k);
+    if (removed) {
+      push_change(removed, d);
+    } else {
+      free_dent(in, d);
+    }
+  }
+  for (size_t i = 0; i < fresh.n; i++) {
+    struct inotify_dent *d = fresh.v[i];
+    int ret;
+    k = kh_put(dent, w->dents, d->name, &ret);
+    kh_value(w->dents, k) = d;
+    watch_child(kq, in, d, fd);
+    if (added) {
+      push_change(added, d);
+    }
+  }
+  free(fresh.v);
+  closedir(dir);
+}
+
+/* report the result of rescans, pairing a removal and an addition of the same inode as a rename */
+static void
+report_changes(struct inotify *in, struct dent_changes *removed, struct dent_changes *added)
+{
+  for (size_t i = 0; i < removed->n; i++) {
+    struct inotify_dent *from = removed->v[i];
+    uint32_t isdir = from->is_dir ? LINUX_IN_ISDIR : 0;
+    size_t j;
+    for (j = 0; j < added->n; j++) {
+      if (added->v[j] != NULL && added->v[j]->ino == from->ino) {
+        break;
+      }
+    }
+    if (j < added->n) {
+      struct inotify_dent *to = added->v[j];
+      if (++in->last_cookie == 0) {
+        ++in->last_cookie;
+      }
+      notify(in, from->watch, LINUX_IN_MOVED_FROM | isdir, in->last_cookie, from->name);
+      notify(in, to->watch, LINUX_IN_MOVED_TO | isdir, in->last_cookie, to->name);
+      added->v[j] = NULL;
+    } else {
+      notify(in, from->watch, LINUX_IN_DELETE | isdir, 0, from->name);
+    }
+    free_dent(in, from);
+  }
+  for (size_t j = 0; j < added->n; j++) {
+    struct inotify_dent *to = added->v[j];
+    if (to != NULL) {
+      notify(in, to->watch, LINUX_IN_CREATE | (to->is_dir ? LINUX_IN_ISDIR : 0), 0, to->name);
+    }
+  }
+  free(removed->v);
+  free(added->v);
+}
+
+static void
+destroy_watch(struct inotify *in, struct inotify_watch *w)
+{
+  if (w->dents) {
+    khiter_t k;
+    for (k = kh_begin(w->dents); k != kh_end(w->dents); ++k) {
+      if (kh_exist(w->dents, k)) {
+        free_dent(in, kh_value(w->dents, k));
+      }
+    }
+    kh_destroy(dent, w->dents);
+  }
+  close_vkern_fd(in, w->self.fd);
+  free(w);
+}
+
+/* remove dead watches, reporting IN_IGNORED for each */
+static void
+reap_watches(struct inotify *in)
+{
+  struct inotify_watch **p = &in->watches;
+  while (*p) {
+    struct inotify_watch *w = *p;
+    if (!w->dead) {
+      p = &w->next;
+      continue;
+    }
+    *p = w->next;
+    queue_event(in, w->wd, LINUX_IN_IGNORED, 0, NULL);
+    destroy_watch(in, w);
+  }
+}
+
+static struct inotify_watch *
+find_watch(struct inotify *in, int wd)
+{
+  for (struct inotify_watch *w = in->watches; w; w = w->next) {
+    if (w->wd == wd && !w->dead) {
+      return w;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Translate knotes delivered to the kqueue into inotify events.
+ * Must be called with the lock held.
+ */
+static void
+inotify_collect(int kq, struct inotify *in)
+{
+  struct kevent kev[64];
+  struct timespec zero = { 0, 0 };
+  struct dent_changes removed = { NULL, 0, 0 }, added = { NULL, 0, 0 };
+  int n;
+
+  evfile_set_ready(kq, false);
+  while ((n = kevent(kq, NULL, 0, kev, 64, &zero)) > 0) {
+    for (int i = 0; i < n; i++) {
+      if (kev[i].filter != EVFILT_VNODE) {
+        continue;
+      }
+      struct inotify_dent *d = kev[i].udata;
+      struct inotify_watch *w = d->watch;
+      uint32_t f = kev[i].fflags;
+      if (w->dead) {
+        continue;
+      }
+      if (d != &w->self) {
+        /* a regular file in a watched directory */
+        if (f & (NOTE_WRITE | NOTE_EXTEND)) {
+          notify(in, w, LINUX_IN_MODIFY, 0, d->name);
+        }
+        if (f & NOTE_ATTRIB) {
+          notify(in, w, LINUX_IN_ATTRIB, 0, d->name);
+        }
+        continue;
+      }
+      if (w->dents) {
+        if (f & (NOTE_WRITE | NOTE_LINK)) {
+          scan_dir(kq, in, w, &removed, &added);
+        }
+        if (f & NOTE_ATTRIB) {
+          notify(in, w, LINUX_IN_ATTRIB | LINUX_IN_ISDIR, 0, NULL);
+        }
+      } else {
+        if (f & (NOTE_WRITE | NOTE_EXTEND)) {
+          notify(in, w, LINUX_IN_MODIFY, 0, NULL);
+        }
+        if (f & (NOTE_ATTRIB | NOTE_LINK)) {
+          notify(in, w, LINUX_IN_ATTRIB, 0, NULL);
+        }
+      }
+      if (f & NOTE_RENAME) {
+        notify(in, w, LINUX_IN_MOVE_SELF, 0, NULL);
+      }
+      if (f & (NOTE_DELETE | NOTE_REVOKE)) {
+        notify(in, w, LINUX_IN_DELETE_SELF, 0, NULL);
+        w->dead = true;
+      }
+    }
+  }
+  report_changes(in, &removed, &added);
+  reap_watches(in);
+}
+
+static void
+inotify_update_ready(int kq, struct inotify *in)
+{
+  evfile_set_ready(kq, in->head != NULL);
+}
+
+/*
+ * file operations
+ */
+
+static int
+inotify_readv(struct file *file, struct iovec *iov, size_t iovcnt)
+{
+  struct inotify *in = file->private_data;
+  size_t size = iov_size(iov, iovcnt);
+
+  while (1) {
+    pthread_mutex_lock(&in->base.lock);
+    inotify_collect(file->fd, in);
+    if (in->head) {
+      break;
+    }
+    pthread_mutex_unlock(&in->base.lock);
+    if (in->base.nonblock) {
+      return -LINUX_EAGAIN;
+    }
+    /* wait without consuming knotes; they are collected under the lock */
+    struct pollfd pfd = { file->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, -1) < 0) {
+      return -darwin_to_linux_errno(errno);
+    }
+  }
+
+  int r;
+  size_t total = 0;
+  for (struct inotify_event_node *node = in->head; node && total + node->size <= size; node = node->next) {
+    total += node->size;
+  }
+  if (total == 0) {
+    r = -LINUX_EINVAL;
+    goto out;
+  }
+  char *buf = malloc(total), *p = buf;
+  while (p < buf + total) {
+    struct inotify_event_node *node = in->head;
+    memcpy(p, &node->ev, node->size);
+    p += node->size;
+    in->head = node->next;
+    in->nevents--;
+    free(node);
+  }
+  if (in->head == NULL) {
+    in->tail = NULL;
+  }
+  copy_to_iov(iov, iovcnt, buf, total);
+  free(buf);
+  r = total;
+
+out:
+  inotify_update_ready(file->fd, in);
+  pthread_mutex_unlock(&in->base.lock);
+  return r;
+}
+
+static int
+inotify_ioctl(struct file *file, int cmd, uint64_t val0)
+{
+  struct inotify *in = file->private_data;
+  if (cmd != LINUX_FIONREAD) {
+    return -LINUX_EINVAL;
+  }
+  int size = 0;
+  pthread_mutex_lock(&in->base.lock);
+  inotify_collect(file->fd, in);
+  for (struct inotify_event_node *node = in->head; node; node = node->next) {
+    size += node->size;
+  }
+  inotify_update_ready(file->fd, in);
+  pthread_mutex_unlock(&in->base.lock);
+  if (copy_to_user(val0, &size, sizeof size)) {
+    return -LINUX_EFAULT;
+  }
+  return 0;
+}
+
+static int
+inotify_close(struct file *file)
+{
+  struct inotify *in = file->private_data;
+  if (atomic_load(&in->base.refcount) == 1) {
+    in->closing = true;
+    while (in->watches) {
+      struct inotify_watch *w = in->watches;
+      in->watches = w->next;
+      destroy_watch(in, w);
+    }
+    while (in->head) {
+      struct inotify_event_node *node = in->head;
+      in->head = node->next;
+      free(node);
+    }
+  }
+  return evfile_close(file);
+}
+
+static struct file_operations inotify_ops = {
+  .readv = inotify_readv,
+  .close = inotify_close,
+  .ioctl = inotify_ioctl,
+  .lseek = darwinfs_lseek,
+  .getdents = darwinfs_getdents,
+  .fcntl = evfile_fcntl,
+  .fsync = darwinfs_fsync,
+  .fstat = darwinfs_fstat,
+  .fstatfs = darwinfs_fstatfs,
+  .fchown = darwinfs_fchown,
+  .fchmod = darwinfs_fchmod,
+  .dup = evfile_dup,
+};
+
+static void
+renew_dent(int kq, struct inotify_dent *d, uint32_t notes)
+{
+  struct kevent kev;
+  EV_SET(&kev, d->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, notes, 0, d);
+  kevent(kq, &kev, 1, NULL, 0, NULL);
+}
+
+static void
+inotify_renew(struct file *file, bool cloexec, void *arg)
+{
+  struct inotify *in = file->private_data;
+  if (!evfile_renew(file, cloexec)) {
+    return;
+  }
+  /* changes made while the parent's kqueue was not read yet are lost */
+  for (struct inotify_watch *w = in->watches; w; w = w->next) {
+    renew_dent(file->fd, &w->self, INOTIFY_VNODE_NOTES);
+    if (w->dents == NULL) {
+      continue;
+    }
+    khiter_t k;
+    for (k = kh_begin(w->dents); k != kh_end(w->dents); ++k) {
+      if (kh_exist(w->dents, k) && kh_value(w->dents, k)->fd >= 0) {
+        renew_dent(file->fd, kh_value(w->dents, k), NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB);
+      }
+    }
+  }
+  inotify_update_ready(file->fd, in);
+}
+
+/* called in a forked child */
+void
+fork_inotify(void)
+{
+  for_each_file(&inotify_ops, inotify_renew, NULL);
+}
+
+/*
+ * system calls
+ */
+
+DEFINE_SYSCALL(inotify_init1, int, flags)
+{
+  if (flags & ~(LINUX_IN_CLOEXEC | LINUX_IN_NONBLOCK)) {
+    return -LINUX_EINVAL;
+  }
+  struct inotify *in = calloc(1, sizeof *in);
+  return evfile_create(&in->base, &inotify_ops, flags & LINUX_IN_CLOEXEC, flags & LINUX_IN_NONBLOCK);
+}
+
+DEFINE_SYSCALL(inotify_init)
+{
+  return sys_inotify_init1(0);
+}
+
+static struct inotify *
+get_inotify(int fd, struct file **filep)
+{
+  struct file *file = get_file(fd);
+  if (file == NULL || file->ops != &inotify_ops) {
+    return NULL;
+  }
+  *filep = file;
+  return file->private_data;
+}
+
+DEFINE_SYSCALL(inotify_add_watch, int, fd, gstr_t, path_ptr, uint32_t, mask)
+{
+  struct file *file;
+  struct inotify *in = get_inotify(fd, &file);
+  if (in == NULL) {
+    return (get_file(fd) == NULL) ? -LINUX_EBADF : -LINUX_EINVAL;
+  }
+  if ((mask & LINUX_IN_ALL_EVENTS) == 0) {
+    return -LINUX_EINVAL;
+  }
+  if ((mask & LINUX_IN_MASK_ADD) && (mask & LINUX_IN_MASK_CREATE)) {
+    return -LINUX_EINVAL;
+  }
+  char path[LINUX_PATH_MAX];
+  if (strncpy_from_user(path, path_ptr, sizeof path) < 0) {
+    return -LINUX_EFAULT;
+  }
+
+  /* like linux, watching requires read permission unless the target is a symlink itself */
+  int flags = LINUX_O_CLOEXEC;
+  if (mask & LINUX_IN_DONT_FOLLOW) {
+    flags |= LINUX_O_PATH | LINUX_O_NOFOLLOW;
+  } else {
+    flags |= LINUX_O_RDONLY | LINUX_O_NONBLOCK;
+  }
+  if (mask & LINUX_IN_ONLYDIR) {
+    flags |= LINUX_O_DIRECTORY;
+  }
+  int hfd = vkern_openat(LINUX_AT_FDCWD, path, flags, 0);
+  if (hfd < 0) {
+    return hfd;
+  }
+  struct stat st;
+  if (fstat(hfd, &st) < 0) {
+    int err = -darwin_to_linux_errno(errno);
+    vkern_close(hfd);
+    return err;
+  }
+  mask &= ~(LINUX_IN_DONT_FOLLOW | LINUX_IN_ONLYDIR | LINUX_IN_MASK_CREATE);
+
+  int r;
+  pthread_mutex_lock(&in->base.lock);
+  struct inotify_watch *w;
+  for (w = in->watches; w; w = w->next) {
+    if (!w->dead && w->dev == st.st_dev && w->self.ino == st.st_ino) {
+      break;
+    }
+  }
+  if (w) {
+    vkern_close(hfd);
+    w->mask = (mask & LINUX_IN_MASK_ADD) ? w->mask | mask : mask;
+    w->mask &= ~LINUX_IN_MASK_ADD;
+    if (w->dents && (w->mask & INOTIFY_CHILD_EVENTS)) {
+      khiter_t k;
+      for (k = kh_begin(w->dents); k != kh_end(w->dents); ++k) {
+        if (kh_exist(w->dents, k)) {
+          watch_child(file->fd, in, kh_value(w->dents, k), w->self.fd);
+        }
+      }
+    }
+    r = w->wd;
+    goto out;
+  }
+
+  w = calloc(1, sizeof *w);
+  w->wd = ++in->last_wd;
+  w->mask = mask & ~LINUX_IN_MASK_ADD;
+  w->dev = st.st_dev;
+  w->self = (struct inotify_dent) { w, NULL, st.st_ino, S_ISDIR(st.st_mode), false, hfd };
+  struct kevent kev;
+  EV_SET(&kev, hfd, EVFILT_VNODE, EV_ADD | EV_CLEAR, INOTIFY_VNODE_NOTES, 0, &w->self);
+  if (kevent(file->fd, &kev, 1, NULL, 0, NULL) < 0) {
+    r = -darwin_to_linux_errno(errno);
+    vkern_close(hfd);
+    free(w);
+    goto out;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    w->dents = kh_init(dent);
+    scan_dir(file->fd, in, w, NULL, NULL);
+  }
+  w->next = in->watches;
+  in->watches = w;
+  r = w->wd;
+
+out:
+  pthread_mutex_unlock(&in->base.lock);
+  return r;
+}
+
+DEFINE_SYSCALL(inotify_rm_watch, int, fd, int, wd)
+{
+  struct file *file;
+  struct inotify *in = get_inotify(fd, &file);
+  if (in == NULL) {
+    return (get_file(fd) == NULL) ? -LINUX_EBADF : -LINUX_EINVAL;
+  }
+  int r = 0;
+  pthread_mutex_lock(&in->base.lock);
+  struct inotify_watch *w = find_watch(in, wd);
+  if (w == NULL) {
+    r = -LINUX_EINVAL;
+  } else {
+    w->dead = true;
+    reap_watches(in);
+    inotify_update_ready(file->fd, in);
+  }
+  pthread_mutex_unlock(&in->base.lock);
+  return r;
+}
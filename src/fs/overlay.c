@@ -0,0 +1,1013 @@
+#include "common.h"
+#include "noah.h"
+#include "fs.h"
+
+#include "linux/common.h"
+#include "linux/time.h"
+#include "linux/fs.h"
+#include "linux/errno.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syslimits.h>
+#include <sys/clonefile.h>
+#include <copyfile.h>
+
+/*
+ * Overlay root filesystem.
+ *
+ * The guest root (-m) becomes a read-only lower layer and every modification
+ * goes to a writable upper directory (--upper):
+ *   - files are copied up to the upper layer when opened for writing or when
+ *     their metadata is changed; regular files are cloned when both layers
+ *     live on the same APFS volume
+ *   - a removed lower entry is hidden by a whiteout file ".wh.<name>" next to
+ *     it in the upper layer
+ *   - a directory created where a lower entry was removed contains the marker
+ *     ".wh..wh..opq" and hides the lower directory of the same name
+ *   - directories present in both layers are listed as the union of the two
+ *
+ * Operations are given a host directory fd and a path relative to it; the fd
+ * may refer to either layer (a cwd or a dirfd opened by the guest), so both are
+ * mapped back to a path relative to the overlay root. Anything outside both
+ * layers is passed to darwinfs.
+ */
+
+struct overlay {
+  struct fs fs;
+  int lowerfd, upperfd;
+  char lower[PATH_MAX], upper[PATH_MAX];   /* canonical host paths */
+};
+
+enum {
+  OVL_NONE,
+  OVL_UPPER,
+  OVL_LOWER,
+};
+
+static const char whiteout_prefix[] = ".wh.";
+static const char opaque_name[] = ".wh..wh..opq";
+
+static bool
+is_whiteout_name(const char *name)
+{
+  return strncmp(name, whiteout_prefix, sizeof whiteout_prefix - 1) == 0;
+}
+
+static bool
+exists_at(int dirfd, const char *path)
+{
+  struct stat st;
+  return fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/* if path is prefix or below it, store the remaining part in rel */
+static bool
+strip_prefix(const char *path, const char *prefix, char *rel)
+{
+  size_t n = strlen(prefix);
+  if (strncmp(path, prefix, n) != 0 || (path[n] != '\0' && path[n] != '/')) {
+    return false;
+  }
+  path += n;
+  while (*path == '/') {
+    path++;
+  }
+  strcpy(rel, path);
+  return true;
+}
+
+/* normalize base/path into a path relative to the overlay root; the root itself is "." */
+static int
+join_path(const char *base, const char *path, char *rel)
+{
+  char buf[LINUX_PATH_MAX * 2];
+  if (snprintf(buf, sizeof buf, "%s/%s", base, path) >= (int) sizeof buf) {
+    return -LINUX_ENAMETOOLONG;
+  }
+  size_t len = 0;
+  char *save, *c;
+  for (c = strtok_r(buf, "/", &save); c; c = strtok_r(NULL, "/", &save)) {
+    if (strcmp(c, ".") == 0) {
+      continue;
+    }
+    if (strcmp(c, "..") == 0) {
+      /* ".." at the root stays at the root */
+      while (len > 0 && rel[--len] != '/')
+        ;
+      continue;
+    }
+    size_t n = strlen(c);
+    if (len + n + 2 > LINUX_PATH_MAX) {
+      return -LINUX_ENAMETOOLONG;
+    }
+    if (len > 0) {
+      rel[len++] = '/';
+    }
+    memcpy(rel + len, c, n);
+    len += n;
+  }
+  if (len == 0) {
+    rel[len++] = '.';
+  }
+  rel[len] = '\0';
+  return 0;
+}
+
+static bool
+ovl_host_relpath(struct overlay *ovl, const char *host, char *base)
+{
+  /* the upper layer is checked first in case it is placed under the lower one */
+  return strip_prefix(host, ovl->upper, base) || strip_prefix(host, ovl->lower, base);
+}
+
+static bool
+ovl_relpath(struct overlay *ovl, struct dir *dir, const char *path, char *rel)
+{
+  char base[PATH_MAX] = "";
+  if (dir->fd != proc.fileinfo.rootfd) {
+    char host[PATH_MAX];
+    if (dir->fd == AT_FDCWD) {
+      if (getcwd(host, sizeof host) == NULL) {
+        return false;
+      }
+    } else if (fcntl(dir->fd, F_GETPATH, host) < 0) {
+      return false;
+    }
+    if (!ovl_host_relpath(ovl, host, base)) {
+      return false;
+    }
+  }
+  return join_path(base, path, rel) == 0;
+}
+
+static void
+split_path(const char *rel, char *parent, const char **name)
+{
+  const char *slash = strrchr(rel, '/');
+  if (slash == NULL) {
+    strcpy(parent, ".");
+    *name = rel;
+  } else {
+    memcpy(parent, rel, slash - rel);
+    parent[slash - rel] = '\0';
+    *name = slash + 1;
+  }
+}
+
+static void
+whiteout_path(const char *rel, char *buf)
+{
+  char parent[LINUX_PATH_MAX];
+  const char *name;
+  split_path(rel, parent, &name);
+  snprintf(buf, LINUX_PATH_MAX, "%s/%s%s", parent, whiteout_prefix, name);
+}
+
+static bool
+is_opaque(struct overlay *ovl, const char *rel)
+{
+  char buf[LINUX_PATH_MAX];
+  snprintf(buf, sizeof buf, "%s/%s", rel, opaque_name);
+  return exists_at(ovl->upperfd, buf);
+}
+
+/* whether the lower layer may show through at rel, i.e. no whiteout or opaque directory hides it */
+static bool
+ovl_lower_visible(struct overlay *ovl, const char *rel)
+{
+  char buf[LINUX_PATH_MAX];
+  if (strcmp(rel, ".") == 0) {
+    return true;
+  }
+  for (const char *p = rel; ; ) {
+    const char *slash = strchr(p, '/');
+    int plen = p - rel;
+    int clen = slash ? slash - p : (int) strlen(p);
+    snprintf(buf, sizeof buf, "%.*s%s%.*s", plen, rel, whiteout_prefix, clen, p);
+    if (exists_at(ovl->upperfd, buf)) {
+      return false;
+    }
+    if (slash == NULL) {
+      return true;
+    }
+    snprintf(buf, sizeof buf, "%.*s/%s", (int) (slash - rel), rel, opaque_name);
+    if (exists_at(ovl->upperfd, buf)) {
+      return false;
+    }
+    p = slash + 1;
+  }
+}
+
+static bool
+ovl_has_lower(struct overlay *ovl, const char *rel)
+{
+  return ovl_lower_visible(ovl, rel) && exists_at(ovl->lowerfd, rel);
+}
+
+static int
+ovl_lookup(struct overlay *ovl, const char *rel, struct stat *st)
+{
+  struct stat tmp;
+  if (st == NULL) {
+    st = &tmp;
+  }
+  if (fstatat(ovl->upperfd, rel, st, AT_SYMLINK_NOFOLLOW) == 0) {
+    return OVL_UPPER;
+  }
+  if (ovl_lower_visible(ovl, rel) && fstatat(ovl->lowerfd, rel, st, AT_SYMLINK_NOFOLLOW) == 0) {
+    return OVL_LOWER;
+  }
+  return OVL_NONE;
+}
+
+static int
+ovl_layerfd(struct overlay *ovl, int layer)
+{
+  return layer == OVL_UPPER ? ovl->upperfd : ovl->lowerfd;
+}
+
+/*
+ * copy-up
+ */
+
+static int
+copy_up_data(struct overlay *ovl, const char *rel, struct stat *st)
+{
+  /* a clone shares the data blocks until either side is modified */
+  if (clonefileat(ovl->lowerfd, rel, ovl->upperfd, rel, CLONE_NOFOLLOW) == 0) {
+    return 0;
+  }
+  int src = openat(ovl->lowerfd, rel, O_RDONLY | O_CLOEXEC);
+  if (src < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  int dst = openat(ovl->upperfd, rel, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st->st_mode & 07777);
+  if (dst < 0) {
+    int err = -darwin_to_linux_errno(errno);
+    close(src);
+    return err;
+  }
+  int r = syswrap(fcopyfile(src, dst, NULL, COPYFILE_DATA | COPYFILE_STAT | COPYFILE_XATTR));
+  if (r < 0) {
+    unlinkat(ovl->upperfd, rel, 0);
+  }
+  close(src);
+  close(dst);
+  return r;
+}
+
+static int
+ovl_copy_up(struct overlay *ovl, const char *rel)
+{
+  struct stat st;
+  switch (ovl_lookup(ovl, rel, &st)) {
+  case OVL_UPPER:
+    return 0;
+  case OVL_NONE:
+    return -LINUX_ENOENT;
+  }
+
+  char parent[LINUX_PATH_MAX];
+  const char *name;
+  split_path(rel, parent, &name);
+  int r = ovl_copy_up(ovl, parent);
+  if (r < 0) {
+    return r;
+  }
+
+  switch (st.st_mode & S_IFMT) {
+  case S_IFDIR:
+    r = syswrap(mkdirat(ovl->upperfd, rel, st.st_mode & 07777));
+    break;
+  case S_IFLNK: {
+    char target[LINUX_PATH_MAX];
+    ssize_t n = readlinkat(ovl->lowerfd, rel, target, sizeof target - 1);
+    if (n < 0) {
+      return -darwin_to_linux_errno(errno);
+    }
+    target[n] = '\0';
+    r = syswrap(symlinkat(target, ovl->upperfd, rel));
+    break;
+  }
+  case S_IFREG:
+    r = copy_up_data(ovl, rel, &st);
+    break;
+  case S_IFIFO: {
+    char path[PATH_MAX * 2];
+    snprintf(path, sizeof path, "%s/%s", ovl->upper, rel);
+    r = syswrap(mkfifo(path, st.st_mode & 07777));
+    break;
+  }
+  default:
+    return -LINUX_EPERM;
+  }
+  if (r < 0) {
+    return r;
+  }
+  /* only effective when noah runs as root */
+  fchownat(ovl->upperfd, rel, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+  return 0;
+}
+
+/* hide the lower entry at rel */
+static int
+ovl_whiteout(struct overlay *ovl, const char *rel)
+{
+  char parent[LINUX_PATH_MAX], wh[LINUX_PATH_MAX];
+  const char *name;
+  split_path(rel, parent, &name);
+  int r = ovl_copy_up(ovl, parent);
+  if (r < 0) {
+    return r;
+  }
+  whiteout_path(rel, wh);
+  int fd = openat(ovl->upperfd, wh, O_WRONLY | O_CREAT | O_CLOEXEC, 0);
+  if (fd < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  close(fd);
+  return 0;
+}
+
+static int
+ovl_make_opaque(struct overlay *ovl, const char *rel)
+{
+  char buf[LINUX_PATH_MAX];
+  snprintf(buf, sizeof buf, "%s/%s", rel, opaque_name);
+  int fd = openat(ovl->upperfd, buf, O_WRONLY | O_CREAT | O_CLOEXEC, 0);
+  if (fd < 0) {
+    return -darwin_to_linux_errno(errno);
+  }
+  close(fd);
+  return 0;
+}
+
+/*
+ * Make a new entry at rel creatable in the upper layer. *whiteout tells if a
+ * whiteout was removed for it; the caller puts it back if the creation fails.
+ */
+static int
+ovl_prepare_create(struct overlay *ovl, const char *rel, bool *whiteout)
+{
+  char parent[LINUX_PATH_MAX], wh[LINUX_PATH_MAX];
+  const char *name;
+  split_path(rel, parent, &name);
+  struct stat st;
+  if (ovl_lookup(ovl, parent, &st) == OVL_NONE) {
+    return -LINUX_ENOENT;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return -LINUX_ENOTDIR;
+  }
+  int r = ovl_copy_up(ovl, parent);
+  if (r < 0) {
+    return r;
+  }
+  whiteout_path(rel, wh);
+  *whiteout = unlinkat(ovl->upperfd, wh, 0) == 0;
+  return 0;
+}
+
+/*
+ * merged directory listing
+ */
+
+struct ovl_dirent {
+  char *name;
+  ino_t ino;
+  uint8_t type;
+};
+
+struct ovl_dirlist {
+  struct ovl_dirent *v;
+  size_t n, cap;
+};
+
+KHASH_SET_INIT_STR(name)
+
+static void
+dirlist_push(struct ovl_dirlist *list, struct dirent *ent)
+{
+  if (list->n == list->cap) {
+    list->cap = list->cap ? list->cap * 2 : 32;
+    list->v = realloc(list->v, list->cap * sizeof *list->v);
+  }
+  list->v[list->n++] = (struct ovl_dirent) { strdup(ent->d_name), ent->d_ino, ent->d_type };
+}
+
+static void
+dirlist_free(struct ovl_dirlist *list)
+{
+  for (size_t i = 0; i < list->n; i++) {
+    free(list->v[i].name);
+  }
+  free(list->v);
+  *list = (struct ovl_dirlist) { NULL, 0, 0 };
+}
+
+static DIR *
+opendir_at(int dirfd, const char *rel)
+{
+  int fd = openat(dirfd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL) {
+    close(fd);
+  }
+  return dir;
+}
+
+static int
+ovl_read_dir(struct overlay *ovl, const char *rel, struct ovl_dirlist *list)
+{
+  khash_t(name) *seen = kh_init(name);
+  bool opaque = false;
+  struct dirent *ent;
+  DIR *dir;
+  int ret;
+
+  if ((dir = opendir_at(ovl->upperfd, rel)) != NULL) {
+    while ((ent = readdir(dir)) != NULL) {
+      if (strcmp(ent->d_name, opaque_name) == 0) {
+        opaque = true;
+        continue;
+      }
+      const char *name = ent->d_name;
+      if (is_whiteout_name(name)) {
+        name += sizeof whiteout_prefix - 1;
+      } else {
+        dirlist_push(list, ent);
+      }
+      kh_put(name, seen, strdup(name), &ret);
+    }
+    closedir(dir);
+  }
+  if (!opaque && ovl_lower_visible(ovl, rel) && (dir = opendir_at(ovl->lowerfd, rel)) != NULL) {
+    while ((ent = readdir(dir)) != NULL) {
+      if (kh_get(name, seen, ent->d_name) == kh_end(seen)) {
+        dirlist_push(list, ent);
+      }
+    }
+    closedir(dir);
+  }
+
+  khiter_t k;
+  for (k = kh_begin(seen); k != kh_end(seen); ++k) {
+    if (kh_exist(seen, k)) {
+      free((char *) kh_key(seen, k));
+    }
+  }
+  kh_destroy(name, seen);
+  return 0;
+}
+
+static int
+ovl_check_empty(struct overlay *ovl, const char *rel)
+{
+  struct ovl_dirlist list = { NULL, 0, 0 };
+  ovl_read_dir(ovl, rel, &list);
+  int r = 0;
+  for (size_t i = 0; i < list.n; i++) {
+    if (strcmp(list.v[i].name, ".") && strcmp(list.v[i].name, "..")) {
+      r = -LINUX_ENOTEMPTY;
+      break;
+    }
+  }
+  dirlist_free(&list);
+  return r;
+}
+
+/* remove whiteouts in an upper directory about to be removed */
+static void
+ovl_clear_dir(struct overlay *ovl, const char *rel)
+{
+  DIR *dir = opendir_at(ovl->upperfd, rel);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (is_whiteout_name(ent->d_name)) {
+      unlinkat(dirfd(dir), ent->d_name, 0);
+    }
+  }
+  closedir(dir);
+}
+
+struct ovl_dir {
+  atomic_int refcount;
+  pthread_mutex_t lock;
+  struct overlay *ovl;
+  char *rel;
+  struct ovl_dirlist list;
+  bool loaded;
+  size_t pos;
+};
+
+static int
+ovl_dir_getdents(struct file *file, char *direntp, unsigned count, bool is64)
+{
+  struct ovl_dir *od = file->private_data;
+  size_t off = 0;
+  int r;
+
+  pthread_mutex_lock(&od->lock);
+  if (!od->loaded) {
+    ovl_read_dir(od->ovl, od->rel, &od->list);
+    od->loaded = true;
+  }
+  while (od->pos < od->list.n) {
+    struct ovl_dirent *e = &od->list.v[od->pos];
+    struct dirent d;
+    memset(&d, 0, sizeof d);
+    d.d_ino = e->ino;
+    d.d_seekoff = od->pos + 1;
+    d.d_type = e->type;
+    d.d_namlen = strlcpy(d.d_name, e->name, sizeof d.d_name);
+    ssize_t reclen = darwin_to_linux_dent(&d, direntp + off, count - off, is64);
+    if (reclen < 0) {
+      break;
+    }
+    off += reclen;
+    od->pos++;
+  }
+  r = (off == 0 && od->pos < od->list.n) ? -LINUX_EINVAL : (int) off;
+  pthread_mutex_unlock(&od->lock);
+  return r;
+}
+
+static int
+ovl_dir_lseek(struct file *file, l_off_t offset, int whence)
+{
+  struct ovl_dir *od = file->private_data;
+  if (whence != SEEK_SET || offset < 0) {
+    return -LINUX_EINVAL;
+  }
+  pthread_mutex_lock(&od->lock);
+  od->pos = offset;
+  if (offset == 0) {
+    /* rewinddir(3) sees a fresh listing */
+    dirlist_free(&od->list);
+    od->loaded = false;
+  }
+  pthread_mutex_unlock(&od->lock);
+  return offset;
+}
+
+static int
+ovl_dir_close(struct file *file)
+{
+  struct ovl_dir *od = file->private_data;
+  if (atomic_fetch_sub(&od->refcount, 1) == 1) {
+    dirlist_free(&od->list);
+    pthread_mutex_destroy(&od->lock);
+    free(od->rel);
+    free(od);
+  }
+  return syswrap(close(file->fd));
+}
+
+static void
+ovl_dir_dup(struct file *file)
+{
+  struct ovl_dir *od = file->private_data;
+  atomic_fetch_add(&od->refcount, 1);
+}
+
+static struct file_operations ovl_dir_ops = {
+  .readv = darwinfs_readv,
+  .writev = darwinfs_writev,
+  .close = ovl_dir_close,
+  .ioctl = darwinfs_ioctl,
+  .lseek = ovl_dir_lseek,
+  .getdents = ovl_dir_getdents,
+  .fcntl = darwinfs_fcntl,
+  .fsync = darwinfs_fsync,
+  .fstat = darwinfs_fstat,
+  .fstatfs = darwinfs_fstatfs,
+  .fchown = darwinfs_fchown,
+  .fchmod = darwinfs_fchmod,
+  .dup = ovl_dir_dup,
+};
+
+/*
+ * fs operations
+ */
+
+#define OVL(fs) ((struct overlay *) (fs))
+
+static int
+ovl_openat(struct fs *fs, struct dir *dir, const char *path, int l_flags, int mode)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_openat(fs, dir, path, l_flags, mode);
+  }
+  int flags = linux_to_darwin_o_flags(l_flags);
+  struct stat st;
+  int layer = ovl_lookup(ovl, rel, &st);
+  int r;
+
+  if (layer == OVL_NONE) {
+    if ((l_flags & LINUX_O_CREAT) == 0) {
+      return -LINUX_ENOENT;
+    }
+    bool wh;
+    if ((r = ovl_prepare_create(ovl, rel, &wh)) < 0) {
+      return r;
+    }
+    r = syswrap(openat(ovl->upperfd, rel, flags, mode));
+    if (r < 0 && wh) {
+      ovl_whiteout(ovl, rel);
+    }
+    return r;
+  }
+  bool write = (l_flags & LINUX_O_ACCMODE) != LINUX_O_RDONLY || (l_flags & LINUX_O_TRUNC);
+  if (layer == OVL_LOWER && write && !(l_flags & LINUX_O_PATH) && !S_ISDIR(st.st_mode)) {
+    if ((r = ovl_copy_up(ovl, rel)) < 0) {
+      return r;
+    }
+    layer = OVL_UPPER;
+  }
+  return syswrap(openat(ovl_layerfd(ovl, layer), rel, flags, mode));
+}
+
+static int
+ovl_symlinkat(struct fs *fs, const char *target, struct dir *dir, const char *name)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, name, rel)) {
+    return darwinfs_symlinkat(fs, target, dir, name);
+  }
+  if (ovl_lookup(ovl, rel, NULL) != OVL_NONE) {
+    return -LINUX_EEXIST;
+  }
+  bool wh;
+  int r = ovl_prepare_create(ovl, rel, &wh);
+  if (r < 0) {
+    return r;
+  }
+  r = syswrap(symlinkat(target, ovl->upperfd, rel));
+  if (r < 0 && wh) {
+    ovl_whiteout(ovl, rel);
+  }
+  return r;
+}
+
+static int
+ovl_faccessat(struct fs *fs, struct dir *dir, const char *path, int mode)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_faccessat(fs, dir, path, mode);
+  }
+  int layer = ovl_lookup(ovl, rel, NULL);
+  if (layer == OVL_NONE) {
+    return -LINUX_ENOENT;
+  }
+  return syswrap(faccessat(ovl_layerfd(ovl, layer), rel, mode, 0));
+}
+
+static int
+ovl_renameat(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel1[LINUX_PATH_MAX], rel2[LINUX_PATH_MAX];
+  bool in1 = ovl_relpath(ovl, dir1, from, rel1);
+  bool in2 = ovl_relpath(ovl, dir2, to, rel2);
+  if (!in1 && !in2) {
+    return darwinfs_renameat(fs, dir1, from, dir2, to);
+  }
+  if (!in1 || !in2) {
+    return -LINUX_EXDEV;
+  }
+
+  struct stat st1, st2;
+  if (ovl_lookup(ovl, rel1, &st1) == OVL_NONE) {
+    return -LINUX_ENOENT;
+  }
+  bool lower1 = ovl_has_lower(ovl, rel1);
+  /* like linux's overlayfs without redirect_dir; mv(1) falls back to copying */
+  if (S_ISDIR(st1.st_mode) && lower1) {
+    return -LINUX_EXDEV;
+  }
+  if (ovl_lookup(ovl, rel2, &st2) != OVL_NONE && S_ISDIR(st2.st_mode)) {
+    if (!S_ISDIR(st1.st_mode)) {
+      return -LINUX_EISDIR;
+    }
+    int r = ovl_check_empty(ovl, rel2);
+    if (r < 0) {
+      return r;
+    }
+    if (ovl_has_lower(ovl, rel2)) {
+      return -LINUX_EXDEV;
+    }
+  }
+
+  int r = ovl_copy_up(ovl, rel1);
+  if (r < 0) {
+    return r;
+  }
+  bool wh;
+  if ((r = ovl_prepare_create(ovl, rel2, &wh)) < 0) {
+    return r;
+  }
+  r = syswrap(renameat(ovl->upperfd, rel1, ovl->upperfd, rel2));
+  if (r < 0) {
+    if (wh) {
+      ovl_whiteout(ovl, rel2);
+    }
+    return r;
+  }
+  if (wh && S_ISDIR(st1.st_mode)) {
+    ovl_make_opaque(ovl, rel2);
+  }
+  if (lower1) {
+    return ovl_whiteout(ovl, rel1);
+  }
+  return 0;
+}
+
+static int
+ovl_linkat(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to, int l_flags)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel1[LINUX_PATH_MAX], rel2[LINUX_PATH_MAX];
+  bool in1 = ovl_relpath(ovl, dir1, from, rel1);
+  bool in2 = ovl_relpath(ovl, dir2, to, rel2);
+  if (!in1 && !in2) {
+    return darwinfs_linkat(fs, dir1, from, dir2, to, l_flags);
+  }
+  if (!in1 || !in2) {
+    return -LINUX_EXDEV;
+  }
+  if (ovl_lookup(ovl, rel1, NULL) == OVL_NONE) {
+    return -LINUX_ENOENT;
+  }
+  if (ovl_lookup(ovl, rel2, NULL) != OVL_NONE) {
+    return -LINUX_EEXIST;
+  }
+  int r = ovl_copy_up(ovl, rel1);
+  if (r < 0) {
+    return r;
+  }
+  bool wh;
+  if ((r = ovl_prepare_create(ovl, rel2, &wh)) < 0) {
+    return r;
+  }
+  r = syswrap(linkat(ovl->upperfd, rel1, ovl->upperfd, rel2, linux_to_darwin_at_flags(l_flags)));
+  if (r < 0 && wh) {
+    ovl_whiteout(ovl, rel2);
+  }
+  return r;
+}
+
+static int
+ovl_unlinkat(struct fs *fs, struct dir *dir, const char *path, int l_flags)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_unlinkat(fs, dir, path, l_flags);
+  }
+  int flags = linux_to_darwin_at_flags(l_flags);
+  /* see darwinfs_unlinkat */
+  if (flags & AT_EACCESS) {
+    flags &= ~AT_EACCESS;
+    flags |= AT_REMOVEDIR;
+  }
+  bool rmdir = flags & AT_REMOVEDIR;
+
+  struct stat st;
+  int layer = ovl_lookup(ovl, rel, &st);
+  if (layer == OVL_NONE) {
+    return -LINUX_ENOENT;
+  }
+  if (rmdir && !S_ISDIR(st.st_mode)) {
+    return -LINUX_ENOTDIR;
+  }
+  if (!rmdir && S_ISDIR(st.st_mode)) {
+    return -LINUX_EISDIR;
+  }
+  int r;
+  if (rmdir && (r = ovl_check_empty(ovl, rel)) < 0) {
+    return r;
+  }
+  bool lower = ovl_has_lower(ovl, rel);
+  if (layer == OVL_UPPER) {
+    if (rmdir) {
+      ovl_clear_dir(ovl, rel);
+    }
+    if ((r = syswrap(unlinkat(ovl->upperfd, rel, flags))) < 0) {
+      return r;
+    }
+  }
+  if (lower) {
+    return ovl_whiteout(ovl, rel);
+  }
+  return 0;
+}
+
+static int
+ovl_readlinkat(struct fs *fs, struct dir *dir, const char *path, char *buf, int bufsize)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_readlinkat(fs, dir, path, buf, bufsize);
+  }
+  int layer = ovl_lookup(ovl, rel, NULL);
+  if (layer == OVL_NONE) {
+    return -LINUX_ENOENT;
+  }
+  return syswrap(readlinkat(ovl_layerfd(ovl, layer), rel, buf, bufsize));
+}
+
+static int
+ovl_mkdirat(struct fs *fs, struct dir *dir, const char *path, int mode)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_mkdirat(fs, dir, path, mode);
+  }
+  if (ovl_lookup(ovl, rel, NULL) != OVL_NONE) {
+    return -LINUX_EEXIST;
+  }
+  bool wh;
+  int r = ovl_prepare_create(ovl, rel, &wh);
+  if (r < 0) {
+    return r;
+  }
+  if ((r = syswrap(mkdirat(ovl->upperfd, rel, mode))) < 0) {
+    if (wh) {
+      ovl_whiteout(ovl, rel);
+    }
+    return r;
+  }
+  /* a directory replacing a removed one must not show the old contents */
+  if (wh) {
+    ovl_make_opaque(ovl, rel);
+  }
+  return 0;
+}
+
+static int
+ovl_fstatat(struct fs *fs, struct dir *dir, const char *path, struct l_newstat *l_st, int l_flags)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_fstatat(fs, dir, path, l_st, l_flags);
+  }
+  int layer = ovl_lookup(ovl, rel, NULL);
+  if (layer == OVL_NONE) {
+    return -LINUX_ENOENT;
+  }
+  struct dir d = { ovl_layerfd(ovl, layer) };
+  return darwinfs_fstatat(fs, &d, rel, l_st, l_flags);
+}
+
+static int
+ovl_statfs(struct fs *fs, struct dir *dir, const char *path, struct l_statfs *buf)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_statfs(fs, dir, path, buf);
+  }
+  int layer = ovl_lookup(ovl, rel, NULL);
+  if (layer == OVL_NONE) {
+    return -LINUX_ENOENT;
+  }
+  struct dir d = { ovl_layerfd(ovl, layer) };
+  return darwinfs_statfs(fs, &d, rel, buf);
+}
+
+static int
+ovl_fchownat(struct fs *fs, struct dir *dir, const char *path, l_uid_t uid, l_gid_t gid, int l_flags)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_fchownat(fs, dir, path, uid, gid, l_flags);
+  }
+  int r = ovl_copy_up(ovl, rel);
+  if (r < 0) {
+    return r;
+  }
+  struct dir d = { ovl->upperfd };
+  return darwinfs_fchownat(fs, &d, rel, uid, gid, l_flags);
+}
+
+static int
+ovl_fchmodat(struct fs *fs, struct dir *dir, const char *path, l_mode_t mode)
+{
+  struct overlay *ovl = OVL(fs);
+  char rel[LINUX_PATH_MAX];
+  if (!ovl_relpath(ovl, dir, path, rel)) {
+    return darwinfs_fchmodat(fs, dir, path, mode);
+  }
+  int r = ovl_copy_up(ovl, rel);
+  if (r < 0) {
+    return r;
+  }
+  struct dir d = { ovl->upperfd };
+  return darwinfs_fchmodat(fs, &d, rel, mode);
+}
+
+/* directories that exist in both layers are listed through ovl_dir_ops */
+static void
+ovl_init_file(struct fs *fs, struct file *file, const char *path)
+{
+  struct overlay *ovl = OVL(fs);
+  struct stat st;
+  char host[PATH_MAX], base[PATH_MAX], rel[LINUX_PATH_MAX];
+
+  if (fstat(file->fd, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    return;
+  }
+  if (fcntl(file->fd, F_GETPATH, host) < 0 || !strip_prefix(host, ovl->upper, base)) {
+    /* a directory only in the lower layer contains no whiteouts */
+    return;
+  }
+  if (join_path(base, "", rel) < 0) {
+    return;
+  }
+  if (!exists_at(ovl->lowerfd, rel) && !is_opaque(ovl, rel)) {
+    return;
+  }
+  struct ovl_dir *od = calloc(1, sizeof *od);
+  od->refcount = ATOMIC_VAR_INIT(1);
+  pthread_mutex_init(&od->lock, NULL);
+  od->ovl = ovl;
+  od->rel = strdup(rel);
+  file->ops = &ovl_dir_ops;
+  file->private_data = od;
+}
+
+static struct fs_operations overlay_ops = {
+  ovl_openat,
+  ovl_symlinkat,
+  ovl_faccessat,
+  ovl_renameat,
+  ovl_linkat,
+  ovl_unlinkat,
+  ovl_readlinkat,
+  ovl_mkdirat,
+  ovl_fstatat,
+  ovl_statfs,
+  ovl_fchownat,
+  ovl_fchmodat,
+  ovl_init_file,
+};
+
+/* stack a writable upper directory on the current root; called once at startup */
+int
+init_overlay(const char *upper)
+{
+  struct overlay *ovl = calloc(1, sizeof *ovl);
+  ovl->fs.ops = &overlay_ops;
+  ovl->lowerfd = proc.fileinfo.rootfd;
+  if (fcntl(ovl->lowerfd, F_GETPATH, ovl->lower) < 0) {
+    goto fail;
+  }
+  if (mkdir(upper, 0755) < 0 && errno != EEXIST) {
+    goto fail;
+  }
+  if (realpath(upper, ovl->upper) == NULL) {
+    goto fail;
+  }
+  if (strcmp(ovl->lower, ovl->upper) == 0) {
+    errno = EINVAL;
+    goto fail;
+  }
+  int fd = open(ovl->upper, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    goto fail;
+  }
+  ovl->upperfd = vkern_dup_fd(fd, false);
+  close(fd);
+  proc.fileinfo.rootfs = &ovl->fs;
+  return 0;
+
+fail:
+  free(ovl);
+  return -1;
+}
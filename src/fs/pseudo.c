@@ -0,0 +1,246 @@
+#include "common.h"
+#include "noah.h"
+#include "fs.h"
+
+#include "linux/common.h"
+#include "linux/time.h"
+#include "linux/fs.h"
+#include "linux/errno.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/*
+ * Read-only files synthesized by noah, for the parts of procfs and sysfs that
+ * programs read to learn about the machine. They shadow the same paths under
+ * the guest root. The content is generated on each open into an unlinked
+ * temporary file, so the returned fd is an ordinary host file and is handled
+ * by darwinfs_ops from then on.
+ */
+
+struct pseudo_file {
+  const char *path;
+  void (*generate)(FILE *out);
+};
+
+static void
+print_cpu_range(FILE *out, int nr)
+{
+  if (nr > 1) {
+    fprintf(out, "0-%d\n", nr - 1);
+  } else {
+    fprintf(out, "0\n");
+  }
+}
+
+static void
+gen_cpu_online(FILE *out)
+{
+  print_cpu_range(out, host_cpu_topology()->nr_online);
+}
+
+static void
+gen_cpu_possible(FILE *out)
+{
+  print_cpu_range(out, host_cpu_topology()->nr_possible);
+}
+
+static void
+gen_cpuinfo(FILE *out)
+{
+  const struct cpu_topology *t = host_cpu_topology();
+  int per_package = MAX(t->nr_online / t->nr_packages, 1);
+  int cores_per_package = MAX(t->nr_cores / t->nr_packages, 1);
+  int threads_per_core = MAX(per_package / cores_per_package, 1);
+  double mhz = t->freq / 1e6;
+
+  for (int i = 0; i < t->nr_online; i++) {
+    fprintf(out, "processor\t: %d\n", i);
+    fprintf(out, "vendor_id\t: %s\n", t->vendor);
+    fprintf(out, "cpu family\t: %d\n", t->family);
+    fprintf(out, "model\t\t: %d\n", t->model);
+    fprintf(out, "model name\t: %s\n", t->brand);
+    fprintf(out, "stepping\t: %d\n", t->stepping);
+    fprintf(out, "cpu MHz\t\t: %.3f\n", mhz);
+    fprintf(out, "cache size\t: %llu KB\n", (unsigned long long) t->cache_size / 1024);
+    fprintf(out, "physical id\t: %d\n", i / per_package);
+    fprintf(out, "siblings\t: %d\n", per_package);
+    fprintf(out, "core id\t\t: %d\n", i % per_package / threads_per_core);
+    fprintf(out, "cpu cores\t: %d\n", cores_per_package);
+    fprintf(out, "apicid\t\t: %d\n", i);
+    fprintf(out, "fpu\t\t: yes\n");
+    fprintf(out, "fpu_exception\t: yes\n");
+    fprintf(out, "wp\t\t: yes\n");
+    fprintf(out, "flags\t\t: %s\n", t->features);
+    fprintf(out, "bogomips\t: %.2f\n", mhz * 2);
+    fprintf(out, "clflush size\t: 64\n");
+    fprintf(out, "cache_alignment\t: 64\n");
+    fprintf(out, "address sizes\t: 39 bits physical, 48 bits virtual\n");
+    fprintf(out, "power management:\n\n");
+  }
+}
+
+static const struct pseudo_file pseudo_files[] = {
+  {"/proc/cpuinfo", gen_cpuinfo},
+  {"/sys/devices/system/cpu/online", gen_cpu_online},
+  {"/sys/devices/system/cpu/possible", gen_cpu_possible},
+  {"/sys/devices/system/cpu/present", gen_cpu_online},
+};
+
+static const struct pseudo_file *
+find_pseudo_file(const char *path)
+{
+  for (size_t i = 0; i < sizeof pseudo_files / sizeof pseudo_files[0]; i++) {
+    if (strcmp(path, pseudo_files[i].path) == 0) {
+      return &pseudo_files[i];
+    }
+  }
+  return NULL;
+}
+
+bool
+is_pseudo_file(const char *path)
+{
+  return find_pseudo_file(path) != NULL;
+}
+
+static int
+pseudo_openat(struct fs *fs, struct dir *dir, const char *path, int l_flags, int mode)
+{
+  const struct pseudo_file *pf = find_pseudo_file(path);
+  if (pf == NULL)
+    return -LINUX_ENOENT;
+  if ((l_flags & LINUX_O_ACCMODE) != LINUX_O_RDONLY)
+    return -LINUX_EACCES;
+
+  char tmpl[] = "/tmp/noah-pseudo.XXXXXX";
+  int wfd = mkstemp(tmpl);
+  if (wfd < 0)
+    return -darwin_to_linux_errno(errno);
+  int fd = open(tmpl, O_RDONLY);
+  unlink(tmpl);
+  if (fd < 0) {
+    int err = errno;
+    close(wfd);
+    return -darwin_to_linux_errno(err);
+  }
+  FILE *out = fdopen(wfd, "w");
+  pf->generate(out);
+  fclose(out);
+  return fd;
+}
+
+static int
+pseudo_symlinkat(struct fs *fs, const char *target, struct dir *dir, const char *name)
+{
+  return -LINUX_EEXIST;
+}
+
+static int
+pseudo_faccessat(struct fs *fs, struct dir *dir, const char *path, int mode)
+{
+  if (mode & (W_OK | X_OK))
+    return -LINUX_EACCES;
+  return 0;
+}
+
+static int
+pseudo_renameat(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to)
+{
+  return -LINUX_EACCES;
+}
+
+static int
+pseudo_linkat(struct fs *fs, struct dir *dir1, const char *from, struct dir *dir2, const char *to, int l_flags)
+{
+  return -LINUX_EACCES;
+}
+
+static int
+pseudo_unlinkat(struct fs *fs, struct dir *dir, const char *path, int l_flags)
+{
+  return -LINUX_EACCES;
+}
+
+static int
+pseudo_readlinkat(struct fs *fs, struct dir *dir, const char *path, char *buf, int bufsize)
+{
+  return -LINUX_EINVAL;
+}
+
+static int
+pseudo_mkdirat(struct fs *fs, struct dir *dir, const char *path, int mode)
+{
+  return -LINUX_EEXIST;
+}
+
+static int
+pseudo_fstatat(struct fs *fs, struct dir *dir, const char *path, struct l_newstat *l_st, int l_flags)
+{
+  /* like procfs, the size is not known until the file is read */
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  *l_st = (struct l_newstat) {
+    .st_ino = find_pseudo_file(path) - pseudo_files + 1,
+    .st_nlink = 1,
+    .st_mode = S_IFREG | 0444,
+    .st_blksize = 4096,
+    .st_atim = { now.tv_sec, now.tv_nsec },
+    .st_mtim = { now.tv_sec, now.tv_nsec },
+    .st_ctim = { now.tv_sec, now.tv_nsec },
+  };
+  return 0;
+}
+
+#define PROC_SUPER_MAGIC 0x9fa0
+
+static int
+pseudo_statfs(struct fs *fs, struct dir *dir, const char *path, struct l_statfs *buf)
+{
+  *buf = (struct l_statfs) {
+    .f_type = PROC_SUPER_MAGIC,
+    .f_bsize = 4096,
+    .f_namelen = 255,
+    .f_frsize = 4096,
+  };
+  return 0;
+}
+
+static int
+pseudo_fchownat(struct fs *fs, struct dir *dir, const char *path, l_uid_t uid, l_gid_t gid, int l_flags)
+{
+  return -LINUX_EPERM;
+}
+
+static int
+pseudo_fchmodat(struct fs *fs, struct dir *dir, const char *path, l_mode_t mode)
+{
+  return -LINUX_EPERM;
+}
+
+static struct fs_operations pseudofs_ops = {
+  pseudo_openat,
+  pseudo_symlinkat,
+  pseudo_faccessat,
+  pseudo_renameat,
+  pseudo_linkat,
+  pseudo_unlinkat,
+  pseudo_readlinkat,
+  pseudo_mkdirat,
+  pseudo_fstatat,
+  pseudo_statfs,
+  pseudo_fchownat,
+  pseudo_fchmodat,
+  NULL,
+};
+
+struct fs pseudofs = {
+  .ops = &pseudofs_ops,
+};
@@ -69,6 +69,25 @@ do_futex_wake(gaddr_t uaddr, int count)
   return ret;
 }
 
+/* wake every waiter spuriously; used to bring all threads to a safe point */
+void
+futex_interrupt_waiters(void)
+{
+  pthread_mutex_lock(&proc.futex_mutex);
+  khiter_t k;
+  for (k = kh_begin(proc.pfutex); k != kh_end(proc.pfutex); k++) {
+    if (!kh_exist(proc.pfutex, k))
+      continue;
+    struct list_head *p, *n, *head = kh_value(proc.pfutex, k);
+    list_for_each_safe (p, n, head) {
+      struct pfutex_entry *entry = container_of(p, struct pfutex_entry, head);
+      list_del_init(p);
+      pthread_cond_signal(&entry->cond);
+    }
+  }
+  pthread_mutex_unlock(&proc.futex_mutex);
+}
+
 static int
 __cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, bool use_timeout, struct timespec *ts)
 {
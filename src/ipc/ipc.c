@@ -0,0 +1,88 @@
+#include "common.h"
+#include "noah.h"
+#include "linux/common.h"
+#include "linux/ipc.h"
+
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ * Pieces shared by the SysV IPC objects noah keeps in the shared arena
+ * (sem.c and shm.c).
+ */
+
+void
+init_ipc(void)
+{
+  init_sem();
+  init_shm();
+}
+
+/* called by a process on its way out */
+void
+exit_ipc(void)
+{
+  exit_sem();
+  exit_shm();
+}
+
+/* for the locks that live in the arena and are taken by several processes */
+void
+init_shared_mutex(pthread_mutex_t *mutex)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+static l_uid_t
+current_euid(void)
+{
+  pthread_rwlock_rdlock(&proc.cred.lock);
+  l_uid_t euid = proc.cred.euid;
+  pthread_rwlock_unlock(&proc.cred.lock);
+  return euid;
+}
+
+/* flag holds rwx bits in any of the three positions, as ipcperms in Linux */
+bool
+ipc_permitted(const struct l_ipc64_perm *perm, int flag)
+{
+  l_uid_t euid = current_euid();
+  if (euid == 0)
+    return true;
+  int requested = (flag >> 6 | flag >> 3 | flag) & 7;
+  int granted = perm->mode;
+  if (euid == perm->uid || euid == perm->cuid) {
+    granted >>= 6;
+  } else if (getegid() == perm->gid || getegid() == perm->cgid) {
+    granted >>= 3;
+  }
+  return (requested & ~granted & 7) == 0;
+}
+
+bool
+ipc_owner(const struct l_ipc64_perm *perm)
+{
+  l_uid_t euid = current_euid();
+  return euid == 0 || euid == perm->uid || euid == perm->cuid;
+}
+
+/* a new object is owned by the caller */
+void
+init_ipc_perm(struct l_ipc64_perm *perm, l_key_t key, int mode, unsigned short seq)
+{
+  l_uid_t euid = current_euid();
+  *perm = (struct l_ipc64_perm) {
+    .key = key,
+    .uid = euid,
+    .gid = getegid(),
+    .cuid = euid,
+    .cgid = getegid(),
+    .mode = mode & 0777,
+    .seq = seq,
+  };
+}
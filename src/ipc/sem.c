@@ -2,71 +2,733 @@
 #include "noah.h"
 #include "mm.h"
 #include "linux/common.h"
-#include "linux/futex.h"
+#include "linux/errno.h"
 #include "linux/time.h"
 #include "linux/ipc.h"
 
-#include <assert.h>
-#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <sys/time.h>
-#include <sys/ipc.h>
-#include <sys/sem.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-int
-linux_to_darwin_semflg(int l_semflg)
+/*
+ * SysV semaphores are kept by noah instead of being forwarded to the host.
+ * The sets live in the shared malloc arena, so every process forked from the
+ * same boot sees the same namespace. An operation takes the set's
+ * process-shared mutex, which stays in user space unless contended, and a
+ * caller that has to block sleeps on the set's sequence word with the host's
+ * futex-like ulock. Wakeups are only issued when somebody sleeps.
+ */
+
+/* from xnu's sys/ulock.h, which is not installed */
+extern int __ulock_wait(uint32_t operation, void *addr, uint64_t value, uint32_t timeout_us);
+extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
+#define UL_COMPARE_AND_WAIT_SHARED 3
+#define ULF_WAKE_ALL               0x00000100
+
+#define SEMMNI 4096                /* sets */
+#define SEMMSL 32000               /* semaphores per set */
+#define SEMMNS (SEMMNI * SEMMSL)   /* semaphores in total */
+#define SEMOPM 500                 /* operations per semop */
+#define SEMVMX 32767               /* semaphore value */
+#define SEMAEM SEMVMX              /* adjustment on exit */
+#define SEMUSZ 20
+#define IPCMNI 32768               /* an id is its index plus seq * IPCMNI */
+
+/* a signal that lands between the pending check and the sleep is noticed this late at worst */
+#define SEM_SLEEP_SLICE_US 100000
+
+struct sem {
+  int semval;
+  l_pid_t sempid;
+  int ncnt;                     /* sleepers waiting for the value to grow */
+  int zcnt;                     /* sleepers waiting for the value to be zero */
+};
+
+/* SEM_UNDO adjustments of one process, applied when it exits */
+struct sem_undo {
+  struct sem_undo *next;
+  l_pid_t pid;
+  int adj[];
+};
+
+struct sem_array {
+  pthread_mutex_t lock;
+  _Atomic uint32_t seq;         /* the word the sleepers wait on */
+  int nr_sleepers;
+  int refs;                     /* the sleepers keep a removed set alive */
+  bool removed;
+  int id;
+  struct l_ipc64_perm perm;
+  time_t otime, ctime;
+  int nsems;
+  struct sem_undo *undo;
+  struct sem sems[];
+};
+
+struct sem_ns {
+  pthread_mutex_t lock;
+  unsigned short seq;
+  int nr_sets;
+  int nr_sems;
+  struct sem_array *sets[SEMMNI];
+};
+
+static struct sem_ns *sem_ns;   /* in the arena; set up before the first fork */
+
+void
+init_sem(void)
 {
-  int d_semflg = 0;
-  if (l_semflg & LINUX_IPC_CREAT) {
-    l_semflg &= ~LINUX_IPC_CREAT;
-    d_semflg |= IPC_CREAT;
+  sem_ns = shm_malloc(sizeof *sem_ns);
+  if (sem_ns == NULL) {
+    panic("init_sem: out of shared memory");
   }
-  if (l_semflg & LINUX_IPC_EXCL) {
-    l_semflg &= ~LINUX_IPC_EXCL;
-    d_semflg |= IPC_EXCL;
+  memset(sem_ns, 0, sizeof *sem_ns);
+  init_shared_mutex(&sem_ns->lock);
+}
+
+/*
+ * Sets and undo records may have been allocated by another process, past the
+ * part of the arena this one has committed, so the arena is caught up after
+ * taking the lock that publishes them.
+ */
+static void
+lock_ns(void)
+{
+  pthread_mutex_lock(&sem_ns->lock);
+  shm_commit();
+}
+
+static void
+lock_sma(struct sem_array *sma)
+{
+  pthread_mutex_lock(&sma->lock);
+  shm_commit();
+}
+
+/* Returns the set locked. With keep_ns, sem_ns->lock stays held as well. */
+static struct sem_array *
+lock_set(int semid, bool keep_ns)
+{
+  if (semid < 0 || semid % IPCMNI >= SEMMNI)
+    return NULL;
+  lock_ns();
+  struct sem_array *sma = sem_ns->sets[semid % IPCMNI];
+  if (sma == NULL || sma->id != semid) {
+    pthread_mutex_unlock(&sem_ns->lock);
+    return NULL;
+  }
+  lock_sma(sma);
+  if (!keep_ns) {
+    pthread_mutex_unlock(&sem_ns->lock);
+  }
+  return sma;
+}
+
+static void
+free_set(struct sem_array *sma)
+{
+  struct sem_undo *un = sma->undo;
+  while (un != NULL) {
+    struct sem_undo *next = un->next;
+    shm_free(un);
+    un = next;
+  }
+  pthread_mutex_destroy(&sma->lock);
+  shm_free(sma);
+}
+
+static void
+wake_sleepers(struct sem_array *sma)
+{
+  if (sma->nr_sleepers == 0)
+    return;
+  atomic_fetch_add(&sma->seq, 1);
+  __ulock_wake(UL_COMPARE_AND_WAIT_SHARED | ULF_WAKE_ALL, (void *) &sma->seq, 0);
+}
+
+static struct sem_undo *
+find_undo(struct sem_array *sma, l_pid_t pid, bool create)
+{
+  struct sem_undo *un;
+  for (un = sma->undo; un != NULL; un = un->next) {
+    if (un->pid == pid)
+      return un;
   }
-  if (l_semflg & LINUX_IPC_NOWAIT) {
-    l_semflg &= ~LINUX_IPC_NOWAIT;
-    d_semflg |= IPC_NOWAIT;
+  if (!create)
+    return NULL;
+  un = shm_malloc(sizeof *un + sizeof un->adj[0] * sma->nsems);
+  if (un == NULL)
+    return NULL;
+  memset(un, 0, sizeof *un + sizeof un->adj[0] * sma->nsems);
+  un->pid = pid;
+  un->next = sma->undo;
+  sma->undo = un;
+  return un;
+}
+
+/* called with both sem_ns->lock and sma->lock held; drops sma->lock */
+static void
+remove_set(struct sem_array *sma)
+{
+  sem_ns->sets[sma->id % IPCMNI] = NULL;
+  sem_ns->nr_sets--;
+  sem_ns->nr_sems -= sma->nsems;
+  sma->removed = true;
+  wake_sleepers(sma);
+  bool unused = sma->refs == 0;
+  pthread_mutex_unlock(&sma->lock);
+  if (unused) {
+    free_set(sma);
   }
-  assert(l_semflg == 0);
-  return d_semflg;
+}
+
+/* called with sem_ns->lock held */
+static int
+new_set(l_key_t key, int nsems, int semflg)
+{
+  if (nsems == 0)
+    return -LINUX_EINVAL;
+  if (sem_ns->nr_sets == SEMMNI || sem_ns->nr_sems + nsems > SEMMNS)
+    return -LINUX_ENOSPC;
+
+  int idx;
+  for (idx = 0; sem_ns->sets[idx] != NULL; idx++)
+    ;
+  struct sem_array *sma = shm_malloc(sizeof *sma + sizeof sma->sems[0] * nsems);
+  if (sma == NULL)
+    return -LINUX_ENOMEM;
+  memset(sma, 0, sizeof *sma + sizeof sma->sems[0] * nsems);
+  init_shared_mutex(&sma->lock);
+
+  init_ipc_perm(&sma->perm, key, semflg, sem_ns->seq);
+  sem_ns->seq = (sem_ns->seq + 1) % (INT32_MAX / IPCMNI);
+  sma->id = sma->perm.seq * IPCMNI + idx;
+  sma->nsems = nsems;
+  sma->ctime = time(NULL);
+
+  sem_ns->sets[idx] = sma;
+  sem_ns->nr_sets++;
+  sem_ns->nr_sems += nsems;
+  return sma->id;
 }
 
 DEFINE_SYSCALL(semget, l_key_t, key, int, nsems, int, semflg)
 {
-  return syswrap(semget(key | IPC_PRIVATE, nsems, linux_to_darwin_semflg(semflg)));
+  if (nsems < 0 || nsems > SEMMSL)
+    return -LINUX_EINVAL;
+
+  int ret;
+  lock_ns();
+  if (key != LINUX_IPC_PRIVATE) {
+    for (int i = 0; i < SEMMNI; i++) {
+      struct sem_array *sma = sem_ns->sets[i];
+      if (sma == NULL || sma->perm.key != key)
+        continue;
+      if ((semflg & LINUX_IPC_CREAT) && (semflg & LINUX_IPC_EXCL)) {
+        ret = -LINUX_EEXIST;
+      } else if (nsems > sma->nsems) {
+        ret = -LINUX_EINVAL;
+      } else if (!ipc_permitted(&sma->perm, semflg & 0777)) {
+        ret = -LINUX_EACCES;
+      } else {
+        ret = sma->id;
+      }
+      goto out;
+    }
+    if (!(semflg & LINUX_IPC_CREAT)) {
+      ret = -LINUX_ENOENT;
+      goto out;
+    }
+  }
+  ret = new_set(key, nsems, semflg);
+ out:
+  pthread_mutex_unlock(&sem_ns->lock);
+  return ret;
+}
+
+/*
+ * Applies the operations in order, all or nothing. Returns 0 when they are
+ * done, 1 when sops[*blocked] has to wait, or an error.
+ */
+static int
+try_semop(struct sem_array *sma, struct l_sembuf *sops, unsigned nsops, int *blocked)
+{
+  l_pid_t pid = getpid();
+  struct sem_undo *un = NULL;
+  bool changed = false;
+  int ret = 0;
+  unsigned i;
+
+  for (i = 0; i < nsops; i++) {
+    if ((sops[i].sem_flg & LINUX_SEM_UNDO) && sops[i].sem_op != 0) {
+      if ((un = find_undo(sma, pid, true)) == NULL)
+        return -LINUX_ENOMEM;
+      break;
+    }
+  }
+
+  for (i = 0; i < nsops; i++) {
+    struct l_sembuf *op = &sops[i];
+    struct sem *sem = &sma->sems[op->sem_num];
+    int val = sem->semval + op->sem_op;
+    if ((op->sem_op == 0 && sem->semval != 0) || val < 0) {
+      *blocked = i;
+      ret = 1;
+      goto rollback;
+    }
+    if (val > SEMVMX) {
+      ret = -LINUX_ERANGE;
+      goto rollback;
+    }
+    if ((op->sem_flg & LINUX_SEM_UNDO) && op->sem_op != 0) {
+      int adj = un->adj[op->sem_num] - op->sem_op;
+      if (adj < -SEMAEM - 1 || adj > SEMAEM) {
+        ret = -LINUX_ERANGE;
+        goto rollback;
+      }
+      un->adj[op->sem_num] = adj;
+    }
+    sem->semval = val;
+    changed |= op->sem_op != 0;
+  }
+
+  for (i = 0; i < nsops; i++) {
+    sma->sems[sops[i].sem_num].sempid = pid;
+  }
+  sma->otime = time(NULL);
+  if (changed) {
+    wake_sleepers(sma);
+  }
+  return 0;
+
+ rollback:
+  while (i-- > 0) {
+    struct l_sembuf *op = &sops[i];
+    sma->sems[op->sem_num].semval -= op->sem_op;
+    if ((op->sem_flg & LINUX_SEM_UNDO) && op->sem_op != 0) {
+      un->adj[op->sem_num] += op->sem_op;
+    }
+  }
+  return ret;
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+do_semtimedop(int semid, gaddr_t tsops_ptr, unsigned nsops, gaddr_t timeout_ptr)
+{
+  struct l_sembuf sops[SEMOPM];
+
+  if (semid < 0 || nsops < 1)
+    return -LINUX_EINVAL;
+  if (nsops > SEMOPM)
+    return -LINUX_E2BIG;
+  if (copy_from_user(sops, tsops_ptr, sizeof sops[0] * nsops))
+    return -LINUX_EFAULT;
+
+  uint64_t deadline = 0;
+  if (timeout_ptr != 0) {
+    struct l_timespec ts;
+    if (copy_from_user(&ts, timeout_ptr, sizeof ts))
+      return -LINUX_EFAULT;
+    if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000)
+      return -LINUX_EINVAL;
+    deadline = monotonic_ns() + ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  int max_num = 0;
+  bool alter = false;
+  for (unsigned i = 0; i < nsops; i++) {
+    max_num = MAX(max_num, sops[i].sem_num);
+    alter |= sops[i].sem_op != 0;
+  }
+
+  struct sem_array *sma = lock_set(semid, false);
+  if (sma == NULL)
+    return -LINUX_EINVAL;
+
+  int ret;
+  if (max_num >= sma->nsems) {
+    ret = -LINUX_EFBIG;
+    goto out;
+  }
+  if (!ipc_permitted(&sma->perm, alter ? 0222 : 0444)) {
+    ret = -LINUX_EACCES;
+    goto out;
+  }
+
+  for (;;) {
+    int blocked;
+    if ((ret = try_semop(sma, sops, nsops, &blocked)) != 1)
+      break;
+    struct l_sembuf *op = &sops[blocked];
+    if (op->sem_flg & LINUX_IPC_NOWAIT) {
+      ret = -LINUX_EAGAIN;
+      break;
+    }
+    if (has_sigpending()) {
+      ret = -LINUX_EINTR;
+      break;
+    }
+    uint32_t slice = SEM_SLEEP_SLICE_US;
+    if (deadline) {
+      uint64_t now = monotonic_ns();
+      if (now >= deadline) {
+        ret = -LINUX_EAGAIN;
+        break;
+      }
+      slice = MIN(slice, (deadline - now + 999) / 1000);
+    }
+
+    struct sem *sem = &sma->sems[op->sem_num];
+    int *cnt = op->sem_op == 0 ? &sem->zcnt : &sem->ncnt;
+    (*cnt)++;
+    sma->nr_sleepers++;
+    sma->refs++;
+    uint32_t seq = atomic_load(&sma->seq);
+    pthread_mutex_unlock(&sma->lock);
+
+    int err = __ulock_wait(UL_COMPARE_AND_WAIT_SHARED, (void *) &sma->seq, seq, slice) < 0 ? errno : 0;
+
+    lock_sma(sma);
+    (*cnt)--;
+    sma->nr_sleepers--;
+    sma->refs--;
+    if (sma->removed) {
+      bool unused = sma->refs == 0;
+      pthread_mutex_unlock(&sma->lock);
+      if (unused) {
+        free_set(sma);
+      }
+      return -LINUX_EIDRM;
+    }
+    if (err == EINTR) {
+      /* a kick alone makes the syscall restart */
+      ret = -LINUX_EINTR;
+      break;
+    }
+  }
+ out:
+  pthread_mutex_unlock(&sma->lock);
+  return ret;
 }
 
 DEFINE_SYSCALL(semop, int, semid, gaddr_t, tsops_ptr, unsigned, nsops)
 {
-  struct l_sembuf *l_tsops = malloc(sizeof l_tsops[0] * nsops);
-  struct sembuf *tsops = malloc(sizeof tsops[0] * nsops);
-  int r = 0;
-  if (copy_from_user(&l_tsops, tsops_ptr, sizeof l_tsops[0] * nsops)) {
-    r = -LINUX_EFAULT;
+  return do_semtimedop(semid, tsops_ptr, nsops, 0);
+}
+
+DEFINE_SYSCALL(semtimedop, int, semid, gaddr_t, tsops_ptr, unsigned, nsops, gaddr_t, timeout_ptr)
+{
+  return do_semtimedop(semid, tsops_ptr, nsops, timeout_ptr);
+}
+
+static int
+sem_info(int cmd, gaddr_t buf_ptr)
+{
+  struct l_seminfo info = {
+    .semmap = SEMMNS,
+    .semmni = SEMMNI,
+    .semmns = SEMMNS,
+    .semmnu = SEMMNS,
+    .semmsl = SEMMSL,
+    .semopm = SEMOPM,
+    .semume = SEMOPM,
+    .semusz = SEMUSZ,
+    .semvmx = SEMVMX,
+    .semaem = SEMAEM,
+  };
+  int max_idx = 0;
+  lock_ns();
+  if (cmd == LINUX_SEM_INFO) {
+    info.semusz = sem_ns->nr_sets;
+    info.semaem = sem_ns->nr_sems;
+  }
+  for (int i = 0; i < SEMMNI; i++) {
+    if (sem_ns->sets[i] != NULL)
+      max_idx = i;
+  }
+  pthread_mutex_unlock(&sem_ns->lock);
+  if (copy_to_user(buf_ptr, &info, sizeof info))
+    return -LINUX_EFAULT;
+  return max_idx;
+}
+
+static void
+fill_semid_ds(struct sem_array *sma, struct l_semid64_ds *ds)
+{
+  *ds = (struct l_semid64_ds) {
+    .sem_perm = sma->perm,
+    .sem_otime = sma->otime,
+    .sem_ctime = sma->ctime,
+    .sem_nsems = sma->nsems,
+  };
+}
+
+/* IPC_STAT, and SEM_STAT and SEM_STAT_ANY that take an index instead of an id */
+static int
+sem_stat(int semid, int cmd, gaddr_t buf_ptr)
+{
+  struct sem_array *sma;
+  if (cmd == LINUX_IPC_STAT) {
+    sma = lock_set(semid, false);
+  } else {
+    if (semid < 0 || semid >= SEMMNI)
+      return -LINUX_EINVAL;
+    lock_ns();
+    sma = sem_ns->sets[semid];
+    if (sma != NULL) {
+      lock_sma(sma);
+    }
+    pthread_mutex_unlock(&sem_ns->lock);
+  }
+  if (sma == NULL)
+    return -LINUX_EINVAL;
+
+  if (cmd != LINUX_SEM_STAT_ANY && !ipc_permitted(&sma->perm, 0444)) {
+    pthread_mutex_unlock(&sma->lock);
+    return -LINUX_EACCES;
+  }
+  struct l_semid64_ds ds;
+  fill_semid_ds(sma, &ds);
+  int ret = cmd == LINUX_IPC_STAT ? 0 : sma->id;
+  pthread_mutex_unlock(&sma->lock);
+
+  if (copy_to_user(buf_ptr, &ds, sizeof ds))
+    return -LINUX_EFAULT;
+  return ret;
+}
+
+static int
+sem_rmid_set(int semid, int cmd, gaddr_t buf_ptr)
+{
+  struct l_semid64_ds ds;
+  if (cmd == LINUX_IPC_SET && copy_from_user(&ds, buf_ptr, sizeof ds))
+    return -LINUX_EFAULT;
+
+  struct sem_array *sma = lock_set(semid, true);
+  if (sma == NULL)
+    return -LINUX_EINVAL;
+  if (!ipc_owner(&sma->perm)) {
+    pthread_mutex_unlock(&sma->lock);
+    pthread_mutex_unlock(&sem_ns->lock);
+    return -LINUX_EPERM;
+  }
+  if (cmd == LINUX_IPC_RMID) {
+    remove_set(sma);
+  } else {
+    sma->perm.uid = ds.sem_perm.uid;
+    sma->perm.gid = ds.sem_perm.gid;
+    sma->perm.mode = (sma->perm.mode & ~0777) | (ds.sem_perm.mode & 0777);
+    sma->ctime = time(NULL);
+    pthread_mutex_unlock(&sma->lock);
+  }
+  pthread_mutex_unlock(&sem_ns->lock);
+  return 0;
+}
+
+static int
+sem_setall(int semid, gaddr_t array_ptr)
+{
+  struct sem_array *sma = lock_set(semid, false);
+  if (sma == NULL)
+    return -LINUX_EINVAL;
+  int nsems = sma->nsems;
+  pthread_mutex_unlock(&sma->lock);
+
+  /* a set never changes its size, so the values stay good for the same id */
+  l_ushort *vals = malloc(sizeof vals[0] * nsems);
+  if (vals == NULL)
+    return -LINUX_ENOMEM;
+  if (copy_from_user(vals, array_ptr, sizeof vals[0] * nsems)) {
+    free(vals);
+    return -LINUX_EFAULT;
+  }
+  int ret = 0;
+  for (int i = 0; i < nsems; i++) {
+    if (vals[i] > SEMVMX) {
+      ret = -LINUX_ERANGE;
+      goto out;
+    }
+  }
+  if ((sma = lock_set(semid, false)) == NULL) {
+    ret = -LINUX_EINVAL;
+    goto out;
+  }
+  if (!ipc_permitted(&sma->perm, 0222)) {
+    ret = -LINUX_EACCES;
+  } else {
+    l_pid_t pid = getpid();
+    for (int i = 0; i < nsems; i++) {
+      sma->sems[i].semval = vals[i];
+      sma->sems[i].sempid = pid;
+    }
+    for (struct sem_undo *un = sma->undo; un != NULL; un = un->next) {
+      memset(un->adj, 0, sizeof un->adj[0] * nsems);
+    }
+    sma->ctime = time(NULL);
+    wake_sleepers(sma);
+  }
+  pthread_mutex_unlock(&sma->lock);
+ out:
+  free(vals);
+  return ret;
+}
+
+static int
+sem_getall(int semid, gaddr_t array_ptr)
+{
+  struct sem_array *sma = lock_set(semid, false);
+  if (sma == NULL)
+    return -LINUX_EINVAL;
+  if (!ipc_permitted(&sma->perm, 0444)) {
+    pthread_mutex_unlock(&sma->lock);
+    return -LINUX_EACCES;
+  }
+  int nsems = sma->nsems;
+  l_ushort *vals = malloc(sizeof vals[0] * nsems);
+  if (vals == NULL) {
+    pthread_mutex_unlock(&sma->lock);
+    return -LINUX_ENOMEM;
+  }
+  for (int i = 0; i < nsems; i++) {
+    vals[i] = sma->sems[i].semval;
+  }
+  pthread_mutex_unlock(&sma->lock);
+
+  int ret = copy_to_user(array_ptr, vals, sizeof vals[0] * nsems) ? -LINUX_EFAULT : 0;
+  free(vals);
+  return ret;
+}
+
+/* GETVAL, GETPID, GETNCNT, GETZCNT and SETVAL */
+static int
+sem_one(int semid, int semnum, int cmd, int val)
+{
+  struct sem_array *sma = lock_set(semid, false);
+  if (sma == NULL)
+    return -LINUX_EINVAL;
+
+  int ret;
+  if (semnum < 0 || semnum >= sma->nsems) {
+    ret = -LINUX_EINVAL;
     goto out;
   }
-  for (uint i = 0; i < nsops; ++i) {
-    tsops[i].sem_num = l_tsops[i].sem_num;
-    tsops[i].sem_op = l_tsops[i].sem_op;
-    tsops[i].sem_flg = 0;
-    if (l_tsops[i].sem_flg & LINUX_IPC_NOWAIT)
-      tsops[i].sem_flg |= IPC_NOWAIT;
-    if (l_tsops[i].sem_flg & LINUX_SEM_UNDO)
-      tsops[i].sem_flg |= SEM_UNDO;
+  if (!ipc_permitted(&sma->perm, cmd == LINUX_SETVAL ? 0222 : 0444)) {
+    ret = -LINUX_EACCES;
+    goto out;
+  }
+  struct sem *sem = &sma->sems[semnum];
+  switch (cmd) {
+  case LINUX_GETVAL:
+    ret = sem->semval;
+    break;
+  case LINUX_GETPID:
+    ret = sem->sempid;
+    break;
+  case LINUX_GETNCNT:
+    ret = sem->ncnt;
+    break;
+  case LINUX_GETZCNT:
+    ret = sem->zcnt;
+    break;
+  case LINUX_SETVAL:
+    if (val < 0 || val > SEMVMX) {
+      ret = -LINUX_ERANGE;
+      break;
+    }
+    sem->semval = val;
+    sem->sempid = getpid();
+    for (struct sem_undo *un = sma->undo; un != NULL; un = un->next) {
+      un->adj[semnum] = 0;
+    }
+    sma->ctime = time(NULL);
+    wake_sleepers(sma);
+    ret = 0;
+    break;
+  default:
+    ret = -LINUX_EINVAL;
   }
-  r = syswrap(semop(semid, tsops, nsops));
  out:
-  free(l_tsops);
-  free(tsops);
-  return r;
+  pthread_mutex_unlock(&sma->lock);
+  return ret;
+}
+
+/* the fourth argument is a union semun passed by value, which is one register */
+DEFINE_SYSCALL(semctl, int, semid, int, semnum, int, cmd, uint64_t, arg)
+{
+  cmd &= ~LINUX_IPC_64;
+  switch (cmd) {
+  case LINUX_IPC_INFO:
+  case LINUX_SEM_INFO:
+    return sem_info(cmd, arg);
+  case LINUX_IPC_STAT:
+  case LINUX_SEM_STAT:
+  case LINUX_SEM_STAT_ANY:
+    return sem_stat(semid, cmd, arg);
+  case LINUX_IPC_RMID:
+  case LINUX_IPC_SET:
+    return sem_rmid_set(semid, cmd, arg);
+  case LINUX_GETALL:
+    return sem_getall(semid, arg);
+  case LINUX_SETALL:
+    return sem_setall(semid, arg);
+  case LINUX_GETVAL:
+  case LINUX_GETPID:
+  case LINUX_GETNCNT:
+  case LINUX_GETZCNT:
+  case LINUX_SETVAL:
+    return sem_one(semid, semnum, cmd, (int) arg);
+  default:
+    warnk("semctl: unsupported command: 0x%x\n", cmd);
+    return -LINUX_EINVAL;
+  }
 }
 
-DEFINE_SYSCALL(semctl, int, semid, int, semnum, int, cmd, union l_semun, arg)
+/* applies and drops the SEM_UNDO adjustments of the exiting process */
+void
+exit_sem(void)
 {
-  warnk("semctl: unsupported command: 0x%x\n", cmd);
-  return -LINUX_ENOSYS;
+  if (sem_ns == NULL)
+    return;
+
+  l_pid_t pid = getpid();
+  lock_ns();
+  for (int i = 0, seen = 0; i < SEMMNI && seen < sem_ns->nr_sets; i++) {
+    struct sem_array *sma = sem_ns->sets[i];
+    if (sma == NULL)
+      continue;
+    seen++;
+    lock_sma(sma);
+    for (struct sem_undo **p = &sma->undo; *p != NULL; p = &(*p)->next) {
+      struct sem_undo *un = *p;
+      if (un->pid != pid)
+        continue;
+      for (int j = 0; j < sma->nsems; j++) {
+        if (un->adj[j] == 0)
+          continue;
+        sma->sems[j].semval = MIN(MAX(sma->sems[j].semval + un->adj[j], 0), SEMVMX);
+        sma->sems[j].sempid = pid;
+      }
+      *p = un->next;
+      shm_free(un);
+      wake_sleepers(sma);
+      break;
+    }
+    pthread_mutex_unlock(&sma->lock);
+  }
+  pthread_mutex_unlock(&sem_ns->lock);
 }
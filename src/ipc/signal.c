@@ -1,31 +1,281 @@
 #include "common.h"
 #include "linux/signal.h"
+#include "linux/time.h"
 
 #include "noah.h"
 #include "vmm.h"
+#include "x86/irq_vectors.h"
+#include "x86/specialreg.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
 #include <stdatomic.h>
 #include <pthread.h>
+#include <time.h>
+#include <cpuid.h>
+#include <mach/mach.h>
 
 #define SET_SIGBIT(sigbits, lsig) (atomic_fetch_or((sigbits), (1UL << ((lsig) - 1))))
 #define CLEAR_SIGBIT(sigbits, lsig) (atomic_fetch_and((sigbits), ~(1UL << ((lsig) - 1))))
 
+/*
+ * Pending signals live in task.sigpending, one bit per signal. Signals caught
+ * by the host handler only set the bit. Signals raised from within noah --
+ * tgkill, sigqueue, kill of our own process, faults -- carry a siginfo, which
+ * is queued on the target task; RT signals queue up, standard ones do not.
+ * Either way the target is kicked out of the guest to deliver the signal.
+ *
+ * Faults are different: they are synchronous to the faulting instruction and
+ * get their frame right away, see force_fault.
+ *
+ * Each task also has a semaphore that is signaled whenever a signal becomes
+ * pending on it, which sigsuspend and sigtimedwait sleep on. Unlike a sleep
+ * that is interrupted by the host handler, a count left by a signal that came
+ * in just before the wait is not lost.
+ */
+
+#define SIGQUEUE_MAX 1024       /* per task */
+
+struct sigqueue {
+  struct list_head head;
+  l_siginfo_t info;
+};
+
 static void
 __host_signal_handler(int signum, siginfo_t *info, ucontext_t *context)
 {
+  int sig = darwin_to_linux_signal(signum);
+  task.sigsender[sig - 1].pid = info->si_pid;
+  task.sigsender[sig - 1].uid = info->si_uid;
   /* actually no need to do it atomically */
-  SET_SIGBIT(&task.sigpending, darwin_to_linux_signal(signum));
+  SET_SIGBIT(&task.sigpending, sig);
+  semaphore_signal(task.sigwake);
+  /* in case this thread is just about to enter the guest */
+  vmm_request_exit();
+}
+
+/*
+ * sigtimedwait has to see the signals it waits for even while they are left
+ * at SIG_DFL or SIG_IGN, where the host would kill us or drop them. For as
+ * long as somebody waits for such a signal the host handler is installed for
+ * it; a thread that catches it instead applies the guest's disposition as it
+ * would for any other signal. Counted under proc.sig_lock.
+ */
+static int nr_sigwaiters[LINUX_NSIG];
+
+static void *
+host_handler(int sig, const l_sigaction_t *lact)
+{
+  if (lact->lsa_handler != LINUX_SIG_DFL && lact->lsa_handler != LINUX_SIG_IGN) {
+    return __host_signal_handler;
+  }
+  /* an ignored SIGCHLD also means no zombies, which only the host can see to */
+  if (nr_sigwaiters[sig - 1] > 0 && !(sig == LINUX_SIGCHLD && lact->lsa_handler == LINUX_SIG_IGN)) {
+    return __host_signal_handler;
+  }
+  return lact->lsa_handler == LINUX_SIG_DFL ? SIG_DFL : SIG_IGN;
+}
+
+static void
+to_host_sigaction(int sig, l_sigaction_t *lact, struct sigaction *dact)
+{
+  void *handler = host_handler(sig, lact);
+  linux_to_darwin_sigaction(lact, dact, handler);
+  if (handler == __host_signal_handler) {
+    dact->sa_flags |= SA_SIGINFO;
+  }
+}
+
+/* lend the host handler to the standard signals in set (delta 1), or take it back (-1) */
+static void
+borrow_host_handlers(const l_sigset_t *set, int delta)
+{
+  pthread_rwlock_wrlock(&proc.sig_lock);
+  for (int sig = 1; sig < LINUX_SIGRTMIN; sig++) {
+    int dsig = linux_to_darwin_signal(sig);
+    if (!LINUX_SIGISMEMBER(set, sig) || dsig <= 0) {
+      continue;
+    }
+    nr_sigwaiters[sig - 1] += delta;
+    l_sigaction_t *lact = &proc.sigaction[sig - 1];
+    if (lact->lsa_handler == LINUX_SIG_DFL || lact->lsa_handler == LINUX_SIG_IGN) {
+      struct sigaction dact;
+      to_host_sigaction(sig, lact, &dact);
+      sigaction(dsig, &dact, NULL);
+    }
+  }
+  pthread_rwlock_unlock(&proc.sig_lock);
+}
+
+/* the state of a new host thread or a forked child; pending signals are not inherited */
+void
+init_sigqueue(void)
+{
+  pthread_mutex_init(&task.sigqueue_lock, NULL);
+  INIT_LIST_HEAD(&task.sigqueue);
+  task.nr_sigqueue = 0;
+  INIT_SIGBIT(&task.sigpending);
+  task.thread = pthread_self();
+  task.restore_sigmask = false;
+  /* made once per host thread; a forked child does not inherit its parent's */
+  if (task.sigwake_owner != getpid()) {
+    semaphore_create(mach_task_self(), &task.sigwake, SYNC_POLICY_FIFO, 0);
+    task.sigwake_owner = getpid();
+  }
+}
+
+/* frees discarded entries; a timer whose signal is among them may fire again */
+static void
+free_sigqueue_entries(struct list_head *list)
+{
+  struct sigqueue *q, *n;
+  list_for_each_entry_safe (q, n, list, head) {
+    if (q->info.lsi_code == LINUX_SI_TIMER) {
+      drop_timer_signal(&q->info);
+    }
+    free(q);
+  }
+}
+
+/* drop everything queued; no other thread may send to this task any more */
+void
+flush_sigqueue(void)
+{
+  free_sigqueue_entries(&task.sigqueue);
+  init_sigqueue();
+}
+
+/* called with proc.lock held */
+static struct task *
+find_task(l_pid_t tid)
+{
+  struct task *t;
+  list_for_each_entry (t, &proc.tasks, head) {
+    if ((l_pid_t) t->tid == tid) {
+      return t;
+    }
+  }
+  return NULL;
+}
+
+/* a thread that can take a process-directed signal now, preferring this one;
+   the caller may also be a host thread of noah's own, which is no task.
+   called with proc.lock held */
+static struct task *
+pick_task(int sig)
+{
+  struct task *t, *self = NULL, *first = NULL;
+  list_for_each_entry (t, &proc.tasks, head) {
+    if (t == &task) {
+      self = t;
+    }
+    if (!first && !LINUX_SIGISMEMBER(&t->sigmask, sig)) {
+      first = t;
+    }
+  }
+  if (self && !LINUX_SIGISMEMBER(&self->sigmask, sig)) {
+    return self;
+  }
+  if (first) {
+    return first;
+  }
+  return self ? self : list_first_entry(&proc.tasks, struct task, head);
+}
+
+/* returns 1 if a standard signal was merged with the one already pending;
+   called with proc.lock held */
+static int
+queue_signal(struct task *t, const l_siginfo_t *info)
+{
+  int sig = info->lsi_signo;
+  int ret = 0;
+
+  pthread_mutex_lock(&t->sigqueue_lock);
+  if (sig < LINUX_SIGRTMIN && (t->sigpending & (1ULL << (sig - 1)))) {
+    /* standard signals do not queue up */
+    ret = 1;
+    goto out;
+  }
+  if (t->nr_sigqueue >= SIGQUEUE_MAX) {
+    ret = -LINUX_EAGAIN;
+    goto out;
+  }
+  struct sigqueue *q = malloc(sizeof *q);
+  q->info = *info;
+  list_add_tail(&q->head, &t->sigqueue);
+  t->nr_sigqueue++;
+  SET_SIGBIT(&t->sigpending, sig);
+ out:
+  pthread_mutex_unlock(&t->sigqueue_lock);
+
+  if (ret >= 0) {
+    semaphore_signal(t->sigwake);
+    if (t != &task) {
+      vmm_kick(t->thread);
+    }
+  }
+  return ret;
 }
 
+/* Takes the lowest pending signal in mask and fills in its siginfo. Returns
+   the signal number, or 0 if none is pending. */
 int
-send_signal(pid_t pid, int signum)
+dequeue_signal(uint64_t mask, l_siginfo_t *info)
+{
+  uint64_t pending = task.sigpending & mask;
+  if (pending == 0) {
+    return 0;
+  }
+  int sig = __builtin_ffsll(pending);
+
+  pthread_mutex_lock(&task.sigqueue_lock);
+  struct sigqueue *q, *found = NULL;
+  bool more = false;
+  list_for_each_entry (q, &task.sigqueue, head) {
+    if (q->info.lsi_signo != sig) {
+      continue;
+    }
+    if (found) {
+      more = true;
+      break;
+    }
+    found = q;
+  }
+  if (found) {
+    *info = found->info;
+    list_del(&found->head);
+    free(found);
+    task.nr_sigqueue--;
+  } else {
+    /* caught by the host handler */
+    bzero(info, sizeof *info);
+    info->lsi_signo = sig;
+    info->lsi_code = LINUX_SI_USER;
+    info->lsi_pid = task.sigsender[sig - 1].pid;
+    info->lsi_uid = task.sigsender[sig - 1].uid;
+  }
+  if (!more) {
+    CLEAR_SIGBIT(&task.sigpending, sig);
+  }
+  pthread_mutex_unlock(&task.sigqueue_lock);
+
+  if (found && info->lsi_code == LINUX_SI_TIMER) {
+    /* the overrun count is that at the time the signal is taken */
+    take_timer_signal(info);
+  }
+  return sig;
+}
+
+static int
+send_host_signal(pid_t pid, int signum)
 {
   if (signum >= LINUX_SIGRTMIN) {
+    /* the host has no RT signals to carry it to another process */
     warnk("RT signal is raised: %d\n", signum);
     return 0;
   }
@@ -33,6 +283,98 @@ send_signal(pid_t pid, int signum)
   return syswrap(kill(pid, dsignum));
 }
 
+/* process-directed; signals to this process are delivered by noah itself */
+static int
+send_signal_info(pid_t pid, const l_siginfo_t *info)
+{
+  int sig = info->lsi_signo;
+  if (pid != getpid() || sig == 0 || sig == LINUX_SIGKILL || sig == LINUX_SIGSTOP) {
+    return send_host_signal(pid, sig);
+  }
+  pthread_rwlock_rdlock(&proc.lock);
+  int ret = queue_signal(pick_task(sig), info);
+  pthread_rwlock_unlock(&proc.lock);
+  return MIN(ret, 0);
+}
+
+/* thread-directed; tgid is -1 for tkill */
+static int
+send_thread_signal(l_pid_t tgid, l_pid_t tid, const l_siginfo_t *info)
+{
+  if (tgid == -1 || tgid == getpid()) {
+    pthread_rwlock_rdlock(&proc.lock);
+    struct task *t = find_task(tid);
+    int ret = -LINUX_ESRCH;
+    if (t) {
+      ret = info->lsi_signo == 0 ? 0 : MIN(queue_signal(t, info), 0);
+    }
+    pthread_rwlock_unlock(&proc.lock);
+    if (t || tgid != -1) {
+      return ret;
+    }
+  }
+  /* threads of other processes are out of reach; only their main thread,
+     whose tid is the pid, can be named */
+  if (tgid != -1 && tgid != tid) {
+    return -LINUX_ESRCH;
+  }
+  return send_host_signal(tid, info->lsi_signo);
+}
+
+/* Raises a signal in this process on behalf of noah itself, e.g. for an
+   expiring timer, from any host thread. tid 0 makes it process-directed;
+   -ESRCH if there is no such thread. Returns 1 if a standard signal was
+   already pending and the new one merged with it. */
+int
+send_kernel_signal(l_pid_t tid, const l_siginfo_t *info)
+{
+  pthread_rwlock_rdlock(&proc.lock);
+  struct task *t = tid ? find_task(tid) : pick_task(info->lsi_signo);
+  int ret = -LINUX_ESRCH;
+  if (t) {
+    ret = info->lsi_signo == 0 ? 0 : queue_signal(t, info);
+  }
+  pthread_rwlock_unlock(&proc.lock);
+  return ret;
+}
+
+int
+send_signal(pid_t pid, int signum)
+{
+  l_siginfo_t info = {
+    .lsi_signo = signum,
+    .lsi_code = LINUX_SI_USER,
+  };
+  info.lsi_pid = getpid();
+  info.lsi_uid = proc.cred.uid;
+  return send_signal_info(pid, &info);
+}
+
+/* what Linux does when a signal is set to be ignored: the instances already
+   pending in any thread are thrown away */
+static void
+discard_signal(int sig)
+{
+  LIST_HEAD(dropped);
+  pthread_rwlock_rdlock(&proc.lock);
+  struct task *t;
+  list_for_each_entry (t, &proc.tasks, head) {
+    pthread_mutex_lock(&t->sigqueue_lock);
+    struct sigqueue *q, *n;
+    list_for_each_entry_safe (q, n, &t->sigqueue, head) {
+      if (q->info.lsi_signo == sig) {
+        list_move_tail(&q->head, &dropped);
+        t->nr_sigqueue--;
+      }
+    }
+    CLEAR_SIGBIT(&t->sigpending, sig);
+    pthread_mutex_unlock(&t->sigqueue_lock);
+  }
+  pthread_rwlock_unlock(&proc.lock);
+  /* outside the locks above, which the timer thread takes under its own */
+  free_sigqueue_entries(&dropped);
+}
+
 bool
 has_sigpending()
 {
@@ -51,8 +393,12 @@ init_signal(void)
 
   /* import signal handlers registered on the host */
   for (int i = 0; i < LINUX_NSIG; i++) {
-    struct sigaction oact;
-    sigaction(i + 1, NULL, &oact);
+    /* numbering differs; e.g. darwin's 7 is SIGEMT, which the vmm uses for itself */
+    int dsig = linux_to_darwin_signal(i + 1);
+    struct sigaction oact = { .sa_handler = SIG_DFL };
+    if (dsig > 0) {
+      sigaction(dsig, NULL, &oact);
+    }
     if (!(oact.sa_handler == SIG_IGN || oact.sa_handler == SIG_DFL)) {
       warnk("sa_handler:%d\n", (int)oact.sa_handler);
     }
@@ -70,7 +416,7 @@ init_signal(void)
   sigset_t set;
   sigprocmask(0, NULL, &set);
   darwin_to_linux_sigset(&set, &task.sigmask);
-  task.sigpending = ATOMIC_VAR_INIT(0);
+  init_sigqueue();
 }
 
 static void
@@ -96,28 +442,45 @@ reset_signal_state()
       .lsa_restorer= 0,
       .lsa_mask = {0}
     };
+    int dsig = linux_to_darwin_signal(i + 1);
+    if (dsig <= 0) {
+      continue;
+    }
     struct sigaction dact;
     linux_to_darwin_sigaction(&proc.sigaction[i], &dact, SIG_DFL);
-    sigaction(i + 1, &dact, NULL);
+    sigaction(dsig, &dact, NULL);
   }
   reset_sas();
 }
 
-static inline int
-pop_signal()
+/* make the host follow proc.sigaction and task.sigmask again after they were
+   restored from a checkpoint */
+void
+reload_signal_state(void)
 {
-  uint64_t pending = task.sigpending;
-  pending &= ~LINUX_SIGSET_TO_UI64(&task.sigmask);
-  if (pending == 0)
-    return 0;
-  int sig = __builtin_ffs(pending);
-  assert(0 < sig && sig < 32);
-  CLEAR_SIGBIT(&task.sigpending, sig);
-  return sig;
+  for (int i = 0; i < LINUX_NSIG; i++) {
+    int dsig = linux_to_darwin_signal(i + 1);
+    if (dsig <= 0 || i + 1 == LINUX_SIGKILL || i + 1 == LINUX_SIGSTOP) {
+      continue;
+    }
+    struct sigaction dact;
+    to_host_sigaction(i + 1, &proc.sigaction[i], &dact);
+    sigaction(dsig, &dact, NULL);
+  }
+  sigset_t dset;
+  linux_to_darwin_sigset(&task.sigmask, &dset);
+  pthread_sigmask(SIG_SETMASK, &dset, NULL);
 }
 
+/* what the CPU reported for a fault, or NULL for any other signal */
+struct trapinfo {
+  int trapno;
+  uint64_t err;
+  uint64_t cr2;
+};
+
 static void
-setup_sigcontext(struct l_sigcontext *mcontext)
+setup_sigcontext(struct l_sigcontext *mcontext, const struct trapinfo *trap)
 {
   vmm_read_register(HV_X86_R8, &mcontext->sc_r8);
   vmm_read_register(HV_X86_R9, &mcontext->sc_r9);
@@ -146,10 +509,13 @@ setup_sigcontext(struct l_sigcontext *mcontext)
   mcontext->sc_gs = gs;
   mcontext->sc_fs = fs;
   mcontext->sc_ss = ss;
-  // TODO: err, trapno
-  mcontext->sc_mask = task.sigmask;
-  // TODO: cr2
-  // TODO: save FPU state
+  if (trap) {
+    mcontext->sc_trapno = trap->trapno;
+    mcontext->sc_err = trap->err;
+    mcontext->sc_cr2 = trap->cr2;
+  } else {
+    mcontext->sc_trapno = mcontext->sc_err = mcontext->sc_cr2 = 0;
+  }
 }
 
 static void
@@ -175,11 +541,8 @@ restore_sigcontext(struct l_sigcontext *mcontext)
   vmm_write_register(HV_X86_RFLAGS, mcontext->sc_rflags); // TODO: fix some flags after implementing proper rflags initialization
   // TODO: set user mode bits
   vmm_write_register(HV_X86_CS, mcontext->sc_cs);
-  vmm_write_register(HV_X86_GS, mcontext->sc_gs);
-  vmm_write_register(HV_X86_FS, mcontext->sc_fs);
+  /* as on linux, fs and gs are not restored so that the tls bases survive the handler */
   vmm_write_register(HV_X86_SS, mcontext->sc_ss); // TODO: handle ss register more carefully if you want to support software such as DOSEMU
-
-  // TODO: restore FPU state
 }
 
 static l_int
@@ -194,10 +557,131 @@ sas_ss_flags(uint64_t rsp)
   return task.sas.ss_flags;
 }
 
+/*
+ * The FPU state goes into signal frames in the layout of Linux: the xsave
+ * image sits above the frame, 64-byte aligned, with its size and features
+ * described in the software reserved bytes of the fxsave header. Only the
+ * components the guest has enabled in XCR0 make up the image, and of those
+ * only the ones not in their initial state are copied, so a thread that never
+ * touched AVX pays for 576 bytes and nothing more.
+ */
+
+#define FXSAVE_SIZE       512
+#define XSAVE_HDR_SIZE    64
+#define XSTATE_BV_OFFSET  FXSAVE_SIZE
+#define MXCSR_OFFSET      24
+#define MXCSR_MASK        0xffff
+
+static struct {
+  uint32_t offset, size;
+} xstate_comp[64];              /* by cpuid 0xd, for the components above sse */
+
+static void
+init_xstate_layout(void)
+{
+  for (int i = 2; i < 64; i++) {
+    unsigned eax, ebx, ecx, edx;
+    __cpuid_count(0xd, i, eax, ebx, ecx, edx);
+    xstate_comp[i].size = eax;
+    xstate_comp[i].offset = ebx;
+  }
+}
+
+/* size of the xsave image for the components in xfeatures */
+static size_t
+xstate_size(uint64_t xfeatures)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_xstate_layout);
+
+  size_t size = FXSAVE_SIZE + XSAVE_HDR_SIZE;
+  for (int i = 2; i < 64; i++) {
+    if ((xfeatures & (1ULL << i)) && xstate_comp[i].size) {
+      size = MAX(size, xstate_comp[i].offset + xstate_comp[i].size);
+    }
+  }
+  return MIN(size, VMM_FPSTATE_SIZE);
+}
+
+/* push the FPU state below rsp; returns the address of the image, or 0 */
+static gaddr_t
+save_fpstate(uint64_t *rsp)
+{
+  char buf[VMM_FPSTATE_SIZE] __attribute__((aligned(64)));
+  vmm_read_fpstate(buf, sizeof buf);
+
+  uint64_t xcr0, xstate_bv;
+  vmm_read_register(HV_X86_XCR0, &xcr0);
+  memcpy(&xstate_bv, buf + XSTATE_BV_OFFSET, sizeof xstate_bv);
+  xstate_bv &= xcr0;
+  memcpy(buf + XSTATE_BV_OFFSET, &xstate_bv, sizeof xstate_bv);
+
+  size_t size = xstate_size(xcr0);
+  struct l_fpstate *fx = (struct l_fpstate *) buf;
+  fx->sw_reserved = (struct l_fpx_sw_bytes) {
+    .magic1 = LINUX_FP_XSTATE_MAGIC1,
+    .extended_size = size + sizeof(uint32_t),
+    .xfeatures = xcr0,
+    .xstate_size = size,
+  };
+
+  gaddr_t fpaddr = rounddown(*rsp - size - sizeof(uint32_t), 64);
+  uint32_t magic2 = LINUX_FP_XSTATE_MAGIC2;
+  /* components in their initial state are left out; xrstor takes XSTATE_BV */
+  if (copy_to_user(fpaddr, buf, xstate_size(xstate_bv))
+      || copy_to_user(fpaddr + size, &magic2, sizeof magic2)) {
+    return 0;
+  }
+  *rsp = fpaddr;
+  return fpaddr;
+}
+
+static int
+restore_fpstate(gaddr_t fpaddr)
+{
+  if (fpaddr == 0) {
+    return 0;
+  }
+
+  char buf[VMM_FPSTATE_SIZE] __attribute__((aligned(64)));
+  memset(buf, 0, sizeof buf);
+  if (copy_from_user(buf, fpaddr, FXSAVE_SIZE)) {
+    return -LINUX_EFAULT;
+  }
+
+  uint64_t xcr0, xstate_bv = XCR0_X87_STATE | XCR0_SSE_STATE;
+  vmm_read_register(HV_X86_XCR0, &xcr0);
+  struct l_fpx_sw_bytes sw = ((struct l_fpstate *) buf)->sw_reserved;
+  uint32_t magic2;
+  if (sw.magic1 == LINUX_FP_XSTATE_MAGIC1
+      && sw.xstate_size >= FXSAVE_SIZE + XSAVE_HDR_SIZE && sw.xstate_size <= sizeof buf
+      && sw.extended_size == sw.xstate_size + sizeof magic2
+      && copy_from_user(&magic2, fpaddr + sw.xstate_size, sizeof magic2) == 0
+      && magic2 == LINUX_FP_XSTATE_MAGIC2) {
+    if (copy_from_user(buf + FXSAVE_SIZE, fpaddr + FXSAVE_SIZE, sw.xstate_size - FXSAVE_SIZE)) {
+      return -LINUX_EFAULT;
+    }
+    memcpy(&xstate_bv, buf + XSTATE_BV_OFFSET, sizeof xstate_bv);
+    xstate_bv &= sw.xfeatures;
+  }
+  /* keep xrstor from faulting on what the guest may have scribbled */
+  xstate_bv &= xcr0;
+  memset(buf + XSTATE_BV_OFFSET, 0, XSAVE_HDR_SIZE);
+  memcpy(buf + XSTATE_BV_OFFSET, &xstate_bv, sizeof xstate_bv);
+  uint32_t mxcsr;
+  memcpy(&mxcsr, buf + MXCSR_OFFSET, sizeof mxcsr);
+  mxcsr &= MXCSR_MASK;
+  memcpy(buf + MXCSR_OFFSET, &mxcsr, sizeof mxcsr);
+
+  vmm_write_fpstate(buf, sizeof buf);
+  return 0;
+}
+
 static int
-setup_sigframe(int signum)
+setup_sigframe(const l_siginfo_t *info, const struct trapinfo *trap)
 {
   struct l_rt_sigframe frame;
+  int signum = info->lsi_signo;
 
   assert(signum <= LINUX_NSIG);
   static_assert(is_aligned(sizeof frame, sizeof(uint64_t)), "signal frame size should be aligned");
@@ -206,6 +690,8 @@ setup_sigframe(int signum)
   vmm_read_register(HV_X86_RSP, &rsp);
   if ((proc.sigaction[signum - 1].lsa_flags & LINUX_SA_ONSTACK) && (sas_ss_flags(rsp) & ~LINUX_SS_AUTODISARM) == 0) {
     rsp = task.sas.ss_sp + task.sas.ss_size;
+  } else {
+    rsp -= 128;                 /* red zone */
   }
 
   /* Setup sigframe */
@@ -215,22 +701,30 @@ setup_sigframe(int signum)
     // x86_64 should always use SA_RESTORER
     return -LINUX_EFAULT;
   }
-  bzero(&frame.sf_si, sizeof(l_siginfo_t));
-  frame.sf_si.lsi_signo = signum;
+  frame.sf_si = *info;
 
   /* Setup ucontext */
   frame.sf_sc.uc_flags = LINUX_UC_FP_XSTATE | LINUX_UC_SIGCONTEXT_SS | LINUX_UC_STRICT_RESTORE_SS; // Handle more carefully if you want to support DOSEMU
   frame.sf_sc.uc_link = 0;
-  frame.sf_sc.uc_sigmask = task.sigmask;
+  /* sigreturn goes back to the mask from before sigsuspend and the like */
+  l_sigset_t oldmask = task.restore_sigmask ? task.saved_sigmask : task.sigmask;
+  task.restore_sigmask = false;
+  frame.sf_sc.uc_sigmask = oldmask;
   frame.sf_sc.uc_stack = task.sas;
   if (task.sas.ss_flags & LINUX_SS_AUTODISARM) {
     reset_sas();
   }
-  setup_sigcontext(&frame.sf_sc.uc_mcontext);
+  setup_sigcontext(&frame.sf_sc.uc_mcontext, trap);
+  gaddr_t fpaddr = save_fpstate(&rsp);
+  if (fpaddr == 0) {
+    return -LINUX_EFAULT;
+  }
+  frame.sf_sc.uc_mcontext.sc_fpstate = (struct l_fpstate *) fpaddr;
 
   sigset_t dset;
-  frame.sf_sc.uc_mcontext.sc_mask = task.sigmask;
-  l_sigset_t newmask = proc.sigaction[signum - 1].lsa_mask;
+  frame.sf_sc.uc_mcontext.sc_mask = oldmask;
+  l_sigset_t newmask = task.sigmask;
+  LINUX_SIGSET_ADD(&newmask, &proc.sigaction[signum - 1].lsa_mask);
   if (!(proc.sigaction[signum - 1].lsa_flags & LINUX_SA_NOMASK)) {
     LINUX_SIGADDSET(&newmask, signum);
   }
@@ -238,8 +732,8 @@ setup_sigframe(int signum)
   linux_to_darwin_sigset(&newmask, &dset);
   sigprocmask(SIG_SETMASK, &dset, NULL);
 
-  /* OK, push them then... */
-  rsp -= sizeof frame;
+  /* OK, push them then... the handler sees rsp as if the frame were called */
+  rsp = rounddown(rsp - sizeof frame, 16) - 8;
   vmm_write_register(HV_X86_RSP, rsp);
   if (copy_to_user(rsp, &frame, sizeof frame)) {
     return -LINUX_EFAULT;
@@ -257,47 +751,154 @@ setup_sigframe(int signum)
 }
 
 static void
+default_signal_action(int sig)
+{
+  switch (sig) {
+  case LINUX_SIGCHLD:
+  case LINUX_SIGURG:
+  case LINUX_SIGWINCH:
+  case LINUX_SIGCONT:
+    return;
+  case LINUX_SIGTSTP:
+  case LINUX_SIGTTIN:
+  case LINUX_SIGTTOU:
+    /* the host action is the default one too, which stops the process */
+    kill(getpid(), linux_to_darwin_signal(sig));
+    return;
+  default:
+    /* RT signals have no host counterpart to die with */
+    die_with_forcedsig(sig < LINUX_SIGRTMIN && linux_to_darwin_signal(sig) > 0 ? sig : LINUX_SIGKILL);
+  }
+}
+
+/* returns true if a handler frame has been set up */
+static bool
 wake_sighandler()
 {
+  bool woke = false;
   pthread_rwlock_rdlock(&proc.sig_lock);
 
   int sig;
-  while ((sig = pop_signal()) != 0) {
+  l_siginfo_t info;
+  while ((sig = dequeue_signal(~LINUX_SIGSET_TO_UI64(&task.sigmask), &info)) != 0) {
 
     meta_strace_sigdeliver(sig);
     switch (proc.sigaction[sig - 1].lsa_handler) {
       case LINUX_SIG_DFL:
-        //warnk("Handling default signal in Noah is not implemented yet\n");
-        /* fall through */
+        default_signal_action(sig);
+        continue;
+
       case LINUX_SIG_IGN:
         continue;
 
       default:
-        if (setup_sigframe(sig) < 0) {
+        if (setup_sigframe(&info, NULL) < 0) {
           die_with_forcedsig(LINUX_SIGSEGV);
         }
         if (proc.sigaction[sig - 1].lsa_flags & LINUX_SA_ONESHOT) {
           proc.sigaction[sig - 1].lsa_handler = LINUX_SIG_DFL;
           // Host signal handler must be set to SIG_DFL already by Darwin kernel
         }
+        woke = true;
         goto out;
     }
   }
 
 out:
   pthread_rwlock_unlock(&proc.sig_lock);
+  return woke;
+}
+
+/*
+ * Deliver a fault raised by the instruction at the current rip. Nothing is
+ * queued: the frame is built on the spot and the vcpu resumes in the handler
+ * on its next entry, as sigreturn brings it back to the same loop. A fault
+ * that is blocked or ignored cannot be put off, so like Linux's force_sig it
+ * falls back to the default action, which kills the process.
+ */
+void
+force_fault(int sig, int code, gaddr_t addr, int trapno, uint64_t err)
+{
+  l_siginfo_t info = { .lsi_signo = sig, .lsi_code = code };
+  info.lsi_addr = addr;
+  struct trapinfo trap = { trapno, err, trapno == X86_VEC_PF ? addr : 0 };
+
+  pthread_rwlock_wrlock(&proc.sig_lock);
+  l_sigaction_t *act = &proc.sigaction[sig - 1];
+  if (LINUX_SIGISMEMBER(&task.sigmask, sig) || act->lsa_handler == LINUX_SIG_IGN) {
+    act->lsa_handler = LINUX_SIG_DFL;
+  }
+  meta_strace_sigdeliver(sig);
+  if (act->lsa_handler == LINUX_SIG_DFL) {
+    die_with_forcedsig(sig);
+  }
+  if (setup_sigframe(&info, &trap) < 0) {
+    die_with_forcedsig(LINUX_SIGSEGV);
+  }
+  if (act->lsa_flags & LINUX_SA_ONESHOT) {
+    /* the host never saw this one, so reset its handler ourselves */
+    act->lsa_handler = LINUX_SIG_DFL;
+    signal(linux_to_darwin_signal(sig), SIG_DFL);
+  }
+  pthread_rwlock_unlock(&proc.sig_lock);
 }
 
 void
 handle_signal()
 {
-  wake_sighandler();
-  main_loop(1);
+  /* run handlers one after another until nothing deliverable is left, e.g.
+     every RT signal queued while it was blocked */
+  while (has_sigpending() && wake_sighandler()) {
+    main_loop(1);
+  }
+}
+
+/*
+ * sigsuspend, pselect, ppoll and epoll_pwait wait with a mask of their own,
+ * which stays in effect until the signal that ended the wait is delivered. The
+ * signal frame then records the saved mask for sigreturn to go back to; if no
+ * handler is run, task_run puts it back before the guest resumes.
+ */
+void
+set_temporary_sigmask(const l_sigset_t *mask)
+{
+  if (!task.restore_sigmask) {
+    task.saved_sigmask = task.sigmask;
+    task.restore_sigmask = true;
+  }
+  task.sigmask = *mask;
+  LINUX_SIGDELSET(&task.sigmask, LINUX_SIGKILL);
+  LINUX_SIGDELSET(&task.sigmask, LINUX_SIGSTOP);
+
+  sigset_t dset;
+  linux_to_darwin_sigset(&task.sigmask, &dset);
+  pthread_sigmask(SIG_SETMASK, &dset, NULL);
+}
+
+void
+restore_saved_sigmask(void)
+{
+  if (!task.restore_sigmask) {
+    return;
+  }
+  task.restore_sigmask = false;
+  task.sigmask = task.saved_sigmask;
+
+  sigset_t dset;
+  linux_to_darwin_sigset(&task.sigmask, &dset);
+  pthread_sigmask(SIG_SETMASK, &dset, NULL);
 }
 
 DEFINE_SYSCALL(alarm, unsigned int, seconds)
 {
-  return syswrap(alarm(seconds));
+  struct l_itimerval value = { .it_value = { seconds, 0 } }, ovalue;
+  set_real_itimer(&value, &ovalue);
+  /* rounded to the nearest second, but a running alarm never reads 0 */
+  unsigned int left = ovalue.it_value.tv_sec + (ovalue.it_value.tv_usec >= 500000);
+  if (left == 0 && ovalue.it_value.tv_usec != 0) {
+    left = 1;
+  }
+  return left;
 }
 
 DEFINE_SYSCALL(rt_sigaction, int, sig, gaddr_t, act, gaddr_t, oact, size_t, size)
@@ -324,27 +925,26 @@ DEFINE_SYSCALL(rt_sigaction, int, sig, gaddr_t, act, gaddr_t, oact, size_t, size
     return -LINUX_EFAULT;
   }
 
-  if (lact.lsa_flags & (LINUX_SA_SIGINFO)) {
-    warnk("SA_SIGINFO implementaion is incomplete: 0x%llx\n", lact.lsa_flags);
-  }
-
-  void *handler;
-  if (lact.lsa_handler == LINUX_SIG_DFL || lact.lsa_handler == LINUX_SIG_IGN) {
-    handler = lact.lsa_handler == LINUX_SIG_DFL ? SIG_DFL : SIG_IGN;
-  } else {
+  if (lact.lsa_handler != LINUX_SIG_DFL && lact.lsa_handler != LINUX_SIG_IGN) {
     lact.lsa_flags |= LINUX_SA_SIGINFO;
-    handler = __host_signal_handler;
   }
-  linux_to_darwin_sigaction(&lact, &dact, handler);
-  dsig = linux_to_darwin_signal(sig);
+  dsig = sig < LINUX_SIGRTMIN ? linux_to_darwin_signal(sig) : 0;
   // TODO: make handlings of linux specific signals consistent
 
   int err = 0;
   pthread_rwlock_wrlock(&proc.sig_lock);
+  /* a waiter in sigtimedwait may be borrowing the host handler */
+  to_host_sigaction(sig, &lact, &dact);
 
-  err = syswrap(sigaction(dsig, &dact, &doact));
+  /* RT signals never come from the host, so there is nothing to install */
+  if (sig < LINUX_SIGRTMIN) {
+    err = syswrap(sigaction(dsig, &dact, &doact));
+  }
   if (err >= 0) {
     proc.sigaction[sig - 1] = lact;
+    if (lact.lsa_handler == LINUX_SIG_IGN) {
+      discard_signal(sig);
+    }
   }
 
   pthread_rwlock_unlock(&proc.sig_lock);
@@ -407,35 +1007,100 @@ DEFINE_SYSCALL(rt_sigsuspend, gaddr_t, nset, size_t, size)
     return -LINUX_EINVAL;
   }
 
-  l_sigset_t lnset, loset = task.sigmask;
-
+  l_sigset_t lnset;
   if (copy_from_user(&lnset, nset, sizeof(l_sigset_t))) {
     return -LINUX_EFAULT;
   }
-  LINUX_SIGDELSET(&lnset, LINUX_SIGKILL);
-  LINUX_SIGDELSET(&lnset, LINUX_SIGSTOP);
-
-  sigset_t dwset, doset;
-  linux_to_darwin_sigset(&lnset, &dwset);
-  pthread_sigmask(SIG_SETMASK, &dwset, &doset);
-  
-  task.sigmask = lnset;
 
-  while (1) {
-    /* NB: macOS's sleep is implemented using nanosleep. That's why we can use
-       sleep to implement sugsuspend without worrying about alarm(2). */
-    sleep(114514);
-    if (has_sigpending()) {
+  /* the handler is run on the way back to the guest, see task_run */
+  set_temporary_sigmask(&lnset);
+  while (!has_sigpending()) {
+    if (semaphore_wait(task.sigwake) != KERN_SUCCESS) {
+      /* the host handler ran; a kick alone makes the syscall restart */
       break;
     }
   }
-  handle_signal();
-  warnk("signal handled\n");
-  pthread_sigmask(SIG_SETMASK, &doset, NULL);
-  task.sigmask = loset;
   return -LINUX_EINTR;          /* returns -EINTR when its execution ends NORMALLY */
 }
 
+DEFINE_SYSCALL(rt_sigtimedwait, gaddr_t, uthese, gaddr_t, uinfo, gaddr_t, uts, size_t, size)
+{
+  if (size != sizeof(l_sigset_t)) {
+    return -LINUX_EINVAL;
+  }
+
+  l_sigset_t these;
+  if (copy_from_user(&these, uthese, sizeof these)) {
+    return -LINUX_EFAULT;
+  }
+  LINUX_SIGDELSET(&these, LINUX_SIGKILL);
+  LINUX_SIGDELSET(&these, LINUX_SIGSTOP);
+
+  struct timespec deadline;
+  if (uts != 0) {
+    struct l_timespec ts;
+    if (copy_from_user(&ts, uts, sizeof ts)) {
+      return -LINUX_EFAULT;
+    }
+    if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+      return -LINUX_EINVAL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ts.tv_sec + (deadline.tv_nsec + ts.tv_nsec) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + ts.tv_nsec) % 1000000000;
+  }
+
+  uint64_t mask = LINUX_SIGSET_TO_UI64(&these);
+  l_siginfo_t info;
+  int sig = dequeue_signal(mask, &info);
+  if (sig == 0) {
+    /* unblock the awaited signals while sleeping so that the host handler
+       catches them, just as Linux does */
+    borrow_host_handlers(&these, 1);
+    l_sigset_t oldmask = task.sigmask;
+    sigset_t dset;
+    LINUX_SIGSET_DEL(&task.sigmask, &these);
+    linux_to_darwin_sigset(&task.sigmask, &dset);
+    pthread_sigmask(SIG_SETMASK, &dset, NULL);
+
+    int ret = 0;
+    for (;;) {
+      if ((sig = dequeue_signal(mask, &info)) != 0) {
+        break;
+      }
+      if (has_sigpending() || (ret != KERN_SUCCESS && ret != KERN_OPERATION_TIMED_OUT)) {
+        sig = -LINUX_EINTR;
+        break;
+      }
+      if (uts == 0) {
+        ret = semaphore_wait(task.sigwake);
+        continue;
+      }
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      int64_t left = (deadline.tv_sec - now.tv_sec) * 1000000000 + (deadline.tv_nsec - now.tv_nsec);
+      if (left <= 0) {
+        sig = -LINUX_EAGAIN;
+        break;
+      }
+      ret = semaphore_timedwait(task.sigwake, (mach_timespec_t) { left / 1000000000, left % 1000000000 });
+    }
+
+    task.sigmask = oldmask;
+    linux_to_darwin_sigset(&task.sigmask, &dset);
+    pthread_sigmask(SIG_SETMASK, &dset, NULL);
+    borrow_host_handlers(&these, -1);
+    if (sig < 0) {
+      return sig;
+    }
+  }
+
+  if (uinfo != 0 && copy_to_user(uinfo, &info, sizeof info)) {
+    return -LINUX_EFAULT;
+  }
+  return sig;
+}
+
 DEFINE_SYSCALL(rt_sigpending, gaddr_t, set, size_t, size)
 {
   if (size > sizeof(l_sigset_t)) {
@@ -463,6 +1128,9 @@ DEFINE_SYSCALL(rt_sigreturn)
   }
 
   restore_sigcontext(&frame.sf_sc.uc_mcontext);
+  if (restore_fpstate((gaddr_t) frame.sf_sc.uc_mcontext.sc_fpstate) < 0) {
+    die_with_forcedsig(LINUX_SIGSEGV);
+  }
   sigset_t dset;
   task.sigmask = frame.sf_sc.uc_mcontext.sc_mask;
   linux_to_darwin_sigset(&task.sigmask, &dset);
@@ -515,5 +1183,76 @@ DEFINE_SYSCALL(sigaltstack, gaddr_t, uss, gaddr_t, uoss)
 
 DEFINE_SYSCALL(kill, l_pid_t, pid, int, sig)
 {
+  if (sig < 0 || sig > LINUX_NSIG) {
+    return -LINUX_EINVAL;
+  }
   return send_signal(pid, sig);
 }
+
+DEFINE_SYSCALL(tgkill, l_pid_t, tgid, l_pid_t, tid, int, sig)
+{
+  if (tgid <= 0 || tid <= 0 || sig < 0 || sig > LINUX_NSIG) {
+    return -LINUX_EINVAL;
+  }
+  l_siginfo_t info = {
+    .lsi_signo = sig,
+    .lsi_code = LINUX_SI_TKILL,
+  };
+  info.lsi_pid = getpid();
+  info.lsi_uid = proc.cred.uid;
+  return send_thread_signal(tgid, tid, &info);
+}
+
+DEFINE_SYSCALL(tkill, l_pid_t, tid, int, sig)
+{
+  if (tid <= 0 || sig < 0 || sig > LINUX_NSIG) {
+    return -LINUX_EINVAL;
+  }
+  l_siginfo_t info = {
+    .lsi_signo = sig,
+    .lsi_code = LINUX_SI_TKILL,
+  };
+  info.lsi_pid = getpid();
+  info.lsi_uid = proc.cred.uid;
+  return send_thread_signal(-1, tid, &info);
+}
+
+static int
+copy_siginfo_from_user(l_siginfo_t *info, gaddr_t uinfo, l_pid_t tgid, int sig)
+{
+  if (sig < 0 || sig > LINUX_NSIG) {
+    return -LINUX_EINVAL;
+  }
+  if (copy_from_user(info, uinfo, sizeof *info)) {
+    return -LINUX_EFAULT;
+  }
+  /* only the kernel may claim to be the kernel or kill(2), except to oneself */
+  if ((info->lsi_code >= 0 || info->lsi_code == LINUX_SI_TKILL) && tgid != getpid()) {
+    return -LINUX_EPERM;
+  }
+  info->lsi_signo = sig;
+  return 0;
+}
+
+DEFINE_SYSCALL(rt_sigqueueinfo, l_pid_t, tgid, int, sig, gaddr_t, uinfo)
+{
+  l_siginfo_t info;
+  int err;
+  if ((err = copy_siginfo_from_user(&info, uinfo, tgid, sig)) < 0) {
+    return err;
+  }
+  return send_signal_info(tgid, &info);
+}
+
+DEFINE_SYSCALL(rt_tgsigqueueinfo, l_pid_t, tgid, l_pid_t, tid, int, sig, gaddr_t, uinfo)
+{
+  if (tgid <= 0 || tid <= 0) {
+    return -LINUX_EINVAL;
+  }
+  l_siginfo_t info;
+  int err;
+  if ((err = copy_siginfo_from_user(&info, uinfo, tgid, sig)) < 0) {
+    return err;
+  }
+  return send_thread_signal(tgid, tid, &info);
+}
@@ -13,6 +13,7 @@
 #include "vmm.h"
 #include "mm.h"
 #include "noah.h"
+#include "fs.h"
 #include "syscall.h"
 #include "linux/errno.h"
 #include "x86/irq_vectors.h"
@@ -61,7 +62,8 @@ handle_syscall(void)
   vmm_read_register(HV_X86_RAX, &rax);
   if (rax >= NR_SYSCALLS) {
     warnk("unknown system call: %lld\n", rax);
-    send_signal(getpid(), LINUX_SIGSYS);
+    vmm_write_register(HV_X86_RAX, -LINUX_ENOSYS);
+    return 0;
   }
   uint64_t rdi, rsi, rdx, r10, r8, r9;
   vmm_read_register(HV_X86_RDI, &rdi);
@@ -70,7 +72,21 @@ handle_syscall(void)
   vmm_read_register(HV_X86_R10, &r10);
   vmm_read_register(HV_X86_R8, &r8);
   vmm_read_register(HV_X86_R9, &r9);
+  if (vmm_ept_deferred()) {
+    settle_deferred_fork(rax);
+  }
   uint64_t retval = sc_handler_table[rax](rdi, rsi, rdx, r10, r8, r9);
+  if (retval == (uint64_t) -LINUX_EINTR && vmm_kicked() && !has_sigpending()) {
+    /* interrupted only to be parked for a fork in another thread; restart */
+    restore_saved_sigmask();
+    uint64_t rip;
+    vmm_read_register(HV_X86_RIP, &rip);
+    vmm_write_register(HV_X86_RIP, rip - 2);
+    return 0;
+  }
+  if (retval == (uint64_t) -LINUX_EINTR) {
+    forget_nanosleep_restart();
+  }
   vmm_write_register(HV_X86_RAX, retval);
 
   if (rax == LSYS_rt_sigreturn) {
@@ -82,10 +98,18 @@ handle_syscall(void)
 int
 task_run()
 {
+  /* step aside while another thread forks */
+  vmm_park();
+
+  if (checkpoint_pending()) {
+    do_checkpoint();
+  }
+
   /* handle pending signals */
   if (has_sigpending()) {
     handle_signal();
   }
+  restore_saved_sigmask();
   return vmm_run();
 }
 
@@ -197,11 +221,112 @@ static void check_vm_entry()
 
 }
 
+/* page fault error code */
+#define PF_ERR_PRESENT (1 << 0)
+#define PF_ERR_WRITE   (1 << 1)
+#define PF_ERR_USER    (1 << 2)
+#define PF_ERR_FETCH   (1 << 4)
+
+/* si_code of an x87 or SIMD floating point exception, from its unmasked status flags */
+static int
+fpe_code(int vec)
+{
+  char fpstate[VMM_FPSTATE_SIZE] __attribute__((aligned(16)));
+  vmm_read_fpstate(fpstate, sizeof fpstate);
+
+  /* the fxsave layout leads the xsave image */
+  uint16_t cwd, swd;
+  uint32_t mxcsr, status;
+  memcpy(&cwd, fpstate, sizeof cwd);
+  memcpy(&swd, fpstate + 2, sizeof swd);
+  memcpy(&mxcsr, fpstate + 24, sizeof mxcsr);
+  if (vec == X86_VEC_MF) {
+    status = swd & ~cwd;
+  } else {
+    status = mxcsr & ~(mxcsr >> 7);
+  }
+
+  if (status & 0x01)            /* invalid operation */
+    return LINUX_FPE_FLTINV;
+  if (status & 0x04)            /* divide by zero */
+    return LINUX_FPE_FLTDIV;
+  if (status & 0x08)            /* overflow */
+    return LINUX_FPE_FLTOVF;
+  if (status & 0x12)            /* underflow, denormal operand */
+    return LINUX_FPE_FLTUND;
+  if (status & 0x20)            /* precision */
+    return LINUX_FPE_FLTRES;
+  return 0;
+}
+
+/* turn an exception in the guest into the signal Linux would send for it (cf. arch/x86/kernel/traps.c) */
+static void
+handle_exception(int vec, uint64_t exc_info)
+{
+  uint64_t rip, err = 0, qual;
+  vmm_read_register(HV_X86_RIP, &rip);
+  if (exc_info & (1 << 11)) {
+    vmm_read_vmcs(VMCS_RO_VMEXIT_IRQ_ERROR, &err);
+  }
+  printk("exception %d at 0x%llx (error code 0x%llx)\n", vec, rip, err);
+
+  switch (vec) {
+  case X86_VEC_DE:
+    force_fault(LINUX_SIGFPE, LINUX_FPE_INTDIV, rip, vec, err);
+    break;
+  case X86_VEC_DB:
+    vmm_read_vmcs(VMCS_RO_EXIT_QUALIFIC, &qual);
+    force_fault(LINUX_SIGTRAP, (qual & (1 << 14)) ? LINUX_TRAP_TRACE : LINUX_TRAP_HWBKPT, rip, vec, err);
+    break;
+  case X86_VEC_BP:
+  case X86_VEC_OF: {
+    /* traps: the vcpu has not moved past int3 or into yet */
+    uint64_t instlen;
+    vmm_read_vmcs(VMCS_RO_VMEXIT_INSTR_LEN, &instlen);
+    vmm_write_register(HV_X86_RIP, rip + instlen);
+    force_fault(vec == X86_VEC_BP ? LINUX_SIGTRAP : LINUX_SIGSEGV, LINUX_SI_KERNEL, 0, vec, err);
+    break;
+  }
+  case X86_VEC_UD:
+    force_fault(LINUX_SIGILL, LINUX_ILL_ILLOPN, rip, vec, err);
+    break;
+  case X86_VEC_NP:
+  case X86_VEC_SS:
+    force_fault(LINUX_SIGBUS, LINUX_SI_KERNEL, 0, vec, err);
+    break;
+  case X86_VEC_PF:
+    /* the exit qualification holds what would have been CR2 */
+    vmm_read_vmcs(VMCS_RO_EXIT_QUALIFIC, &qual);
+    force_fault(LINUX_SIGSEGV, (err & PF_ERR_PRESENT) ? LINUX_SEGV_ACCERR : LINUX_SEGV_MAPERR, qual, vec, err);
+    break;
+  case X86_VEC_AC:
+    force_fault(LINUX_SIGBUS, LINUX_BUS_ADRALN, 0, vec, err);
+    break;
+  case X86_VEC_MF:
+  case X86_VEC_XM:
+    force_fault(LINUX_SIGFPE, fpe_code(vec), rip, vec, err);
+    break;
+  case X86_VEC_MC:
+    force_fault(LINUX_SIGBUS, LINUX_BUS_MCEERR_AR, rip, vec, err);
+    break;
+  case X86_VEC_BR:
+  case X86_VEC_NM:
+  case X86_VEC_DF:
+  case X86_VEC_TS:
+  case X86_VEC_GP:
+  case X86_VEC_VE:
+  case X86_VEC_SX:
+  default:
+    force_fault(LINUX_SIGSEGV, LINUX_SI_KERNEL, 0, vec, err);
+    break;
+  }
+}
+
 void
 main_loop(int return_on_sigret)
 {
   /* main_loop returns only if return_on_sigret == 1 && rt_sigreturn is invoked.
-     see also: rt_sigsuspend */
+     see also: handle_signal */
 
   while (task_run() == 0) {
 
@@ -238,15 +363,7 @@ main_loop(int return_on_sigret)
       }
 
       int exc_vec = exc_info & 0xff;
-      switch (exc_vec) {
-      case X86_VEC_PF: {
-        /* FIXME */
-        uint64_t gladdr;
-        vmm_read_vmcs(VMCS_RO_EXIT_QUALIFIC, &gladdr);
-        printk("page fault: caused by guest linear address 0x%llx\n", gladdr);
-        send_signal(getpid(), LINUX_SIGSEGV);
-      }
-      case X86_VEC_UD: {
+      if (exc_vec == X86_VEC_UD) {
         uint64_t instlen, rip;
         vmm_read_vmcs(VMCS_RO_VMEXIT_INSTR_LEN, &instlen);
         vmm_read_register(HV_X86_RIP, &rip);
@@ -270,48 +387,8 @@ main_loop(int return_on_sigret)
 	    }
 	  }
 	}
-        /* FIXME */
-        warnk("invalid opcode! (rip = %p): ", (void *) rip);
-        unsigned char inst[instlen];
-        if (copy_from_user(inst, rip, instlen))
-          assert(false);
-        for (uint64_t i = 0; i < instlen; ++i)
-          fprintf(stderr, "%02x ", inst[i] & 0xff);
-        fprintf(stderr, "\n");
-        send_signal(getpid(), LINUX_SIGILL);
-      }
-      case X86_VEC_DE:
-      case X86_VEC_DB:
-      case X86_VEC_BP:
-      case X86_VEC_OF:
-      case X86_VEC_BR:
-      case X86_VEC_NM:
-      case X86_VEC_DF:
-      case X86_VEC_TS:
-      case X86_VEC_NP:
-      case X86_VEC_SS:
-      case X86_VEC_GP:
-      case X86_VEC_MF:
-      case X86_VEC_AC:
-      case X86_VEC_MC:
-      case X86_VEC_XM:
-      case X86_VEC_VE:
-      case X86_VEC_SX:
-      default:
-        /* FIXME */
-        warnk("exception thrown: %d\n", exc_vec);
-        uint64_t instlen, rip;
-        vmm_read_vmcs(VMCS_RO_VMEXIT_INSTR_LEN, &instlen);
-        vmm_read_register(HV_X86_RIP, &rip);
-        fprintf(stderr, "inst: \n");
-        unsigned char inst[instlen];
-        if (copy_from_user(inst, rip, instlen))
-          assert(false);
-        for (uint64_t i = 0; i < instlen; ++i)
-          fprintf(stderr, "%02x ", inst[i] & 0xff);
-        fprintf(stderr, "\n");
-        exit(1);                /* TODO */
       }
+      handle_exception(exc_vec, exc_info);
       break;
     }
 
@@ -327,6 +404,14 @@ main_loop(int return_on_sigret)
       vmm_read_vmcs(VMCS_RO_EXIT_QUALIFIC, &qual);
       printk("exit qualification = 0x%llx\n", qual);
 
+      if (vmm_ept_deferred()) {
+        /* a forked child touching the inherited image for the first time */
+        int access = (qual & (1 << 1)) ? VERIFY_WRITE : (qual & (1 << 2)) ? VERIFY_EXEC : VERIFY_READ;
+        if (vmm_fault_in_ept(gpaddr, access)) {
+          break;
+        }
+      }
+
       if (qual & (1 << 7)) {
         uint64_t gladdr;
         vmm_read_vmcs(VMCS_RO_GUEST_LIN_ADDR, &gladdr);
@@ -343,7 +428,11 @@ main_loop(int return_on_sigret)
 
         if (!addr_ok(gladdr, verify)) {
           printk("page fault: caused by guest linear address 0x%llx\n", gladdr);
-          send_signal(getpid(), LINUX_SIGSEGV);
+          /* the error code the guest would have seen for this #PF */
+          bool present = find_region(gladdr, proc.mm) != NULL;
+          uint64_t err = PF_ERR_USER | (present ? PF_ERR_PRESENT : 0)
+            | (verify == VERIFY_WRITE ? PF_ERR_WRITE : 0) | (verify == VERIFY_EXEC ? PF_ERR_FETCH : 0);
+          force_fault(LINUX_SIGSEGV, present ? LINUX_SEGV_ACCERR : LINUX_SEGV_MAPERR, gladdr, X86_VEC_PF, err);
         }
       } else {
         printk("guest linear address = (unavailable)\n");
@@ -351,15 +440,16 @@ main_loop(int return_on_sigret)
       break;
 
     case VMX_REASON_CPUID: {
-      uint64_t rax;
+      uint64_t rax, rcx;
       vmm_read_register(HV_X86_RAX, &rax);
-      unsigned eax, ebx, ecx, edx;
-      __get_cpuid(rax, &eax, &ebx, &ecx, &edx);
+      vmm_read_register(HV_X86_RCX, &rcx);
+      uint32_t regs[4];
+      guest_cpuid(rax, rcx, regs);
 
-      vmm_write_register(HV_X86_RAX, eax);
-      vmm_write_register(HV_X86_RBX, ebx);
-      vmm_write_register(HV_X86_RCX, ecx);
-      vmm_write_register(HV_X86_RDX, edx);
+      vmm_write_register(HV_X86_RAX, regs[0]);
+      vmm_write_register(HV_X86_RBX, regs[1]);
+      vmm_write_register(HV_X86_RCX, regs[2]);
+      vmm_write_register(HV_X86_RDX, regs[3]);
 
       uint64_t rip;
       vmm_read_register(HV_X86_RIP, &rip);
@@ -372,6 +462,10 @@ main_loop(int return_on_sigret)
       break;
     }
 
+    case VMX_REASON_VMX_TIMER_EXPIRED:
+      /* a kick, or just the periodic check for one; task_run looks at what the kicker wanted */
+      break;
+
     case VMX_REASON_HLT: {
       break;
     }
@@ -414,7 +508,8 @@ init_vmcs()
 
 #define cap2ctrl(cap,ctrl) (((ctrl) | ((cap) & 0xffffffff)) & ((cap) >> 32))
 
-  vmm_write_vmcs(VMCS_CTRL_PIN_BASED, cap2ctrl(vmx_cap_pinbased, 0));
+  /* the preemption timer, where there is one, carries kicks into the guest; see vmm_run */
+  vmm_write_vmcs(VMCS_CTRL_PIN_BASED, cap2ctrl(vmx_cap_pinbased, PIN_BASED_PREEMPTION_TIMER));
   vmm_write_vmcs(VMCS_CTRL_CPU_BASED, cap2ctrl(vmx_cap_procbased,
                                                CPU_BASED_HLT |
                                                CPU_BASED_CR8_LOAD |
@@ -431,7 +526,7 @@ init_vmcs()
 }
 
 void
-init_special_regs()
+init_special_regs(void)
 {
   uint64_t cr0;
   vmm_read_vmcs(VMCS_GUEST_CR0, &cr0);
@@ -439,7 +534,14 @@ init_special_regs()
 
   uint64_t cr4;
   vmm_read_vmcs(VMCS_GUEST_CR4, &cr4);
-  vmm_write_vmcs(VMCS_GUEST_CR4, cr4 | CR4_PAE | CR4_OSFXSR | CR4_OSXMMEXCPT | CR4_VMXE | CR4_OSXSAVE);
+  cr4 |= CR4_PAE | CR4_OSFXSR | CR4_OSXMMEXCPT | CR4_VMXE | CR4_OSXSAVE;
+  /* lets threads switch their tls bases without a trip through arch_prctl */
+  if (guest_has_fsgsbase()) {
+    cr4 |= CR4_FSGSBASE;
+  } else {
+    cr4 &= ~CR4_FSGSBASE;
+  }
+  vmm_write_vmcs(VMCS_GUEST_CR4, cr4);
 
   uint64_t efer;
   vmm_read_vmcs(VMCS_GUEST_IA32_EFER, &efer);
@@ -463,13 +565,9 @@ init_regs()
 {
   /* set up cpu regs */
   vmm_write_register(HV_X86_RFLAGS, 0x2);
-  unsigned int eax, ebx, ecx, edx;
-  get_cpuid_count(0x0d, 0x0, &eax, &ebx, &ecx, &edx);
-  if (eax & XCR0_SSE_STATE) {
-    uint64_t xcr0;
-    vmm_read_register(HV_X86_XCR0, &xcr0);
-    vmm_write_register(HV_X86_XCR0, xcr0 | XCR0_SSE_STATE);
-  }
+  /* everything up front, for libc checks xgetbv once at startup to pick its
+     string and math routines */
+  vmm_write_register(HV_X86_XCR0, guest_xcr0());
 }
 
 void
@@ -559,21 +657,49 @@ init_first_proc(const char *root)
   task.tid = getpid();
 }
 
+static bool boot_trace;
+static uint64_t boot_clock;
+
+static void
+trace_boot(const char *phase)
+{
+  uint64_t now = vmm_clock_ns();
+  if (boot_trace) {
+    fprintf(stderr, "noah: boot: %-18s %9.3f ms\n", phase, (now - boot_clock) / 1e6);
+  }
+  boot_clock = now;
+}
+
 static void
 init_vkernel(const char *root)
 {
   init_mm(&vkern_mm);
+  trace_boot("init_mm");
   init_shm_malloc();
+  trace_boot("init_shm_malloc");
+  init_ipc();
+  trace_boot("init_ipc");
   init_vmcs();
+  trace_boot("init_vmcs");
   init_msr();
+  trace_boot("init_msr");
   init_page();
+  trace_boot("init_page");
+  init_cpuid();
+  trace_boot("init_cpuid");
   init_special_regs();
+  trace_boot("init_special_regs");
   init_segment();
+  trace_boot("init_segment");
   init_idt();
+  trace_boot("init_idt");
   init_regs();
+  trace_boot("init_regs");
   init_fpu();
+  trace_boot("init_fpu");
 
   init_first_proc(root);
+  trace_boot("init_first_proc");
 }
 
 void
@@ -601,6 +727,7 @@ noreturn void
 die_with_forcedsig(int sig)
 {
   // TODO: Termination processing
+  exit_ipc();
 
   /* Force default signal action */
   int dsig = linux_to_darwin_signal(sig);
@@ -639,6 +766,13 @@ main(int argc, char *argv[], char **envp)
   check_platform_version();
 
   char root[PATH_MAX] = {};
+  char upper[PATH_MAX] = {};
+  char zygote_path[PATH_MAX] = {};
+  char connect_path[PATH_MAX] = {};
+  char checkpoint_path[PATH_MAX] = {};
+  char restore_path[PATH_MAX] = {};
+  const char *preloads[ZYGOTE_MAX_PRELOAD];
+  int nr_preloads = 0;
 
   int c;
   enum {PRINTK_PATH, WARNK_PATH, STRACE_PATH, MAX_DEBUG_PATH};
@@ -648,11 +782,18 @@ main(int argc, char *argv[], char **envp)
     { "strace", required_argument, NULL, 's'},
     { "warning", required_argument, NULL, 'w'},
     { "mnt", required_argument, NULL, 'm' },
+    { "upper", required_argument, NULL, 'u' },
+    { "zygote", required_argument, NULL, 'z' },
+    { "preload", required_argument, NULL, 'p' },
+    { "connect", required_argument, NULL, 'c' },
+    { "checkpoint", required_argument, NULL, 'C' },
+    { "restore", required_argument, NULL, 'R' },
+    { "boot-trace", no_argument, NULL, 'B' },
     { "help", no_argument, NULL, 'h' },
     { 0, 0, 0, 0 }
   };
 
-  while ((c = getopt_long(argc, argv, "+ho:w:s:m:", long_options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "+ho:w:s:m:u:z:p:c:C:R:B", long_options, NULL)) != -1) {
     switch (c) {
     case 'o':
       strncpy(debug_paths[PRINTK_PATH], optarg, PATH_MAX);
@@ -670,9 +811,37 @@ main(int argc, char *argv[], char **envp)
       }
       argv[optind - 1] = root;
       break;
+    case 'u':
+      strncpy(upper, optarg, PATH_MAX);
+      break;
+    case 'z':
+      strncpy(zygote_path, optarg, PATH_MAX);
+      break;
+    case 'p':
+      if (nr_preloads == ZYGOTE_MAX_PRELOAD) {
+        fprintf(stderr, "Too many --preload flags\n");
+        exit(1);
+      }
+      preloads[nr_preloads++] = optarg;
+      break;
+    case 'c':
+      strncpy(connect_path, optarg, PATH_MAX);
+      break;
+    case 'C':
+      strncpy(checkpoint_path, optarg, PATH_MAX);
+      break;
+    case 'R':
+      strncpy(restore_path, optarg, PATH_MAX);
+      break;
+    case 'B':
+      boot_trace = true;
+      break;
     case 'h':
     default:
-      printf("Usage: noah -h | [-o output] [-w warning] [-s strace] -m /virtual/filesystem/root executable ...\n");
+      printf("Usage: noah -h | [-o output] [-w warning] [-s strace] [-B] -m /virtual/filesystem/root [-u /writable/upper/dir] executable ...\n");
+      printf("       noah [-o output] [-w warning] [-s strace] -m /virtual/filesystem/root [-u /writable/upper/dir] -z socket [-p file ...]\n");
+      printf("       noah -c socket executable ...\n");
+      printf("       noah [-o output] [-w warning] [-s strace] [-m /virtual/filesystem/root] [-u /writable/upper/dir] -R checkpoint\n");
       exit(0);
     }
   }
@@ -680,14 +849,34 @@ main(int argc, char *argv[], char **envp)
   argc -= optind;
   argv += optind;
 
-  if (argc == 0) {
+  if (connect_path[0] != '\0') {
+    if (argc == 0) {
+      abort();
+    }
+    zygote_connect(connect_path, argc, argv, envp);
+  }
+
+  if (argc == 0 && zygote_path[0] == '\0' && restore_path[0] == '\0') {
     abort();
   }
 
+  if (restore_path[0] != '\0' && root[0] == '\0' && checkpoint_root(restore_path, root, sizeof root) < 0) {
+    fprintf(stderr, "noah: %s is not a checkpoint\n", restore_path);
+    exit(1);
+  }
+
+  uint64_t boot_start = boot_clock = vmm_clock_ns();
   vmm_create();
+  trace_boot("vmm_create");
 
   init_vkernel(root);
 
+  if (upper[0] != '\0' && init_overlay(upper) < 0) {
+    perror("Invalid --upper flag");
+    exit(1);
+  }
+  trace_boot("init_overlay");
+
   for (int i = PRINTK_PATH; i < MAX_DEBUG_PATH; i++) {
     static void (* init_funcs[3])(const char *path) = {
       [PRINTK_PATH] = init_printk,
@@ -698,9 +887,26 @@ main(int argc, char *argv[], char **envp)
       init_funcs[i](debug_paths[i]);
     }
   }
+  trace_boot("debug sinks");
+  if (boot_trace) {
+    fprintf(stderr, "noah: boot: %-18s %9.3f ms\n", "total", (vmm_clock_ns() - boot_start) / 1e6);
+  }
+
+  if (zygote_path[0] != '\0') {
+    /* returns in each spawned child */
+    zygote_serve(zygote_path, root, preloads, nr_preloads, &argc, &argv, &envp);
+  }
+
+  if (checkpoint_path[0] != '\0') {
+    arm_checkpoint(checkpoint_path);
+  }
 
   int err;
-  if ((err = do_exec(argv[0], argc, argv, envp)) < 0) {
+  if (restore_path[0] != '\0') {
+    if (restore_checkpoint(restore_path) < 0) {
+      exit(1);
+    }
+  } else if ((err = do_exec(argv[0], argc, argv, envp)) < 0) {
     errno = linux_to_darwin_errno(-err);
     perror("Error");
     exit(1);
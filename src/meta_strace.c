@@ -118,9 +118,13 @@ void
 meta_strace_info(const char *fmt, ...)
 {
   va_list ap;
-  va_start(ap, fmt);
   char *mes;
 
+  if (!strace_sink) {
+    return;
+  }
+
+  va_start(ap, fmt);
   vasprintf(&mes, fmt, ap);
 
   fprintf(strace_sink, "INFO: %s", mes);
@@ -17,8 +17,11 @@ typedef struct header Header;
 
 /* 1GB should suffice, I guess? */
 #define MEMORY_ARENA_SIZE (1L * 1024 * 1024 * 1024)
+/* the arena is made accessible this much at a time */
+#define MEMORY_ARENA_CHUNK (1L * 1024 * 1024)
 
 void *arena_start;              /* never changed after the boot sequence completed */
+static char *arena_committed;   /* per process: end of the accessible part of the arena */
 
 struct malloc_data {
   pthread_rwlock_t lock;
@@ -34,16 +37,42 @@ struct malloc_data {
 #define freep (((struct malloc_data *) arena_start)->freep)
 #define brk_start (((struct malloc_data *) arena_start)->brk_start)
 
+/*
+ * Protections are private to each process while the memory is shared, so a
+ * process that did not grow the break itself catches up here before touching
+ * the arena.
+ */
+static int
+commit_arena(char *end)
+{
+  if (end <= arena_committed)
+    return 0;
+  char *start = arena_committed;
+  end = (char *) arena_start + ((end - (char *) arena_start + MEMORY_ARENA_CHUNK - 1) / MEMORY_ARENA_CHUNK) * MEMORY_ARENA_CHUNK;
+  if (end > (char *) arena_start + MEMORY_ARENA_SIZE)
+    end = (char *) arena_start + MEMORY_ARENA_SIZE;
+  if (mprotect(start, end - start, PROT_READ | PROT_WRITE) < 0)
+    return -1;
+  arena_committed = end;
+  return 0;
+}
+
 void
 init_shm_malloc(void)
 {
   /* this function is part of the "boot" sequence */
 
-  arena_start = mmap(NULL, MEMORY_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_HASSEMAPHORE | MAP_SHARED, -1, 0);
+  /* only reserve the address range; pages are opened up as the break grows */
+  arena_start = mmap(NULL, MEMORY_ARENA_SIZE, PROT_NONE, MAP_ANON | MAP_HASSEMAPHORE | MAP_SHARED, -1, 0);
   if (arena_start == MAP_FAILED) {
     perror("init_malloc");
     exit(1);
   }
+  arena_committed = arena_start;
+  if (commit_arena((char *) arena_start + sizeof(struct malloc_data)) < 0) {
+    perror("init_malloc");
+    exit(1);
+  }
 
   pthread_rwlock_init(&lock, NULL);
   bzero(&base, sizeof base);
@@ -56,6 +85,8 @@ static void *__shm_sbrk(size_t s)
   /* we must be in the critical section in shm_malloc so don't get the lock here... */
   if (brkp + s >= (char *) arena_start + MEMORY_ARENA_SIZE)
     return NULL;
+  if (commit_arena(brkp + s) < 0)
+    return NULL;
   brkp += s;
   return brkp - s;
 }
@@ -141,7 +172,9 @@ void *shm_malloc(size_t nbytes)
 {
   void *ptr;
 
+  /* the lock itself lives in the first chunk, which every process has */
   pthread_rwlock_wrlock(&lock);
+  commit_arena(brkp);
   ptr = __shm_malloc(nbytes);
   pthread_rwlock_unlock(&lock);
   return ptr;
@@ -150,6 +183,21 @@ void *shm_malloc(size_t nbytes)
 void shm_free(void *ptr)
 {
   pthread_rwlock_wrlock(&lock);
+  commit_arena(brkp);
   __shm_free(ptr);
   pthread_rwlock_unlock(&lock);
 }
+
+/*
+ * Makes whatever any process has allocated so far accessible to this one.
+ * Call it before following a pointer into the arena that another process may
+ * have published, after taking the lock that protects the pointer.
+ */
+void shm_commit(void)
+{
+  if (brkp <= arena_committed)
+    return;
+  pthread_rwlock_wrlock(&lock);
+  commit_arena(brkp);
+  pthread_rwlock_unlock(&lock);
+}
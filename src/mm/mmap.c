@@ -3,6 +3,7 @@
 #include "noah.h"
 #include "vmm.h"
 #include "mm.h"
+#include "fs.h"
 #include "x86/vm.h"
 
 #include "linux/mman.h"
@@ -126,6 +127,9 @@ do_mmap(gaddr_t addr, size_t len, int d_prot, int l_prot, int l_flags, int fd, o
 DEFINE_SYSCALL(mmap, gaddr_t, addr, size_t, len, int, prot, int, flags, int, fd, off_t, offset)
 {
   uint64_t ret;
+  if (!(flags & LINUX_MAP_ANONYMOUS) && is_dev_zero(fd)) {
+    flags |= LINUX_MAP_ANONYMOUS;
+  }
   pthread_rwlock_wrlock(&proc.mm->alloc_lock);
   ret = do_mmap(addr, len, prot, prot, flags, fd, offset);
   pthread_rwlock_unlock(&proc.mm->alloc_lock);
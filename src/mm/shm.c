@@ -2,65 +2,540 @@
 #include "noah.h"
 #include "vmm.h"
 #include "mm.h"
+#include "x86/vm.h"
 #include "linux/common.h"
-#include "linux/futex.h"
-#include "linux/time.h"
+#include "linux/errno.h"
+#include "linux/mman.h"
 #include "linux/ipc.h"
 
-#include <assert.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <sys/time.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
-DEFINE_SYSCALL(shmget, l_key_t, l_key, size_t, size, int, l_shmflg)
+/*
+ * SysV shared memory. Each segment is a POSIX shared memory object of its
+ * own, so it is not bound by the host's tiny kern.sysv.shm* limits, and its
+ * bookkeeping lives in the shared arena like the semaphores do. shmat maps
+ * the object into the host and enters it into the guest as an ordinary
+ * shared mm_region, which fork keeps shared and exec throws away.
+ */
+
+#define SHMMNI 4096
+#define SHMMIN 1
+#define SHMMAX (ULONG_MAX - (1UL << 24))
+#define SHMALL (ULONG_MAX - (1UL << 24))     /* in pages */
+#define IPCMNI 32768                          /* an id is its index plus seq * IPCMNI */
+
+struct shm_segment {
+  int id;
+  struct l_ipc64_perm perm;
+  size_t size;                  /* as requested by shmget */
+  size_t map_size;              /* rounded up to the page size of the segment */
+  bool hugetlb;
+  time_t atime, dtime, ctime;
+  l_pid_t cpid, lpid;
+  unsigned long nattch;
+  char name[32];                /* of the host object */
+};
+
+struct shm_ns {
+  pthread_mutex_t lock;
+  unsigned short seq;
+  int nr_segs;
+  unsigned long nr_pages;
+  pid_t boot_pid;               /* keeps the object names of two noahs apart */
+  struct shm_segment *segs[SHMMNI];
+};
+
+static struct shm_ns *shm_ns;   /* in the arena; set up before the first fork */
+
+/* attaches of this process, guarded by proc.mm->alloc_lock */
+struct shm_attach {
+  struct list_head list;
+  int id;
+  gaddr_t gaddr;
+  size_t size;
+  char *haddr;                  /* tells the segment's regions from later mappings */
+};
+
+static LIST_HEAD(shm_attaches);
+
+void
+init_shm(void)
 {
-  int shmflg = 0;
-  if (l_shmflg & LINUX_IPC_EXCL)
-    shmflg |= IPC_EXCL;
-  if (l_shmflg & LINUX_IPC_CREAT)
-    shmflg |= IPC_CREAT;
-  key_t key = IPC_PRIVATE;
-  if (l_key != LINUX_IPC_PRIVATE) {
-    warnk("shmget: unknown key is given: %d\n", l_key);
-    key = l_key;
+  shm_ns = shm_malloc(sizeof *shm_ns);
+  if (shm_ns == NULL) {
+    panic("init_shm: out of shared memory");
   }
-  return syswrap(shmget(key, size, shmflg));
+  memset(shm_ns, 0, sizeof *shm_ns);
+  init_shared_mutex(&shm_ns->lock);
+  shm_ns->boot_pid = getpid();
+}
+
+/*
+ * Segments may have been allocated by another process, past the part of the
+ * arena this one has committed, so the arena is caught up after taking the
+ * lock that publishes them.
+ */
+static void
+lock_ns(void)
+{
+  pthread_mutex_lock(&shm_ns->lock);
+  shm_commit();
+}
+
+/* called with shm_ns->lock held */
+static struct shm_segment *
+find_segment(int shmid)
+{
+  if (shmid < 0 || shmid % IPCMNI >= SHMMNI)
+    return NULL;
+  struct shm_segment *seg = shm_ns->segs[shmid % IPCMNI];
+  if (seg == NULL || seg->id != shmid)
+    return NULL;
+  return seg;
 }
 
-DEFINE_SYSCALL(shmat, int, shmid, gaddr_t, addr, int, shmflg)
+/* called with shm_ns->lock held */
+static void
+destroy_segment(struct shm_segment *seg)
 {
-  if (addr != 0) {
-    warnk("shmat: non-zero address is given: 0x%llx", addr);
-    return -LINUX_ENOSYS;
+  shm_unlink(seg->name);
+  shm_ns->segs[seg->id % IPCMNI] = NULL;
+  shm_ns->nr_segs--;
+  shm_ns->nr_pages -= seg->map_size / PAGE_SIZEOF(PAGE_4KB);
+  shm_free(seg);
+}
+
+/* drops an attach; a removed segment goes away with its last one */
+static void
+put_segment(int shmid)
+{
+  lock_ns();
+  struct shm_segment *seg = find_segment(shmid);
+  if (seg != NULL) {
+    seg->nattch--;
+    seg->dtime = time(NULL);
+    seg->lpid = getpid();
+    if ((seg->perm.mode & LINUX_SHM_DEST) && seg->nattch == 0) {
+      destroy_segment(seg);
+    }
+  }
+  pthread_mutex_unlock(&shm_ns->lock);
+}
+
+/* called with shm_ns->lock held */
+static int
+new_segment(l_key_t key, size_t size, int shmflg)
+{
+  if (size < SHMMIN || size > SHMMAX)
+    return -LINUX_EINVAL;
+  bool hugetlb = shmflg & LINUX_SHM_HUGETLB;
+  size_t map_size = roundup(size, PAGE_SIZEOF(hugetlb ? PAGE_2MB : PAGE_4KB));
+  unsigned long nr_pages = map_size / PAGE_SIZEOF(PAGE_4KB);
+  if (shm_ns->nr_segs == SHMMNI || shm_ns->nr_pages + nr_pages > SHMALL)
+    return -LINUX_ENOSPC;
+
+  int idx;
+  for (idx = 0; shm_ns->segs[idx] != NULL; idx++)
+    ;
+  struct shm_segment *seg = shm_malloc(sizeof *seg);
+  if (seg == NULL)
+    return -LINUX_ENOMEM;
+  memset(seg, 0, sizeof *seg);
+  init_ipc_perm(&seg->perm, key, shmflg, shm_ns->seq);
+  shm_ns->seq = (shm_ns->seq + 1) % (INT32_MAX / IPCMNI);
+  seg->id = seg->perm.seq * IPCMNI + idx;
+  snprintf(seg->name, sizeof seg->name, "/noah.%d.%d", shm_ns->boot_pid, seg->id);
+
+  int fd = shm_open(seg->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    /* left over by a noah that died with the same pid */
+    shm_unlink(seg->name);
+    fd = shm_open(seg->name, O_RDWR | O_CREAT | O_EXCL, 0600);
   }
-  assert(shmflg == 0);
-  void *ptr = shmat(shmid, NULL, shmflg);
-  if (ptr == (void *) -1) {
-    return -linux_to_darwin_errno(errno);
+  if (fd < 0 || ftruncate(fd, map_size) < 0) {
+    int err = errno;
+    if (fd >= 0) {
+      close(fd);
+      shm_unlink(seg->name);
+    }
+    shm_free(seg);
+    return -darwin_to_linux_errno(err);
   }
-  struct shmid_ds ds;
-  shmctl(shmid, IPC_STAT, &ds);
-  size_t len = ds.shm_segsz;
+  close(fd);
+
+  seg->size = size;
+  seg->map_size = map_size;
+  seg->hugetlb = hugetlb;
+  seg->cpid = getpid();
+  seg->ctime = time(NULL);
+
+  shm_ns->segs[idx] = seg;
+  shm_ns->nr_segs++;
+  shm_ns->nr_pages += nr_pages;
+  return seg->id;
+}
+
+DEFINE_SYSCALL(shmget, l_key_t, key, size_t, size, int, shmflg)
+{
+  int ret;
+  lock_ns();
+  if (key != LINUX_IPC_PRIVATE) {
+    for (int i = 0; i < SHMMNI; i++) {
+      struct shm_segment *seg = shm_ns->segs[i];
+      if (seg == NULL || seg->perm.key != key)
+        continue;
+      if ((shmflg & LINUX_IPC_CREAT) && (shmflg & LINUX_IPC_EXCL)) {
+        ret = -LINUX_EEXIST;
+      } else if (size > seg->size) {
+        ret = -LINUX_EINVAL;
+      } else if (!ipc_permitted(&seg->perm, shmflg & 0777)) {
+        ret = -LINUX_EACCES;
+      } else {
+        ret = seg->id;
+      }
+      goto out;
+    }
+    if (!(shmflg & LINUX_IPC_CREAT)) {
+      ret = -LINUX_ENOENT;
+      goto out;
+    }
+  }
+  ret = new_segment(key, size, shmflg);
+ out:
+  pthread_mutex_unlock(&shm_ns->lock);
+  return ret;
+}
+
+/* maps the object at a host address aligned as the segment's pages */
+static void *
+map_segment(int fd, size_t len, int d_prot, size_t align)
+{
+  if (align == PAGE_SIZEOF(PAGE_4KB))
+    return mmap(NULL, len, d_prot, MAP_SHARED, fd, 0);
+
+  char *resv = mmap(NULL, len + align, PROT_NONE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  if (resv == MAP_FAILED)
+    return MAP_FAILED;
+  char *start = (char *) roundup((uint64_t) resv, align);
+  if (start > resv) {
+    munmap(resv, start - resv);
+  }
+  munmap(start + len, resv + align - start);
+  void *ptr = mmap(start, len, d_prot, MAP_SHARED | MAP_FIXED, fd, 0);
+  if (ptr == MAP_FAILED) {
+    munmap(start, len);
+  }
+  return ptr;
+}
+
+DEFINE_SYSCALL(shmat, int, shmid, gaddr_t, shmaddr, int, shmflg)
+{
+  int l_prot = LINUX_PROT_READ, d_prot = PROT_READ, oflag = O_RDONLY, mode = 0444;
+  if (!(shmflg & LINUX_SHM_RDONLY)) {
+    l_prot |= LINUX_PROT_WRITE;
+    d_prot |= PROT_WRITE;
+    oflag = O_RDWR;
+    mode |= 0222;
+  }
+  if (shmflg & LINUX_SHM_EXEC) {
+    l_prot |= LINUX_PROT_EXEC;
+    d_prot |= PROT_EXEC;
+    mode |= 0111;
+  }
+
+  lock_ns();
+  struct shm_segment *seg = find_segment(shmid);
+  if (seg == NULL) {
+    pthread_mutex_unlock(&shm_ns->lock);
+    return -LINUX_EINVAL;
+  }
+  if (!ipc_permitted(&seg->perm, mode)) {
+    pthread_mutex_unlock(&shm_ns->lock);
+    return -LINUX_EACCES;
+  }
+  size_t len = seg->map_size;
+  size_t align = PAGE_SIZEOF(seg->hugetlb ? PAGE_2MB : PAGE_4KB);
+  int fd = shm_open(seg->name, oflag, 0);
+  if (fd < 0) {
+    pthread_mutex_unlock(&shm_ns->lock);
+    return -darwin_to_linux_errno(errno);
+  }
+  /* taken now so that a concurrent IPC_RMID leaves the segment alone */
+  seg->nattch++;
+  pthread_mutex_unlock(&shm_ns->lock);
+
+  int err = 0;
+  if (shmaddr & (align - 1)) {
+    if (!(shmflg & LINUX_SHM_RND)) {
+      err = -LINUX_EINVAL;
+      goto out;
+    }
+    shmaddr = rounddown(shmaddr, align);
+  }
+  if ((shmflg & LINUX_SHM_REMAP) && shmaddr == 0) {
+    err = -LINUX_EINVAL;
+    goto out;
+  }
+
+  void *ptr = map_segment(fd, len, d_prot, align);
+  if (ptr == MAP_FAILED) {
+    err = -darwin_to_linux_errno(errno);
+    goto out;
+  }
+
   pthread_rwlock_wrlock(&proc.mm->alloc_lock);
-  addr = alloc_region(len);
-  do_munmap(addr, len);
-  record_region(proc.mm, ptr, addr, len, LINUX_PROT_READ | LINUX_PROT_WRITE, LINUX_MAP_PRIVATE | LINUX_MAP_FIXED, -1, 0);
-  vmm_mmap(addr, len, HV_MEMORY_READ | HV_MEMORY_WRITE, ptr);
+  if (shmaddr == 0) {
+    shmaddr = roundup(alloc_region(len + align - PAGE_SIZEOF(PAGE_4KB)), align);
+  } else if (shmaddr + len > user_addr_max || shmaddr + len < shmaddr) {
+    err = -LINUX_EINVAL;
+  } else if (find_region_range(shmaddr, len, proc.mm) != NULL) {
+    /* unlike mmap with MAP_FIXED, shmat keeps existing mappings unless told */
+    if (shmflg & LINUX_SHM_REMAP) {
+      do_munmap(shmaddr, len);
+    } else {
+      err = -LINUX_EINVAL;
+    }
+  }
+  if (err < 0) {
+    pthread_rwlock_unlock(&proc.mm->alloc_lock);
+    munmap(ptr, len);
+    goto out;
+  }
+  record_region(proc.mm, ptr, shmaddr, len, l_prot, LINUX_MAP_SHARED | LINUX_MAP_FIXED, -1, 0);
+  vmm_mmap(shmaddr, len, linux_mprot_to_hv_mflag(l_prot), ptr);
+
+  struct shm_attach *attach = malloc(sizeof *attach);
+  attach->id = shmid;
+  attach->gaddr = shmaddr;
+  attach->size = len;
+  attach->haddr = ptr;
+  list_add_tail(&attach->list, &shm_attaches);
+  pthread_rwlock_unlock(&proc.mm->alloc_lock);
+
+  lock_ns();
+  if ((seg = find_segment(shmid)) != NULL) {
+    seg->atime = time(NULL);
+    seg->lpid = getpid();
+  }
+  pthread_mutex_unlock(&shm_ns->lock);
+
+ out:
+  close(fd);
+  if (err < 0) {
+    put_segment(shmid);
+    return err;
+  }
+  return shmaddr;
+}
+
+DEFINE_SYSCALL(shmdt, gaddr_t, shmaddr)
+{
+  struct shm_attach *attach;
+  pthread_rwlock_wrlock(&proc.mm->alloc_lock);
+  list_for_each_entry (attach, &shm_attaches, list) {
+    if (attach->gaddr == shmaddr)
+      goto found;
+  }
+  pthread_rwlock_unlock(&proc.mm->alloc_lock);
+  return -LINUX_EINVAL;
+
+ found:
+  /* the guest may have unmapped parts of it already, and mapped something else there */
+  gaddr_t addr = attach->gaddr, end = attach->gaddr + attach->size;
+  struct mm_region *region;
+  while (addr < end && (region = find_region_range(addr, end - addr, proc.mm)) != NULL) {
+    gaddr_t start = MAX(addr, region->gaddr);
+    addr = MIN(end, region->gaddr + region->size);
+    if ((char *) region->haddr == attach->haddr + (region->gaddr - attach->gaddr)) {
+      do_munmap(start, addr - start);
+    }
+  }
+  list_del(&attach->list);
   pthread_rwlock_unlock(&proc.mm->alloc_lock);
-  return (uint64_t) addr;
+
+  put_segment(attach->id);
+  free(attach);
+  return 0;
+}
+
+/* on exit and execve; the mappings themselves go with the mm */
+void
+exit_shm(void)
+{
+  struct shm_attach *attach, *n;
+  list_for_each_entry_safe (attach, n, &shm_attaches, list) {
+    list_del(&attach->list);
+    put_segment(attach->id);
+    free(attach);
+  }
+}
+
+/* in a forked child, which has inherited the attaches of its parent */
+void
+fork_shm(bool vm_shared)
+{
+  struct shm_attach *attach, *n;
+  if (vm_shared) {
+    /* they stay the parent's, whose mm we are using */
+    list_for_each_entry_safe (attach, n, &shm_attaches, list) {
+      list_del(&attach->list);
+      free(attach);
+    }
+    return;
+  }
+  lock_ns();
+  list_for_each_entry (attach, &shm_attaches, list) {
+    struct shm_segment *seg = find_segment(attach->id);
+    if (seg != NULL) {
+      seg->nattch++;
+    }
+  }
+  pthread_mutex_unlock(&shm_ns->lock);
+}
+
+static int
+max_segment_index(void)
+{
+  int max_idx = 0;
+  for (int i = 0; i < SHMMNI; i++) {
+    if (shm_ns->segs[i] != NULL)
+      max_idx = i;
+  }
+  return max_idx;
+}
+
+static int
+shm_info(int cmd, gaddr_t buf_ptr)
+{
+  lock_ns();
+  int ret = max_segment_index();
+  struct l_shminfo64 info = {
+    .shmmax = SHMMAX,
+    .shmmin = SHMMIN,
+    .shmmni = SHMMNI,
+    .shmseg = SHMMNI,
+    .shmall = SHMALL,
+  };
+  struct l_shm_info usage = {
+    .used_ids = shm_ns->nr_segs,
+    .shm_tot = shm_ns->nr_pages,
+    .shm_rss = shm_ns->nr_pages,
+  };
+  pthread_mutex_unlock(&shm_ns->lock);
+
+  if (cmd == LINUX_IPC_INFO ? copy_to_user(buf_ptr, &info, sizeof info) : copy_to_user(buf_ptr, &usage, sizeof usage))
+    return -LINUX_EFAULT;
+  return ret;
+}
+
+/* IPC_STAT, and SHM_STAT and SHM_STAT_ANY that take an index instead of an id */
+static int
+shm_stat(int shmid, int cmd, gaddr_t buf_ptr)
+{
+  lock_ns();
+  struct shm_segment *seg;
+  if (cmd == LINUX_IPC_STAT) {
+    seg = find_segment(shmid);
+  } else {
+    seg = shmid >= 0 && shmid < SHMMNI ? shm_ns->segs[shmid] : NULL;
+  }
+  if (seg == NULL) {
+    pthread_mutex_unlock(&shm_ns->lock);
+    return -LINUX_EINVAL;
+  }
+  if (cmd != LINUX_SHM_STAT_ANY && !ipc_permitted(&seg->perm, 0444)) {
+    pthread_mutex_unlock(&shm_ns->lock);
+    return -LINUX_EACCES;
+  }
+  struct l_shmid64_ds ds = {
+    .shm_perm = seg->perm,
+    .shm_segsz = seg->size,
+    .shm_atime = seg->atime,
+    .shm_dtime = seg->dtime,
+    .shm_ctime = seg->ctime,
+    .shm_cpid = seg->cpid,
+    .shm_lpid = seg->lpid,
+    .shm_nattch = seg->nattch,
+  };
+  int ret = cmd == LINUX_IPC_STAT ? 0 : seg->id;
+  pthread_mutex_unlock(&shm_ns->lock);
+
+  if (copy_to_user(buf_ptr, &ds, sizeof ds))
+    return -LINUX_EFAULT;
+  return ret;
 }
 
 DEFINE_SYSCALL(shmctl, int, shmid, int, cmd, gaddr_t, buf_ptr)
 {
+  cmd &= ~LINUX_IPC_64;
   switch (cmd) {
+  case LINUX_IPC_INFO:
+  case LINUX_SHM_INFO:
+    return shm_info(cmd, buf_ptr);
+  case LINUX_IPC_STAT:
+  case LINUX_SHM_STAT:
+  case LINUX_SHM_STAT_ANY:
+    return shm_stat(shmid, cmd, buf_ptr);
+  case LINUX_IPC_SET:
   case LINUX_IPC_RMID:
-    return syswrap(shmctl(shmid, IPC_RMID, NULL));
+  case LINUX_SHM_LOCK:
+  case LINUX_SHM_UNLOCK:
+    break;
   default:
-    warnk("shmctl: unimplemented cmd = %d\n", cmd);
-    return -LINUX_ENOSYS;
+    warnk("shmctl: unsupported command: 0x%x\n", cmd);
+    return -LINUX_EINVAL;
+  }
+
+  struct l_shmid64_ds ds;
+  if (cmd == LINUX_IPC_SET && copy_from_user(&ds, buf_ptr, sizeof ds))
+    return -LINUX_EFAULT;
+
+  int ret = 0;
+  lock_ns();
+  struct shm_segment *seg = find_segment(shmid);
+  if (seg == NULL) {
+    ret = -LINUX_EINVAL;
+    goto out;
+  }
+  if (!ipc_owner(&seg->perm)) {
+    ret = -LINUX_EPERM;
+    goto out;
+  }
+  switch (cmd) {
+  case LINUX_IPC_SET:
+    seg->perm.uid = ds.shm_perm.uid;
+    seg->perm.gid = ds.shm_perm.gid;
+    seg->perm.mode = (seg->perm.mode & ~0777) | (ds.shm_perm.mode & 0777);
+    seg->ctime = time(NULL);
+    break;
+  case LINUX_IPC_RMID:
+    /* the id stays usable until the last detach, as in Linux */
+    seg->perm.key = LINUX_IPC_PRIVATE;
+    seg->perm.mode |= LINUX_SHM_DEST;
+    if (seg->nattch == 0) {
+      destroy_segment(seg);
+    }
+    break;
+  case LINUX_SHM_LOCK:
+    /* only recorded; paging of the host object is up to the host */
+    seg->perm.mode |= LINUX_SHM_LOCKED;
+    break;
+  case LINUX_SHM_UNLOCK:
+    seg->perm.mode &= ~LINUX_SHM_LOCKED;
+    break;
   }
+ out:
+  pthread_mutex_unlock(&shm_ns->lock);
+  return ret;
 }
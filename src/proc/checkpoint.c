@@ -0,0 +1,560 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syslimits.h>
+
+#include "common.h"
+#include "noah.h"
+#include "vmm.h"
+#include "mm.h"
+#include "fs.h"
+#include "x86/vm.h"
+
+#include "linux/common.h"
+#include "linux/mman.h"
+#include "linux/errno.h"
+
+/*
+ * Checkpoint and restore of a single-threaded process.
+ *
+ * With --checkpoint FILE, SIGINFO (^T on a terminal) makes the process write
+ * its state to FILE between two runs of its vcpu and go on running.
+ * --restore FILE starts a new noah from that state instead of a program.
+ *
+ * The file is a header followed by typed records. User memory is stored per
+ * region as a bitmap of the pages that are not all zero, followed by those
+ * pages only. Regular files and directories open in the guest are reopened
+ * by host path at their saved offsets, and the devices of devfs by their
+ * guest path; other fds (ttys, pipes, sockets and noah's virtual files) are
+ * not restored, except that fds 0 to 2 come from
+ * the restoring noah. Shared mappings come back as private copies.
+ */
+
+#define CKPT_MAGIC "NOAHCKP1"
+
+enum {
+  CKPT_ROOT = 1,
+  CKPT_CWD,
+  CKPT_CRED,
+  CKPT_VCPU,
+  CKPT_MM,
+  CKPT_REGION,
+  CKPT_FD,
+  CKPT_SIGNAL,
+  CKPT_TASK,
+  CKPT_END,
+};
+
+struct ckpt_header {
+  char magic[8];
+  uint32_t page_size;
+  uint32_t vcpu_snapshot_size;
+};
+
+struct ckpt_record {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t len;         /* of the payload that follows */
+};
+
+struct ckpt_region {
+  uint64_t gaddr;
+  uint64_t size;
+  int32_t prot;
+  int32_t mm_flags;
+  /* followed by a bitmap of the stored pages and the stored pages */
+};
+
+struct ckpt_fd {
+  int32_t fd;
+  int32_t flags;        /* host open flags */
+  int32_t cloexec;
+  int32_t dev;          /* a device of devfs, saved by its guest path */
+  int64_t offset;
+  /* followed by the host path, or the guest path of a device */
+};
+
+struct ckpt_signal {
+  l_sigaction_t sigaction[LINUX_NSIG];
+  l_sigset_t sigmask;
+  uint64_t sigpending;
+  l_stack_t sas;
+};
+
+struct ckpt_task {
+  uint64_t set_child_tid, clear_child_tid;
+  uint64_t robust_list;
+  uint64_t cpumask[CPUMASK_WORDS];
+};
+
+struct ckpt_mm {
+  uint64_t start_brk, current_brk;
+  uint64_t current_mmap_top;
+};
+
+static const size_t page_size = PAGE_SIZEOF(PAGE_4KB);
+
+static int
+write_record(FILE *fp, uint32_t type, const void *data, uint64_t len)
+{
+  struct ckpt_record rec = { .type = type, .len = len };
+  if (fwrite(&rec, sizeof rec, 1, fp) != 1)
+    return -1;
+  if (len > 0 && data && fwrite(data, len, 1, fp) != 1)
+    return -1;
+  return 0;
+}
+
+static bool
+is_zero_page(const uint64_t *p)
+{
+  for (size_t i = 0; i < page_size / sizeof *p; i++) {
+    if (p[i])
+      return false;
+  }
+  return true;
+}
+
+static int
+write_region(FILE *fp, struct mm_region *r)
+{
+  size_t nr_pages = r->size / page_size;
+  size_t bitmap_size = roundup(nr_pages, 64) / 8;
+  uint64_t *bitmap = calloc(1, bitmap_size);
+
+  /* a region the guest cannot read may not be readable on the host either */
+  if ((r->prot & LINUX_PROT_READ) == 0) {
+    mprotect(r->haddr, r->size, PROT_READ);
+  }
+
+  size_t nr_stored = 0;
+  for (size_t i = 0; i < nr_pages; i++) {
+    if (!is_zero_page((uint64_t *) ((char *) r->haddr + i * page_size))) {
+      bitmap[i / 64] |= 1ULL << (i % 64);
+      nr_stored++;
+    }
+  }
+
+  struct ckpt_region cr = {
+    .gaddr = r->gaddr,
+    .size = r->size,
+    .prot = r->prot,
+    .mm_flags = r->mm_flags,
+  };
+  int err = write_record(fp, CKPT_REGION, NULL, sizeof cr + bitmap_size + nr_stored * page_size);
+  if (err == 0 && (fwrite(&cr, sizeof cr, 1, fp) != 1 || fwrite(bitmap, bitmap_size, 1, fp) != 1)) {
+    err = -1;
+  }
+  for (size_t i = 0; err == 0 && i < nr_pages; i++) {
+    if (bitmap[i / 64] & (1ULL << (i % 64))) {
+      if (fwrite((char *) r->haddr + i * page_size, page_size, 1, fp) != 1)
+        err = -1;
+    }
+  }
+
+  if ((r->prot & LINUX_PROT_READ) == 0) {
+    mprotect(r->haddr, r->size, r->prot & (PROT_READ | PROT_WRITE | PROT_EXEC));
+  }
+  free(bitmap);
+  return err;
+}
+
+struct fd_writer {
+  FILE *fp;
+  int err;
+};
+
+static void
+write_fd(struct file *file, bool cloexec, void *arg)
+{
+  struct fd_writer *w = arg;
+  int fd = file->fd;
+  bool dev = file->ops == &dev_file_ops;
+  struct stat st;
+  char path[PATH_MAX];
+
+  if (dev) {
+    strlcpy(path, dev_file_path(file), sizeof path);
+  } else if (fstat(fd, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) || fcntl(fd, F_GETPATH, path) < 0) {
+    if (fd > 2) {
+      warnk("checkpoint: fd %d is not a regular file and is not saved\n", fd);
+    }
+    return;
+  }
+  struct ckpt_fd cf = {
+    .fd = fd,
+    .flags = fcntl(fd, F_GETFL),
+    .cloexec = cloexec,
+    .dev = dev,
+    .offset = dev ? 0 : lseek(fd, 0, SEEK_CUR),
+  };
+  size_t len = strlen(path) + 1;
+  if (write_record(w->fp, CKPT_FD, NULL, sizeof cf + len) < 0 || fwrite(&cf, sizeof cf, 1, w->fp) != 1 || fwrite(path, len, 1, w->fp) != 1) {
+    w->err = -1;
+  }
+}
+
+static int
+write_checkpoint(FILE *fp)
+{
+  struct ckpt_header hdr = {
+    .magic = CKPT_MAGIC,
+    .page_size = page_size,
+    .vcpu_snapshot_size = sizeof(struct vcpu_snapshot),
+  };
+  if (fwrite(&hdr, sizeof hdr, 1, fp) != 1)
+    return -1;
+
+  char path[PATH_MAX];
+  if (fcntl(proc.fileinfo.rootfd, F_GETPATH, path) < 0 || write_record(fp, CKPT_ROOT, path, strlen(path) + 1) < 0)
+    return -1;
+  if (getcwd(path, sizeof path) == NULL || write_record(fp, CKPT_CWD, path, strlen(path) + 1) < 0)
+    return -1;
+
+  pthread_rwlock_rdlock(&proc.cred.lock);
+  l_uid_t cred[3] = { proc.cred.uid, proc.cred.euid, proc.cred.suid };
+  pthread_rwlock_unlock(&proc.cred.lock);
+  if (write_record(fp, CKPT_CRED, cred, sizeof cred) < 0)
+    return -1;
+
+  struct vcpu_snapshot *vcpu = malloc(sizeof *vcpu);
+  vmm_snapshot_vcpu(vcpu);
+  int err = write_record(fp, CKPT_VCPU, vcpu, sizeof *vcpu);
+  free(vcpu);
+  if (err < 0)
+    return -1;
+
+  struct ckpt_task ct = {
+    .set_child_tid = task.set_child_tid,
+    .clear_child_tid = task.clear_child_tid,
+    .robust_list = task.robust_list,
+  };
+  memcpy(ct.cpumask, task.cpumask, sizeof ct.cpumask);
+  if (write_record(fp, CKPT_TASK, &ct, sizeof ct) < 0)
+    return -1;
+
+  struct ckpt_signal *cs = calloc(1, sizeof *cs);
+  pthread_rwlock_rdlock(&proc.sig_lock);
+  memcpy(cs->sigaction, proc.sigaction, sizeof cs->sigaction);
+  pthread_rwlock_unlock(&proc.sig_lock);
+  cs->sigmask = task.sigmask;
+  cs->sigpending = task.sigpending;
+  cs->sas = task.sas;
+  err = write_record(fp, CKPT_SIGNAL, cs, sizeof *cs);
+  free(cs);
+  if (err < 0)
+    return -1;
+
+  pthread_rwlock_rdlock(&proc.mm->alloc_lock);
+  struct ckpt_mm cm = {
+    .start_brk = proc.mm->start_brk,
+    .current_brk = proc.mm->current_brk,
+    .current_mmap_top = proc.mm->current_mmap_top,
+  };
+  err = write_record(fp, CKPT_MM, &cm, sizeof cm);
+  struct mm_region *r;
+  list_for_each_entry (r, &proc.mm->mm_regions, list) {
+    if (err == 0) {
+      err = write_region(fp, r);
+    }
+  }
+  pthread_rwlock_unlock(&proc.mm->alloc_lock);
+  if (err < 0)
+    return -1;
+
+  struct fd_writer w = { fp, 0 };
+  for_each_host_file(write_fd, &w);
+  if (w.err < 0)
+    return -1;
+
+  return write_record(fp, CKPT_END, NULL, 0);
+}
+
+/* checkpoint */
+
+static char checkpoint_path[PATH_MAX];
+static atomic_bool checkpoint_requested;
+static pthread_t checkpoint_thread;
+
+static void
+checkpoint_handler(int signum)
+{
+  atomic_store(&checkpoint_requested, true);
+  /* get the vcpu thread out of a blocking host syscall; it is restarted */
+  vmm_wake(checkpoint_thread);
+}
+
+void
+arm_checkpoint(const char *path)
+{
+  strlcpy(checkpoint_path, path, sizeof checkpoint_path);
+  checkpoint_thread = pthread_self();
+  struct sigaction sa = { .sa_handler = checkpoint_handler, .sa_flags = SA_RESTART };
+  sigaction(SIGINFO, &sa, NULL);
+}
+
+bool
+checkpoint_pending(void)
+{
+  return atomic_load(&checkpoint_requested);
+}
+
+/* called between two runs of the vcpu, where its state is consistent */
+void
+do_checkpoint(void)
+{
+  atomic_store(&checkpoint_requested, false);
+  if (proc.nr_tasks != 1) {
+    warnk("checkpoint: only single-threaded processes can be checkpointed\n");
+    return;
+  }
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof tmp, "%s.tmp", checkpoint_path);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    warnk("checkpoint: could not open %s\n", tmp);
+    return;
+  }
+  int err = write_checkpoint(fp);
+  if (fclose(fp) != 0 || err < 0) {
+    warnk("checkpoint: could not write %s\n", tmp);
+    unlink(tmp);
+    return;
+  }
+  rename(tmp, checkpoint_path);
+  printk("checkpoint written to %s\n", checkpoint_path);
+}
+
+/* restore */
+
+static int
+read_header(FILE *fp)
+{
+  struct ckpt_header hdr;
+  if (fread(&hdr, sizeof hdr, 1, fp) != 1 || memcmp(hdr.magic, CKPT_MAGIC, sizeof hdr.magic) != 0)
+    return -1;
+  if (hdr.page_size != page_size || hdr.vcpu_snapshot_size != sizeof(struct vcpu_snapshot))
+    return -1;
+  return 0;
+}
+
+/* the root the checkpointed process ran in, for the restoring noah to boot with */
+int
+checkpoint_root(const char *path, char *root, size_t size)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return -1;
+  struct ckpt_record rec;
+  int ret = -1;
+  if (read_header(fp) == 0 && fread(&rec, sizeof rec, 1, fp) == 1 && rec.type == CKPT_ROOT && rec.len <= size) {
+    if (fread(root, rec.len, 1, fp) == 1 && root[rec.len - 1] == '\0')
+      ret = 0;
+  }
+  fclose(fp);
+  return ret;
+}
+
+static int
+read_region(FILE *fp, uint64_t len)
+{
+  struct ckpt_region cr;
+  if (len < sizeof cr || fread(&cr, sizeof cr, 1, fp) != 1)
+    return -1;
+  size_t nr_pages = cr.size / page_size;
+  size_t bitmap_size = roundup(nr_pages, 64) / 8;
+  uint64_t *bitmap = malloc(bitmap_size);
+  if (fread(bitmap, bitmap_size, 1, fp) != 1) {
+    free(bitmap);
+    return -1;
+  }
+
+  int l_flags = (cr.mm_flags & ~LINUX_MAP_SHARED) | LINUX_MAP_PRIVATE | LINUX_MAP_ANONYMOUS | LINUX_MAP_FIXED;
+  gaddr_t addr = do_mmap(cr.gaddr, cr.size, PROT_READ | PROT_WRITE, cr.prot, l_flags, -1, 0);
+  struct mm_region *r = find_region(cr.gaddr, proc.mm);
+  int err = (addr == cr.gaddr && r) ? 0 : -1;
+  for (size_t i = 0; err == 0 && i < nr_pages; i++) {
+    if (bitmap[i / 64] & (1ULL << (i % 64))) {
+      if (fread((char *) r->haddr + i * page_size, page_size, 1, fp) != 1)
+        err = -1;
+    }
+  }
+  if (err == 0) {
+    mprotect(r->haddr, r->size, cr.prot & (PROT_READ | PROT_WRITE | PROT_EXEC));
+  }
+  free(bitmap);
+  return err;
+}
+
+static int
+read_fd(FILE *fp, uint64_t len)
+{
+  struct ckpt_fd cf;
+  char path[PATH_MAX];
+  if (len < sizeof cf || len - sizeof cf > sizeof path || fread(&cf, sizeof cf, 1, fp) != 1 || fread(path, len - sizeof cf, 1, fp) != 1)
+    return -1;
+  path[len - sizeof cf - 1] = '\0';
+
+  const char *host = cf.dev ? dev_host_path(path) : path;
+  int fd = host ? open(host, cf.flags & ~(O_CREAT | O_TRUNC | O_EXCL)) : -1;
+  if (fd < 0) {
+    warnk("restore: could not reopen %s as fd %d\n", path, cf.fd);
+    return 0;
+  }
+  pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
+  if (fd != cf.fd && cf.fd > 2 && fcntl(cf.fd, F_GETFD) >= 0) {
+    /* held by noah itself, e.g. for the checkpoint being read; only the
+       restoring noah's fds 0 to 2 may be replaced */
+    pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+    close(fd);
+    warnk("restore: fd %d is already in use\n", cf.fd);
+    return -1;
+  }
+  if (fd != cf.fd) {
+    dup2(fd, cf.fd);
+    close(fd);
+  }
+  int err;
+  if (cf.dev) {
+    err = register_dev_file(cf.fd, cf.cloexec, path);
+  } else {
+    lseek(cf.fd, cf.offset, SEEK_SET);
+    err = register_fd(cf.fd, cf.cloexec);
+  }
+  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+  return err < 0 ? -1 : 0;
+}
+
+/* Load the state of a checkpointed process into this freshly booted one. The
+   vcpu resumes it on the next run. */
+int
+restore_checkpoint(const char *path)
+{
+  /* kept above the guest's fds, which read_fd will not replace */
+  FILE *fp = NULL;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, proc.fileinfo.vkern_fdtable.start);
+    close(fd);
+    fp = (high < 0) ? NULL : fdopen(high, "r");
+  }
+  if (fp == NULL || read_header(fp) < 0) {
+    fprintf(stderr, "noah: %s is not a checkpoint\n", path);
+    return -1;
+  }
+
+  int err = 0;
+  bool done = false;
+  while (!done && err == 0) {
+    struct ckpt_record rec;
+    if (fread(&rec, sizeof rec, 1, fp) != 1) {
+      err = -1;
+      break;
+    }
+    switch (rec.type) {
+    case CKPT_ROOT:
+      fseeko(fp, rec.len, SEEK_CUR);    /* taken at boot; see checkpoint_root */
+      break;
+    case CKPT_CWD: {
+      char cwd[PATH_MAX];
+      if (rec.len > sizeof cwd || fread(cwd, rec.len, 1, fp) != 1) {
+        err = -1;
+        break;
+      }
+      cwd[rec.len - 1] = '\0';
+      if (chdir(cwd) < 0) {
+        warnk("restore: could not change directory to %s\n", cwd);
+      }
+      break;
+    }
+    case CKPT_CRED: {
+      l_uid_t cred[3];
+      if (rec.len != sizeof cred || fread(cred, sizeof cred, 1, fp) != 1) {
+        err = -1;
+        break;
+      }
+      pthread_rwlock_wrlock(&proc.cred.lock);
+      proc.cred.uid = cred[0];
+      proc.cred.euid = cred[1];
+      proc.cred.suid = cred[2];
+      pthread_rwlock_unlock(&proc.cred.lock);
+      break;
+    }
+    case CKPT_VCPU: {
+      struct vcpu_snapshot *vcpu = malloc(sizeof *vcpu);
+      if (rec.len != sizeof *vcpu || fread(vcpu, sizeof *vcpu, 1, fp) != 1) {
+        err = -1;
+      } else {
+        vmm_restore_vcpu(vcpu);
+        /* the saved CR4 is the checkpointing host's; take this host's features */
+        init_special_regs();
+      }
+      free(vcpu);
+      break;
+    }
+    case CKPT_TASK: {
+      struct ckpt_task ct;
+      if (rec.len != sizeof ct || fread(&ct, sizeof ct, 1, fp) != 1) {
+        err = -1;
+        break;
+      }
+      task.set_child_tid = ct.set_child_tid;
+      task.clear_child_tid = ct.clear_child_tid;
+      task.robust_list = ct.robust_list;
+      memcpy(task.cpumask, ct.cpumask, sizeof task.cpumask);
+      break;
+    }
+    case CKPT_SIGNAL: {
+      struct ckpt_signal *cs = malloc(sizeof *cs);
+      if (rec.len != sizeof *cs || fread(cs, sizeof *cs, 1, fp) != 1) {
+        err = -1;
+      } else {
+        memcpy(proc.sigaction, cs->sigaction, sizeof proc.sigaction);
+        task.sigmask = cs->sigmask;
+        task.sigpending = cs->sigpending;
+        task.sas = cs->sas;
+        reload_signal_state();
+      }
+      free(cs);
+      break;
+    }
+    case CKPT_MM: {
+      struct ckpt_mm cm;
+      if (rec.len != sizeof cm || fread(&cm, sizeof cm, 1, fp) != 1) {
+        err = -1;
+        break;
+      }
+      proc.mm->start_brk = cm.start_brk;
+      proc.mm->current_brk = cm.current_brk;
+      proc.mm->current_mmap_top = cm.current_mmap_top;
+      break;
+    }
+    case CKPT_REGION:
+      err = read_region(fp, rec.len);
+      break;
+    case CKPT_FD:
+      err = read_fd(fp, rec.len);
+      break;
+    case CKPT_END:
+      done = true;
+      break;
+    default:
+      err = -1;
+      break;
+    }
+  }
+  fclose(fp);
+  if (err < 0) {
+    fprintf(stderr, "noah: %s is broken\n", path);
+  }
+  return err;
+}
@@ -232,68 +232,33 @@ load_script(const char *script, size_t len, const char *elf_path, int argc, char
   return 0;
 }
 
-uint64_t
-push(const void *data, size_t n)
-{
-  uint64_t size = roundup(n, 8);
-  uint64_t rsp;
-
-  assert(data != 0);
-
-  vmm_read_register(HV_X86_RSP, &rsp);
-  rsp -= size;
-  vmm_write_register(HV_X86_RSP, rsp);
-
-  copy_to_user(rsp, data, n);
-
-  return rsp;
-}
-
+/*
+ * The whole initial stack is laid out in a host buffer and copied to the guest
+ * at once. From STACK_TOP downwards:
+ *
+ *   16 random bytes (AT_RANDOM)
+ *   "x86_64" (AT_PLATFORM)
+ *   argument and environment strings
+ *   auxv, NULL, envp[], NULL, argv[], argc  <- rsp, 16-byte aligned
+ */
 void
 init_userstack(int argc, char *argv[], char **envp, uint64_t exe_base, const Elf64_Ehdr *ehdr, uint64_t global_offset, uint64_t interp_base)
 {
-  static const uint64_t zero = 0;
-
   do_mmap(STACK_TOP - STACK_SIZE, STACK_SIZE, PROT_READ | PROT_WRITE, LINUX_PROT_READ | LINUX_PROT_WRITE, LINUX_MAP_PRIVATE | LINUX_MAP_FIXED | LINUX_MAP_ANONYMOUS, -1, 0);
 
-  vmm_write_register(HV_X86_RSP, STACK_TOP);
-  vmm_write_register(HV_X86_RBP, STACK_TOP);
-
-  char random[16];
-
-  uint64_t rand_ptr = push(random, sizeof random);
-
-  char **renvp;
-  for (renvp = envp; *renvp; ++renvp)
-    ;
-
-  uint64_t total = 0, args_total = 0;
-
-  for (int i = 0; i < argc; ++i) {
-    total += strlen(argv[i]) + 1;
-  }
-  args_total = total;
-  for (char **e = envp; *e; ++e) {
-    total += strlen(*e) + 1;
-  }
-
-  char buf[total];
-
-  uint64_t off = 0;
-
+  int envc = 0;
+  size_t strings_size = 0;
   for (int i = 0; i < argc; ++i) {
-    size_t len = strlen(argv[i]);
-    memcpy(buf + off, argv[i], len + 1);
-    off += len + 1;
+    strings_size += strlen(argv[i]) + 1;
   }
-  for (char **e = envp; *e; ++e) {
-    size_t len = strlen(*e);
-    memcpy(buf + off, *e, len + 1);
-    off += len + 1;
+  for (; envp[envc]; ++envc) {
+    strings_size += strlen(envp[envc]) + 1;
   }
 
-  uint64_t args_start = push(buf, total);
-  uint64_t args_end = args_start + args_total, env_end = args_start + total;
+  static const char platform[] = "x86_64";
+  uint64_t rand_ptr = STACK_TOP - 16;
+  uint64_t platform_ptr = rand_ptr - sizeof platform;
+  uint64_t strings_ptr = platform_ptr - strings_size;
 
   Elf64_Auxv aux[] = {
     { AT_BASE, interp_base },
@@ -303,31 +268,45 @@ init_userstack(int argc, char *argv[], char **envp, uint64_t exe_base, const Elf
     { AT_PHNUM, ehdr->e_phnum },
     { AT_PAGESZ, PAGE_SIZEOF(PAGE_4KB) },
     { AT_RANDOM, rand_ptr },
+    { AT_HWCAP, guest_hwcap() },
+    { AT_HWCAP2, guest_hwcap2() },
+    { AT_PLATFORM, platform_ptr },
+    { AT_CLKTCK, LINUX_HZ },
     { AT_NULL, 0 },
   };
 
-  push(aux, sizeof aux);
+  size_t nr_words = 1 + argc + 1 + envc + 1;
+  uint64_t rsp = rounddown(strings_ptr - sizeof aux - nr_words * sizeof(uint64_t), 16);
+  size_t size = STACK_TOP - rsp;
 
-  push(&zero, sizeof zero);
+  char *image = calloc(1, size);
+  uint64_t *sp = (uint64_t *) image;
+  char *str = image + (strings_ptr - rsp);
 
-  uint64_t ptr = env_end;
-  for (char **e = renvp - 1; e >= envp; --e) {
-    ptr -= strlen(*e) + 1;
-    push(&ptr, sizeof ptr);
-    assert(strcmp(buf + (ptr - args_start), *e) == 0);
+  *sp++ = argc;
+  for (int i = 0; i < argc; ++i) {
+    size_t len = strlen(argv[i]) + 1;
+    *sp++ = rsp + (str - image);
+    memcpy(str, argv[i], len);
+    str += len;
   }
-
-  push(&zero, sizeof zero);
-
-  ptr = args_end;
-  for (int i = argc - 1; i >= 0; --i) {
-    ptr -= strlen(argv[i]) + 1;
-    push(&ptr, sizeof ptr);
-    assert(strcmp(buf + (ptr - args_start), argv[i]) == 0);
+  *sp++ = 0;
+  for (int i = 0; i < envc; ++i) {
+    size_t len = strlen(envp[i]) + 1;
+    *sp++ = rsp + (str - image);
+    memcpy(str, envp[i], len);
+    str += len;
   }
+  *sp++ = 0;
+  memcpy(sp, aux, sizeof aux);
+  memcpy(image + (platform_ptr - rsp), platform, sizeof platform);
+  arc4random_buf(image + (rand_ptr - rsp), 16);
 
-  uint64_t argc64 = argc;
-  push(&argc64, sizeof argc64);
+  copy_to_user(rsp, image, size);
+  free(image);
+
+  vmm_write_register(HV_X86_RSP, rsp);
+  vmm_write_register(HV_X86_RBP, STACK_TOP);
 }
 
 static void
@@ -369,7 +348,11 @@ prepare_newproc(void)
   /* Reinitialize proc and task structures */
   /* Not handling locks seriously now because multi-thread execve is not implemented yet */
   proc.nr_tasks = 1;
+  exit_shm();
+  flush_timers();
   destroy_mm(proc.mm); // munlock is also done by unmapping mm
+  vmm_drop_deferred_ept();
+  release_vfork_parent();
   init_mm(proc.mm);
   init_reg_state();
   reset_signal_state();
@@ -440,94 +423,96 @@ do_exec(const char *elf_path, int argc, char *argv[], char **envp)
   return 0;
 }
 
-DEFINE_SYSCALL(execve, gstr_t, gelf_path, gaddr_t, gargv, gaddr_t, genvp)
-{
-  int err;
-  char elf_path[LINUX_PATH_MAX];
-  strncpy_from_user(elf_path, gelf_path, sizeof elf_path);
+/* like linux, let the strings take at most a quarter of the stack */
+#define EXEC_STRINGS_MAX (STACK_SIZE / 4)
+
+struct exec_strings {
+  char *buf;
+  size_t size, cap;
+  size_t *offs;                 /* offsets into buf, turned into pointers at the end */
+  size_t nr, nr_cap;
+};
 
-  size_t argv_rsrv = 1024;
-  char **argv = malloc(sizeof(char *) * argv_rsrv);
-  size_t argc = 0;
-  while (true) {
-    size_t i = argc;
+/* copies a NULL-terminated guest string vector, reading each string once */
+static int
+copy_strings_from_user(struct exec_strings *s, gaddr_t gvec)
+{
+  for (size_t i = 0; ; i++) {
     gaddr_t addr;
-    if (copy_from_user(&addr, gargv + sizeof(gaddr_t) * i, sizeof addr)) {
-      err = -LINUX_EFAULT;
-      goto faile_copy_argv;
+    if (copy_from_user(&addr, gvec + sizeof(gaddr_t) * i, sizeof addr)) {
+      return -LINUX_EFAULT;
     }
-    if (addr == 0)
+    if (addr == 0) {
       break;
-    argc++;
-    if (argc + 1 > LINUX_MAX_ARG_STRINGS) {
-      err = -LINUX_E2BIG;
-      goto faile_copy_argv;
     }
-    if (argc + 1 > argv_rsrv) {
-      argv_rsrv *= 2;
-      argv = realloc(argv, sizeof(char *) * argv_rsrv);
+    if (s->nr + 2 > LINUX_MAX_ARG_STRINGS) {
+      return -LINUX_E2BIG;
     }
-    int size = strnlen_user(addr, LINUX_MAX_ARG_STRLEN);
-    if (size == 0) {
-      err = -LINUX_EFAULT;
-      goto faile_copy_argv;
+    if (s->nr + 2 > s->nr_cap) {
+      s->nr_cap *= 2;
+      s->offs = realloc(s->offs, sizeof(size_t) * s->nr_cap);
     }
-    if (size > LINUX_MAX_ARG_STRLEN) {
-      err = -LINUX_E2BIG;
-      goto faile_copy_argv;
+    while (true) {
+      size_t n = MIN(s->cap - s->size, LINUX_MAX_ARG_STRLEN);
+      ssize_t len = strncpy_from_user(s->buf + s->size, addr, n);
+      if (len < 0) {
+        return len;
+      }
+      if ((size_t) len < n) {
+        s->offs[s->nr++] = s->size;
+        s->size += len + 1;
+        break;
+      }
+      /* no terminator within n bytes: either too long or out of room */
+      if (n == LINUX_MAX_ARG_STRLEN || s->cap == EXEC_STRINGS_MAX) {
+        return -LINUX_E2BIG;
+      }
+      s->cap = MIN(s->cap * 2, EXEC_STRINGS_MAX);
+      s->buf = realloc(s->buf, s->cap);
     }
-    argv[i] = alloca(size);
-    copy_from_user(argv[i], addr, size); /* always success */
   }
-  argv[argc] = NULL;
+  s->offs[s->nr++] = (size_t) -1;
+  return 0;
+}
 
-  size_t envp_rsrv = 1024;
-  char **envp = malloc(sizeof(char *) * envp_rsrv);
-  size_t envc = 0;
-  while (true) {
-    size_t i = envc;
-    gaddr_t addr;
-    if (copy_from_user(&addr, genvp + sizeof(gaddr_t) * i, sizeof addr)) {
-      err = -LINUX_EFAULT;
-      goto fail_copy_envp;
-    }
-    if (addr == 0)
-      break;
-    envc++;
-    if (envc + 1 > LINUX_MAX_ARG_STRINGS) {
-      err = -LINUX_E2BIG;
-      goto fail_copy_envp;
-    }
-    if (envc + 1 > envp_rsrv) {
-      envp_rsrv *= 2;
-      envp = realloc(envp, sizeof(char *) * envp_rsrv);
-    }
-    int size = strnlen_user(addr, LINUX_MAX_ARG_STRLEN);
-    if (size == 0) {
-      err = -LINUX_EFAULT;
-      goto fail_copy_envp;
-    }
-    if (size > LINUX_MAX_ARG_STRLEN) {
-      err = -LINUX_E2BIG;
-      goto fail_copy_envp;
-    }
-    envp[i] = alloca(size);
-    copy_from_user(envp[i], addr, size); /* always success */
+DEFINE_SYSCALL(execve, gstr_t, gelf_path, gaddr_t, gargv, gaddr_t, genvp)
+{
+  int err;
+  char elf_path[LINUX_PATH_MAX];
+  strncpy_from_user(elf_path, gelf_path, sizeof elf_path);
+
+  /* argv and envp strings share one buffer and one pointer array */
+  struct exec_strings s = {
+    .buf = malloc(16384),
+    .cap = 16384,
+    .offs = malloc(sizeof(size_t) * 256),
+    .nr_cap = 256,
+  };
+  if ((err = copy_strings_from_user(&s, gargv)) < 0) {
+    goto out;
+  }
+  size_t argc = s.nr - 1;
+  if ((err = copy_strings_from_user(&s, genvp)) < 0) {
+    goto out;
+  }
+
+  char **vec = (char **) s.offs;
+  for (size_t i = 0; i < s.nr; i++) {
+    vec[i] = s.offs[i] == (size_t) -1 ? NULL : s.buf + s.offs[i];
   }
-  envp[envc] = NULL;
+  char **argv = vec, **envp = vec + argc + 1;
 
   err = do_exec(elf_path, argc, argv, envp);
   if (err < 0) {
-    goto fail_copy_envp;
+    goto out;
   }
 
   uint64_t entry;
   vmm_read_register(HV_X86_RIP, &entry);
   vmm_write_register(HV_X86_RIP, entry - 2); // because syscall handler adds 2 to current rip when returning to vmm_run
 
- fail_copy_envp:
-  free(envp);
- faile_copy_argv:
-  free(argv);
+ out:
+  free(s.offs);
+  free(s.buf);
   return err;
 }
@@ -3,11 +3,20 @@
 #include <assert.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <mach/vm_inherit.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 
 #include "common.h"
 #include "noah.h"
 #include "vmm.h"
+#include "mm.h"
+#include "syscall.h"
 
 #include "linux/common.h"
 #include "linux/misc.h"
@@ -16,12 +25,14 @@
 static void
 init_task(unsigned long clone_flags, gaddr_t child_tid, gaddr_t tls)
 {
-  LINUX_SIGEMPTYSET(&task.sigmask);
-  INIT_SIGBIT(&task.sigpending);
+  /* the signal mask is inherited, pending signals are not; a thread's queue
+     is set up by the cloning thread, before the task can be found */
+  if (!(clone_flags & LINUX_CLONE_THREAD)) {
+    flush_sigqueue();
+  }
 
-  if (clone_flags & LINUX_CLONE_THREAD) {
-    pthread_threadid_np(NULL, &task.tid);
-  } else {
+  /* a thread's tid is given by the cloning thread */
+  if (!(clone_flags & LINUX_CLONE_THREAD)) {
     task.tid = getpid();
   }
 
@@ -49,117 +60,424 @@ init_task(unsigned long clone_flags, gaddr_t child_tid, gaddr_t tls)
   }
 }
 
+static void reset_thread_pool(void);
+
+/* write end of the pipe a vfork child holds until it execve's or exits */
+static int vfork_fd = -1;
+/* user memory of a CLONE_VM child is still shared with its parent */
+static bool vm_shared;
+
+/* Make the user regions shared with (or copied into) the children forked next.
+   A CLONE_VM child thereby writes to the very pages of its parent. */
+static void
+inherit_user_memory(int inheritance)
+{
+  struct list_head *list;
+  list_for_each (list, &proc.mm->mm_regions) {
+    struct mm_region *p = list_entry(list, struct mm_region, list);
+    if (inheritance == VM_INHERIT_COPY && !is_region_private(p)) {
+      /* shared mappings and shm attaches stay shared with every child */
+      continue;
+    }
+    minherit(p->haddr, p->size, inheritance);
+  }
+}
+
+void
+release_vfork_parent(void)
+{
+  if (vfork_fd >= 0) {
+    vkern_close(vfork_fd);
+    vfork_fd = -1;
+  }
+  vm_shared = false;
+}
+
+static void
+wait_vfork_child(int fd)
+{
+  char c;
+  /* the child never writes; EOF comes on its execve or exit */
+  while (read(fd, &c, 1) < 0 && errno == EINTR) {
+    vmm_park();
+  }
+  vkern_close(fd);
+}
+
 int
 __do_clone_process(unsigned long clone_flags, unsigned long newsp, gaddr_t parent_tid, gaddr_t child_tid, gaddr_t tls)
 {
+  int vfork_pipe[2] = {-1, -1};
+  if (clone_flags & LINUX_CLONE_VFORK) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      return -darwin_to_linux_errno(errno);
+    }
+    pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
+    vfork_pipe[0] = vkern_dup_fd(fds[0], true);
+    vfork_pipe[1] = vkern_dup_fd(fds[1], true);
+    pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
   // Because Apple Hypervisor Framwork won't let us use multiple VMs,
   // we destroy the current vm and restore it later
+  uint64_t t0 = vmm_clock_ns();
   struct vmm_snapshot snapshot;
-  vmm_snapshot(&snapshot);
+  if (vmm_snapshot(&snapshot) < 0) {
+    if (clone_flags & LINUX_CLONE_VFORK) {
+      vkern_close(vfork_pipe[0]);
+      vkern_close(vfork_pipe[1]);
+    }
+    return -LINUX_EAGAIN;
+  }
+
+  if (vm_shared) {
+    /* a CLONE_VM child forking before execve; its children get their own copy */
+    inherit_user_memory(VM_INHERIT_COPY);
+    vm_shared = false;
+  }
+  if (clone_flags & LINUX_CLONE_VM) {
+    inherit_user_memory(VM_INHERIT_SHARE);
+  }
+
+  uint64_t t1 = vmm_clock_ns();
   vmm_destroy();
+  uint64_t t2 = vmm_clock_ns();
 
+  prepare_fork_timers();
   int ret = syswrap(fork());
-
-  vmm_reentry(&snapshot);
+  fork_timers(ret == 0);
+  uint64_t t3 = vmm_clock_ns();
+
+  /* Most children execve soon, throwing the inherited image away. The child
+     enters its user mappings into the EPT lazily until it turns out to stay. */
+  vmm_reentry(&snapshot, ret == 0);
+
+  vmm_fork_stats.nr_forks++;
+  vmm_fork_stats.snapshot += t1 - t0;
+  vmm_fork_stats.destroy += t2 - t1;
+  vmm_fork_stats.fork += t3 - t2;
+  printk("fork #%llu: snapshot %llu, destroy %llu, fork %llu, reentry %llu, restore %llu (total ns)\n",
+         vmm_fork_stats.nr_forks, vmm_fork_stats.snapshot, vmm_fork_stats.destroy, vmm_fork_stats.fork,
+         vmm_fork_stats.reentry, vmm_fork_stats.restore);
+
+  if ((clone_flags & LINUX_CLONE_VM) && ret != 0) {
+    inherit_user_memory(VM_INHERIT_COPY);
+  }
 
   if (ret < 0) {
+    if (clone_flags & LINUX_CLONE_VFORK) {
+      vkern_close(vfork_pipe[0]);
+      vkern_close(vfork_pipe[1]);
+    }
     return ret;
   }
 
   if (ret == 0) {
-    /* NB: we don't yet support multi-threaded execve so comment out the following: */
-    /* proc.nr_tasks = 1; */
-    /* INIT_LIST_HEAD(&proc.tasks); */
-    /* list_add(&task.head, &proc.tasks); */
+    /* only the calling thread is duplicated */
+    proc.nr_tasks = 1;
+    INIT_LIST_HEAD(&proc.tasks);
+    list_add(&task.head, &proc.tasks);
+    reset_thread_pool();
+    /* what we inherited belongs to our own vfork parent */
+    release_vfork_parent();
+    if (clone_flags & LINUX_CLONE_VFORK) {
+      vkern_close(vfork_pipe[0]);
+      vfork_fd = vfork_pipe[1];
+    }
+    vm_shared = clone_flags & LINUX_CLONE_VM;
+    fork_shm(vm_shared);
+    /* before fork_epoll, which watches them */
+    fork_evfiles();
+    fork_inotify();
+    fork_epoll();
+    if (newsp) {
+      vmm_write_register(HV_X86_RSP, newsp);
+    }
     init_task(clone_flags, child_tid, tls);
   } else {
     if (clone_flags & LINUX_CLONE_PARENT_SETTID) {
       if (copy_to_user(parent_tid, &ret, sizeof ret)) {
-        return -LINUX_EFAULT;
+        ret = -LINUX_EFAULT;
       }
     }
+    if (clone_flags & LINUX_CLONE_VFORK) {
+      vkern_close(vfork_pipe[1]);
+      wait_vfork_child(vfork_pipe[0]);
+    }
   }
 
   return ret;
 }
 
-struct clone_thread_arg {
+/* syscalls a child typically issues between fork and execve */
+static bool
+is_exec_prologue(int nr)
+{
+  switch (nr) {
+  case LSYS_execve:
+  case LSYS_exit:
+  case LSYS_exit_group:
+  case LSYS_close:
+  case LSYS_dup:
+  case LSYS_dup2:
+  case LSYS_dup3:
+  case LSYS_fcntl:
+  case LSYS_open:
+  case LSYS_openat:
+  case LSYS_write:
+  case LSYS_ioctl:
+  case LSYS_chdir:
+  case LSYS_fchdir:
+  case LSYS_umask:
+  case LSYS_setpgid:
+  case LSYS_setsid:
+  case LSYS_getpid:
+  case LSYS_getppid:
+  case LSYS_gettid:
+  case LSYS_rt_sigaction:
+  case LSYS_rt_sigprocmask:
+  case LSYS_set_robust_list:
+  case LSYS_setrlimit:
+  case LSYS_access:
+  case LSYS_faccessat:
+  case LSYS_stat:
+  case LSYS_newfstatat:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Called before each syscall while the EPT is deferred. Anything beyond the
+   usual fork-exec prologue means the child keeps running the inherited image. */
+void
+settle_deferred_fork(int nr)
+{
+  if (!is_exec_prologue(nr)) {
+    vmm_populate_ept();
+  }
+}
+
+/*
+ * Threads for clone(CLONE_THREAD) are taken from a pool of parked host
+ * threads whose vcpus are already created and initialized from a template
+ * of this process. The cloning thread only hands over the per-thread part of
+ * its vcpu state, and an exiting thread goes back to the pool.
+ */
+#define THREAD_POOL_SPARE 2     /* idle threads kept ready after each clone */
+#define THREAD_POOL_MAX   16    /* idle threads beyond this exit for real */
+
+struct pooled_thread {
+  struct list_head head;
+  pthread_t thread;
+  struct task *task;
+  jmp_buf retire;
+  atomic_bool assigned;
+  /* request from the cloning thread */
   unsigned long clone_flags;
   unsigned long newsp;
-  gaddr_t parent_tid;
   gaddr_t child_tid;
   gaddr_t tls;
-  pthread_cond_t cond;
-  pthread_mutex_t mutex;
-  struct vcpu_snapshot vcpu_snapshot;
+  struct vcpu_thread_snapshot state;
 };
 
-static void*
-__start_thread(struct clone_thread_arg *arg)
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct list_head pool = { &pool, &pool };
+static int nr_pooled;
+static struct vcpu_snapshot *pool_template;
+_Thread_local static struct pooled_thread *self_pt;
+
+static void
+run_pooled_thread(struct pooled_thread *pt)
 {
   uint64_t rip;
+  sigset_t dset;
 
-  pthread_mutex_lock(&arg->mutex);
+  /* already set up and linked into proc.tasks by the cloning thread */
+  linux_to_darwin_sigset(&task.sigmask, &dset);
+  pthread_sigmask(SIG_SETMASK, &dset, NULL);
 
-  printk("__start_thread\n");
-
-  vmm_create_vcpu(&arg->vcpu_snapshot);
+  vmm_restore_vcpu_thread(&pt->state);
   vmm_write_register(HV_X86_RAX, 0);
-  vmm_write_register(HV_X86_RSP, arg->newsp);
+  vmm_write_register(HV_X86_RSP, pt->newsp);
   vmm_read_register(HV_X86_RIP, &rip);
   vmm_write_register(HV_X86_RIP, rip + 2);
 
-  pthread_rwlock_wrlock(&proc.lock);
-  proc.nr_tasks++;
-  list_add(&task.head, &proc.tasks);
-  pthread_rwlock_unlock(&proc.lock);
-
-  INIT_SIGBIT(&task.sigpending);
+  init_task(pt->clone_flags, pt->child_tid, pt->tls);
 
-  init_task(arg->clone_flags, arg->child_tid, arg->tls);
+  main_loop(0);
+}
 
-  if (arg->clone_flags & LINUX_CLONE_PARENT_SETTID) {
-    if (copy_to_user(arg->parent_tid, &task.tid, sizeof task.tid)) {
-      assert(false);
-    }
+static void *
+pooled_thread_main(struct pooled_thread *pt)
+{
+  self_pt = pt;
+  pt->task = &task;
+  init_sigqueue();
+  vmm_create_vcpu(pool_template);
+
+  /* an idle thread must not catch signals meant for the guest threads */
+  sigset_t all;
+  sigfillset(&all);
+
+  setjmp(pt->retire);           /* exit_thread comes back here */
+  for (;;) {
+    pthread_sigmask(SIG_SETMASK, &all, NULL);
+    atomic_store(&pt->assigned, false);
+    pthread_mutex_lock(&pool_lock);
+    list_add(&pt->head, &pool);
+    nr_pooled++;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    vmm_idle(&pt->assigned);
+    run_pooled_thread(pt);
   }
+  return NULL; // hv_vcpu_run failed for some reason
+}
 
-  pthread_cond_signal(&arg->cond);
+/* Make the task of an idle pooled thread a fresh one for a thread cloned
+   from the current one. This is done before it is linked into proc.tasks;
+   the host thread keeps its wake semaphore and sigqueue lock. */
+static void
+reset_pooled_task(struct task *t)
+{
+  t->set_child_tid = t->clear_child_tid = 0;
+  t->robust_list = 0;
+  t->sigmask = task.sigmask;
+  t->restore_sigmask = false;
+  INIT_SIGBIT(&t->sigpending);
+  INIT_LIST_HEAD(&t->sigqueue);
+  t->nr_sigqueue = 0;
+  memset(t->sigsender, 0, sizeof t->sigsender);
+  memset(&t->sas, 0, sizeof t->sas);
+  memcpy(t->cpumask, task.cpumask, sizeof t->cpumask);
+}
 
-  pthread_mutex_unlock(&arg->mutex);
+static bool
+spawn_pooled_thread(void)
+{
+  pthread_t thread;
+  struct pooled_thread *pt = calloc(1, sizeof *pt);
+  if (pt == NULL || pthread_create(&thread, NULL, (void *) pooled_thread_main, pt) != 0) {
+    free(pt);
+    return false;
+  }
+  pt->thread = thread;
+  pthread_detach(thread);
+  return true;
+}
 
-  main_loop(0);
+/* forget the threads of the parent; they do not exist in a forked child */
+static void
+reset_thread_pool(void)
+{
+  pthread_mutex_init(&pool_lock, NULL);
+  pthread_cond_init(&pool_cond, NULL);
+  INIT_LIST_HEAD(&pool);
+  nr_pooled = 0;
+}
 
-  return NULL; // hv_vcpu_run failed for some reason
+/*
+ * A pooled host thread serves one guest thread after another, so guest tids
+ * are handed out here rather than taken from the host thread, and a tid is not
+ * given again before the counter wraps. They start above darwin's PID_MAX, so
+ * that a stale tid never names a host process.
+ */
+#define TID_MIN 100000
+static int last_tid = TID_MIN - 1;
+
+/* called with proc.lock held for writing */
+static int
+alloc_tid(void)
+{
+  for (;;) {
+    last_tid = (last_tid == INT32_MAX) ? TID_MIN : last_tid + 1;
+    bool used = false;
+    struct task *t;
+    list_for_each_entry (t, &proc.tasks, head) {
+      if (t->tid == (uint64_t) last_tid) {
+        used = true;
+        break;
+      }
+    }
+    if (!used) {
+      return last_tid;
+    }
+  }
+}
+
+noreturn void
+exit_thread(void)
+{
+  if (self_pt) {
+    pthread_mutex_lock(&pool_lock);
+    bool keep = nr_pooled < THREAD_POOL_MAX;
+    pthread_mutex_unlock(&pool_lock);
+    if (keep) {
+      longjmp(self_pt->retire, 1);
+    }
+    free(self_pt);
+  }
+  vmm_destroy_vcpu();
+  pthread_exit(NULL);
 }
 
 int
 __do_clone_thread(unsigned long clone_flags, unsigned long newsp, gaddr_t parent_tid, gaddr_t child_tid, gaddr_t tls)
 {
   printk("clone_thread\n");
-  uint64_t tid;
-  pthread_t threadid;
-
-  struct clone_thread_arg *arg = malloc(sizeof *arg);
-  *arg = (struct clone_thread_arg){
-    .clone_flags = clone_flags,
-    .newsp = newsp,
-    .parent_tid = parent_tid,
-    .child_tid = child_tid,
-    .tls = tls,
-    .cond = PTHREAD_COND_INITIALIZER,
-    .mutex =PTHREAD_MUTEX_INITIALIZER
-  };
-  vmm_snapshot_vcpu(&arg->vcpu_snapshot);
-  pthread_mutex_lock(&arg->mutex);
-  pthread_create(&threadid, NULL, (void *)__start_thread, arg);
-  pthread_cond_wait(&arg->cond, &arg->mutex);
-  pthread_mutex_unlock(&arg->mutex);
-  pthread_cond_destroy(&arg->cond);
-  pthread_mutex_destroy(&arg->mutex);
-  free(arg);
-
-  pthread_threadid_np(threadid, &tid);
+
+  pthread_mutex_lock(&pool_lock);
+  if (pool_template == NULL) {
+    /* the process-wide part of the vcpu state, shared by every thread */
+    pool_template = malloc(sizeof *pool_template);
+    vmm_snapshot_vcpu(pool_template);
+  }
+  if (nr_pooled == 0 && !spawn_pooled_thread()) {
+    pthread_mutex_unlock(&pool_lock);
+    return -LINUX_EAGAIN;
+  }
+  while (nr_pooled == 0) {
+    pthread_cond_wait(&pool_cond, &pool_lock);
+  }
+  struct pooled_thread *pt = list_first_entry(&pool, struct pooled_thread, head);
+  list_del(&pt->head);
+  nr_pooled--;
+  int nr_spawn = THREAD_POOL_SPARE - nr_pooled;
+  pthread_mutex_unlock(&pool_lock);
+
+  pt->clone_flags = clone_flags;
+  pt->newsp = newsp;
+  pt->child_tid = child_tid;
+  pt->tls = tls;
+  vmm_snapshot_vcpu_thread(&pt->state);
+  reset_pooled_task(pt->task);
+
+  pthread_rwlock_wrlock(&proc.lock);
+  int tid = alloc_tid();
+  pt->task->tid = tid;
+  proc.nr_tasks++;
+  list_add(&pt->task->head, &proc.tasks);
+  pthread_rwlock_unlock(&proc.lock);
+
+  if (clone_flags & LINUX_CLONE_PARENT_SETTID) {
+    if (copy_to_user(parent_tid, &tid, sizeof tid)) {
+      assert(false);
+    }
+  }
+
+  atomic_store(&pt->assigned, true);
+  vmm_wake(pt->thread);
+
+  /* refill the pool off the critical path of the next clone */
+  for (int i = 0; i < nr_spawn; i++) {
+    spawn_pooled_thread();
+  }
 
   return tid;
 }
@@ -171,11 +489,14 @@ do_clone(unsigned long clone_flags, unsigned long newsp, gaddr_t parent_tid, gad
   assert(sigtype == LINUX_SIGCHLD || sigtype == 0);
 
   clone_flags &= -0x100;
-  unsigned long implemented = LINUX_CLONE_THREAD | LINUX_CLONE_DETACHED | LINUX_CLONE_SETTLS | LINUX_CLONE_CHILD_SETTID | LINUX_CLONE_CHILD_CLEARTID | LINUX_CLONE_PARENT_SETTID;
+  unsigned long implemented = LINUX_CLONE_THREAD | LINUX_CLONE_DETACHED | LINUX_CLONE_SETTLS | LINUX_CLONE_CHILD_SETTID | LINUX_CLONE_CHILD_CLEARTID | LINUX_CLONE_PARENT_SETTID | LINUX_CLONE_VFORK;
   unsigned long needed = 0;
   if (clone_flags & LINUX_CLONE_THREAD) {
     int needed = LINUX_CLONE_VM | LINUX_CLONE_FS | LINUX_CLONE_FILES | LINUX_CLONE_SIGHAND | LINUX_CLONE_SYSVSEM;
     implemented |= needed;
+  } else if (clone_flags & LINUX_CLONE_VFORK) {
+    /* the parent sleeps until the child execve's, so sharing the memory is safe */
+    implemented |= LINUX_CLONE_VM;
   }
   if ((clone_flags & ~implemented) || (clone_flags & needed) != needed) {
     warnk("unsupported clone_flags: %lx\n", clone_flags);
@@ -202,5 +523,5 @@ DEFINE_SYSCALL(fork)
 
 DEFINE_SYSCALL(vfork)
 {
-  return do_clone(LINUX_SIGCHLD, 0, 0, 0, 0);
+  return do_clone(LINUX_CLONE_VM | LINUX_CLONE_VFORK | LINUX_SIGCHLD, 0, 0, 0, 0);
 }
@@ -9,6 +9,7 @@
 #include <sys/wait.h>
 #include <sys/resource.h>
 #include <pthread.h>
+#include <signal.h>
 #include <assert.h>
 
 #include "common.h"
@@ -22,6 +23,8 @@
 #include "linux/futex.h"
 
 #include <sys/sysctl.h>
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
 
 #define _GNU_SOURCE
 #include <sys/syscall.h>
@@ -347,15 +350,16 @@ DEFINE_SYSCALL(exit, int, reason)
       return -LINUX_EFAULT;
     do_futex_wake(task.clear_child_tid, 1);
   }
-  vmm_destroy_vcpu();
   pthread_rwlock_wrlock(&proc.lock);
   if (proc.nr_tasks == 1) {
+    exit_ipc();
     _exit(reason);
   } else {
     proc.nr_tasks--;
     list_del(&task.head);
     pthread_rwlock_unlock(&proc.lock);
-    pthread_exit(&reason);
+    flush_sigqueue();
+    exit_thread();
   }
 }
 
@@ -367,15 +371,10 @@ DEFINE_SYSCALL(exit_group, int, reason)
       return -LINUX_EFAULT;
     do_futex_wake(task.clear_child_tid, 1);
   }
+  exit_ipc();
   _exit(reason);
 }
 
-DEFINE_SYSCALL(tgkill)
-{
-  printk("unimplemented syscall: tgkill\n");
-  return -LINUX_ENOSYS;
-}
-
 DEFINE_SYSCALL(capget, gaddr_t, header_ptr, gaddr_t, data_ptr)
 {
   printk("capget is unimplemented\n");
@@ -587,14 +586,113 @@ DEFINE_SYSCALL(setpriority, int, which, int, who, int, niceval)
   return syswrap(setpriority(which, who, niceval));
 }
 
+/* the size in bytes of linux's cpumask_t, which follows the number of possible cpus */
+static unsigned
+cpumask_size(void)
+{
+  return (host_cpu_topology()->nr_possible + 63) / 64 * 8;
+}
+
+/* NULL with *found set is a task of another process */
+static struct task *
+find_affinity_task(l_pid_t pid, bool *found)
+{
+  *found = true;
+  if (pid == 0 || (uint64_t) pid == task.tid) {
+    return &task;
+  }
+  struct task *t;
+  list_for_each_entry (t, &proc.tasks, head) {
+    if (t->tid == (uint64_t) pid) {
+      return t;
+    }
+  }
+  *found = kill(pid, 0) == 0 || errno == EPERM;
+  return NULL;
+}
+
 DEFINE_SYSCALL(sched_getaffinity, l_pid_t, pid, unsigned int, len, gaddr_t, user_mask_ptr)
 {
-  static const unsigned sizeof_cpumask_t = 32; /* FIXME */
-  if (len < sizeof_cpumask_t)
+  unsigned size = cpumask_size();
+  if (len < size || (len & (sizeof(uint64_t) - 1)))
     return -LINUX_EINVAL;
-  unsigned char buf[sizeof_cpumask_t] = {0};
-  buf[0] = 0x1;
-  if (copy_to_user(user_mask_ptr, buf, sizeof buf))
+
+  uint64_t mask[CPUMASK_WORDS];
+  host_online_cpumask(mask);
+
+  bool found;
+  pthread_rwlock_rdlock(&proc.lock);
+  struct task *t = find_affinity_task(pid, &found);
+  if (t) {
+    for (int i = 0; i < CPUMASK_WORDS; i++) {
+      if (t->cpumask[i]) {
+        memcpy(mask, t->cpumask, sizeof mask);
+        break;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&proc.lock);
+  if (! found)
+    return -LINUX_ESRCH;
+
+  if (copy_to_user(user_mask_ptr, mask, size))
     return -LINUX_EFAULT;
-  return sizeof_cpumask_t;
+  return size;
+}
+
+/* Darwin has no way to bind a thread to a cpu. Threads given the same cpu
+   get the same affinity tag instead, which the scheduler takes as a hint to
+   share caches between them. */
+static void
+set_affinity_hint(const uint64_t mask[CPUMASK_WORDS])
+{
+  uint64_t online[CPUMASK_WORDS];
+  host_online_cpumask(online);
+
+  thread_affinity_policy_data_t policy = { THREAD_AFFINITY_TAG_NULL };
+  if (memcmp(mask, online, sizeof online) != 0) {
+    for (int i = 0; i < LINUX_NR_CPUS; i++) {
+      if (mask[i / 64] & (1ULL << (i % 64))) {
+        policy.affinity_tag = i + 1;
+        break;
+      }
+    }
+  }
+  thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY, (thread_policy_t) &policy, THREAD_AFFINITY_POLICY_COUNT);
+}
+
+DEFINE_SYSCALL(sched_setaffinity, l_pid_t, pid, unsigned int, len, gaddr_t, user_mask_ptr)
+{
+  uint64_t mask[CPUMASK_WORDS] = {0};
+  unsigned size = cpumask_size();
+  if (len < size)
+    size = len;
+  if (copy_from_user(mask, user_mask_ptr, size))
+    return -LINUX_EFAULT;
+
+  uint64_t online[CPUMASK_WORDS];
+  host_online_cpumask(online);
+  bool empty = true;
+  for (int i = 0; i < CPUMASK_WORDS; i++) {
+    mask[i] &= online[i];
+    empty = empty && mask[i] == 0;
+  }
+  if (empty)
+    return -LINUX_EINVAL;
+
+  bool found;
+  pthread_rwlock_wrlock(&proc.lock);
+  struct task *t = find_affinity_task(pid, &found);
+  if (t) {
+    memcpy(t->cpumask, mask, sizeof mask);
+  }
+  pthread_rwlock_unlock(&proc.lock);
+  if (! found)
+    return -LINUX_ESRCH;
+
+  /* the mask of another thread is only recorded */
+  if (t == &task) {
+    set_affinity_hint(mask);
+  }
+  return 0;
 }
@@ -0,0 +1,242 @@
+#include "common.h"
+#include "noah.h"
+#include "vmm.h"
+
+#include "linux/misc.h"
+#include "x86/specialreg.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <cpuid.h>
+
+/*
+ * CPUID as the guest sees it. The host leaves are read once at boot into a
+ * table, noah's adjustments are applied there, and a CPUID exit is answered
+ * from the table. The XCR0 the guest runs with is decided here too, so that
+ * leaf 0xd and xgetbv agree with each other.
+ */
+
+#define CPUID_MAX_ENTRIES 128
+
+enum { EAX, EBX, ECX, EDX };
+
+struct cpuid_entry {
+  uint32_t leaf, subleaf;
+  uint32_t regs[4];             /* eax, ebx, ecx, edx */
+};
+
+static struct cpuid_entry cpuid_table[CPUID_MAX_ENTRIES];
+static int nr_cpuid_entries;
+static uint32_t max_basic_leaf;
+static uint64_t xcr0;
+
+/* leaves whose output depends on ecx */
+static bool
+has_subleaves(uint32_t leaf)
+{
+  switch (leaf) {
+  case 0x4: case 0x7: case 0xb: case 0xd: case 0xf: case 0x10:
+  case 0x12: case 0x14: case 0x17: case 0x18: case 0x1f:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static struct cpuid_entry *
+find_entry(uint32_t leaf, uint32_t subleaf)
+{
+  if (!has_subleaves(leaf)) {
+    subleaf = 0;
+  }
+  for (int i = 0; i < nr_cpuid_entries; i++) {
+    if (cpuid_table[i].leaf == leaf && cpuid_table[i].subleaf == subleaf) {
+      return &cpuid_table[i];
+    }
+  }
+  return NULL;
+}
+
+static void
+add_entry(uint32_t leaf, uint32_t subleaf)
+{
+  if (nr_cpuid_entries == CPUID_MAX_ENTRIES) {
+    warnk("cpuid: too many leaves, 0x%x.%u is left out\n", leaf, subleaf);
+    return;
+  }
+  struct cpuid_entry *e = &cpuid_table[nr_cpuid_entries++];
+  e->leaf = leaf;
+  e->subleaf = subleaf;
+  __cpuid_count(leaf, subleaf, e->regs[0], e->regs[1], e->regs[2], e->regs[3]);
+}
+
+static void
+add_leaf(uint32_t leaf)
+{
+  add_entry(leaf, 0);
+  if (!has_subleaves(leaf)) {
+    return;
+  }
+  uint32_t *r = cpuid_table[nr_cpuid_entries - 1].regs;
+  switch (leaf) {
+  case 0x7:
+  case 0x14:
+  case 0x17:
+  case 0x18:
+    /* eax of subleaf 0 is the last subleaf */
+    for (uint32_t i = 1; i <= r[0] && i < 8; i++) {
+      add_entry(leaf, i);
+    }
+    break;
+  case 0x4:
+  case 0xb:
+  case 0x1f:
+    /* until the cache or topology level type reads 0 */
+    for (uint32_t i = 1; i < 8; i++) {
+      add_entry(leaf, i);
+      uint32_t *s = cpuid_table[nr_cpuid_entries - 1].regs;
+      if ((leaf == 0x4 ? s[0] & 0x1f : (s[2] >> 8) & 0xff) == 0) {
+        break;
+      }
+    }
+    break;
+  case 0xd:
+    /* one subleaf per state component */
+    for (uint32_t i = 1; i < 64; i++) {
+      if (i == 1 || (((uint64_t) r[3] << 32 | r[0]) & (1ULL << i))) {
+        add_entry(leaf, i);
+      }
+    }
+    break;
+  default:
+    for (uint32_t i = 1; i < 4; i++) {
+      add_entry(leaf, i);
+    }
+    break;
+  }
+}
+
+static void
+set_bit(uint32_t leaf, uint32_t subleaf, int reg, int bit, bool on)
+{
+  struct cpuid_entry *e = find_entry(leaf, subleaf);
+  if (e == NULL) {
+    return;
+  }
+  if (on) {
+    e->regs[reg] |= 1U << bit;
+  } else {
+    e->regs[reg] &= ~(1U << bit);
+  }
+}
+
+/* size of the standard format xsave area for the components in mask */
+static uint32_t
+xsave_size(uint64_t mask)
+{
+  uint32_t size = 512 + 64;
+  for (int i = 2; i < 64; i++) {
+    struct cpuid_entry *e;
+    if ((mask & (1ULL << i)) && (e = find_entry(0xd, i)) != NULL) {
+      size = MAX(size, e->regs[EBX] + e->regs[EAX]);
+    }
+  }
+  return size;
+}
+
+static void
+init_xcr0(void)
+{
+  struct cpuid_entry *e = find_entry(0xd, 0);
+  uint64_t supported = e ? (uint64_t) e->regs[EDX] << 32 | e->regs[EAX] : XCR0_X87_STATE | XCR0_SSE_STATE;
+
+  /* what the host kernel has enabled for us, which is what the vcpu can hold */
+  uint32_t lo, hi;
+  __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  uint64_t host = (uint64_t) hi << 32 | lo;
+
+  /* no MPX or protection keys; they need kernel support we lack */
+  xcr0 = supported & host & (XCR0_X87_STATE | XCR0_SSE_STATE | XCR0_AVX_STATE | XCR0_AVX512_STATE);
+  /* the vcpu state is moved around in buffers of VMM_FPSTATE_SIZE bytes */
+  if (xsave_size(xcr0) > VMM_FPSTATE_SIZE) {
+    xcr0 &= ~XCR0_AVX512_STATE;
+  }
+  if (xsave_size(xcr0) > VMM_FPSTATE_SIZE) {
+    xcr0 &= ~XCR0_AVX_STATE;
+  }
+
+  if (e != NULL) {
+    e->regs[EBX] = xsave_size(xcr0);
+  }
+}
+
+void
+init_cpuid(void)
+{
+  nr_cpuid_entries = 0;
+
+  uint32_t max, ext_max, unused;
+  __cpuid(0, max, unused, unused, unused);
+  max_basic_leaf = max;
+  for (uint32_t leaf = 0; leaf <= max; leaf++) {
+    add_leaf(leaf);
+  }
+  __cpuid(0x80000000, ext_max, unused, unused, unused);
+  for (uint32_t leaf = 0x80000000; leaf <= ext_max && leaf < 0x80000020; leaf++) {
+    add_leaf(leaf);
+  }
+
+  /* no nested virtualization, and monitor/mwait are not ours to give */
+  set_bit(0x1, 0, ECX, 5, false);
+  set_bit(0x1, 0, ECX, 3, false);
+  /* the guest's CR4 has OSXSAVE set */
+  set_bit(0x1, 0, ECX, 27, true);
+
+  init_xcr0();
+}
+
+void
+guest_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+  struct cpuid_entry *e = find_entry(leaf, subleaf);
+  if (e == NULL && leaf < 0x80000000 && leaf > max_basic_leaf) {
+    /* as Intel cpus do, answer with the highest basic leaf */
+    e = find_entry(max_basic_leaf, subleaf);
+  }
+  if (e == NULL) {
+    memset(regs, 0, sizeof(uint32_t) * 4);
+    return;
+  }
+  memcpy(regs, e->regs, sizeof e->regs);
+}
+
+uint64_t
+guest_xcr0(void)
+{
+  return xcr0;
+}
+
+/* AT_HWCAP of x86_64 is the edx of leaf 1 */
+uint64_t
+guest_hwcap(void)
+{
+  uint32_t regs[4];
+  guest_cpuid(0x1, 0, regs);
+  return regs[EDX];
+}
+
+/* rdfsbase and friends are passed through; init_special_regs sets CR4.FSGSBASE to match */
+bool
+guest_has_fsgsbase(void)
+{
+  uint32_t regs[4];
+  guest_cpuid(0x7, 0, regs);
+  return regs[EBX] & 1;
+}
+
+uint64_t
+guest_hwcap2(void)
+{
+  return guest_has_fsgsbase() ? LINUX_HWCAP2_FSGSBASE : 0;
+}
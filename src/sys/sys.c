@@ -6,12 +6,127 @@
 #include "linux/random.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/sysctl.h>
 
+static struct cpu_topology cpu_topology;
+static pthread_once_t cpu_topology_once = PTHREAD_ONCE_INIT;
+
+static int64_t
+sysctl_int(const char *name, int64_t dflt)
+{
+  /* the values are either 32 or 64 bit wide depending on the name */
+  union { int32_t i32; int64_t i64; } val = {};
+  size_t len = sizeof val;
+  if (sysctlbyname(name, &val, &len, NULL, 0) < 0) {
+    return dflt;
+  }
+  return len == sizeof val.i32 ? val.i32 : val.i64;
+}
+
+static void
+sysctl_str(const char *name, char *buf, size_t size)
+{
+  size_t len = size;
+  if (sysctlbyname(name, buf, &len, NULL, 0) < 0) {
+    buf[0] = '\0';
+  }
+  buf[size - 1] = '\0';
+}
+
+/* darwin's feature names that differ from those in linux's /proc/cpuinfo */
+static const struct {
+  const char *darwin_name, *linux_name;
+} feature_names[] = {
+  {"sse3", "pni"}, {"clfsh", "clflush"}, {"htt", "ht"}, {"dscpl", "ds_cpl"},
+  {"sse4.1", "sse4_1"}, {"sse4.2", "sse4_2"}, {"avx1.0", "avx"}, {"xd", "nx"},
+  {"em64t", "lm"}, {"lahf", "lahf_lm"}, {"tsctmr", "tsc_deadline_timer"},
+  {"seglim64", NULL},
+};
+
+static void
+append_features(const char *list)
+{
+  struct cpu_topology *t = &cpu_topology;
+  char buf[512];
+  strlcpy(buf, list, sizeof buf);
+  for (char *p = buf; *p; p++) {
+    *p = tolower(*p);
+  }
+  char *save, *name;
+  for (name = strtok_r(buf, " ", &save); name; name = strtok_r(NULL, " ", &save)) {
+    for (size_t i = 0; i < sizeof feature_names / sizeof feature_names[0]; i++) {
+      if (strcmp(name, feature_names[i].darwin_name) == 0) {
+        name = (char *) feature_names[i].linux_name;
+        break;
+      }
+    }
+    if (name == NULL)
+      continue;
+    if (t->features[0]) {
+      strlcat(t->features, " ", sizeof t->features);
+    }
+    strlcat(t->features, name, sizeof t->features);
+  }
+}
+
+static void
+init_cpu_topology(void)
+{
+  struct cpu_topology *t = &cpu_topology;
+
+  t->nr_online = sysctl_int("hw.logicalcpu", 1);
+  t->nr_possible = sysctl_int("hw.logicalcpu_max", t->nr_online);
+  t->nr_cores = sysctl_int("hw.physicalcpu", t->nr_online);
+  t->nr_packages = sysctl_int("hw.packages", 1);
+  if (t->nr_possible > LINUX_NR_CPUS) {
+    t->nr_possible = LINUX_NR_CPUS;
+  }
+  if (t->nr_online > t->nr_possible) {
+    t->nr_online = t->nr_possible;
+  }
+
+  sysctl_str("machdep.cpu.vendor", t->vendor, sizeof t->vendor);
+  sysctl_str("machdep.cpu.brand_string", t->brand, sizeof t->brand);
+  t->family = sysctl_int("machdep.cpu.family", 0);
+  t->model = sysctl_int("machdep.cpu.model", 0);
+  t->stepping = sysctl_int("machdep.cpu.stepping", 0);
+  t->freq = sysctl_int("hw.cpufrequency", 0);
+  t->cache_size = sysctl_int("hw.l3cachesize", sysctl_int("hw.l2cachesize", 0));
+
+  char list[512];
+  static const char *const feature_sysctls[] = {
+    "machdep.cpu.features", "machdep.cpu.extfeatures", "machdep.cpu.leaf7_features",
+  };
+  for (size_t i = 0; i < sizeof feature_sysctls / sizeof feature_sysctls[0]; i++) {
+    sysctl_str(feature_sysctls[i], list, sizeof list);
+    append_features(list);
+  }
+}
+
+const struct cpu_topology *
+host_cpu_topology(void)
+{
+  pthread_once(&cpu_topology_once, init_cpu_topology);
+  return &cpu_topology;
+}
+
+void
+host_online_cpumask(uint64_t mask[CPUMASK_WORDS])
+{
+  int n = host_cpu_topology()->nr_online;
+  memset(mask, 0, sizeof(uint64_t) * CPUMASK_WORDS);
+  for (int i = 0; i < n; i++) {
+    mask[i / 64] |= 1ULL << (i % 64);
+  }
+}
+
 DEFINE_SYSCALL(sysinfo, gaddr_t, info_ptr)
 {
   struct l_sysinfo info;
@@ -82,27 +197,20 @@ DEFINE_SYSCALL(sysinfo, gaddr_t, info_ptr)
 
 DEFINE_SYSCALL(getrandom, gaddr_t, buf_ptr, size_t, count, unsigned, flags)
 {
-  if (flags & ~(GRND_RANDOM | GRND_NONBLOCK)) {
+  if ((flags & ~(GRND_RANDOM | GRND_NONBLOCK | GRND_INSECURE)) || ((flags & GRND_RANDOM) && (flags & GRND_INSECURE))) {
     return -LINUX_EINVAL;
   }
-  const char *source;
-  source = flags & GRND_RANDOM ? "/dev/random" : "/dev/urandom";
-  int oflags = O_RDONLY;
-  oflags |= flags & GRND_NONBLOCK ? O_NONBLOCK : 0;
-  int fd = open(source, oflags);
-  if (fd < 0) {
-    printk("getrandom: logic flaw\n");
-    return -darwin_to_linux_errno(errno);
-  }
-  char *buf = malloc(count);
-  int r = syswrap(read(fd, buf, count));
-  if (r < 0) {
-    goto out;
-  }
-  if (copy_to_user(buf_ptr, buf, count)) {
-    r = -LINUX_EFAULT;
+  /* the host generator never blocks once the system is up, with or without GRND_RANDOM */
+  count = MIN(count, GRND_MAX_COUNT);
+  char buf[4096];
+  size_t done = 0;
+  while (done < count) {
+    size_t n = MIN(count - done, sizeof buf);
+    arc4random_buf(buf, n);
+    if (copy_to_user(buf_ptr + done, buf, n)) {
+      return done ? (int64_t) done : -LINUX_EFAULT;
+    }
+    done += n;
   }
-out:
-  free(buf);
-  return r;
+  return done;
 }
@@ -17,6 +17,7 @@
 #include <sys/time.h>
 #include <sys/attr.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <mach/clock.h>
 #include <mach/mach.h>
 
@@ -25,6 +26,7 @@
 #define TIMER_ABSTIME -1
 #define CLOCK_REALTIME CALENDAR_CLOCK
 #define CLOCK_MONOTONIC SYSTEM_CLOCK
+#define CLOCK_MONOTONIC_RAW SYSTEM_CLOCK
 #define CLOCK_PROCESS_CPUTIME_ID       2
 #define CLOCK_THREAD_CPUTIME_ID        3
 
@@ -85,27 +87,6 @@ DEFINE_SYSCALL(gettimeofday, gaddr_t, tp_ptr, gaddr_t, tzp_ptr)
   return 0;
 }
 
-DEFINE_SYSCALL(nanosleep, gaddr_t, rqtp_ptr, gaddr_t, rmtp_ptr)
-{
-  struct l_timespec rqtp, rmtp;
-  if (copy_from_user(&rqtp, rqtp_ptr, sizeof rqtp))
-    return -LINUX_EFAULT;
-  struct timespec rq, rm;
-  rq.tv_sec = rqtp.tv_sec;
-  rq.tv_nsec = rqtp.tv_nsec;
-  int r = syswrap(nanosleep(&rq, &rm));
-  if (r < 0) {
-    return r;
-  }
-  if (rmtp_ptr != 0) {
-    rmtp.tv_sec = rm.tv_sec;
-    rmtp.tv_nsec = rm.tv_nsec;
-    if (copy_to_user(rmtp_ptr, &rmtp, sizeof rmtp))
-      return -LINUX_EFAULT;
-  }
-  return r;
-}
-
 int
 do_utimensat(int dirfd, const char *name, const struct l_timespec *l_times, int flags)
 {
@@ -205,32 +186,130 @@ DEFINE_SYSCALL(utime, gaddr_t, path, gaddr_t, times)
   return do_utimensat(LINUX_AT_FDCWD, name, times == 0 ? NULL : l_time, 0);
 }
 
-clockid_t
+/* returns -1 for the clocks not in the host's hand */
+static clockid_t
 linux_to_darwin_clockid(l_clockid_t id)
 {
   switch (id) {
   case LINUX_CLOCK_REALTIME:
-  case LINUX_CLOCK_REALTIME_HR:
+  case LINUX_CLOCK_REALTIME_COARSE:
+  case LINUX_CLOCK_REALTIME_ALARM:
+  case LINUX_CLOCK_TAI:
     return CLOCK_REALTIME;
   case LINUX_CLOCK_MONOTONIC:
   case LINUX_CLOCK_MONOTONIC_COARSE:
+  case LINUX_CLOCK_BOOTTIME:
+  case LINUX_CLOCK_BOOTTIME_ALARM:
     return CLOCK_MONOTONIC;
+  case LINUX_CLOCK_MONOTONIC_RAW:
+    return CLOCK_MONOTONIC_RAW;
   case LINUX_CLOCK_PROCESS_CPUTIME_ID:
     return CLOCK_PROCESS_CPUTIME_ID;
   case LINUX_CLOCK_THREAD_CPUTIME_ID:
     return CLOCK_THREAD_CPUTIME_ID;
   default:
-    panic("linux_to_darwin_clockid: %d", id);
+    return (clockid_t) -1;
   }
 }
 
-DEFINE_SYSCALL(clock_gettime, l_clockid_t, id, gaddr_t, spec_ptr)
+static uint64_t
+time_value_to_ns(time_value_t tv)
+{
+  return tv.seconds * 1000000000ULL + tv.microseconds * 1000ULL;
+}
+
+static int
+thread_cputime(l_pid_t tid, int which, uint64_t *ns)
+{
+  if (tid == 0) {
+    tid = task.tid;
+  }
+  if (tid == (l_pid_t) task.tid && which != LINUX_CPUCLOCK_VIRT) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    *ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    return 0;
+  }
+
+  /* other threads are read through their mach thread port */
+  int ret = -LINUX_EINVAL;
+  pthread_rwlock_rdlock(&proc.lock);
+  struct task *t;
+  list_for_each_entry (t, &proc.tasks, head) {
+    if ((l_pid_t) t->tid != tid) {
+      continue;
+    }
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    if (thread_info(pthread_mach_thread_np(t->thread), THREAD_BASIC_INFO, (thread_info_t) &info, &count) == KERN_SUCCESS) {
+      *ns = time_value_to_ns(info.user_time);
+      if (which != LINUX_CPUCLOCK_VIRT) {
+        *ns += time_value_to_ns(info.system_time);
+      }
+      ret = 0;
+    }
+    break;
+  }
+  pthread_rwlock_unlock(&proc.lock);
+  return ret;
+}
+
+static int
+cpuclock_read(l_clockid_t id, uint64_t *ns)
 {
+  l_pid_t pid = LINUX_CPUCLOCK_PID(id);
+  int which = LINUX_CPUCLOCK_WHICH(id);
+  if (which >= LINUX_CPUCLOCK_MAX) {
+    return -LINUX_EINVAL;
+  }
+  if (LINUX_CPUCLOCK_PERTHREAD(id)) {
+    return thread_cputime(pid, which, ns);
+  }
+  /* the clocks of other processes are out of our reach */
+  if (pid != 0 && pid != getpid()) {
+    return -LINUX_EINVAL;
+  }
+  if (which == LINUX_CPUCLOCK_SCHED) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    *ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    return 0;
+  }
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  *ns = ru.ru_utime.tv_sec * 1000000000ULL + ru.ru_utime.tv_usec * 1000ULL;
+  if (which == LINUX_CPUCLOCK_PROF) {
+    *ns += ru.ru_stime.tv_sec * 1000000000ULL + ru.ru_stime.tv_usec * 1000ULL;
+  }
+  return 0;
+}
+
+/* reads a Linux clock in ns, the cpu-time clocks of this process and its
+   threads included; -EINVAL for an unknown clock */
+int
+clock_read(l_clockid_t id, uint64_t *ns)
+{
+  if (id < 0) {
+    return cpuclock_read(id, ns);
+  }
+  clockid_t clock = linux_to_darwin_clockid(id);
+  if (clock == (clockid_t) -1) {
+    return -LINUX_EINVAL;
+  }
   struct timespec ts;
-  int r = syswrap(clock_gettime(linux_to_darwin_clockid(id), &ts));
+  clock_gettime(clock, &ts);
+  *ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  return 0;
+}
+
+DEFINE_SYSCALL(clock_gettime, l_clockid_t, id, gaddr_t, spec_ptr)
+{
+  uint64_t ns;
+  int r = clock_read(id, &ns);
   if (r < 0) {
     return r;
   }
+  struct l_timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
   if (spec_ptr != 0 && copy_to_user(spec_ptr, &ts, sizeof ts)) {
     return -LINUX_EFAULT;
   }
@@ -239,12 +318,17 @@ DEFINE_SYSCALL(clock_gettime, l_clockid_t, id, gaddr_t, spec_ptr)
 
 DEFINE_SYSCALL(clock_getres, l_clockid_t, id, gaddr_t, res_ptr)
 {
-  struct timespec ts;
-  int r = syswrap(clock_getres(linux_to_darwin_clockid(id), &ts));
+  uint64_t ns;
+  int r = clock_read(id, &ns);
   if (r < 0) {
     return r;
   }
-  if (res_ptr != 0 && copy_to_user(res_ptr, &ts, sizeof ts)) {
+  struct timespec ts = { 0, 1 };
+  if (id >= 0) {
+    clock_getres(linux_to_darwin_clockid(id), &ts);
+  }
+  struct l_timespec lts = { ts.tv_sec, ts.tv_nsec };
+  if (res_ptr != 0 && copy_to_user(res_ptr, &lts, sizeof lts)) {
     return -LINUX_EFAULT;
   }
   return 0;
@@ -272,18 +356,22 @@ linux_to_darwin_itimerval(const struct l_itimerval* l_val, struct itimerval* d_v
 }
 
 DEFINE_SYSCALL(getitimer, int, which, gaddr_t, ret_ptr) {
-  struct itimerval value;
-  // Darwin's which is compatible with that of Linux
-  int r = syswrap(getitimer(which, &value));
-  if (r < 0) {
-    return r;
-  }
   struct l_itimerval l_itimerval;
-  darwin_to_linux_itimerval(&value, &l_itimerval);
+  if (which == ITIMER_REAL) {
+    get_real_itimer(&l_itimerval);
+  } else {
+    struct itimerval value;
+    // Darwin's which is compatible with that of Linux
+    int r = syswrap(getitimer(which, &value));
+    if (r < 0) {
+      return r;
+    }
+    darwin_to_linux_itimerval(&value, &l_itimerval);
+  }
   if (copy_to_user(ret_ptr, &l_itimerval, sizeof l_itimerval)) {
     return -LINUX_EFAULT;
   }
-  return r;
+  return 0;
 }
 
 
@@ -296,18 +384,25 @@ DEFINE_SYSCALL(setitimer, int, which, gaddr_t, new_ptr, gaddr_t, old_ptr) {
   if (copy_from_user(&l_newvalue, new_ptr, sizeof l_newvalue)) {
     return -LINUX_EFAULT;
   }
-  linux_to_darwin_itimerval(&l_newvalue, &newvalue);
-  // Darwin's which is compatible with that of Linux
-  int r = syswrap(setitimer(which, &newvalue, &oldvalue));
-  if (r < 0) {
-    return r;
+  if (which == ITIMER_REAL) {
+    /* kept by noah, so that SIGALRM does not land on whichever host thread */
+    int r = set_real_itimer(&l_newvalue, &l_oldvalue);
+    if (r < 0) {
+      return r;
+    }
+  } else {
+    linux_to_darwin_itimerval(&l_newvalue, &newvalue);
+    // Darwin's which is compatible with that of Linux
+    int r = syswrap(setitimer(which, &newvalue, &oldvalue));
+    if (r < 0) {
+      return r;
+    }
+    darwin_to_linux_itimerval(&oldvalue, &l_oldvalue);
   }
   if (old_ptr != 0) {
-    darwin_to_linux_itimerval(&oldvalue, &l_oldvalue);
     if (copy_to_user(old_ptr, &l_oldvalue, sizeof l_oldvalue)) {
       return -LINUX_EFAULT;
     }
   }
-  return r;
+  return 0;
 }
-
@@ -0,0 +1,676 @@
+#include "common.h"
+#include "noah.h"
+#include "vmm.h"
+
+#include "linux/common.h"
+#include "linux/time.h"
+#include "linux/errno.h"
+#include "linux/signal.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/event.h>
+#include <mach/mach.h>
+
+/*
+ * POSIX timers, the real interval timer, and clock_nanosleep.
+ *
+ * The timers of a process are expired by a host thread of noah's own, which
+ * sleeps on a kqueue holding a one-shot EVFILT_TIMER knote per armed timer.
+ * Deadlines are kept in the timer's own clock. A knote is armed for the time
+ * left as that clock reads now, and when it fires early -- the realtime clock
+ * was set back, or a cpu-time clock did not advance as fast as the wall
+ * clock -- it is just armed again for the rest.
+ *
+ * As on Linux, a timer has at most one signal pending at a time. Expirations
+ * while it is pending are counted and reported as the overrun when the signal
+ * is taken.
+ */
+
+#define TIMER_MAX            4096                 /* per process */
+#define OVERRUN_MAX          INT32_MAX
+#define CPUCLOCK_MIN_SLICE   1000000ULL           /* cpu-time clocks are looked at every 1ms at most */
+#define REALTIME_MAX_SLICE   1000000000ULL        /* and the realtime clock every 1s at least, as it may be set */
+
+struct ptimer {
+  struct list_head head;
+  int id;                  /* -1 for the real interval timer */
+  l_clockid_t clockid;     /* cpu-time clocks are in the form naming the process or thread */
+  int notify;
+  int signo;
+  l_sigval_t value;
+  l_pid_t tid;             /* for SIGEV_THREAD_ID */
+  uint64_t expires;        /* in the timer's clock (ns), 0 while disarmed */
+  uint64_t interval;
+  bool pending;            /* its signal is queued and not yet taken */
+  int pending_overrun;
+  int overrun;             /* of the signal taken last */
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct list_head list;
+  int nr_timers;
+  int next_id;
+  int kq;                  /* vkern fd, -1 until the expiring thread is started */
+  struct ptimer itimer;    /* ITIMER_REAL */
+} timers = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .list = { &timers.list, &timers.list },
+  .kq = -1,
+  .itimer = {
+    .id = -1,
+    .clockid = LINUX_CLOCK_MONOTONIC,
+    .notify = LINUX_SIGEV_SIGNAL,
+    .signo = LINUX_SIGALRM,
+  },
+};
+
+static uint64_t
+l_timespec_to_ns(const struct l_timespec *ts)
+{
+  if ((uint64_t) ts->tv_sec >= UINT64_MAX / 1000000000ULL) {
+    return UINT64_MAX;
+  }
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void
+ns_to_l_timespec(uint64_t ns, struct l_timespec *ts)
+{
+  ts->tv_sec = ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static bool
+l_timespec_valid(const struct l_timespec *ts)
+{
+  return ts->tv_sec >= 0 && ts->tv_nsec >= 0 && ts->tv_nsec < 1000000000L;
+}
+
+static uint64_t
+add_ns(uint64_t a, uint64_t b)
+{
+  return (a > UINT64_MAX - b) ? UINT64_MAX : a + b;
+}
+
+static bool
+is_cpuclock(l_clockid_t id)
+{
+  return id < 0 || id == LINUX_CLOCK_PROCESS_CPUTIME_ID || id == LINUX_CLOCK_THREAD_CPUTIME_ID;
+}
+
+/* how long to sleep before looking at the clock again, with left ns to go */
+static uint64_t
+wait_slice(l_clockid_t id, uint64_t left)
+{
+  switch (id) {
+  case LINUX_CLOCK_REALTIME:
+  case LINUX_CLOCK_REALTIME_COARSE:
+  case LINUX_CLOCK_REALTIME_ALARM:
+  case LINUX_CLOCK_TAI:
+    return MIN(left, REALTIME_MAX_SLICE);
+  }
+  if (!is_cpuclock(id)) {
+    return left;
+  }
+  if (id == LINUX_CLOCK_PROCESS_CPUTIME_ID || (id < 0 && !LINUX_CPUCLOCK_PERTHREAD(id))) {
+    /* every thread may be using up cpu time at once */
+    left /= MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+  }
+  return MAX(left, CPUCLOCK_MIN_SLICE);
+}
+
+static struct ptimer *
+find_timer(int id)
+{
+  if (id == -1) {
+    return &timers.itimer;
+  }
+  struct ptimer *t;
+  list_for_each_entry (t, &timers.list, head) {
+    if (t->id == id) {
+      return t;
+    }
+  }
+  return NULL;
+}
+
+/* called with the lock held */
+static void
+arm_timer(struct ptimer *t, uint64_t now)
+{
+  struct kevent kev;
+  if (t->expires == 0) {
+    EV_SET(&kev, (uintptr_t) t->id, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+  } else {
+    uint64_t slice = wait_slice(t->clockid, (t->expires > now) ? t->expires - now : 0);
+    /* NOTE_CRITICAL keeps the host from coalescing it with other timers */
+    EV_SET(&kev, (uintptr_t) t->id, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_NSECONDS | NOTE_CRITICAL, MAX(slice, 1), NULL);
+  }
+  kevent(timers.kq, &kev, 1, NULL, 0, NULL);
+}
+
+/* called with the lock held */
+static void
+notify_timer(struct ptimer *t, uint64_t expirations)
+{
+  if (t->notify == LINUX_SIGEV_NONE) {
+    return;
+  }
+  if (t->pending) {
+    t->pending_overrun = MIN(t->pending_overrun + expirations, OVERRUN_MAX);
+    return;
+  }
+
+  l_siginfo_t info = {
+    .lsi_signo = t->signo,
+    .lsi_code = LINUX_SI_KERNEL,
+  };
+  if (t->id >= 0) {
+    info.lsi_code = LINUX_SI_TIMER;
+    info.lsi_tid = t->id;
+    info.lsi_value = t->value;
+  }
+  int ret = send_kernel_signal((t->notify & LINUX_SIGEV_THREAD_ID) ? t->tid : 0, &info);
+  /* a signal merged with one not of ours is taken without telling us */
+  if (ret == 0 && t->id >= 0) {
+    t->pending = true;
+    t->pending_overrun = MIN(expirations - 1, OVERRUN_MAX);
+  }
+}
+
+/* called with the lock held */
+static void
+expire_timer(struct ptimer *t)
+{
+  uint64_t now;
+  if (clock_read(t->clockid, &now) < 0) {
+    /* the thread whose clock it was has gone */
+    t->expires = 0;
+    return;
+  }
+  if (now < t->expires) {
+    arm_timer(t, now);
+    return;
+  }
+  uint64_t expirations = 1;
+  if (t->interval) {
+    expirations += (now - t->expires) / t->interval;
+    t->expires = add_ns(t->expires, expirations * t->interval);
+    arm_timer(t, now);
+  } else {
+    t->expires = 0;
+  }
+  notify_timer(t, expirations);
+}
+
+static void *
+timer_thread(void *arg)
+{
+  int kq = (int) (intptr_t) arg;
+  struct kevent evs[16];
+
+  for (;;) {
+    int n = kevent(kq, NULL, 0, evs, 16, NULL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    pthread_mutex_lock(&timers.lock);
+    for (int i = 0; i < n; i++) {
+      struct ptimer *t = find_timer((int) evs[i].ident);
+      if (t && t->expires) {
+        expire_timer(t);
+      }
+    }
+    pthread_mutex_unlock(&timers.lock);
+  }
+  return NULL;
+}
+
+/* called with the lock held */
+static int
+start_timer_thread(void)
+{
+  if (timers.kq >= 0) {
+    return 0;
+  }
+  int kq = kqueue();
+  if (kq < 0) {
+    return -LINUX_EAGAIN;
+  }
+  pthread_rwlock_wrlock(&proc.fileinfo.fdtable_lock);
+  int vkq = vkern_dup_fd(kq, true);
+  pthread_rwlock_unlock(&proc.fileinfo.fdtable_lock);
+  close(kq);
+
+  /* host signals are for the tasks; the thread starts with all of them blocked */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, timer_thread, (void *) (intptr_t) vkq);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err) {
+    vkern_close(vkq);
+    return -LINUX_EAGAIN;
+  }
+  pthread_detach(thread);
+  timers.kq = vkq;
+  return 0;
+}
+
+/* called with the lock held */
+static void
+get_timer(struct ptimer *t, struct l_itimerspec *value)
+{
+  ns_to_l_timespec(t->interval, &value->it_interval);
+  uint64_t now, left = 0;
+  if (t->expires && clock_read(t->clockid, &now) == 0) {
+    /* expired but not yet handled by the thread; Linux reads it as 1ns too */
+    left = (t->expires > now) ? t->expires - now : 1;
+  }
+  ns_to_l_timespec(left, &value->it_value);
+}
+
+/* called with the lock held */
+static int
+set_timer(struct ptimer *t, int flags, const struct l_itimerspec *value)
+{
+  uint64_t now;
+  int r = clock_read(t->clockid, &now);
+  if (r < 0) {
+    return r;
+  }
+  uint64_t expires = l_timespec_to_ns(&value->it_value);
+  if (expires != 0 && (r = start_timer_thread()) < 0) {
+    return r;
+  }
+  if (expires != 0 && !(flags & LINUX_TIMER_ABSTIME)) {
+    expires = add_ns(now, expires);
+  }
+  t->expires = expires;
+  t->interval = l_timespec_to_ns(&value->it_interval);
+  t->pending_overrun = 0;
+  if (timers.kq >= 0) {
+    arm_timer(t, now);
+  }
+  return 0;
+}
+
+/* called with the lock held */
+static void
+delete_timer(struct ptimer *t)
+{
+  t->expires = 0;
+  if (timers.kq >= 0) {
+    arm_timer(t, 0);
+  }
+  list_del(&t->head);
+  timers.nr_timers--;
+  free(t);
+}
+
+DEFINE_SYSCALL(timer_delete, int, timerid)
+{
+  pthread_mutex_lock(&timers.lock);
+  struct ptimer *t = (timerid >= 0) ? find_timer(timerid) : NULL;
+  if (t) {
+    delete_timer(t);
+  }
+  pthread_mutex_unlock(&timers.lock);
+  return t ? 0 : -LINUX_EINVAL;
+}
+
+DEFINE_SYSCALL(timer_create, l_clockid_t, clockid, gaddr_t, sevp, gaddr_t, timerid_ptr)
+{
+  uint64_t now;
+  int r = clock_read(clockid, &now);
+  if (r < 0) {
+    return r;
+  }
+  if (clockid == LINUX_CLOCK_PROCESS_CPUTIME_ID) {
+    clockid = LINUX_MAKE_PROCESS_CPUCLOCK(0, LINUX_CPUCLOCK_SCHED);
+  } else if (clockid == LINUX_CLOCK_THREAD_CPUTIME_ID) {
+    /* the clock of the creating thread, wherever the timer is read */
+    clockid = LINUX_MAKE_THREAD_CPUCLOCK(task.tid, LINUX_CPUCLOCK_SCHED);
+  }
+
+  struct l_sigevent ev = {
+    .sigev_notify = LINUX_SIGEV_SIGNAL,
+    .sigev_signo = LINUX_SIGALRM,
+  };
+  if (sevp != 0 && copy_from_user(&ev, sevp, sizeof ev)) {
+    return -LINUX_EFAULT;
+  }
+  switch (ev.sigev_notify) {
+  case LINUX_SIGEV_SIGNAL | LINUX_SIGEV_THREAD_ID: {
+    /* the thread has to be one of ours */
+    l_siginfo_t probe = { .lsi_signo = 0 };
+    if (send_kernel_signal(ev.lsigev_notify_thread_id, &probe) < 0) {
+      return -LINUX_EINVAL;
+    }
+  }
+    /* fall through */
+  case LINUX_SIGEV_SIGNAL:
+  case LINUX_SIGEV_THREAD:
+    if (ev.sigev_signo <= 0 || ev.sigev_signo > LINUX_NSIG) {
+      return -LINUX_EINVAL;
+    }
+    break;
+  case LINUX_SIGEV_NONE:
+    break;
+  default:
+    return -LINUX_EINVAL;
+  }
+
+  struct ptimer *t = calloc(1, sizeof *t);
+  t->clockid = clockid;
+  t->notify = ev.sigev_notify;
+  t->signo = ev.sigev_signo;
+  t->value = ev.sigev_value;
+  t->tid = ev.lsigev_notify_thread_id;
+
+  pthread_mutex_lock(&timers.lock);
+  if (timers.nr_timers >= TIMER_MAX) {
+    pthread_mutex_unlock(&timers.lock);
+    free(t);
+    return -LINUX_EAGAIN;
+  }
+  /* ids go round, so that a stale signal is not mistaken for a new timer's */
+  do {
+    t->id = timers.next_id;
+    timers.next_id = (timers.next_id == INT32_MAX) ? 0 : timers.next_id + 1;
+  } while (find_timer(t->id) != NULL);
+  if (sevp == 0) {
+    t->value.sival_int = t->id;
+  }
+  list_add_tail(&t->head, &timers.list);
+  timers.nr_timers++;
+  pthread_mutex_unlock(&timers.lock);
+
+  int id = t->id;
+  if (copy_to_user(timerid_ptr, &id, sizeof id)) {
+    sys_timer_delete(id);
+    return -LINUX_EFAULT;
+  }
+  return 0;
+}
+
+DEFINE_SYSCALL(timer_settime, int, timerid, int, flags, gaddr_t, new_ptr, gaddr_t, old_ptr)
+{
+  struct l_itimerspec new, old;
+  if (copy_from_user(&new, new_ptr, sizeof new)) {
+    return -LINUX_EFAULT;
+  }
+  if (!l_timespec_valid(&new.it_value) || !l_timespec_valid(&new.it_interval)) {
+    return -LINUX_EINVAL;
+  }
+
+  pthread_mutex_lock(&timers.lock);
+  struct ptimer *t = (timerid >= 0) ? find_timer(timerid) : NULL;
+  int r = -LINUX_EINVAL;
+  if (t) {
+    get_timer(t, &old);
+    r = set_timer(t, flags, &new);
+  }
+  pthread_mutex_unlock(&timers.lock);
+  if (r < 0) {
+    return r;
+  }
+
+  if (old_ptr != 0 && copy_to_user(old_ptr, &old, sizeof old)) {
+    return -LINUX_EFAULT;
+  }
+  return 0;
+}
+
+DEFINE_SYSCALL(timer_gettime, int, timerid, gaddr_t, value_ptr)
+{
+  struct l_itimerspec value;
+  pthread_mutex_lock(&timers.lock);
+  struct ptimer *t = (timerid >= 0) ? find_timer(timerid) : NULL;
+  if (t) {
+    get_timer(t, &value);
+  }
+  pthread_mutex_unlock(&timers.lock);
+  if (t == NULL) {
+    return -LINUX_EINVAL;
+  }
+  if (copy_to_user(value_ptr, &value, sizeof value)) {
+    return -LINUX_EFAULT;
+  }
+  return 0;
+}
+
+DEFINE_SYSCALL(timer_getoverrun, int, timerid)
+{
+  pthread_mutex_lock(&timers.lock);
+  struct ptimer *t = (timerid >= 0) ? find_timer(timerid) : NULL;
+  int r = t ? t->overrun : -LINUX_EINVAL;
+  pthread_mutex_unlock(&timers.lock);
+  return r;
+}
+
+/* called by dequeue_signal for an SI_TIMER signal, to fill in its overrun */
+void
+take_timer_signal(l_siginfo_t *info)
+{
+  pthread_mutex_lock(&timers.lock);
+  struct ptimer *t = find_timer((int) info->lsi_tid);
+  if (t && t->pending) {
+    t->pending = false;
+    t->overrun = t->pending_overrun;
+    t->pending_overrun = 0;
+    info->lsi_overrun = t->overrun;
+  }
+  pthread_mutex_unlock(&timers.lock);
+}
+
+/* called for a queued SI_TIMER signal that is thrown away instead of taken */
+void
+drop_timer_signal(const l_siginfo_t *info)
+{
+  pthread_mutex_lock(&timers.lock);
+  struct ptimer *t = find_timer((int) info->lsi_tid);
+  if (t && t->pending) {
+    t->pending = false;
+    t->pending_overrun = 0;
+  }
+  pthread_mutex_unlock(&timers.lock);
+}
+
+static uint64_t
+l_timeval_to_ns(const struct l_timeval *tv)
+{
+  return tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+static void
+ns_to_l_timeval(uint64_t ns, struct l_timeval *tv)
+{
+  tv->tv_sec = ns / 1000000000ULL;
+  tv->tv_usec = (ns % 1000000000ULL) / 1000;
+}
+
+static bool
+l_timeval_valid(const struct l_timeval *tv)
+{
+  return tv->tv_sec >= 0 && tv->tv_usec >= 0 && tv->tv_usec < 1000000;
+}
+
+static void
+l_itimerspec_to_l_itimerval(const struct l_itimerspec *spec, struct l_itimerval *value)
+{
+  ns_to_l_timeval(l_timespec_to_ns(&spec->it_interval), &value->it_interval);
+  /* a running timer never reads 0 */
+  uint64_t left = l_timespec_to_ns(&spec->it_value);
+  ns_to_l_timeval(left ? MAX(left, 1000) : 0, &value->it_value);
+}
+
+void
+get_real_itimer(struct l_itimerval *value)
+{
+  struct l_itimerspec spec;
+  pthread_mutex_lock(&timers.lock);
+  get_timer(&timers.itimer, &spec);
+  pthread_mutex_unlock(&timers.lock);
+  l_itimerspec_to_l_itimerval(&spec, value);
+}
+
+int
+set_real_itimer(const struct l_itimerval *value, struct l_itimerval *ovalue)
+{
+  if (!l_timeval_valid(&value->it_value) || !l_timeval_valid(&value->it_interval)) {
+    return -LINUX_EINVAL;
+  }
+  struct l_itimerspec spec, ospec;
+  ns_to_l_timespec(l_timeval_to_ns(&value->it_value), &spec.it_value);
+  ns_to_l_timespec(l_timeval_to_ns(&value->it_interval), &spec.it_interval);
+
+  pthread_mutex_lock(&timers.lock);
+  get_timer(&timers.itimer, &ospec);
+  int r = set_timer(&timers.itimer, 0, &spec);
+  pthread_mutex_unlock(&timers.lock);
+  if (r == 0 && ovalue) {
+    l_itimerspec_to_l_itimerval(&ospec, ovalue);
+  }
+  return r;
+}
+
+/* POSIX timers do not survive execve; the real interval timer does */
+void
+flush_timers(void)
+{
+  pthread_mutex_lock(&timers.lock);
+  struct ptimer *t, *n;
+  list_for_each_entry_safe (t, n, &timers.list, head) {
+    delete_timer(t);
+  }
+  timers.next_id = 0;
+  pthread_mutex_unlock(&timers.lock);
+}
+
+/* keeps the expiring thread out of the way while the process is forked */
+void
+prepare_fork_timers(void)
+{
+  pthread_mutex_lock(&timers.lock);
+}
+
+/* none of the timers are inherited, nor is the thread and its kqueue */
+void
+fork_timers(bool child)
+{
+  if (!child) {
+    pthread_mutex_unlock(&timers.lock);
+    return;
+  }
+  pthread_mutex_init(&timers.lock, NULL);
+  struct ptimer *t, *n;
+  list_for_each_entry_safe (t, n, &timers.list, head) {
+    list_del(&t->head);
+    free(t);
+  }
+  timers.nr_timers = 0;
+  timers.next_id = 0;
+  timers.itimer.expires = 0;
+  timers.itimer.interval = 0;
+  if (timers.kq >= 0) {
+    vkern_close(timers.kq);
+    timers.kq = -1;
+  }
+}
+
+/*
+ * A relative sleep interrupted only to park the thread for a fork is restarted
+ * with the same arguments. Its deadline is kept here so that the restart
+ * sleeps for what was left rather than for the whole interval again.
+ */
+static _Thread_local struct {
+  bool valid;
+  l_clockid_t clockid;
+  gaddr_t rqtp_ptr;
+  struct l_timespec rqtp;
+  uint64_t deadline;
+} nanosleep_restart;
+
+/* called when an EINTR reaches the guest instead of being restarted */
+void
+forget_nanosleep_restart(void)
+{
+  nanosleep_restart.valid = false;
+}
+
+DEFINE_SYSCALL(clock_nanosleep, l_clockid_t, clockid, int, flags, gaddr_t, rqtp_ptr, gaddr_t, rmtp_ptr)
+{
+  struct l_timespec rqtp;
+  if (copy_from_user(&rqtp, rqtp_ptr, sizeof rqtp)) {
+    return -LINUX_EFAULT;
+  }
+  if (!l_timespec_valid(&rqtp)) {
+    return -LINUX_EINVAL;
+  }
+  /* a thread cannot sleep on its own cpu time */
+  if (clockid == LINUX_CLOCK_THREAD_CPUTIME_ID || (clockid < 0 && LINUX_CPUCLOCK_PERTHREAD(clockid))) {
+    return -LINUX_EINVAL;
+  }
+  uint64_t now;
+  int r = clock_read(clockid, &now);
+  if (r < 0) {
+    return r;
+  }
+  uint64_t deadline = l_timespec_to_ns(&rqtp);
+  if (!(flags & LINUX_TIMER_ABSTIME)) {
+    if (nanosleep_restart.valid && nanosleep_restart.clockid == clockid && nanosleep_restart.rqtp_ptr == rqtp_ptr
+        && nanosleep_restart.rqtp.tv_sec == rqtp.tv_sec && nanosleep_restart.rqtp.tv_nsec == rqtp.tv_nsec) {
+      deadline = nanosleep_restart.deadline;
+    } else {
+      deadline = add_ns(now, deadline);
+    }
+  }
+  nanosleep_restart.valid = false;
+
+  /* sleep on the semaphore a pending signal is told through, as sigtimedwait
+     does; a signal that came in just before the wait is not lost */
+  while (now < deadline) {
+    if (has_sigpending()) {
+      if (!(flags & LINUX_TIMER_ABSTIME) && rmtp_ptr != 0) {
+        struct l_timespec rmtp;
+        ns_to_l_timespec(deadline - now, &rmtp);
+        if (copy_to_user(rmtp_ptr, &rmtp, sizeof rmtp)) {
+          return -LINUX_EFAULT;
+        }
+      }
+      return -LINUX_EINTR;
+    }
+    uint64_t slice = MIN(wait_slice(clockid, deadline - now), 3600 * 1000000000ULL);
+    kern_return_t ret = semaphore_timedwait(task.sigwake, (mach_timespec_t) { slice / 1000000000ULL, slice % 1000000000ULL });
+    if (ret == KERN_ABORTED && vmm_kick_pending()) {
+      /* another thread is forking; handle_syscall parks us and restarts */
+      if (!(flags & LINUX_TIMER_ABSTIME)) {
+        nanosleep_restart.valid = true;
+        nanosleep_restart.clockid = clockid;
+        nanosleep_restart.rqtp_ptr = rqtp_ptr;
+        nanosleep_restart.rqtp = rqtp;
+        nanosleep_restart.deadline = deadline;
+      }
+      return -LINUX_EINTR;
+    }
+    clock_read(clockid, &now);
+  }
+  return 0;
+}
+
+/* Linux sleeps on the monotonic clock too */
+DEFINE_SYSCALL(nanosleep, gaddr_t, rqtp_ptr, gaddr_t, rmtp_ptr)
+{
+  return sys_clock_nanosleep(LINUX_CLOCK_MONOTONIC, 0, rqtp_ptr, rmtp_ptr);
+}
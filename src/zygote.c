@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/syslimits.h>
+
+#include "common.h"
+#include "noah.h"
+#include "vmm.h"
+
+/*
+ * Template mode.
+ *
+ * `noah --zygote SOCKET -m ROOT` boots the vkernel once and waits for
+ * requests on a UNIX socket. For each request it forks a child that already
+ * has the vm, the vkernel and the root set up, and that goes on to execve the
+ * requested program as a plain noah would. `noah --connect SOCKET prog ...`
+ * is the thin client: it sends argv, envp, its cwd and its stdio, forwards
+ * terminating signals to the child and exits with the child's status.
+ *
+ * Protocol: the client sends a struct zygote_header with the stdio fds
+ * attached, followed by argv, envp and the cwd as NUL terminated strings.
+ * The zygote answers with the child's pid and later its wait status, both
+ * as int32_t.
+ */
+
+#define ZYGOTE_MAX_REQUEST (4 * 1024 * 1024)
+#define ZYGOTE_RECV_TIMEOUT 5              /* seconds a client has to send its request */
+
+struct zygote_header {
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t len;      /* of the strings that follow */
+};
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* zygote */
+
+struct zygote_conn {
+  struct list_head head;
+  int fd;
+  pid_t pid;
+};
+
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head conns = { &conns, &conns };
+
+struct zygote_request {
+  int stdio[3];
+  char **argv;
+  char **envp;
+  int argc;
+  char *cwd;
+  char *strings;
+};
+
+static void
+free_request(struct zygote_request *req)
+{
+  for (int i = 0; i < 3; i++) {
+    close(req->stdio[i]);
+  }
+  free(req->argv);
+  free(req->envp);
+  free(req->strings);
+}
+
+/* close whatever fds came with a request that is refused */
+static void
+close_passed_fds(struct msghdr *msg)
+{
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+      continue;
+    int *fds = (int *) CMSG_DATA(c);
+    size_t n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < n; i++) {
+      close(fds[i]);
+    }
+  }
+}
+
+static int
+recv_request(int fd, struct zygote_request *req)
+{
+  struct zygote_header hdr;
+  char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+  struct iovec iov = { &hdr, sizeof hdr };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cbuf,
+    .msg_controllen = sizeof cbuf,
+  };
+
+  *req = (struct zygote_request) { .stdio = {-1, -1, -1} };
+
+  ssize_t n = recvmsg(fd, &msg, MSG_WAITALL);
+  if (n < 0)
+    return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof hdr || (msg.msg_flags & MSG_CTRUNC)
+      || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3)
+      || CMSG_NXTHDR(&msg, cmsg) != NULL) {
+    close_passed_fds(&msg);
+    return -1;
+  }
+  memcpy(req->stdio, CMSG_DATA(cmsg), sizeof req->stdio);
+
+  if (hdr.argc == 0 || hdr.len == 0 || hdr.len > ZYGOTE_MAX_REQUEST || hdr.argc + hdr.envc + 1 > hdr.len)
+    goto err;
+  req->strings = malloc(hdr.len);
+  if (req->strings == NULL || read_all(fd, req->strings, hdr.len) < 0 || req->strings[hdr.len - 1] != '\0')
+    goto err;
+
+  req->argc = hdr.argc;
+  req->argv = calloc(hdr.argc + 1, sizeof(char *));
+  req->envp = calloc(hdr.envc + 1, sizeof(char *));
+  char *p = req->strings, *end = req->strings + hdr.len;
+  for (uint32_t i = 0; i < hdr.argc + hdr.envc + 1; i++) {
+    if (p >= end)
+      goto err;
+    if (i < hdr.argc) {
+      req->argv[i] = p;
+    } else if (i < hdr.argc + hdr.envc) {
+      req->envp[i - hdr.argc] = p;
+    } else {
+      req->cwd = p;
+    }
+    p += strlen(p) + 1;
+  }
+  return 0;
+
+ err:
+  free_request(req);
+  return -1;
+}
+
+static void *
+wait_child(struct zygote_conn *conn)
+{
+  int status;
+  while (waitpid(conn->pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      status = W_EXITCODE(127, 0);
+      break;
+    }
+  }
+  int32_t st = status;
+  write_all(conn->fd, &st, sizeof st);
+
+  pthread_mutex_lock(&conns_lock);
+  list_del(&conn->head);
+  pthread_mutex_unlock(&conns_lock);
+  close(conn->fd);
+  free(conn);
+  return NULL;
+}
+
+/* keep the files mapped and resident so that children loading them hit the page cache */
+static void
+preload(const char *root, const char *path)
+{
+  char buf[PATH_MAX];
+  snprintf(buf, sizeof buf, "%s/%s", root, path);
+  int fd = open(buf, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "noah: could not preload %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return;
+  madvise(p, st.st_size, MADV_WILLNEED);
+  volatile const char *c = p;
+  for (off_t off = 0; off < st.st_size; off += 4096) {
+    (void) c[off];
+  }
+}
+
+/* Returns only in a child, with argv, envp, the cwd and stdio of the request in place. */
+void
+zygote_serve(const char *sockpath, const char *root, const char *const *preloads, int nr_preloads, int *argcp, char ***argvp, char ***envpp)
+{
+  for (int i = 0; i < nr_preloads; i++) {
+    preload(root, preloads[i]);
+  }
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (lfd < 0 || strlen(sockpath) >= sizeof addr.sun_path) {
+    fprintf(stderr, "noah: invalid zygote socket %s\n", sockpath);
+    exit(1);
+  }
+  strcpy(addr.sun_path, sockpath);
+  unlink(sockpath);
+  mode_t mask = umask(077);    /* only the owner may spawn processes */
+  if (bind(lfd, (struct sockaddr *) &addr, sizeof addr) < 0 || listen(lfd, SOMAXCONN) < 0) {
+    perror("noah: zygote socket");
+    exit(1);
+  }
+  umask(mask);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("noah: zygote accept");
+      exit(1);
+    }
+    /* the loop serves one client at a time; a silent one must not hold it up */
+    struct timeval tv = { ZYGOTE_RECV_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    uid_t uid;
+    gid_t gid;
+    struct zygote_request req;
+    if (getpeereid(fd, &uid, &gid) < 0 || uid != getuid() || recv_request(fd, &req) < 0) {
+      close(fd);
+      continue;
+    }
+
+    struct vmm_snapshot snapshot;
+    if (vmm_snapshot(&snapshot) < 0) {
+      panic("zygote: could not take a snapshot");
+    }
+    /* keep waiters from changing the list the child walks */
+    pthread_mutex_lock(&conns_lock);
+    vmm_destroy();
+    pid_t pid = fork();
+    vmm_reentry(&snapshot, false);
+
+    if (pid == 0) {
+      close(lfd);
+      close(fd);
+      pthread_mutex_init(&conns_lock, NULL);
+      struct zygote_conn *c;
+      list_for_each_entry (c, &conns, head) {
+        close(c->fd);
+      }
+      INIT_LIST_HEAD(&conns);
+      signal(SIGPIPE, SIG_DFL);
+
+      for (int i = 0; i < 3; i++) {
+        if (req.stdio[i] != i) {
+          dup2(req.stdio[i], i);
+          close(req.stdio[i]);
+        }
+      }
+      if (chdir(req.cwd) < 0) {
+        fprintf(stderr, "noah: could not change directory to %s\n", req.cwd);
+      }
+      task.tid = getpid();
+      flush_sigqueue();                 /* e.g. SIGCHLD of earlier children */
+      *argcp = req.argc;
+      *argvp = req.argv;
+      *envpp = req.envp;
+      return;
+    }
+
+    pthread_mutex_unlock(&conns_lock);
+
+    int32_t reply = pid < 0 ? -1 : pid;
+    write_all(fd, &reply, sizeof reply);
+    free_request(&req);
+    if (pid < 0) {
+      close(fd);
+      continue;
+    }
+
+    struct zygote_conn *conn = malloc(sizeof *conn);
+    conn->fd = fd;
+    conn->pid = pid;
+    pthread_mutex_lock(&conns_lock);
+    list_add(&conn->head, &conns);
+    pthread_mutex_unlock(&conns_lock);
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, (void *) wait_child, conn) != 0) {
+      panic("zygote: pthread_create");
+    }
+    pthread_detach(th);
+  }
+}
+
+/* client */
+
+static volatile pid_t zygote_child;
+
+static void
+forward_signal(int sig)
+{
+  if (zygote_child > 0) {
+    kill(zygote_child, sig);
+  }
+}
+
+noreturn void
+zygote_connect(const char *sockpath, int argc, char *argv[], char **envp)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (fd < 0 || strlen(sockpath) >= sizeof addr.sun_path) {
+    fprintf(stderr, "noah: invalid zygote socket %s\n", sockpath);
+    exit(127);
+  }
+  strcpy(addr.sun_path, sockpath);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+    perror("noah: could not connect to the zygote");
+    exit(127);
+  }
+
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof cwd) == NULL) {
+    strcpy(cwd, "/");
+  }
+
+  struct zygote_header hdr = { .argc = argc };
+  size_t len = strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++) {
+    len += strlen(argv[i]) + 1;
+  }
+  for (char **e = envp; *e; e++) {
+    len += strlen(*e) + 1;
+    hdr.envc++;
+  }
+  hdr.len = len;
+  char *strings = malloc(len), *p = strings;
+  for (int i = 0; i < argc; i++) {
+    p = stpcpy(p, argv[i]) + 1;
+  }
+  for (char **e = envp; *e; e++) {
+    p = stpcpy(p, *e) + 1;
+  }
+  strcpy(p, cwd);
+
+  int stdio[3] = {0, 1, 2};
+  char cbuf[CMSG_SPACE(sizeof stdio)] = {};
+  struct iovec iov = { &hdr, sizeof hdr };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cbuf,
+    .msg_controllen = sizeof cbuf,
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof stdio);
+  memcpy(CMSG_DATA(cmsg), stdio, sizeof stdio);
+
+  int32_t pid, status;
+  if (sendmsg(fd, &msg, 0) != sizeof hdr || write_all(fd, strings, len) < 0 || read_all(fd, &pid, sizeof pid) < 0 || pid < 0) {
+    fprintf(stderr, "noah: the zygote refused the request\n");
+    exit(127);
+  }
+  free(strings);
+
+  zygote_child = pid;
+  static const int forwarded[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGWINCH, SIGUSR1, SIGUSR2 };
+  for (size_t i = 0; i < sizeof forwarded / sizeof forwarded[0]; i++) {
+    signal(forwarded[i], forward_signal);
+  }
+
+  if (read_all(fd, &status, sizeof status) < 0) {
+    exit(127);
+  }
+  if (WIFSIGNALED(status)) {
+    signal(WTERMSIG(status), SIG_DFL);
+    raise(WTERMSIG(status));
+  }
+  exit(WIFEXITED(status) ? WEXITSTATUS(status) : 127);
+}
@@ -0,0 +1,72 @@
+/*
+ * Wait latency of poll(2) and epoll_wait(2) over many idle fds with a single
+ * active one. usage: epoll_vs_poll [nr_idle_fds] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  int nr_idle = argc > 1 ? atoi(argv[1]) : 10000;
+  int iter = argc > 2 ? atoi(argv[2]) : 1000;
+
+  struct rlimit lim;
+  getrlimit(RLIMIT_NOFILE, &lim);
+  lim.rlim_cur = lim.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &lim);
+
+  /* each idle "connection" is the read end of a pipe nobody writes to */
+  struct pollfd *pfds = calloc(nr_idle + 1, sizeof *pfds);
+  int epfd = epoll_create1(0);
+  int fds[2];
+  for (int i = 0; i < nr_idle; i++) {
+    if (pipe(fds) < 0) {
+      fprintf(stderr, "pipe failed after %d fds, raise the fd limit\n", i);
+      return 1;
+    }
+    pfds[i] = (struct pollfd) { fds[0], POLLIN, 0 };
+    struct epoll_event ev = { EPOLLIN, { .fd = fds[0] } };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev);
+  }
+  int active[2];
+  pipe(active);
+  pfds[nr_idle] = (struct pollfd) { active[0], POLLIN, 0 };
+  struct epoll_event ev = { EPOLLIN, { .fd = active[0] } };
+  epoll_ctl(epfd, EPOLL_CTL_ADD, active[0], &ev);
+
+  char c = 0;
+  double start = now();
+  for (int i = 0; i < iter; i++) {
+    write(active[1], &c, 1);
+    poll(pfds, nr_idle + 1, -1);
+    read(active[0], &c, 1);
+  }
+  double t_poll = now() - start;
+
+  struct epoll_event out[64];
+  start = now();
+  for (int i = 0; i < iter; i++) {
+    write(active[1], &c, 1);
+    epoll_wait(epfd, out, 64, -1);
+    read(active[0], &c, 1);
+  }
+  double t_epoll = now() - start;
+
+  printf("%d idle fds, %d iterations\n", nr_idle, iter);
+  printf("poll:       %10.2f us/wait\n", t_poll / iter * 1e6);
+  printf("epoll_wait: %10.2f us/wait\n", t_epoll / iter * 1e6);
+  return 0;
+}
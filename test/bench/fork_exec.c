@@ -0,0 +1,71 @@
+/*
+ * Latency of fork+execve with the child's EPT left deferred, against the same
+ * sequence where the child first issues an unrelated syscall (sched_yield),
+ * which makes noah enter the whole inherited image before execve.
+ * usage: fork_exec [nr_regions] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *self;
+
+static double
+run(int iter, int touch)
+{
+  char *argv[] = { self, "--child", NULL };
+  double start = now();
+  for (int i = 0; i < iter; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (touch) {
+        sched_yield();
+      }
+      execv(self, argv);
+      _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+  }
+  return now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 1 && strcmp(argv[1], "--child") == 0) {
+    return 0;
+  }
+
+  int nr_regions = argc > 1 ? atoi(argv[1]) : 256;
+  int iter = argc > 2 ? atoi(argv[2]) : 200;
+  self = argv[0];
+
+  /* alternate protections so that the regions are not merged */
+  for (int i = 0; i < nr_regions; i++) {
+    char *p = mmap(NULL, 0x10000, (i & 1) ? PROT_READ : PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+    }
+  }
+
+  double t_defer = run(iter, 0);
+  double t_full = run(iter, 1);
+
+  printf("%d extra regions, %d iterations\n", nr_regions, iter);
+  printf("fork+execve:             %10.2f us/iter\n", t_defer / iter * 1e6);
+  printf("fork+sched_yield+execve: %10.2f us/iter\n", t_full / iter * 1e6);
+  return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * fork latency of a process against its number of threads. Half of the
+ * threads sleep on a condvar (futex), the other half spin in the guest.
+ * usage: fork_threads [max_threads] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static volatile int stop;
+
+static void *
+sleeper(void *arg)
+{
+  pthread_mutex_lock(&mutex);
+  while (!stop)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+static void *
+spinner(void *arg)
+{
+  while (!stop)
+    ;
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+  int iter = argc > 2 ? atoi(argv[2]) : 100;
+
+  printf("%d iterations\n", iter);
+  for (int n = 0; n <= max_threads; n = n ? n * 2 : 1) {
+    pthread_t th[n];
+    stop = 0;
+    for (int i = 0; i < n; i++)
+      pthread_create(&th[i], NULL, (i & 1) ? spinner : sleeper, NULL);
+    usleep(10000);
+
+    double start = now();
+    for (int i = 0; i < iter; i++) {
+      pid_t pid = fork();
+      if (pid == 0)
+        _exit(0);
+      waitpid(pid, NULL, 0);
+    }
+    double t = now() - start;
+
+    pthread_mutex_lock(&mutex);
+    stop = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    for (int i = 0; i < n; i++)
+      pthread_join(th[i], NULL);
+
+    printf("%3d threads: %10.2f us/fork\n", n, t / iter * 1e6);
+  }
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Latency of pthread_create+pthread_join of a thread that returns at once.
+ * The first round is reported separately since it is the only one that can
+ * not be served from noah's pool of parked threads.
+ * usage: thread_create [iterations] [batch]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+nop(void *arg)
+{
+  return arg;
+}
+
+static double
+run(int batch)
+{
+  pthread_t th[batch];
+  double start = now();
+  for (int i = 0; i < batch; i++) {
+    if (pthread_create(&th[i], NULL, nop, NULL) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < batch; i++) {
+    pthread_join(th[i], NULL);
+  }
+  return now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+  int iter = argc > 1 ? atoi(argv[1]) : 1000;
+  int batch = argc > 2 ? atoi(argv[2]) : 4;
+
+  double t_first = run(batch);
+  double t = 0;
+  for (int i = 0; i < iter; i++) {
+    t += run(batch);
+  }
+
+  printf("%d threads per round, %d rounds\n", batch, iter);
+  printf("first round:  %10.2f us/thread\n", t_first / batch * 1e6);
+  printf("create+join:  %10.2f us/thread\n", t / iter / batch * 1e6);
+  return 0;
+}
@@ -1,18 +1,25 @@
 TEST_UPROGS := \
-	$(addprefix test_assertion/build/, fib test_fork test_thread test_execve test_execve2 test_sigprocmask test_sigaction test_sigaltstack)\
+	$(addprefix test_assertion/build/, fib test_fork test_thread test_execve test_execve2 test_sigprocmask test_sigaction test_sigaltstack test_sendfile test_epoll test_eventfd test_inotify test_vfork test_fork_thread test_cpus test_exec_stack test_tgkill test_sigsegv test_sigwait test_sigfpu test_fsgsbase test_sem test_shm test_timer test_dev)\
 	$(addprefix test_stdout/build/, hello cat echo)\
 	$(addprefix test_shell/build/, mv env gcc)
 
+BENCH_UPROGS := \
+	$(addprefix bench/build/, epoll_vs_poll fork_exec fork_threads thread_create)
+
 LINUX_BUILD_SERV := idylls.jp
 
 test: $(TEST_UPROGS)
 
+bench: $(BENCH_UPROGS)
+
 test_assertion/build/%: test_assertion/%.c include/*.h
 	$(MAKE_TEST_UPROGS)
 test_stdout/build/%: test_stdout/%.c include/*.h
 	$(MAKE_TEST_UPROGS)
 test_shell/build/%: test_shell/%.c include/*.h
 	$(MAKE_TEST_UPROGS)
+bench/build/%: bench/%.c
+	$(MAKE_TEST_UPROGS)
 
 MAKE_TEST_UPROGS = ssh $(LINUX_BUILD_SERV) "rm /tmp/$(USER)/*";\
                    rsync $^ $(LINUX_BUILD_SERV):/tmp/$(USER)/;\
@@ -20,7 +27,7 @@ MAKE_TEST_UPROGS = ssh $(LINUX_BUILD_SERV) "rm /tmp/$(USER)/*";\
                    rsync $(LINUX_BUILD_SERV):/tmp/$(USER)/$* $@
 
 clean:
-	$(RM) test_assertion/build/* test_stdout/build/*
+	$(RM) test_assertion/build/* test_stdout/build/* bench/build/*
 	$(RM) `ls test_shell/build/* | grep -v gcc`
 
-.PHONY: test clean
+.PHONY: test bench clean
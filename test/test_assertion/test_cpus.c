@@ -0,0 +1,43 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include "test_assert.h"
+
+int
+count_cpuinfo_processors()
+{
+  FILE *fp = fopen("/proc/cpuinfo", "r");
+  if (fp == NULL)
+    return -1;
+  char line[1024];
+  int n = 0;
+  while (fgets(line, sizeof line, fp)) {
+    if (strncmp(line, "processor", 9) == 0)
+      n++;
+  }
+  fclose(fp);
+  return n;
+}
+
+int main()
+{
+  nr_tests(5);
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  assert_true(sched_getaffinity(0, sizeof set, &set) == 0);
+  int n = CPU_COUNT(&set);
+
+  assert_true(n == sysconf(_SC_NPROCESSORS_ONLN));
+  assert_true(n == count_cpuinfo_processors());
+
+  CPU_ZERO(&set);
+  CPU_SET(0, &set);
+  assert_true(sched_setaffinity(0, sizeof set, &set) == 0);
+  CPU_ZERO(&set);
+  sched_getaffinity(0, sizeof set, &set);
+  assert_true(CPU_COUNT(&set) == 1 && CPU_ISSET(0, &set));
+  return 0;
+}
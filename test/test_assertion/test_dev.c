@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include "test_assert.h"
+
+int main()
+{
+  nr_tests(11);
+
+  char buf[64], zero[64] = {};
+
+  // Test /dev/null reads nothing and takes any write
+  int fd = open("/dev/null", O_RDWR);
+  assert_true(read(fd, buf, sizeof buf) == 0 && write(fd, "hello", 5) == 5);
+  struct stat st;
+  fstat(fd, &st);
+  assert_true(S_ISCHR(st.st_mode) && major(st.st_rdev) == 1 && minor(st.st_rdev) == 3);
+  close(fd);
+
+  // Test /dev/zero reads zeros
+  memset(buf, 0xff, sizeof buf);
+  fd = open("/dev/zero", O_RDONLY);
+  assert_true(read(fd, buf, sizeof buf) == sizeof buf && memcmp(buf, zero, sizeof buf) == 0);
+  close(fd);
+
+  // Test /dev/full reads zeros but refuses writes with ENOSPC
+  fd = open("/dev/full", O_RDWR);
+  assert_true(write(fd, "x", 1) == -1 && errno == ENOSPC);
+  assert_true(pwrite(fd, "x", 1, 0) == -1 && errno == ENOSPC);
+  close(fd);
+
+  // Test /dev/urandom gives different bytes each time
+  char a[32], b[32];
+  fd = open("/dev/urandom", O_RDONLY);
+  assert_true(read(fd, a, sizeof a) == sizeof a && read(fd, b, sizeof b) == sizeof b && memcmp(a, b, sizeof a) != 0);
+  close(fd);
+
+  // Test stat reports the Linux device numbers
+  assert_true(stat("/dev/urandom", &st) == 0 && S_ISCHR(st.st_mode) && major(st.st_rdev) == 1 && minor(st.st_rdev) == 9);
+
+  // Test getrandom fills the whole buffer, large or small
+  static char big[1 << 20];
+  assert_true(syscall(SYS_getrandom, a, sizeof a, 0) == sizeof a && syscall(SYS_getrandom, big, sizeof big, 0) == sizeof big);
+  assert_true(syscall(SYS_getrandom, a, sizeof a, 0x80) == -1 && errno == EINVAL);
+
+  // Test a private mapping of /dev/zero is zero-filled anonymous memory
+  fd = open("/dev/zero", O_RDWR);
+  char *p = mmap(NULL, 8192, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  assert_true(p != MAP_FAILED && p[0] == 0 && p[8191] == 0);
+  p[0] = 1;
+
+  // Test a shared mapping of /dev/zero is shared with a child
+  int *shared = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (fork() == 0) {
+    *shared = 42;
+    _exit(0);
+  }
+  wait(NULL);
+  assert_true(*shared == 42);
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+
+#include "test_assert.h"
+
+int main()
+{
+  nr_tests(14);
+
+  int fds[2];
+  pipe(fds);
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  assert_true(epfd >= 0);
+
+  struct epoll_event ev = { EPOLLIN, { .u64 = 42 } }, out[4];
+  assert_true(epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev) == 0);
+  assert_true(epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev) < 0 && errno == EEXIST);
+  assert_true(epoll_wait(epfd, out, 4, 0) == 0);
+
+  /* level-triggered: reported as long as data is there */
+  char c = 'x';
+  write(fds[1], &c, 1);
+  assert_true(epoll_wait(epfd, out, 4, 0) == 1 && out[0].data.u64 == 42 && (out[0].events & EPOLLIN));
+  assert_true(epoll_wait(epfd, out, 4, 0) == 1);
+
+  /* edge-triggered: reported once per new arrival */
+  ev.events = EPOLLIN | EPOLLET;
+  assert_true(epoll_ctl(epfd, EPOLL_CTL_MOD, fds[0], &ev) == 0);
+  write(fds[1], &c, 1);
+  assert_true(epoll_wait(epfd, out, 4, 0) == 1);
+  assert_true(epoll_wait(epfd, out, 4, 0) == 0);
+
+  /* oneshot: disabled after the first report until rearmed */
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, fds[0], &ev);
+  assert_true(epoll_wait(epfd, out, 4, 0) == 1);
+  assert_true(epoll_wait(epfd, out, 4, 0) == 0);
+
+  assert_true(epoll_ctl(epfd, EPOLL_CTL_DEL, fds[0], NULL) == 0);
+  assert_true(epoll_ctl(epfd, EPOLL_CTL_DEL, fds[0], NULL) < 0 && errno == ENOENT);
+
+  /* a forked child gets the instance with its interest list, dups included */
+  ev.events = EPOLLIN;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, fds[0], &ev);
+  int dupfd = dup(epfd);
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(epoll_wait(epfd, out, 4, 0) == 1 && out[0].data.u64 == 42 && epoll_wait(dupfd, out, 4, 0) == 1 ? 0 : 1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "test_assert.h"
+
+static void
+on_alarm(int sig)
+{
+}
+
+int main()
+{
+  nr_tests(17);
+
+  uint64_t v;
+  struct pollfd pfd;
+
+  /* eventfd: counter semantics */
+  int efd = eventfd(0, EFD_NONBLOCK);
+  assert_true(read(efd, &v, sizeof v) == -1 && errno == EAGAIN);
+  v = 3;
+  write(efd, &v, sizeof v);
+  write(efd, &v, sizeof v);
+  pfd = (struct pollfd) { .fd = efd, .events = POLLIN };
+  assert_true(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN));
+  assert_true(read(efd, &v, sizeof v) == sizeof v && v == 6);
+  assert_true(poll(&pfd, 1, 0) == 0);
+  close(efd);
+
+  /* eventfd: semaphore mode */
+  efd = eventfd(2, EFD_SEMAPHORE | EFD_NONBLOCK);
+  assert_true(read(efd, &v, sizeof v) == sizeof v && v == 1);
+  assert_true(read(efd, &v, sizeof v) == sizeof v && v == 1);
+  assert_true(read(efd, &v, sizeof v) == -1 && errno == EAGAIN);
+  close(efd);
+
+  /* eventfd: a writer blocked by a full counter is interrupted by a signal */
+  struct sigaction sa = { .sa_handler = on_alarm };
+  sigaction(SIGALRM, &sa, NULL);
+  efd = eventfd(0, 0);
+  v = UINT64_MAX - 1;
+  write(efd, &v, sizeof v);
+  ualarm(50000, 0);
+  v = 1;
+  assert_true(write(efd, &v, sizeof v) == -1 && errno == EINTR);
+  close(efd);
+
+  /* timerfd: periodic timer accumulates expirations */
+  int tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  struct itimerspec its = { .it_interval = { 0, 10000000 }, .it_value = { 0, 10000000 } };
+  assert_true(timerfd_settime(tfd, 0, &its, NULL) == 0);
+  usleep(55000);
+  assert_true(read(tfd, &v, sizeof v) == sizeof v && v >= 4);
+  struct itimerspec cur;
+  timerfd_gettime(tfd, &cur);
+  assert_true(cur.it_interval.tv_nsec == 10000000);
+  memset(&its, 0, sizeof its);
+  timerfd_settime(tfd, 0, &its, NULL);
+  timerfd_gettime(tfd, &cur);
+  assert_true(cur.it_value.tv_sec == 0 && cur.it_value.tv_nsec == 0);
+  close(tfd);
+
+  /* timerfd: a blocking read of a one-shot timer returns once it expires */
+  tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  its = (struct itimerspec) { .it_value = { 0, 20000000 } };
+  timerfd_settime(tfd, 0, &its, NULL);
+  assert_true(read(tfd, &v, sizeof v) == sizeof v && v == 1);
+  close(tfd);
+
+  /* signalfd: blocked signal is delivered through the fd */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  int sfd = signalfd(-1, &mask, SFD_NONBLOCK);
+  struct signalfd_siginfo si;
+  assert_true(read(sfd, &si, sizeof si) == -1 && errno == EAGAIN);
+  kill(getpid(), SIGUSR1);
+  pfd = (struct pollfd) { .fd = sfd, .events = POLLIN };
+  assert_true(poll(&pfd, 1, 1000) == 1);
+  assert_true(read(sfd, &si, sizeof si) == sizeof si && si.ssi_signo == SIGUSR1);
+  close(sfd);
+
+  /* a forked child gets the counter and the armed timer */
+  efd = eventfd(5, EFD_NONBLOCK);
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  its = (struct itimerspec) { .it_value = { 0, 20000000 } };
+  timerfd_settime(tfd, 0, &its, NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    struct pollfd pfds[2] = { { .fd = efd, .events = POLLIN }, { .fd = tfd, .events = POLLIN } };
+    int ok = poll(pfds, 1, 0) == 1 && read(efd, &v, sizeof v) == sizeof v && v == 5;
+    ok = ok && poll(&pfds[1], 1, 1000) == 1 && read(tfd, &v, sizeof v) == sizeof v && v == 1;
+    _exit(ok ? 0 : 1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  close(efd);
+  close(tfd);
+
+  return 0;
+}
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/auxv.h>
+#include <cpuid.h>
+#include "test_assert.h"
+
+#define NR_VARS 500
+#define LONG_ARG 1000
+
+void test_child(int argc, char *argv[], char *envp[])
+{
+  // Test the strings made it through intact
+  int ok = argc == 3 && strlen(argv[2]) == LONG_ARG;
+  for (int i = 0; ok && i < LONG_ARG; i++) {
+    ok = argv[2][i] == 'a';
+  }
+  assert_true(ok);
+
+  int nr = 0;
+  while (envp[nr])
+    nr++;
+  assert_true(nr == NR_VARS);
+  assert_true(strcmp(envp[NR_VARS - 1], "VAR499=value499") == 0);
+
+  // argc sits right below argv, at a 16-byte aligned address
+  assert_true(((uintptr_t) argv - 8) % 16 == 0);
+
+  // Test AT_RANDOM points to random bytes rather than zeros
+  const unsigned char *rand = (void *) getauxval(AT_RANDOM);
+  int nonzero = 0;
+  for (int i = 0; rand && i < 16; i++) {
+    nonzero |= rand[i];
+  }
+  assert_true(nonzero);
+
+  // Test the hardware entries of the auxv
+  const char *platform = (void *) getauxval(AT_PLATFORM);
+  assert_true(platform && strcmp(platform, "x86_64") == 0 && getauxval(AT_CLKTCK) == 100);
+  unsigned eax, ebx, ecx, edx;
+  __cpuid(1, eax, ebx, ecx, edx);
+  assert_true(getauxval(AT_HWCAP) != 0);
+
+  // Test AVX is usable from the start when the cpu has it, as libc checks
+  int avx_ok = 1;
+  if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+    unsigned lo, hi;
+    __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    avx_ok = (lo & 6) == 6;
+  }
+  assert_true(avx_ok);
+
+  // Test the xsave size in CPUID covers every component enabled in XCR0
+  int osxsave = ecx & bit_OSXSAVE;
+  unsigned lo = 3, hi = 0, size = 512 + 64, max;
+  if (osxsave) {
+    __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  }
+  uint64_t xcr0 = (uint64_t) hi << 32 | lo;
+  for (int i = 2; i < 64; i++) {
+    if (xcr0 & (1ULL << i)) {
+      __cpuid_count(0xd, i, eax, ebx, ecx, edx);
+      size = ebx + eax > size ? ebx + eax : size;
+    }
+  }
+  __cpuid_count(0xd, 0, eax, ebx, max, edx);
+  int avx512 = (xcr0 >> 5) & 7;
+  assert_true((xcr0 & 3) == 3 && (avx512 == 0 || avx512 == 7) && (!osxsave || (ebx == size && ebx <= max)));
+
+  // Test xsave writes no further than that size
+  int fits = 1;
+  if (osxsave) {
+    unsigned char *buf = aligned_alloc(64, ebx + 64);
+    memset(buf, 0xa5, ebx + 64);
+    __asm__ volatile ("xsave (%0)" : : "r"(buf), "a"(-1), "d"(-1) : "memory");
+    for (unsigned i = ebx; i < ebx + 64; i++) {
+      fits &= buf[i] == 0xa5;
+    }
+  }
+  assert_true(fits);
+}
+
+int main(int argc, char *argv[], char *envp[])
+{
+  if (argc > 1 && strcmp(argv[1], "child") == 0) {
+    test_child(argc, argv, envp);
+    return 0;
+  }
+
+  nr_tests(11);
+
+  // Test a single string longer than MAX_ARG_STRLEN is rejected
+  size_t huge_len = 0x1000 * 32 + 1;
+  char *huge = malloc(huge_len + 1);
+  memset(huge, 'a', huge_len);
+  huge[huge_len] = 0;
+  char *huge_argv[] = {argv[0], huge, NULL};
+  assert_true(execve(argv[0], huge_argv, envp) == -1 && errno == E2BIG);
+  free(huge);
+
+  char *e_envp[NR_VARS + 1];
+  for (int i = 0; i < NR_VARS; i++) {
+    asprintf(&e_envp[i], "VAR%d=value%d", i, i);
+  }
+  e_envp[NR_VARS] = NULL;
+
+  char long_arg[LONG_ARG + 1];
+  memset(long_arg, 'a', LONG_ARG);
+  long_arg[LONG_ARG] = 0;
+  char *e_argv[] = {argv[0], "child", long_arg, NULL};
+  execve(argv[0], e_argv, e_envp);
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "test_assert.h"
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+int go;
+
+void *
+waiter(void *arg)
+{
+  pthread_mutex_lock(&mutex);
+  while (!go)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+  return (void *) 42;
+}
+
+int main()
+{
+  nr_tests(4);
+  pthread_t th;
+  pthread_create(&th, NULL, waiter, NULL);
+  usleep(10000);
+
+  pid_t parent_pid = getpid();
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* only the forking thread exists in the child */
+    assert_true(getpid() != parent_pid);
+    _exit(0);
+  }
+  assert_true(pid > 0);
+  int stat;
+  waitpid(pid, &stat, 0);
+  assert_true(WIFEXITED(stat) && WEXITSTATUS(stat) == 0);
+
+  /* the other thread survives the fork in the parent */
+  pthread_mutex_lock(&mutex);
+  go = 1;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mutex);
+  void *ret;
+  pthread_join(th, &ret);
+  assert_true(ret == (void *) 42);
+}
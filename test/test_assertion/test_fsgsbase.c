@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/auxv.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <asm/prctl.h>
+#include "test_assert.h"
+
+#define HWCAP2_FSGSBASE (1 << 1)
+
+/* glibc keeps its TLS in fs on x86_64, so gs is free to play with */
+
+static unsigned long
+rdgsbase(void)
+{
+  unsigned long base;
+  __asm__ volatile ("rdgsbase %0" : "=r"(base));
+  return base;
+}
+
+static void
+wrgsbase(unsigned long base)
+{
+  __asm__ volatile ("wrgsbase %0" :: "r"(base) : "memory");
+}
+
+static volatile unsigned long handler_base;
+
+void handler(int sig)
+{
+  handler_base = rdgsbase();
+}
+
+int main()
+{
+  nr_tests(5);
+
+  if (!(getauxval(AT_HWCAP2) & HWCAP2_FSGSBASE)) {
+    printf("# fsgsbase is not available, skipping\n");
+    for (int i = 0; i < 5; i++)
+      assert_true(1);
+    return 0;
+  }
+
+  static unsigned long slot = 0x1234;
+  unsigned long base, val;
+
+  // Test rdgsbase sees the base set by arch_prctl
+  syscall(SYS_arch_prctl, ARCH_SET_GS, 0x10000);
+  assert_true(rdgsbase() == 0x10000);
+
+  // Test arch_prctl sees the base set by wrgsbase
+  wrgsbase((unsigned long) &slot);
+  syscall(SYS_arch_prctl, ARCH_GET_GS, &base);
+  assert_true(base == (unsigned long) &slot);
+
+  // Test memory accesses go through the new base
+  __asm__ volatile ("mov %%gs:0, %0" : "=r"(val));
+  assert_true(val == 0x1234);
+
+  // Test the base is kept across signal delivery and return
+  signal(SIGUSR1, handler);
+  raise(SIGUSR1);
+  assert_true(handler_base == (unsigned long) &slot && rdgsbase() == (unsigned long) &slot);
+
+  // Test a forked child inherits the base
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(rdgsbase() == (unsigned long) &slot ? 0 : 1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  wrgsbase(0);
+}
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+
+#include "test_assert.h"
+
+static char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+static int nbuf, pos;
+
+/* return the next event, reading more if necessary */
+static struct inotify_event *
+next_event(int fd)
+{
+  if (pos >= nbuf) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 1000) != 1)
+      return NULL;
+    nbuf = read(fd, buf, sizeof buf);
+    pos = 0;
+    if (nbuf <= 0)
+      return NULL;
+  }
+  struct inotify_event *ev = (struct inotify_event *) (buf + pos);
+  pos += sizeof *ev + ev->len;
+  return ev;
+}
+
+int main()
+{
+  nr_tests(13);
+
+  char dir[] = "/tmp/noah_inotify";
+  char file[] = "/tmp/noah_inotify/a";
+  char file2[] = "/tmp/noah_inotify/b";
+  unlink(file);
+  unlink(file2);
+  rmdir(dir);
+  mkdir(dir, 0755);
+
+  int fd = inotify_init1(IN_NONBLOCK);
+  assert_true(fd >= 0);
+  int wd = inotify_add_watch(fd, dir, IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY);
+  assert_true(wd > 0);
+  assert_true(read(fd, buf, sizeof buf) == -1 && errno == EAGAIN);
+
+  struct inotify_event *ev;
+  int f = open(file, O_WRONLY | O_CREAT, 0644);
+  ev = next_event(fd);
+  assert_true(ev && ev->wd == wd && (ev->mask & IN_CREATE) && strcmp(ev->name, "a") == 0);
+
+  write(f, "x", 1);
+  close(f);
+  ev = next_event(fd);
+  assert_true(ev && (ev->mask & IN_MODIFY) && strcmp(ev->name, "a") == 0);
+
+  rename(file, file2);
+  ev = next_event(fd);
+  assert_true(ev && (ev->mask & IN_MOVED_FROM) && strcmp(ev->name, "a") == 0);
+  uint32_t cookie = ev->cookie;
+  ev = next_event(fd);
+  assert_true(ev && (ev->mask & IN_MOVED_TO) && strcmp(ev->name, "b") == 0);
+  assert_true(cookie != 0 && ev->cookie == cookie);
+
+  unlink(file2);
+  ev = next_event(fd);
+  assert_true(ev && (ev->mask & IN_DELETE) && strcmp(ev->name, "b") == 0);
+
+  /* the watch holds no fd number the guest could see */
+  int probe = open("/dev/null", O_RDONLY);
+  assert_true(probe == fd + 1);
+  close(probe);
+
+  /* a forked child keeps the watch */
+  char file3[] = "/tmp/noah_inotify/c";
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(open(file3, O_WRONLY | O_CREAT, 0644));
+    ev = next_event(fd);
+    _exit(ev && (ev->mask & IN_CREATE) && strcmp(ev->name, "c") == 0 ? 0 : 1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  unlink(file3);
+  while (next_event(fd) != NULL)
+    ;
+
+  assert_true(inotify_rm_watch(fd, wd) == 0);
+  ev = next_event(fd);
+  assert_true(ev && (ev->mask & IN_IGNORED) && ev->wd == wd);
+
+  close(fd);
+  rmdir(dir);
+  return 0;
+}
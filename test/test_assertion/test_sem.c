@@ -0,0 +1,71 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/wait.h>
+#include "test_assert.h"
+
+union semun {
+  int val;
+  struct semid_ds *buf;
+  unsigned short *array;
+};
+
+int main()
+{
+  nr_tests(10);
+
+  int id = semget(IPC_PRIVATE, 2, IPC_CREAT | 0600);
+  assert_true(id >= 0);
+
+  // Test SETALL and GETALL round trip
+  unsigned short vals[2] = { 3, 0 }, out[2];
+  semctl(id, 0, SETALL, (union semun) { .array = vals });
+  semctl(id, 0, GETALL, (union semun) { .array = out });
+  assert_true(out[0] == 3 && out[1] == 0 && semctl(id, 0, GETVAL) == 3);
+
+  // Test a set of operations is applied all or nothing
+  struct sembuf ops[2] = { { 0, -1, 0 }, { 1, -1, IPC_NOWAIT } };
+  assert_true(semop(id, ops, 2) < 0 && errno == EAGAIN && semctl(id, 0, GETVAL) == 3);
+
+  // Test semtimedop gives up after the timeout
+  struct timespec ts = { 0, 50 * 1000 * 1000 };
+  struct sembuf down = { 1, -1, 0 };
+  assert_true(semtimedop(id, &down, 1, &ts) < 0 && errno == EAGAIN);
+
+  // Test a sleeper in another process is woken by semop
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(semop(id, &down, 1) == 0 ? 0 : 1);
+  }
+  usleep(100 * 1000);
+  assert_true(semctl(id, 1, GETNCNT) == 1);
+  struct sembuf up = { 1, 1, 0 };
+  semop(id, &up, 1);
+  int status;
+  waitpid(pid, &status, 0);
+  assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0 && semctl(id, 1, GETVAL) == 0);
+  pid_t sleeper = pid;
+
+  // Test SEM_UNDO is applied when the process exits
+  pid = fork();
+  if (pid == 0) {
+    struct sembuf op = { 0, -2, SEM_UNDO };
+    semop(id, &op, 1);
+    _exit(semctl(id, 0, GETVAL) == 1 ? 0 : 1);
+  }
+  waitpid(pid, &status, 0);
+  assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0 && semctl(id, 0, GETVAL) == 3);
+
+  // Test IPC_STAT, and GETPID naming the last process to operate
+  struct semid_ds ds;
+  assert_true(semctl(id, 0, IPC_STAT, (union semun) { .buf = &ds }) == 0 && ds.sem_nsems == 2 && semctl(id, 1, GETPID) == sleeper);
+
+  // Test the set is gone after IPC_RMID
+  assert_true(semctl(id, 0, IPC_RMID) == 0);
+  assert_true(semop(id, &up, 1) < 0 && errno == EINVAL);
+}
@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#include "test_assert.h"
+
+#ifndef SYS_copy_file_range
+#define SYS_copy_file_range 326
+#endif
+
+static const char data[] = "0123456789abcdef";
+
+int main()
+{
+  nr_tests(11);
+
+  char src[] = "/tmp/noah_sendfile_src";
+  char dst[] = "/tmp/noah_sendfile_dst";
+  int in = open(src, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int out = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  write(in, data, sizeof data - 1);
+  lseek(in, 0, SEEK_SET);
+
+  /* explicit offset: file position is left untouched */
+  off_t off = 4;
+  assert_true(sendfile(out, in, &off, 4) == 4);
+  assert_true(off == 8);
+  assert_true(lseek(in, 0, SEEK_CUR) == 0);
+
+  /* implicit offset: file position is advanced */
+  assert_true(sendfile(out, in, NULL, 2) == 2);
+  assert_true(lseek(in, 0, SEEK_CUR) == 2);
+
+  char buf[32] = {0};
+  pread(out, buf, sizeof buf, 0);
+  assert_true(strcmp(buf, "456701") == 0);
+
+  /* copy_file_range clamps to EOF */
+  loff_t off_in = 10, off_out = 0;
+  ftruncate(out, 0);
+  assert_true(syscall(SYS_copy_file_range, in, &off_in, out, &off_out, 100, 0) == 6);
+  assert_true(off_in == 16 && off_out == 6);
+
+  /* splice through a pipe */
+  int fds[2];
+  pipe(fds);
+  off_t pos = 0;
+  assert_true(splice(in, &pos, fds[1], NULL, 8, 0) == 8);
+  memset(buf, 0, sizeof buf);
+  assert_true(read(fds[0], buf, sizeof buf) == 8);
+  assert_true(memcmp(buf, data, 8) == 0);
+
+  unlink(src);
+  unlink(dst);
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "test_assert.h"
+
+int main()
+{
+  nr_tests(10);
+
+  size_t size = 1024 * 1024;
+  int id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  char *p = shmat(id, NULL, 0);
+  assert_true(id >= 0 && p != (void *) -1);
+
+  // Test a forked child writes to the same memory
+  strcpy(p, "parent");
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(strcmp(p, "parent") == 0 && strcpy(p + 4096, "child") ? 0 : 1);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0 && strcmp(p + 4096, "child") == 0);
+
+  // Test IPC_STAT after the child detached by exiting
+  struct shmid_ds ds;
+  assert_true(shmctl(id, IPC_STAT, &ds) == 0 && ds.shm_segsz == size && ds.shm_nattch == 1 && ds.shm_cpid == getpid());
+
+  // Test a read-only attach at an address rounded down by SHM_RND
+  char *hole = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  munmap(hole, size * 2);
+  char *q = shmat(id, hole + 100, SHM_RND | SHM_RDONLY);
+  assert_true(q == hole && strcmp(q, "parent") == 0);
+
+  // Test an attach over an existing mapping needs SHM_REMAP
+  char *busy = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert_true(shmat(id, busy, 0) == (void *) -1 && errno == EINVAL && shmat(id, busy, SHM_REMAP) == busy);
+
+  // Test shmdt leaves alone what was mapped over part of an attach
+  munmap(q, 4096);
+  char *over = mmap(q, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  over[0] = 'x';
+  assert_true(shmdt(q) == 0 && over[0] == 'x');
+  munmap(over, 4096);
+
+  // Test shmdt only takes an attach address
+  assert_true(shmdt(busy) == 0 && shmdt(p + 4096) < 0 && errno == EINVAL);
+
+  // Test a removed segment stays usable until the last detach
+  assert_true(shmctl(id, IPC_RMID, NULL) == 0 && shmctl(id, IPC_STAT, &ds) == 0 && ds.shm_perm.__key == IPC_PRIVATE && strcmp(p, "parent") == 0);
+  shmdt(p);
+  assert_true(shmctl(id, IPC_STAT, &ds) < 0 && errno == EINVAL);
+
+  // Test a segment of several gigabytes
+  size_t big = (size_t) 3 << 30;
+  int bid = shmget(IPC_PRIVATE, big, IPC_CREAT | 0600);
+  char *b = bid >= 0 ? shmat(bid, NULL, 0) : (void *) -1;
+  if (b != (void *) -1) {
+    b[0] = 1;
+    b[big - 1] = 2;
+  }
+  assert_true(b != (void *) -1 && b[0] == 1 && b[big - 1] == 2);
+  shmdt(b);
+  shmctl(bid, IPC_RMID, NULL);
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/syscall.h>
+#include "test_assert.h"
+
+static volatile int has_fpregs, handled;
+static volatile unsigned int handler_mxcsr;
+
+void handler(int sig, siginfo_t *info, void *ctx)
+{
+  ucontext_t *uc = ctx;
+  has_fpregs = uc->uc_mcontext.fpregs != NULL;
+  if (has_fpregs)
+    handler_mxcsr = uc->uc_mcontext.fpregs->mxcsr;
+  /* clobber the vector and x87 state of the interrupted code */
+  __asm__ volatile ("pcmpeqd %%xmm8, %%xmm8\n\tfninit" ::: "xmm8");
+  unsigned int mxcsr = 0x1f80 | 0x6000;   /* round toward zero */
+  __asm__ volatile ("ldmxcsr %0" :: "m"(mxcsr));
+  handled = 1;
+}
+
+int main()
+{
+  nr_tests(4);
+
+  struct sigaction sa = { .sa_sigaction = handler, .sa_flags = SA_SIGINFO };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  unsigned int in[4] = { 0x01234567, 0x89abcdef, 0xdeadbeef, 0xcafebabe }, out[4];
+  unsigned int mxcsr = 0x1f80 | 0x2000;   /* round down */
+  unsigned int after;
+  long nr = SYS_kill;
+  __asm__ volatile ("ldmxcsr %0" :: "m"(mxcsr));
+  /* keep the value in a register across the signal */
+  __asm__ volatile (
+    "movdqu %[in], %%xmm8\n\t"
+    "syscall\n\t"
+    "movdqu %%xmm8, %[out]\n\t"
+    "stmxcsr %[after]"
+    : [out] "=m"(out), [after] "=m"(after), "+a"(nr)
+    : [in] "m"(in), "D"(getpid()), "S"(SIGUSR1)
+    : "rcx", "r11", "memory", "xmm8");
+
+  // Test the handler ran and got the FPU state in its context
+  assert_true(handled == 1);
+  assert_true(has_fpregs && handler_mxcsr == mxcsr);
+
+  // Test the vector registers and MXCSR survive the handler
+  assert_true(memcmp(in, out, sizeof in) == 0);
+  assert_true(after == mxcsr);
+}
@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "test_assert.h"
+
+static sigjmp_buf env;
+static volatile int got_sig, got_code;
+static void *volatile got_addr;
+static volatile unsigned long got_trapno, got_cr2;
+
+void handler(int sig, siginfo_t *info, void *ctx)
+{
+  ucontext_t *uc = ctx;
+  got_sig = sig;
+  got_code = info->si_code;
+  got_addr = info->si_addr;
+  got_trapno = uc->uc_mcontext.gregs[REG_TRAPNO];
+  got_cr2 = uc->uc_mcontext.gregs[REG_CR2];
+  siglongjmp(env, 1);
+}
+
+static volatile int zero = 0;
+
+int main()
+{
+  nr_tests(6);
+
+  struct sigaction sa = { .sa_sigaction = handler, .sa_flags = SA_SIGINFO };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+  sigaction(SIGFPE, &sa, NULL);
+
+  long pagesize = sysconf(_SC_PAGESIZE);
+  char *p = mmap(NULL, pagesize * 2, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  munmap(p + pagesize, pagesize);
+
+  // Test a write to a read-only page reports its address and SEGV_ACCERR
+  if (sigsetjmp(env, 1) == 0) {
+    *(volatile char *) (p + 8) = 1;
+  }
+  assert_true(got_sig == SIGSEGV && got_code == SEGV_ACCERR && got_addr == p + 8);
+  assert_true(got_trapno == 14 && got_cr2 == (unsigned long) (p + 8));
+
+  // Test a read of an unmapped page reports SEGV_MAPERR
+  got_sig = 0;
+  if (sigsetjmp(env, 1) == 0) {
+    (void) *(volatile char *) (p + pagesize + 16);
+  }
+  assert_true(got_sig == SIGSEGV && got_code == SEGV_MAPERR && got_addr == p + pagesize + 16);
+
+  // Test the handler can be entered again after the first fault
+  got_sig = 0;
+  if (sigsetjmp(env, 1) == 0) {
+    *(volatile char *) p = 1;
+  }
+  assert_true(got_sig == SIGSEGV && got_addr == p);
+
+  // Test an integer division by zero raises SIGFPE with FPE_INTDIV
+  got_sig = 0;
+  volatile int r = 0;
+  if (sigsetjmp(env, 1) == 0) {
+    r = 42 / zero;
+  }
+  assert_true(got_sig == SIGFPE && got_code == FPE_INTDIV && got_trapno == 0);
+
+  // Test the mask is restored by siglongjmp, so SIGSEGV is not left blocked
+  sigset_t cur;
+  sigprocmask(SIG_SETMASK, NULL, &cur);
+  assert_true(!sigismember(&cur, SIGSEGV) && !sigismember(&cur, SIGFPE) && r == 0);
+}
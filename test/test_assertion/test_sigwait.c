@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include "test_assert.h"
+
+static volatile sig_atomic_t handled;
+
+void handler(int sig)
+{
+  handled++;
+}
+
+void *send_later(void *arg)
+{
+  usleep(100000);
+  kill(getpid(), (int) (long) arg);
+  return NULL;
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+  nr_tests(11);
+
+  signal(SIGUSR1, handler);
+  sigset_t usr1, empty, cur;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  sigemptyset(&empty);
+  sigprocmask(SIG_BLOCK, &usr1, NULL);
+
+  // Test sigtimedwait times out with EAGAIN
+  struct timespec ts = { 0, 50000000 };
+  double start = now();
+  assert_true(sigtimedwait(&usr1, NULL, &ts) == -1 && errno == EAGAIN && now() - start >= 0.04);
+
+  // Test sigtimedwait takes a signal sent by another thread, without running the handler
+  pthread_t th;
+  siginfo_t info;
+  pthread_create(&th, NULL, send_later, (void *) SIGUSR1);
+  ts.tv_sec = 5;
+  assert_true(sigtimedwait(&usr1, &info, &ts) == SIGUSR1 && info.si_signo == SIGUSR1 && handled == 0);
+  pthread_join(th, NULL);
+
+  // Test an already pending signal is taken at once
+  raise(SIGUSR1);
+  assert_true(sigwaitinfo(&usr1, &info) == SIGUSR1 && info.si_pid == getpid());
+
+  // Test sigsuspend wakes up as soon as the signal comes and restores the mask
+  pthread_create(&th, NULL, send_later, (void *) SIGUSR1);
+  start = now();
+  assert_true(sigsuspend(&empty) == -1 && errno == EINTR && handled == 1);
+  assert_true(now() - start < 2);
+  pthread_join(th, NULL);
+  sigprocmask(SIG_SETMASK, NULL, &cur);
+  assert_true(sigismember(&cur, SIGUSR1));
+
+  // Test ppoll returns EINTR for a signal left pending under the old mask
+  raise(SIGUSR1);
+  int fds[2];
+  pipe(fds);
+  struct pollfd pfd = { fds[0], POLLIN, 0 };
+  assert_true(ppoll(&pfd, 1, NULL, &empty) == -1 && errno == EINTR && handled == 2);
+
+  // Test ppoll without a signal reports the ready fd
+  write(fds[1], "x", 1);
+  assert_true(ppoll(&pfd, 1, NULL, &empty) == 1 && (pfd.revents & POLLIN));
+
+  // Test pselect does the same with its mask
+  read(fds[0], &pfd, 1);
+  raise(SIGUSR1);
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(fds[0], &rfds);
+  assert_true(pselect(fds[0] + 1, &rfds, NULL, NULL, NULL, &empty) == -1 && errno == EINTR && handled == 3);
+  sigprocmask(SIG_SETMASK, NULL, &cur);
+  assert_true(sigismember(&cur, SIGUSR1));
+
+  // Test sigwaitinfo takes a signal left at SIG_DFL when another process sends it
+  sigset_t usr2;
+  sigemptyset(&usr2);
+  sigaddset(&usr2, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &usr2, NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    usleep(100000);
+    kill(getppid(), SIGUSR2);
+    _exit(0);
+  }
+  assert_true(sigwaitinfo(&usr2, &info) == SIGUSR2 && info.si_pid == pid);
+  waitpid(pid, NULL, 0);
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "test_assert.h"
+
+static volatile sig_atomic_t got_code, got_pid;
+static volatile int values[8], nr_values;
+static volatile pthread_t handler_thread;
+static volatile int stop;
+
+static pid_t gettid_() { return syscall(SYS_gettid); }
+
+void info_handler(int sig, siginfo_t *info, void *ctx)
+{
+  got_code = info->si_code;
+  got_pid = info->si_pid;
+}
+
+void rt_handler(int sig, siginfo_t *info, void *ctx)
+{
+  if (nr_values < 8)
+    values[nr_values++] = info->si_value.sival_int;
+}
+
+void stop_handler(int sig)
+{
+  handler_thread = pthread_self();
+  stop = 1;
+}
+
+static pid_t spinner_tid;
+
+void *spin(void *arg)
+{
+  spinner_tid = gettid_();
+  /* never enters the kernel, so only a kick gets the signal in */
+  while (!stop)
+    ;
+  return NULL;
+}
+
+int main()
+{
+  nr_tests(8);
+
+  struct sigaction sa = { .sa_sigaction = info_handler, .sa_flags = SA_SIGINFO };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  // Test tgkill to the current thread carries SI_TKILL and our pid
+  syscall(SYS_tgkill, getpid(), gettid_(), SIGUSR1);
+  assert_true(got_code == SI_TKILL && got_pid == getpid());
+
+  // Test sigqueue carries SI_QUEUE
+  union sigval v = { .sival_int = 42 };
+  sigqueue(getpid(), SIGUSR1, v);
+  assert_true(got_code == SI_QUEUE);
+
+  // Test RT signals queue up and come in order
+  sa.sa_sigaction = rt_handler;
+  sigaction(SIGRTMIN, &sa, NULL);
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGRTMIN);
+  sigprocmask(SIG_BLOCK, &set, &old);
+  for (int i = 1; i <= 3; i++) {
+    v.sival_int = i;
+    sigqueue(getpid(), SIGRTMIN, v);
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  assert_true(nr_values == 3);
+  assert_true(values[0] == 1 && values[1] == 2 && values[2] == 3);
+
+  // Test a signal to a busy thread is delivered to that very thread
+  signal(SIGUSR2, stop_handler);
+  pthread_t th;
+  pthread_create(&th, NULL, spin, NULL);
+  while (spinner_tid == 0)
+    usleep(1000);
+  syscall(SYS_tgkill, getpid(), spinner_tid, SIGUSR2);
+  pthread_join(th, NULL);
+  assert_true(stop == 1);
+  assert_true(pthread_equal(handler_thread, th));
+
+  // Test the tid of a finished thread is not given to the next one
+  pid_t old_tid = spinner_tid;
+  spinner_tid = 0;
+  pthread_create(&th, NULL, spin, NULL);
+  pthread_join(th, NULL);
+  assert_true(spinner_tid != old_tid && syscall(SYS_tgkill, getpid(), old_tid, 0) == -1 && errno == ESRCH);
+
+  // Test an unknown thread is reported
+  assert_true(syscall(SYS_tgkill, getpid(), 0x7ffffff0, SIGUSR2) == -1 && errno == ESRCH);
+}
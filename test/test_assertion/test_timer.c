@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include "test_assert.h"
+
+/* the raw syscalls, so that no -lrt is needed; the kernel's timer ids are ints */
+static int
+timer_create_(clockid_t clock, struct sigevent *ev, int *id)
+{
+  return syscall(SYS_timer_create, clock, ev, id);
+}
+
+static int
+timer_settime_(int id, int flags, const struct itimerspec *new, struct itimerspec *old)
+{
+  return syscall(SYS_timer_settime, id, flags, new, old);
+}
+
+static volatile sig_atomic_t handled;
+
+void handler(int sig)
+{
+  handled++;
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int target_tid;
+static siginfo_t thread_info;
+
+void *wait_timer(void *arg)
+{
+  sigset_t *set = arg;
+  target_tid = syscall(SYS_gettid);
+  sigwaitinfo(set, &thread_info);
+  return NULL;
+}
+
+static double slept;
+
+void *sleep_thread(void *arg)
+{
+  struct timespec req = { 0, 500000000 };
+  double start = now();
+  if (nanosleep(&req, NULL) == 0) {
+    slept = now() - start;
+  }
+  return NULL;
+}
+
+int main()
+{
+  nr_tests(13);
+
+  int sig = SIGRTMIN;
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, sig);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+
+  // Test a one-shot timer raises its signal with SI_TIMER and the value given
+  struct sigevent ev;
+  memset(&ev, 0, sizeof ev);
+  ev.sigev_notify = SIGEV_SIGNAL;
+  ev.sigev_signo = sig;
+  ev.sigev_value.sival_int = 42;
+  int id;
+  assert_true(timer_create_(CLOCK_MONOTONIC, &ev, &id) == 0);
+  struct itimerspec its = { { 0, 0 }, { 0, 50000000 } };
+  double start = now();
+  timer_settime_(id, 0, &its, NULL);
+  siginfo_t info;
+  assert_true(sigwaitinfo(&set, &info) == sig && info.si_code == SI_TIMER && info.si_value.sival_int == 42 && now() - start >= 0.04);
+
+  // Test timer_gettime reads the time left, and 0 once disarmed
+  its.it_value.tv_sec = 10;
+  timer_settime_(id, 0, &its, NULL);
+  struct itimerspec cur;
+  syscall(SYS_timer_gettime, id, &cur);
+  assert_true(cur.it_value.tv_sec == 9 || cur.it_value.tv_sec == 10);
+  memset(&its, 0, sizeof its);
+  timer_settime_(id, 0, &its, &cur);
+  syscall(SYS_timer_gettime, id, &cur);
+  assert_true(cur.it_value.tv_sec == 0 && cur.it_value.tv_nsec == 0);
+
+  // Test expirations while the signal is pending are reported as the overrun
+  its.it_value.tv_nsec = its.it_interval.tv_nsec = 1000000;
+  timer_settime_(id, 0, &its, NULL);
+  usleep(100000);
+  assert_true(sigwaitinfo(&set, &info) == sig && info.si_overrun > 10 && syscall(SYS_timer_getoverrun, id) == info.si_overrun);
+  assert_true(syscall(SYS_timer_delete, id) == 0 && syscall(SYS_timer_delete, id) == -1 && errno == EINVAL);
+
+  // Test SIGEV_THREAD_ID delivers to the thread named, not to this one
+  pthread_t th;
+  pthread_create(&th, NULL, wait_timer, &set);
+  while (target_tid == 0) {
+    usleep(1000);
+  }
+  ev.sigev_notify = SIGEV_THREAD_ID;
+  ev._sigev_un._tid = target_tid;
+  timer_create_(CLOCK_MONOTONIC, &ev, &id);
+  its = (struct itimerspec) { { 0, 0 }, { 0, 20000000 } };
+  timer_settime_(id, 0, &its, NULL);
+  pthread_join(th, NULL);
+  sigset_t pending;
+  sigpending(&pending);
+  assert_true(thread_info.si_signo == sig && thread_info.si_code == SI_TIMER && !sigismember(&pending, sig));
+  syscall(SYS_timer_delete, id);
+
+  // Test clock_nanosleep sleeps until an absolute deadline
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += 50000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  assert_true(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == 0);
+  struct timespec after;
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  assert_true(after.tv_sec > deadline.tv_sec || (after.tv_sec == deadline.tv_sec && after.tv_nsec >= deadline.tv_nsec));
+
+  // Test a relative sleep interrupted by SIGALRM from setitimer reports the time left
+  signal(SIGALRM, handler);
+  struct itimerval itv = { { 0, 0 }, { 0, 50000 } };
+  setitimer(ITIMER_REAL, &itv, NULL);
+  struct timespec req = { 5, 0 }, rem;
+  assert_true(clock_nanosleep(CLOCK_MONOTONIC, 0, &req, &rem) == EINTR && handled == 1 && rem.tv_sec >= 4);
+
+  // Test alarm returns what was left of the previous one
+  alarm(10);
+  assert_true(alarm(0) == 10);
+
+  // Test a timer whose pending signal was discarded by SIG_IGN raises it again
+  ev.sigev_notify = SIGEV_SIGNAL;
+  timer_create_(CLOCK_MONOTONIC, &ev, &id);
+  its = (struct itimerspec) { { 0, 0 }, { 0, 10000000 } };
+  timer_settime_(id, 0, &its, NULL);
+  usleep(50000);
+  signal(sig, SIG_IGN);
+  sigpending(&pending);
+  int discarded = !sigismember(&pending, sig);
+  signal(sig, SIG_DFL);
+  timer_settime_(id, 0, &its, NULL);
+  struct timespec ts = { 1, 0 };
+  assert_true(discarded && sigtimedwait(&set, &info, &ts) == sig && info.si_code == SI_TIMER);
+  syscall(SYS_timer_delete, id);
+
+  // Test a thread in nanosleep lets another one fork, and still sleeps just once
+  pthread_create(&th, NULL, sleep_thread, NULL);
+  usleep(100000);
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  pthread_join(th, NULL);
+  assert_true(pid > 0 && WIFEXITED(status) && slept >= 0.5 && slept < 0.9);
+}
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "test_assert.h"
+
+extern char **environ;
+
+volatile int global_var = 1;
+
+int main()
+{
+  nr_tests(6);
+  pid_t parent_pid = getpid();
+
+  /* the parent does not resume until the child exits, and sees its writes */
+  pid_t pid = vfork();
+  if (pid == 0) {
+    usleep(100000);
+    global_var = 2;
+    _exit(3);
+  }
+  assert_true(pid > 0 && pid != parent_pid);
+  assert_true(global_var == 2);
+  int stat;
+  assert_true(waitpid(pid, &stat, 0) == pid);
+  assert_true(WIFEXITED(stat) && WEXITSTATUS(stat) == 3);
+
+  /* glibc passes the execve error of the child back through the shared memory */
+  char *argv[] = { "/nonexistent", NULL };
+  assert_true(posix_spawn(&pid, "/nonexistent", NULL, NULL, argv, environ) == ENOENT);
+
+  argv[0] = "/bin/true";
+  int err = posix_spawn(&pid, "/bin/true", NULL, NULL, argv, environ);
+  waitpid(pid, &stat, 0);
+  assert_true(err == 0 && WIFEXITED(stat) && WEXITSTATUS(stat) == 0);
+}